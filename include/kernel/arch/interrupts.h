@@ -8,6 +8,11 @@ typedef enum {
 ARCH_IRQSTATE arch_irq_are_enabled(void);
 ARCH_IRQSTATE arch_irq_enable(void);
 ARCH_IRQSTATE arch_irq_disable(void);
+/*
+ * Enables interrupts and halts the CPU until an interrupt arrives. It returns after the interrupt was handled, with
+ * interrupts enabled. An interrupt can't slip in between enabling interrupts and halting.
+ */
+void arch_irq_wait(void);
 
 #define ASSERT_IRQ_DISABLED() assert(!arch_irq_are_enabled())
 
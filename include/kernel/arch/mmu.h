@@ -23,7 +23,15 @@ typedef enum {
     MMU_CACHE_INHIBIT_YES,
 } MMU_CACHE_INHIBIT;
 
+/* Page usage flags, set by the MMU when the page is accessed */
+#define MMU_USAGE_ACCESSED (1U << 0)
+#define MMU_USAGE_DIRTY (1U << 1)
+
 void arch_mmu_flush_tlb_for(void *ptr);
+/*
+ * Flushes the whole TLB, except entries for the kernel area, which may be kept across address space changes.
+ * (arch_mmu_flush_tlb_for() flushes those entries too)
+ */
 void arch_mmu_flush_tlb(void);
 [[nodiscard]] int arch_mmu_map(void *virt_base, PHYSPTR physbase, size_t page_count, uint8_t flags, MMU_USER_ACCESS user_access);
 [[nodiscard]] int arch_mmu_remap(void *virt_base, size_t page_count, uint8_t flags, MMU_USER_ACCESS user_access);
@@ -31,10 +39,29 @@ void arch_mmu_flush_tlb(void);
  * Returns false if such page does not exist.
  */
 [[nodiscard]] int arch_mmu_unmap(void *virt_base, size_t page_count);
+/*
+ * Unmaps single page, and returns MMU_USAGE_* flags it had at the moment it was unmapped, so that writes from other
+ * CPUs can't slip in between checking the flags and unmapping. Physical address of the page is stored to `physaddr_out`.
+ * Returns -EFAULT if such page does not exist.
+ *
+ * Like other functions here, this only flushes TLB of current CPU. See arch_smp_shootdown_tlb().
+ */
+[[nodiscard]] int arch_mmu_unmap_and_get_usage(void *virt, PHYSPTR *physaddr_out);
+/*
+ * Returns MMU_USAGE_* flags of the page, and then clears flags given in `clear_flags`, so that next access sets them again.
+ * Returns -EFAULT if such page does not exist.
+ */
+[[nodiscard]] int arch_mmu_get_and_clear_usage(void *virt, uint8_t clear_flags);
+/*
+ * Frees the page table covering `virt` if nothing is mapped through it, and returns whether it was freed.
+ * Page tables for the kernel area are shared by every address space, so those are never freed.
+ */
+bool arch_mmu_free_pagetable_if_unused(void *virt);
 
 /*
  * Scratch map is useful for quickly mapping physical memory temporaily without going through VMM.
- * (But do make sure to disable interrupts while using it, as anyone else can remap it)
+ * (But do make sure nobody else uses it at the same time, as every CPU shares the same scratch page. pstring functions
+ * take care of that)
  *
  * Scratch page is mapped at ARCH_SCRATCH_MAP_BASE.
  */
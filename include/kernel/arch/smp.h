@@ -0,0 +1,28 @@
+#pragma once
+
+struct cpu;
+
+/*
+ * Returns the CPU running the caller. This is the boot CPU until arch code sets up per-CPU access.
+ */
+struct cpu *arch_smp_get_current_cpu(void);
+/*
+ * Hints the CPU that it is inside a spin-wait loop. This also answers requests from other CPUs that can't wait until
+ * interrupts are enabled again, such as TLB shootdowns, so spin-wait loops must call this.
+ */
+void arch_smp_spin_pause(void);
+/*
+ * Flushes the whole TLB of every other online CPU, and waits until all of them are done. Call this after changing
+ * mappings in a way that needs TLB flush(e.g. unmapping), before anyone relies on other CPUs seeing the new mapping.
+ * It's fine to call this while holding spinlocks.
+ */
+void arch_smp_shootdown_tlb(void);
+/*
+ * Interrupts the CPU, so that it picks up threads that were just queued for it if it was idle.
+ */
+void arch_smp_send_reschedule(struct cpu *cpu);
+/*
+ * Starts other CPUs found during early boot, and returns once they are online or gave up. The scheduler must be ready
+ * to run threads, as they start running threads right away.
+ */
+void arch_smp_start_cpus(void);
@@ -14,3 +14,9 @@ struct arch_thread;
 [[nodiscard]] struct arch_thread *arch_thread_create(size_t init_stacksize, void (*init_mainfunc)(void *), void *init_data);
 void arch_thread_destroy(struct arch_thread *thread);
 void arch_thread_switch(struct arch_thread *from, struct arch_thread *to);
+/*
+ * Lets the thread use floating point(and SIMD, if the arch has it). `thread` must be the running thread.
+ *
+ * Returns -ENOTSUP if there's no FPU, and -ENOMEM if there's not enough memory for saving FPU registers.
+ */
+[[nodiscard]] int arch_thread_enable_fpu(struct arch_thread *thread);
@@ -0,0 +1,18 @@
+#pragma once
+#include <kernel/ticktime.h>
+
+/*
+ * Lets the timer interrupt skip ticks when the CPU has nothing to do: The next timer interrupt arrives `ticks` ticks
+ * later (or after arch_tick_get_max_stop_ticks() ticks, whichever comes first), and g_ticktime catches up when it does.
+ * Does nothing if `ticks` is 1 or less.
+ *
+ * Call arch_tick_resume() once the CPU is awake, as some other interrupt may arrive before that.
+ * Interrupts must be disabled.
+ */
+void arch_tick_stop(TICKTIME ticks);
+/*
+ * Goes back to periodic timer interrupts, adding ticks passed since arch_tick_stop() to g_ticktime.
+ * Does nothing if the timer interrupt already did that. Interrupts must be disabled.
+ */
+void arch_tick_resume(void);
+TICKTIME arch_tick_get_max_stop_ticks(void);
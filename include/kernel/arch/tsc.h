@@ -2,3 +2,7 @@
 #include <stdint.h>
 
 uint64_t arch_read_tsc(void);
+/*
+ * Returns TSC frequency in Hz, or 0 if TSC isn't present or its frequency is unknown.
+ */
+uint64_t arch_tsc_get_frequency(void);
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+/* Length of a single timer tick(see g_ticktime) */
+#define CLOCK_NS_PER_TICK 1000000ULL
+
+/*
+ * Sets up the monotonic clock. TSC is used if the arch knows its frequency, and timer ticks are used otherwise.
+ */
+void clock_init(void);
+/*
+ * Returns nanoseconds since boot. This never goes backwards, and is cheap enough to call from polling loops.
+ *
+ * Resolution is only as good as a single timer tick if there's no usable TSC.
+ */
+uint64_t clock_get_ns(void);
@@ -0,0 +1,42 @@
+#pragma once
+#include <kernel/arch/smp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPU_MAX_COUNT 8
+
+/*
+ * Per-CPU data. Index 0 is always the boot CPU.
+ *
+ * Other CPUs are recorded during early boot, and started by arch_smp_start_cpus() once the kernel is ready to schedule
+ * threads on them.
+ */
+struct cpu {
+    struct cpu *self; /* Must be the first field, so that arch code can find the current CPU with a single load. */
+    size_t index;
+    uint32_t arch_id;      /* Local APIC ID on i586 */
+    _Atomic bool online;   /* Running kernel code. Set by the CPU itself once it can receive IPIs. */
+    size_t spinlock_count; /* spinlock_lock() calls that weren't paired with spinlock_unlock() yet. Only the CPU itself touches this. */
+};
+
+struct cpu *cpu_get_boot(void);
+/*
+ * Returns nullptr if `index` is out of range.
+ */
+struct cpu *cpu_get(size_t index);
+/*
+ * Number of CPUs found so far, including ones that are not online.
+ */
+size_t cpu_get_count(void);
+/*
+ * Number of CPUs that are online.
+ */
+size_t cpu_get_online_count(void);
+/*
+ * Records a CPU found by the firmware. Returns nullptr if there are already CPU_MAX_COUNT CPUs.
+ */
+struct cpu *cpu_add(uint32_t arch_id);
+
+static inline struct cpu *cpu_get_current(void) {
+    return arch_smp_get_current_cpu();
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <kernel/io/disk.h>
 #include <kernel/lib/diagnostics.h>
+#include <kernel/ticktime.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,16 +14,23 @@
 
 /* ACS-3 6.3 ERROR field */
 typedef enum {
-    ATA_CMD_FLUSH_CACHE = 0xe7,     /* ACS-3 7.10 */
-    ATA_CMD_IDENTIFY_DEVICE = 0xec, /* ACS-3 7.12 */
-    ATA_CMD_READ_DMA = 0xc8,        /* ACS-3 7.21 */
-    ATA_CMD_READ_SECTORS = 0x20,    /* ACS-3 7.28 */
-    ATA_CMD_WRITE_DMA = 0xca,       /* ACS-3 7.58 */
-    ATA_CMD_WRITE_SECTORS = 0x30,   /* ACS-3 7.67 */
+    ATA_CMD_FLUSH_CACHE = 0xe7,       /* ACS-3 7.10 */
+    ATA_CMD_FLUSH_CACHE_EXT = 0xea,   /* ACS-3 7.11 */
+    ATA_CMD_IDENTIFY_DEVICE = 0xec,   /* ACS-3 7.12 */
+    ATA_CMD_READ_DMA = 0xc8,          /* ACS-3 7.21 */
+    ATA_CMD_READ_DMA_EXT = 0x25,      /* ACS-3 7.22 */
+    ATA_CMD_READ_SECTORS = 0x20,      /* ACS-3 7.28 */
+    ATA_CMD_READ_SECTORS_EXT = 0x24,  /* ACS-3 7.29 */
+    ATA_CMD_WRITE_DMA = 0xca,         /* ACS-3 7.58 */
+    ATA_CMD_WRITE_DMA_EXT = 0x35,     /* ACS-3 7.59 */
+    ATA_CMD_WRITE_SECTORS = 0x30,     /* ACS-3 7.67 */
+    ATA_CMD_WRITE_SECTORS_EXT = 0x34, /* ACS-3 7.68 */
 } ATA_CMD;
 
 /* Maximum sector count for a 28-bit transfer command. */
 #define ATA_MAX_SECTORS_PER_TRANSFER 256
+/* Maximum sector count for a 48-bit(EXT) transfer command. */
+#define ATA_MAX_SECTORS_PER_TRANSFER_LBA48 65536
 #define ATA_SECTOR_SIZE 512
 
 struct ata_data_buf {
@@ -48,11 +56,19 @@ struct atadisk_ops {
     void (*set_features_param)(struct atadisk *self, uint16_t data);
     void (*set_count_param)(struct atadisk *self, uint16_t data);
     void (*set_lba_param)(struct atadisk *self, uint32_t data);
+    /*
+     * Same as set_count_param and set_lba_param, but for 48-bit commands. Upper halves of parameters are written as well.
+     */
+    void (*set_count48_param)(struct atadisk *self, uint16_t data);
+    void (*set_lba48_param)(struct atadisk *self, uint64_t data);
     void (*set_device_param)(struct atadisk *self, uint8_t data);
     uint32_t (*get_lba_output)(struct atadisk *self);
     void (*issue_command)(struct atadisk *self, ATA_CMD cmd);
-    bool (*get_irq_flag)(struct atadisk *self);
-    void (*clear_irq_flag)(struct atadisk *self);
+    /*
+     * Sleeps until the disk raises an IRQ, or g_ticktime reaches `deadline`. Returns false if it timed out.
+     * IRQ that arrived since the last call counts as well, and it is consumed by this.
+     */
+    bool (*wait_irq)(struct atadisk *self, TICKTIME deadline);
     void (*read_data)(struct ata_data_buf *out, struct atadisk *self);
     void (*write_data)(struct atadisk *self, struct ata_data_buf *buffer);
     void (*soft_reset)(struct atadisk *self);
@@ -68,8 +84,11 @@ struct atadisk_ops {
      * 6. [DMA] Deinitialize DMA transfer
      * (Step 5 and 6 are separate, so that DMA can be deinitialized safely if something fails between
      * Step 1 and Step 3)
+     *
+     * dma_init_transfer may set up less than `*len_inout` bytes (but always whole sectors, at least one), if the
+     * controller can't do it in one go. `*len_inout` is updated to what will actually be transferred.
      */
-    int (*dma_init_transfer)(struct atadisk *self, void *buffer, size_t len, bool is_read);
+    int (*dma_init_transfer)(struct atadisk *self, void *buffer, size_t *len_inout, bool is_read);
     int (*dma_begin_transfer)(struct atadisk *self);
     ATA_DMASTATUS (*dma_check_transfer)(struct atadisk *self);
     void (*dma_end_transfer)(struct atadisk *self, bool was_success);
@@ -79,6 +98,8 @@ struct atadisk {
     struct pdisk physdisk;
     struct atadisk_ops const *ops;
     void *data;
+    uint64_t sector_count;
+    bool lba48_supported;
 };
 
 [[nodiscard]] int atadisk_register(struct atadisk *disk_out, struct atadisk_ops const *ops, void *data);
@@ -5,6 +5,8 @@
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/list.h>
 #include <kernel/lib/queue.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -35,6 +37,12 @@ struct ps2port {
     struct ps2port_ops const *ops;
     struct queue recvqueue;
     uint8_t recv_queue_buf[127];
+    /* Bytes from the interrupt handler that irqwork hasn't processed yet */
+    struct queue irqqueue;
+    uint8_t irq_queue_buf[127];
+    /* Protects both queues */
+    struct spinlock queue_lock;
+    struct irqwork irqwork;
     void *device_data;
 };
 
@@ -46,5 +54,8 @@ struct ps2port {
 
 /* Note that `device->file`'s read callback must be set to ps2port_stream_op_read. */
 [[nodiscard]] int ps2port_register(struct ps2port *port_out, struct stream_ops const *ops, void *data);
+/*
+ * Called by the interrupt handler. The byte is processed later by the IRQ work thread.
+ */
 void ps2port_received_byte(struct ps2port *port, uint8_t byte);
 void ps2_init_devices(void);
@@ -52,6 +52,10 @@ struct vfs_fstype_ops {
     int (*open_directory)(DIR **out, struct vfs_fscontext *self, char const *path);
     int (*close_directory)(DIR *self);
     int (*read_directory)(struct dirent *out, DIR *self);
+    /*
+     * Writes out anything the filesystem is holding in memory. VFS flushes the disk after this.
+     */
+    int (*sync)(struct vfs_fscontext *self);
 };
 
 struct vfs_fstype {
@@ -65,11 +69,17 @@ struct vfs_fscontext {
     void *data;
     char *mount_path;
     struct vfs_fstype *fstype;
+    struct ldisk *disk; /* nullptr if the filesystem isn't on a disk */
     _Atomic size_t open_file_count;
 };
 
 [[nodiscard]] int vfs_mount(char const *fstype, struct ldisk *disk, char const *mountpath);
 [[nodiscard]] int vfs_umount(char const *mountpath);
+/*
+ * Makes everything written to mounted filesystems so far durable. Returns the last error, but keeps going with other
+ * filesystems on failure.
+ */
+[[nodiscard]] int vfs_sync(void);
 /* `name` must be static string. */
 void vfs_register_fstype(struct vfs_fstype *out, char const *name, struct vfs_fstype_ops const *ops);
 void vfs_mount_root(void);
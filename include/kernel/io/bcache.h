@@ -0,0 +1,50 @@
+#pragma once
+#include <kernel/io/disk.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct bcache_stats {
+    uint64_t hits;       /* Blocks that were found in the cache */
+    uint64_t misses;     /* Blocks that had to be read from the disk */
+    uint64_t writebacks; /* Dirty blocks written to the disk */
+    uint64_t evictions;  /* Blocks dropped to stay within the memory budget */
+    size_t cached_size;  /* Memory taken by cached blocks, including bookkeeping */
+    size_t dirty_count;  /* Blocks that are not written to the disk yet */
+    size_t max_size;     /* Memory budget, in bytes */
+};
+
+/*
+ * Block cache that sits between logical disks and physical disks. Blocks are cached per physical disk block, and
+ * least recently used ones are dropped once the memory budget is reached.
+ *
+ * Writes only update the cache, and dirty blocks are written to the disk when they are evicted, on bcache_sync(), or by
+ * the writeback thread. Requests larger than quarter of the budget go to the disk directly, so that a single large
+ * transfer doesn't wipe out the whole cache.
+ *
+ * Disk I/O is done without holding the cache lock, so cache hits don't wait for disk I/O of other requests.
+ */
+
+[[nodiscard]] int bcache_read(struct pdisk *disk, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
+[[nodiscard]] int bcache_write(struct pdisk *disk, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
+/*
+ * Writes every dirty block to the disk. This doesn't flush disks' own write caches.
+ */
+[[nodiscard]] int bcache_sync(void);
+/*
+ * Writes dirty blocks of the disk, and then flushes the disk's write cache, so that everything written so far is
+ * on the media.
+ */
+[[nodiscard]] int bcache_flush(struct pdisk *disk);
+/*
+ * Writes dirty blocks in given range to the disk, and drops them from the cache.
+ */
+[[nodiscard]] int bcache_invalidate(struct pdisk *disk, DISK_BLOCK_ADDR block_addr, DISK_BLOCK_ADDR block_count);
+/*
+ * Sets the memory budget in bytes, evicting blocks if needed.
+ */
+void bcache_set_max_size(size_t size);
+void bcache_get_stats(struct bcache_stats *out);
+/*
+ * Starts the thread that periodically writes dirty blocks to the disk. The scheduler must be initialized.
+ */
+void bcache_start_writeback(void);
@@ -6,12 +6,17 @@
 #include <stdint.h>
 #include <sys/types.h>
 
-typedef uint32_t DISK_BLOCK_ADDR;
+typedef uint64_t DISK_BLOCK_ADDR;
 
 struct pdisk;
 struct pdisk_ops {
     int (*write)(struct pdisk *self, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
     int (*read)(struct pdisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
+    /*
+     * Optional. Makes sure previous writes are on the media, not just in the disk's write cache.
+     * Writes don't do this by themselves, so anyone that needs durability must ask for it.
+     */
+    int (*flush)(struct pdisk *self);
 };
 
 struct pdisk {
@@ -25,12 +30,21 @@ struct ldisk {
     struct iodev iodev;
     struct pdisk *physdisk;
     DISK_BLOCK_ADDR startblockaddr;
-    size_t block_count;
+    DISK_BLOCK_ADDR block_count;
+    bool cache_disabled; /* Bypasses the block cache, for users that can't afford cache allocating memory (e.g. swap) */
 };
 
 [[nodiscard]] ssize_t ldisk_read(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
 [[nodiscard]] ssize_t ldisk_write(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
 [[nodiscard]] int ldisk_read_exact(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
 [[nodiscard]] int ldisk_write_exact(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count);
+/*
+ * Writes back blocks cached for the underlying physical disk, and flushes the disk's write cache.
+ */
+[[nodiscard]] int ldisk_flush(struct ldisk *self);
+/*
+ * Writes back and drops cached blocks of the disk, and makes further I/O go to the physical disk directly.
+ */
+[[nodiscard]] int ldisk_disable_cache(struct ldisk *self);
 [[nodiscard]] int pdisk_register(struct pdisk *disk_out, size_t blocksize, struct pdisk_ops const *ops, void *data);
 void ldisk_discover(void);
@@ -7,11 +7,13 @@
 #define EBADF 9         /* Bad filr descriptor */
 #define ENOMEM 12       /* Not enough space */
 #define EFAULT 14       /* Bad address */
+#define EBUSY 16        /* Device or resource busy */
 #define EEXIST 17       /* File exists */
 #define ENODEV 19       /* No such device */
 #define ENOTDIR 20      /* Not a directory */
 #define EISDIR 21       /* Is a directory */
 #define EINVAL 22       /* Invalid argument */
+#define ENOSPC 28       /* No space left on device */
 #define ENAMETOOLONG 36 /* File name too long */
 #define ENOTSUP 95      /* Operation not supported */
 
@@ -9,6 +9,10 @@ void __heap_check_overflow(struct source_location srcloc);
 #define HEAP_CHECKOVERFLOW() __heap_check_overflow(SOURCELOCATION_CURRENT())
 void *heap_alloc(size_t size, uint8_t flags);
 void heap_free(void *ptr);
+/*
+ * Returns how much heap memory an allocation of `size` bytes actually takes, including the allocator's own bookkeeping.
+ */
+size_t heap_get_footprint(size_t size);
 void heap_expand(void);
 void *heap_realloc(void *ptr, size_t newsize, uint8_t flags);
 void *heap_calloc(size_t size, size_t elements, uint8_t flags);
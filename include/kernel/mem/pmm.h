@@ -9,7 +9,12 @@ void pmm_register_mem(PHYSPTR base, size_t page_count);
  * Returns nullptr on failure
  */
 PHYSPTR pmm_alloc(size_t *pagecount_inout);
+/*
+ * Same as pmm_alloc(), but only returns memory below 4GiB.
+ * Use this for memory that hardware accesses with 32-bit physical address(e.g. DMA buffers).
+ */
+PHYSPTR pmm_alloc_low(size_t *pagecount_inout);
 void pmm_free(PHYSPTR ptr, size_t page_count);
-size_t pmm_get_total_mem_size(void);
+uint64_t pmm_get_total_mem_size(void);
 
 bool pmm_page_pool_test_random(void);
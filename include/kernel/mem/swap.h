@@ -0,0 +1,43 @@
+#pragma once
+#include <kernel/io/disk.h>
+#include <kernel/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Index of a page-sized slot in the swap disk */
+typedef uint32_t SWAP_SLOT;
+
+static SWAP_SLOT const SWAP_SLOT_NONE = ~0U;
+
+/* Maximum number of pages that can be written with single swap_write_cluster() call. */
+#define SWAP_CLUSTER_PAGE_COUNT 16
+
+struct swap_stats {
+    uint64_t page_ins;
+    uint64_t page_outs;
+    uint64_t cluster_writes; /* Number of disk writes made for page_outs */
+    size_t total_slots;
+    size_t used_slots;
+};
+
+/*
+ * Uses given logical disk as swap space. Whatever was stored in the disk will be overwritten.
+ * Only one swap disk can be used at a time.
+ */
+[[nodiscard]] int swap_enable(struct ldisk *disk);
+bool swap_is_enabled(void);
+void swap_get_stats(struct swap_stats *out);
+
+/*
+ * Writes `page_count` pages into consecutive slots with single disk write. `pages` holds pointer to each page,
+ * and Nth page goes to (*first_slot_out + N)th slot.
+ *
+ * Returns -ENOSPC if there aren't enough consecutive free slots.
+ */
+[[nodiscard]] int swap_write_cluster(SWAP_SLOT *first_slot_out, void *const *pages, size_t page_count);
+/*
+ * Reads the page stored in `slot` into physical page at `dest`.
+ * The slot stays allocated, so call swap_free_slot() once it's no longer needed.
+ */
+[[nodiscard]] int swap_read_page(PHYSPTR dest, SWAP_SLOT slot);
+void swap_free_slot(SWAP_SLOT slot);
@@ -31,6 +31,8 @@ struct vmm_object {
     void *end;
     PHYSPTR phys_base; /* VMM_PHYSADDR_NOMAP means it allocates pages instead of mapping existing pages. */
     uint8_t mapflags;
+    bool is_swappable; /* Pages may be moved out to swap space when memory is low. */
+    size_t guard_page_count; /* The first guard_page_count pages are never commited, so that running off the bottom of a stack faults. */
 };
 
 static PHYSPTR const VMM_PHYSADDR_NOMAP = ~0;
@@ -49,6 +51,20 @@ void vmm_deinit_address_space(struct vmm_address_space *self);
 [[nodiscard]] struct vmm_object *vmm_alloc_object_at(struct vmm_address_space *self, void *virtualbase, PHYSPTR physicalbase, size_t size, uint8_t mapflags);
 [[nodiscard]] struct vmm_object *vmm_alloc(struct vmm_address_space *self, size_t size, uint8_t mapflags);
 [[nodiscard]] struct vmm_object *vmm_alloc_at(struct vmm_address_space *self, void *virt_base, size_t size, uint8_t mapflags);
+/*
+ * Same as vmm_alloc(), but pages that weren't used recently can be moved out to swap space when memory is low.
+ * Never use this for memory that may be accessed while interrupts are disabled, as reading pages back requires disk I/O.
+ */
+[[nodiscard]] struct vmm_object *vmm_alloc_swappable(struct vmm_address_space *self, size_t size, uint8_t mapflags);
+/*
+ * Reserves `size` bytes of kernel stack plus a guard page below it, and commits the top `commit_size` bytes right away.
+ * The rest is never committed, and accessing it is reported as stack overflow. So `commit_size` is the usable stack
+ * size, and the stack ends at `end`.
+ *
+ * Unlike vmm_alloc(), nothing is committed on demand: The CPU pushes the exception frame onto the current stack, so a
+ * page fault on the stack itself can't be handled.
+ */
+[[nodiscard]] struct vmm_object *vmm_alloc_stack(struct vmm_address_space *self, size_t size, size_t commit_size);
 [[nodiscard]] struct vmm_object *vmm_map_mem(struct vmm_address_space *self, PHYSPTR phys_base, size_t size, uint8_t mapflags);
 [[nodiscard]] struct vmm_object *vmm_map_memory_at(struct vmm_address_space *self, void *virt_base, PHYSPTR phys_base, size_t size, uint8_t mapflags);
 
@@ -75,5 +91,24 @@ struct vmm_address_space *vmm_get_kernel_address_space(void);
  * Those areas include kernel .text and .data, since those areas are never meant to be touched by VM code.
  */
 struct vmm_address_space *vmm_get_address_space_of(void *ptr);
-void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user, void *trapframe);
+/*
+ * Returns true if any part of given range is in a swappable object, meaning its pages may be moved out to swap space
+ * at any time.
+ */
+bool vmm_is_swappable(void *ptr, size_t size);
+/*
+ * `was_irq_enabled` tells whether the faulting code had interrupts enabled. Pages are only moved out to swap space to
+ * make room if it did, and it doesn't hold any spinlock. Otherwise the page comes from a small reserve that the reclaim
+ * thread refills.
+ */
+void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user, bool was_irq_enabled, void *trapframe);
+/*
+ * Moves out up to `page_count` pages of swappable memory to the swap space, and returns number of pages that were freed.
+ * Does nothing if swap space is not enabled.
+ */
+size_t vmm_reclaim(size_t page_count);
+/*
+ * Starts the thread that keeps the page reserve for vmm_page_fault() filled.
+ */
+void vmm_start_reclaim_thread(void);
 bool vmm_random_test(void);
@@ -0,0 +1,26 @@
+#pragma once
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
+
+struct condvar {
+    struct waitqueue waitqueue;
+};
+
+void condvar_init(struct condvar *out);
+/*
+ * Unlocks the mutex and waits for a signal, and locks the mutex again before returning. Nobody can signal between
+ * unlocking the mutex and starting to wait.
+ *
+ * Like other condition variables, it may return without a signal, so check the condition again after it returns.
+ */
+void condvar_wait(struct condvar *self, struct mutex *mutex);
+/*
+ * Same as condvar_wait(), but gives up once g_ticktime reaches `deadline`. Returns false if that happened.
+ * The mutex is locked again either way.
+ */
+bool condvar_wait_until(struct condvar *self, struct mutex *mutex, TICKTIME deadline);
+/* Wakes up one waiting thread. It can be called from interrupt handlers. */
+void condvar_signal(struct condvar *self);
+/* Wakes up all waiting threads. It can be called from interrupt handlers. */
+void condvar_broadcast(struct condvar *self);
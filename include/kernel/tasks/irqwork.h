@@ -0,0 +1,30 @@
+#pragma once
+#include <kernel/lib/list.h>
+
+/*
+ * Work that interrupt handlers hand over to the IRQ work thread, so that they only have to acknowledge the hardware,
+ * and the rest runs with interrupts enabled.
+ */
+struct irqwork {
+    struct list_node node;
+    void (*callback)(void *data);
+    void *data;
+    bool pending;
+};
+
+void irqwork_init(struct irqwork *out, void (*callback)(void *data), void *data);
+/*
+ * Makes the IRQ work thread call the callback. It can be called from interrupt handlers, and does nothing if the work is
+ * already pending (So the callback should handle everything that has piled up since the last call).
+ *
+ * Until the IRQ work thread is started, the callback is called right away instead.
+ */
+void irqwork_schedule(struct irqwork *work);
+/*
+ * Returns true if the current thread is the IRQ work thread. Callbacks must not wait for other IRQ work to finish.
+ */
+bool irqwork_is_worker_thread(void);
+/*
+ * Starts the IRQ work thread. The scheduler must be initialized.
+ */
+void irqwork_start(void);
@@ -1,9 +1,15 @@
 #pragma once
 #include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+
+struct thread;
 
 struct mutex {
     struct source_location locksource;
     _Atomic bool locked;
+    struct list waiters;         /* struct thread items, in the order they started waiting */
+    struct thread *owner;        /* nullptr if unlocked, or locked before the scheduler was up */
+    struct list_node owner_node; /* Node of owner's held_mutexes list */
 };
 
 void mutex_init(struct mutex *out);
@@ -12,4 +18,10 @@ void __mutex_lock(struct mutex *self, struct source_location loc);
 #define MUTEX_TRYLOCK(self) __mutex_try_lock(self, SOURCELOCATION_CURRENT())
 #define MUTEX_LOCK(self) __mutex_lock(self, SOURCELOCATION_CURRENT())
 
+/*
+ * If there are threads waiting for the mutex, the mutex is handed to the first one directly, instead of unlocking it.
+ *
+ * While threads are waiting, the owner runs at the highest priority among them (priority inheritance), and it goes back
+ * to its own priority here.
+ */
 void mutex_unlock(struct mutex *self);
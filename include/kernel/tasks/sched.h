@@ -2,30 +2,107 @@
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/list.h>
 #include <kernel/tasks/mutex.h>
+#include <kernel/ticktime.h>
 #include <stddef.h>
 #include <stdint.h>
 
 struct thread;
 
 struct sched_queue {
-    struct list_node node;
     /* Lower value -> Higher priority (Works similiarly to UNIX niceness value) */
     int8_t priority;
     size_t opportunities;
+    size_t round; /* Scheduling round where opportunities was given */
     struct list threads;
 };
 
+struct sched_stats {
+    uint64_t context_switches;
+    uint64_t slice_expirations;   /* Running thread used up its time slice */
+    uint64_t priority_preemptions; /* Running thread was preempted because higher priority thread was waiting */
+    uint64_t deadline_throttles;   /* Deadline thread used up its budget before the period ended */
+    uint64_t deadline_misses;      /* Deadline thread didn't finish its work before the period ended */
+    uint32_t deadline_utilization; /* CPU time reserved by deadline threads, in 0.1% units */
+    uint64_t migrations;           /* Idle CPU took a thread queued on another CPU */
+};
+
 /*
- * NOTE: Most scheduler functions are considered as critical section, so it is safe to turn off interrupts before using any of these!
- *       TODO: Just do that in sched itself :D
+ * The scheduler lock protects the scheduler, and everything that decides when threads go to sleep or wake up: waitqueues,
+ * timers, and what's built on top of those. It's a spinlock that can be taken recursively, so scheduler functions can
+ * be called with or without holding it.
+ *
+ * When sleeping, take the lock before checking the condition, and keep holding it until sched_block() (usually through
+ * waitqueue_wait()). Whoever makes the condition true takes the lock to wake the thread up, so it can't happen in
+ * between. The lock is released while other threads run, and taken again before sched_block() returns.
+ *
+ * Lock order: Scheduler lock comes before every other spinlock, so code holding other spinlocks must not call into the
+ * scheduler, including waking up threads.
  */
+void sched_lock(void);
+void sched_unlock(void);
+bool sched_lock_is_held(void);
 
+void sched_print_queues(void);
+/* Returns nullptr if sched_init_boot_thread() wasn't called yet. */
+struct thread *sched_get_current_thread(void);
+/* Returns true if the thread is the idle thread of one of CPUs */
+bool sched_is_idle_thread(struct thread const *thread);
 /*
- * Returns nullptr if sched needs to create a new queue and there's not enough
- * memory.
+ * Switches away from the current thread without putting it back to the queue, so it doesn't run again until someone
+ * calls sched_queue() on it. If there's no other thread to run, the idle thread runs until there is one.
+ * Like sched_schedule(), this must not be called while holding a spinlock other than the scheduler lock.
  */
-void sched_print_queues(void);
+void sched_block(void);
+/*
+ * Deletes the exited thread once it is no longer running. It's fine to call this for the current thread, as long as it
+ * never runs again.
+ */
+void sched_add_zombie(struct thread *thread);
 void sched_wait_mutex(struct mutex *mutex, struct source_location const *locksource);
 [[nodiscard]] int sched_queue(struct thread *thread);
+/*
+ * Sets the priority of the thread. The thread may still run at higher priority while it holds mutexes other threads
+ * are waiting for.
+ */
+void sched_set_priority(struct thread *thread, int8_t priority);
+/*
+ * Recalculates the priority inherited from threads waiting for mutexes the thread holds. Called by mutexes when the
+ * owner changes.
+ */
+void sched_update_inherited_priority(struct thread *thread);
+/*
+ * Puts the thread into the deadline scheduling class: In every `period` ticks, the thread gets to run for up to `budget`
+ * ticks ahead of every best-effort thread, and deadline threads with earlier deadline run first. Once the budget is used
+ * up, the thread doesn't run again until the next period begins. The thread is expected to call
+ * sched_wait_next_period() when it's done with the work for the current period, and if it doesn't happen before the
+ * period ends, it's counted as a missed deadline.
+ *
+ * Setting `period` to 0 makes it a best-effort thread again.
+ *
+ * Returns -EINVAL if the budget is 0 or longer than the period, and -EBUSY if there's not enough CPU time left to
+ * reserve for it.
+ */
+[[nodiscard]] int sched_set_deadline(struct thread *thread, TICKTIME period, TICKTIME budget);
+/*
+ * Called by deadline threads when they are done for the current period. Sleeps until the next period begins, or
+ * returns right away if it already began. Interrupts must be enabled.
+ */
+void sched_wait_next_period(void);
+/*
+ * Gives other threads a chance to run. This must not be called while holding a spinlock other than the scheduler lock.
+ */
 void sched_schedule(void);
+/*
+ * Called by the timer interrupt on every tick. Charges the tick to the running thread's time slice, and switches to
+ * other thread when the time slice runs out, or a higher priority thread is waiting.
+ */
+void sched_tick(void);
+/* Returns the time slice of given priority, in ticks */
+TICKTIME sched_get_time_slice(int8_t priority);
+void sched_get_stats(struct sched_stats *out);
 void sched_init_boot_thread(void);
+/*
+ * Called by other CPUs once they are ready to run threads, with interrupts disabled. What's running becomes the idle
+ * thread of the CPU.
+ */
+[[noreturn]] void sched_start_cpu(void);
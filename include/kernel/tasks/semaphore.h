@@ -0,0 +1,27 @@
+#pragma once
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+
+struct semaphore {
+    size_t count;
+    struct waitqueue waitqueue;
+};
+
+void semaphore_init(struct semaphore *out, size_t count);
+/*
+ * Waits until the count is non-zero, and decrements it.
+ */
+void semaphore_wait(struct semaphore *self);
+/*
+ * Returns false if the count didn't become non-zero before g_ticktime reaches `deadline`.
+ */
+[[nodiscard]] bool semaphore_wait_until(struct semaphore *self, TICKTIME deadline);
+/*
+ * Returns false if the count is zero.
+ */
+[[nodiscard]] bool semaphore_try_wait(struct semaphore *self);
+/*
+ * Increments the count, and wakes up a waiting thread. It can be called from interrupt handlers.
+ */
+void semaphore_post(struct semaphore *self);
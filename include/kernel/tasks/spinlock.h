@@ -0,0 +1,44 @@
+#pragma once
+#include <kernel/arch/interrupts.h>
+#include <stddef.h>
+
+struct cpu;
+struct thread;
+
+/*
+ * Protects data shared between CPUs. Interrupts are disabled while the lock is held, so it also protects against
+ * interrupt handlers on the same CPU.
+ *
+ * The thread holding the lock may take it again, and the lock is released when every spinlock_lock() is paired with
+ * spinlock_unlock(). This keeps nested calls working the way they did when these were arch_irq_disable() sections.
+ * The holder must not sleep, and the scheduler checks that using the CPU's spinlock_count.
+ *
+ * Zero-initialized spinlock is unlocked.
+ */
+struct spinlock {
+    struct cpu *_Atomic owner;   /* nullptr if unlocked */
+    struct thread *owner_thread; /* nullptr if it was taken before the scheduler started */
+    size_t depth;
+    ARCH_IRQSTATE prev_irqstate;
+};
+
+/*
+ * How a thread holds a spinlock that is kept held across context switches. See spinlock_pass_to().
+ */
+struct spinlock_hold {
+    size_t depth;
+    ARCH_IRQSTATE prev_irqstate;
+};
+
+void spinlock_lock(struct spinlock *self);
+void spinlock_unlock(struct spinlock *self);
+/*
+ * Returns true if the current thread holds the lock.
+ */
+bool spinlock_is_held(struct spinlock *self);
+/*
+ * For the scheduler, which keeps its lock held while switching threads: Saves how the current thread holds the lock to
+ * `save_to`, and makes `thread` the holder as described by `restore_from`. The caller must switch to `thread` right
+ * after this.
+ */
+void spinlock_pass_to(struct spinlock *self, struct spinlock_hold *save_to, struct thread *thread, struct spinlock_hold const *restore_from);
@@ -3,10 +3,24 @@
 #include <kernel/lib/list.h>
 #include <kernel/tasks/mutex.h>
 #include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Stack size given to thread_create(). Only the top THREAD_STACK_COMMIT_SIZE bytes of it are backed by memory, and the
+ * rest stays unmapped below that as a guard region. So THREAD_STACK_COMMIT_SIZE is how much stack a thread can actually
+ * use, and running past it faults instead of silently corrupting memory. Stacks are not grown on demand: Kernel-mode
+ * exceptions are delivered on the current stack, so a fault on the stack itself can't be handled.
+ */
 #define THREAD_STACK_SIZE (1024 * 16)
+#define THREAD_STACK_COMMIT_SIZE (1024 * 8)
+
+/* Exit status of threads that were shut down with the shutdown flag */
+#define THREAD_EXIT_STATUS_SHUTDOWN (-1)
 
 struct thread {
     /*
@@ -15,11 +29,55 @@ struct thread {
      * list)
      */
     struct list_node sched_listnode;
+    struct list_node all_threads_node; /* Node of the list of every thread */
     struct arch_thread *arch_thread;
+    void (*init_mainfunc)(void *);
+    void *init_data;
+    struct cpu *cpu;                      /* CPU the thread is running or queued on, or ran on last time */
+    struct spinlock_hold sched_lock_hold; /* How the thread holds the scheduler lock while it's switched out */
     struct mutex *waitingmutex;
     struct source_location desired_locksource;
-    int8_t priority;
+    uint64_t switch_count; /* Number of times the thread was switched to */
+    /* CPU accounting, in TSC cycles */
+    uint64_t run_cycles;
+    uint64_t wait_cycles;    /* Time spent waiting in the run queue */
+    uint64_t last_run_tsc;   /* When the thread was last switched to */
+    uint64_t last_queue_tsc; /* When the thread was last put into the run queue */
+    uint64_t voluntary_switches;   /* Switched away because it blocked or yielded */
+    uint64_t involuntary_switches; /* Switched away by the timer */
+    TICKTIME time_slice_left;
+    /* Deadline scheduling class. See sched_set_deadline(). dl_period is 0 for best-effort threads. */
+    struct timer dl_replenish_timer;
+    TICKTIME dl_period;
+    TICKTIME dl_budget;
+    TICKTIME dl_budget_left;
+    TICKTIME dl_deadline; /* End of the current period */
+    uint64_t dl_missed_deadlines;
+    struct waitqueue join_waitqueue;
+    int exit_status;
+    size_t id; /* Assigned in creation order, starting from 0 */
+    struct list held_mutexes; /* struct mutex items */
+    int8_t priority;      /* Priority the scheduler uses. It may be inherited from threads waiting for our mutexes. */
+    int8_t base_priority; /* Priority of the thread itself */
+    bool in_run_queue : 1;
+    bool running : 1; /* Running on one of CPUs */
     bool shutdown : 1;
+    bool exited : 1;
+    bool detached : 1;
+    bool dl_throttled : 1; /* Used up its budget, and waiting for the next period */
+};
+
+struct thread_stats {
+    size_t id;
+    int8_t priority;
+    bool is_idle : 1;
+    bool exited : 1;
+    uint64_t run_cycles;
+    uint64_t wait_cycles;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t missed_deadlines;
+    bool is_deadline : 1;
 };
 
 /*
@@ -31,3 +89,50 @@ struct thread {
 [[nodiscard]] struct thread *thread_create(size_t init_stacksize, void (*init_mainfunc)(void *), void *init_data);
 void thread_delete(struct thread *thread);
 void thread_switch(struct thread *from, struct thread *to);
+/*
+ * Threads also exit when the main function returns, with exit status 0.
+ */
+[[noreturn]] void thread_exit(int status);
+/*
+ * Waits for the thread to exit, deletes it, and returns its exit status.
+ * Each thread can only be joined once, and detached threads can't be joined.
+ */
+int thread_join(struct thread *thread);
+/*
+ * Lets the thread to be deleted automatically when it exits, instead of having to be joined.
+ */
+void thread_detach(struct thread *thread);
+/*
+ * Used by the scheduler and thread_exit(). The thread must not be in any queue, and it must not run again.
+ */
+void thread_set_exited(struct thread *thread, int status);
+/*
+ * Lets the current thread use floating point. Kernel code is normally built without it, so only code that is built to
+ * use the FPU and runs in such threads gets to use it. FPU registers are saved and restored only for these threads.
+ *
+ * Returns -ENOTSUP if there's no FPU, and -ENOMEM if there's not enough memory.
+ */
+[[nodiscard]] int thread_enable_fpu(void);
+/*
+ * Writes CPU accounting of up to `max_count` threads that weren't deleted yet to `out`, and returns the number of those
+ * threads. (It may be larger than `max_count`)
+ * Run time of the current thread includes time it has been running so far.
+ */
+size_t thread_get_all_stats(struct thread_stats *out, size_t max_count);
+/*
+ * Puts current thread into sleep until g_ticktime reaches `deadline`. The thread is not in the run queue while sleeping.
+ * Interrupts must be enabled, as the thread is woken up by the timer interrupt.
+ *
+ * If the scheduler isn't running yet, this just busy-waits.
+ */
+void thread_sleep_until(TICKTIME deadline);
+/*
+ * Sleeps for at least `ticks` ticks. Zero ticks only gives other threads a chance to run.
+ */
+void thread_sleep(TICKTIME ticks);
+/*
+ * For polling loops that started at `start_ns`(from clock_get_ns()): Does nothing until the loop has been running for a
+ * tick, and sleeps for a tick after that. This way short waits stay as busy-waits, but long ones don't keep the CPU
+ * busy. If interrupts are disabled, it never sleeps.
+ */
+void thread_poll_backoff(uint64_t start_ns);
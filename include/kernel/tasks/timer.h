@@ -0,0 +1,34 @@
+#pragma once
+#include <kernel/lib/list.h>
+#include <kernel/ticktime.h>
+
+struct timer {
+    struct list_node node;
+    struct list *slot; /* nullptr if the timer is not pending */
+    TICKTIME deadline;
+    void (*callback)(void *data);
+    void *data;
+};
+
+/*
+ * Calls `callback` from the timer interrupt once g_ticktime reaches `deadline`. If the deadline has already passed, it
+ * is called on the next tick. The callback runs with the scheduler lock held(so interrupts are disabled as well), and
+ * the timer is no longer pending by then, so it may start the timer again.
+ *
+ * The timer must not be pending already.
+ */
+void timer_start(struct timer *timer, TICKTIME deadline, void (*callback)(void *data), void *data);
+/*
+ * Returns false if the timer wasn't pending. (Either it was never started, or it already fired)
+ */
+bool timer_cancel(struct timer *timer);
+bool timer_is_pending(struct timer const *timer);
+/*
+ * Returns the earliest tick that timer_tick() has something to do, or `limit` if there's nothing to do until then.
+ * The result is never later than 64 ticks from now. The scheduler lock must be held.
+ */
+TICKTIME timer_get_next_event(TICKTIME limit);
+/*
+ * Runs every timer whose deadline is `now` or earlier. Called by the timer interrupt, with the scheduler lock held.
+ */
+void timer_tick(TICKTIME now);
@@ -0,0 +1,34 @@
+#pragma once
+#include <kernel/lib/list.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+
+struct waitqueue {
+    struct list waiters; /* Waiting threads, in the order they started waiting */
+};
+
+/* This is not necessary if it's static variable(which is initialized by zero). */
+void waitqueue_init(struct waitqueue *out);
+
+/*
+ * Blocks current thread until someone wakes it up with waitqueue_wake_one() or waitqueue_wake_all().
+ *
+ * The scheduler lock(see sched_lock()) must be held while checking the condition and calling this, and wakers must
+ * change the condition before calling waitqueue_wake_*(), which takes the lock. This way the wakeup can't slip in
+ * between checking the condition and starting to wait. The lock is held again when it returns, but other threads and
+ * interrupts may have run in the meantime. Callers should check the condition again after waking up: Before the
+ * scheduler is running, this just waits for the next interrupt and returns.
+ */
+void waitqueue_wait(struct waitqueue *self);
+/*
+ * Same as waitqueue_wait(), but gives up once g_ticktime reaches `deadline`. Returns false if that happened.
+ */
+bool waitqueue_wait_until(struct waitqueue *self, TICKTIME deadline);
+/*
+ * These can be called from interrupt handlers. Woken threads are put back to the run queue, but they don't run until
+ * the scheduler picks them.
+ */
+/* Returns false if nobody was waiting. */
+bool waitqueue_wake_one(struct waitqueue *self);
+/* Returns number of threads that were woken up. */
+size_t waitqueue_wake_all(struct waitqueue *self);
@@ -1,5 +1,6 @@
 #pragma once
 #include <kernel/lib/list.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct trap_handler {
@@ -14,4 +15,19 @@ struct trap_handler {
  * That is because PIC driver registers its own traphandler for all of its IRQs, and also takes care of suprious IRQ handling.
  */
 void trapmanager_register_trap(struct trap_handler *out, int trapnum, void (*callback)(int trapnum, void *trapframe, void *data), void *data);
+/*
+ * Removes a handler registered with trapmanager_register_trap(). Both functions panic if they find that handlers of
+ * `trapnum` were corrupted.
+ */
+void trapmanager_unregister_trap(struct trap_handler *handler, int trapnum);
 void trapmanager_trap(int trapnum, void *trapframe);
+size_t trapmanager_get_handler_count(int trapnum);
+/*
+ * Checks every registered handler and the dispatch table against what was registered. Handlers are not checked when
+ * traps are dispatched, so this is what catches corrupted handlers. Returns number of bad entries found.
+ */
+size_t trapmanager_audit(void);
+/*
+ * Starts running trapmanager_audit() periodically. The IRQ work thread must be started.
+ */
+void trapmanager_start_periodic_audit(void);
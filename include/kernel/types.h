@@ -5,6 +5,10 @@
 typedef unsigned char    UCHAR;
 typedef unsigned int     UINT;
 typedef unsigned long    ULONG;
-typedef uintptr_t        PHYSPTR;
+/*
+ * Physical addresses are always 64-bit wide, even on 32-bit architectures, so that physical address extensions
+ * (e.g. PAE on i586) can describe memory above 4GiB.
+ */
+typedef uint64_t         PHYSPTR;
 #define PHYSICALPTR_NULL ((PHYSPTR)0)
-
+#define PHYSICALPTR_MAX  ((PHYSPTR)UINT64_MAX)
@@ -0,0 +1,482 @@
+#include "apic.h"
+#include "asm/i586.h"
+#include "pit.h"
+#include "smp.h"
+#include "tick.h"
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/iodelay.h>
+#include <kernel/arch/mmu.h>
+#include <kernel/arch/smp.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/cpu.h>
+#include <kernel/io/co.h>
+#include <kernel/mem/vmm.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/ticktime.h>
+#include <kernel/trapmanager.h>
+#include <kernel/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************** Configuration *******************************/
+
+/*
+ * Use local APIC timer instead of the PIT for timer ticks?
+ */
+static bool const CONFIG_USE_LAPIC_TIMER = true;
+
+/******************************************************************************/
+
+#define LAPIC_REG_ID 0x020
+#define LAPIC_REG_VERSION 0x030
+#define LAPIC_REG_TPR 0x080
+#define LAPIC_REG_EOI 0x0b0
+#define LAPIC_REG_SVR 0x0f0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_LVT_LINT0 0x350
+#define LAPIC_REG_LVT_LINT1 0x360
+#define LAPIC_REG_LVT_ERROR 0x370
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_FLAG_ENABLE (1U << 8)
+#define LAPIC_LVT_FLAG_MASKED (1U << 16)
+#define LAPIC_LVT_TIMER_ONESHOT (0U << 17)
+#define LAPIC_LVT_TIMER_PERIODIC (1U << 17)
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+#define LAPIC_ICR_DELIVERY_FIXED (0U << 8)
+#define LAPIC_ICR_DELIVERY_INIT (5U << 8)
+#define LAPIC_ICR_DELIVERY_STARTUP (6U << 8)
+#define LAPIC_ICR_FLAG_PENDING (1U << 12)
+#define LAPIC_ICR_FLAG_ASSERT (1U << 14)
+#define LAPIC_ICR_FLAG_LEVEL (1U << 15)
+
+#define IOAPIC_REG_SELECT 0x00
+#define IOAPIC_REG_WINDOW 0x10
+#define IOAPIC_INDEX_VERSION 0x01
+#define IOAPIC_INDEX_REDIRECTION(_n) (0x10 + ((_n) * 2))
+
+#define IOAPIC_REDIRECTION_FLAG_ACTIVE_LOW (1U << 13)
+#define IOAPIC_REDIRECTION_FLAG_LEVEL (1U << 15)
+#define IOAPIC_REDIRECTION_FLAG_MASKED (1U << 16)
+
+#define LAPIC_TIMER_VECTOR 0x40
+#define LAPIC_RESCHEDULE_VECTOR 0x41
+#define LAPIC_TLB_SHOOTDOWN_VECTOR 0x42
+#define LAPIC_ERROR_VECTOR 0xfe
+#define LAPIC_SPURIOUS_VECTOR 0xff
+
+#define ISA_IRQ_COUNT 16
+
+/* Timer ticks to wait while calibrating the local APIC timer */
+#define CALIBRATION_TICKS 10
+/* Give up calibrating if the tick source doesn't seem to tick */
+#define CALIBRATION_TIMEOUT_CYCLES 10000000000ULL
+
+/* Delays of INIT-SIPI-SIPI sequence, from Intel MultiProcessor Specification */
+#define INIT_DELAY_US 10000
+#define STARTUP_DELAY_US 200
+
+static uint32_t volatile *s_lapic;
+static uint32_t volatile *s_ioapic;
+static uint32_t s_ioapic_gsi_base;
+static size_t s_ioapic_pin_count;
+static uint8_t s_isa_irq_pins[ISA_IRQ_COUNT];
+/*
+ * I/O APIC registers are accessed by selecting the index first, so this keeps other CPUs from selecting another in the
+ * middle. Take it around multiple accesses that need to happen together, too.
+ */
+static struct spinlock s_ioapic_lock;
+
+static uint32_t lapic_read(size_t reg) {
+    return s_lapic[reg / sizeof(*s_lapic)];
+}
+
+static void lapic_write(size_t reg, uint32_t value) {
+    s_lapic[reg / sizeof(*s_lapic)] = value;
+}
+
+static uint32_t ioapic_read(uint8_t index) {
+    spinlock_lock(&s_ioapic_lock);
+    s_ioapic[IOAPIC_REG_SELECT / sizeof(*s_ioapic)] = index;
+    uint32_t result = s_ioapic[IOAPIC_REG_WINDOW / sizeof(*s_ioapic)];
+    spinlock_unlock(&s_ioapic_lock);
+    return result;
+}
+
+static void ioapic_write(uint8_t index, uint32_t value) {
+    spinlock_lock(&s_ioapic_lock);
+    s_ioapic[IOAPIC_REG_SELECT / sizeof(*s_ioapic)] = index;
+    s_ioapic[IOAPIC_REG_WINDOW / sizeof(*s_ioapic)] = value;
+    spinlock_unlock(&s_ioapic_lock);
+}
+
+void archi586_lapic_send_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+static void spurious_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    (void)data;
+    /* Spurious interrupts must not be EOI-ed */
+}
+
+static void error_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    (void)data;
+    co_printf("lapic: error interrupt\n");
+    archi586_lapic_send_eoi();
+}
+
+static void reschedule_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    (void)data;
+    /* Waking up from HLT is all it takes. The idle thread looks at the run queue once it wakes up. */
+    archi586_lapic_send_eoi();
+}
+
+/*
+ * Sends IPI to the CPU with given APIC ID. `icr_low` is the vector and delivery mode.
+ */
+static void send_ipi(uint32_t apic_id, uint32_t icr_low) {
+    /* ICR belongs to the CPU we are running on, so we can't move to other CPU in the middle of using it. */
+    bool prev_interrupts = arch_irq_disable();
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_FLAG_PENDING) {
+        arch_smp_spin_pause();
+    }
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    /* Writing the low half sends it. */
+    lapic_write(LAPIC_REG_ICR_LOW, icr_low);
+    arch_irq_restore(prev_interrupts);
+}
+
+void archi586_lapic_send_reschedule(uint32_t apic_id) {
+    if (s_lapic == nullptr) {
+        return;
+    }
+    send_ipi(apic_id, LAPIC_ICR_DELIVERY_FIXED | LAPIC_RESCHEDULE_VECTOR);
+}
+
+static void tlb_shootdown_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    (void)data;
+    archi586_smp_flush_tlb_if_requested();
+    archi586_lapic_send_eoi();
+}
+
+void archi586_lapic_send_tlb_shootdown(uint32_t apic_id) {
+    if (s_lapic == nullptr) {
+        return;
+    }
+    send_ipi(apic_id, LAPIC_ICR_DELIVERY_FIXED | LAPIC_TLB_SHOOTDOWN_VECTOR);
+}
+
+static void delay_us(uint32_t us) {
+    uint64_t frequency = arch_tsc_get_frequency();
+    if (frequency == 0) {
+        /* Each I/O delay takes about a microsecond */
+        for (uint32_t i = 0; i < us; i++) {
+            arch_iodelay();
+        }
+        return;
+    }
+    uint64_t cycles = (frequency / 1000000) * us;
+    uint64_t start_tsc = arch_read_tsc();
+    while ((arch_read_tsc() - start_tsc) < cycles) {
+        arch_smp_spin_pause();
+    }
+}
+
+bool archi586_lapic_start_cpu(uint32_t apic_id, PHYSPTR startaddr) {
+    assert(((startaddr % ARCH_PAGESIZE) == 0) && (startaddr < 0x100000));
+    if (s_lapic == nullptr) {
+        return false;
+    }
+    send_ipi(apic_id, LAPIC_ICR_DELIVERY_INIT | LAPIC_ICR_FLAG_ASSERT | LAPIC_ICR_FLAG_LEVEL);
+    /* Deassert is only needed by old external APICs, and newer ones ignore it. */
+    send_ipi(apic_id, LAPIC_ICR_DELIVERY_INIT | LAPIC_ICR_FLAG_LEVEL);
+    delay_us(INIT_DELAY_US);
+    /* The second one is for CPUs that missed the first one. CPUs that are already running ignore it. */
+    for (int i = 0; i < 2; i++) {
+        send_ipi(apic_id, LAPIC_ICR_DELIVERY_STARTUP | (uint32_t)(startaddr / ARCH_PAGESIZE));
+        delay_us(STARTUP_DELAY_US);
+    }
+    return true;
+}
+
+static bool is_lapic_supported(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return false;
+    }
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx & CPUID_1_EDX_FLAG_APIC;
+}
+
+static void *map_registers(PHYSPTR base) {
+    struct vmm_object *object = vmm_map_mem(vmm_get_kernel_address_space(), base, ARCH_PAGESIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_PROT_NOCACHE);
+    if (object == nullptr) {
+        return nullptr;
+    }
+    return object->start;
+}
+
+static struct trap_handler s_spurious_trap_handler;
+static struct trap_handler s_error_trap_handler;
+static struct trap_handler s_reschedule_trap_handler;
+static struct trap_handler s_tlb_shootdown_trap_handler;
+
+static void init_current_lapic(void) {
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_FLAG_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_FLAG_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_FLAG_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_FLAG_MASKED);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_ERROR_VECTOR);
+    archi586_lapic_send_eoi();
+}
+
+bool archi586_apic_init(void) {
+    PHYSPTR lapic_base = archi586_smp_get_lapic_base();
+    PHYSPTR ioapic_base = archi586_smp_get_ioapic_base(&s_ioapic_gsi_base);
+    if (!is_lapic_supported() || (lapic_base == 0) || (ioapic_base == 0)) {
+        co_printf("apic: no local APIC or I/O APIC\n");
+        return false;
+    }
+    s_lapic = map_registers(lapic_base);
+    s_ioapic = map_registers(ioapic_base);
+    if ((s_lapic == nullptr) || (s_ioapic == nullptr)) {
+        co_printf("apic: not enough memory to map registers\n");
+        s_lapic = nullptr;
+        s_ioapic = nullptr;
+        return false;
+    }
+    s_ioapic_pin_count = ((ioapic_read(IOAPIC_INDEX_VERSION) >> 16) & 0xffU) + 1;
+
+    /* Setup I/O APIC *********************************************************/
+    for (size_t pin = 0; pin < s_ioapic_pin_count; pin++) {
+        ioapic_write(IOAPIC_INDEX_REDIRECTION(pin), IOAPIC_REDIRECTION_FLAG_MASKED);
+        ioapic_write(IOAPIC_INDEX_REDIRECTION(pin) + 1, 0);
+    }
+
+    /* Setup local APIC *******************************************************/
+    trapmanager_register_trap(&s_spurious_trap_handler, LAPIC_SPURIOUS_VECTOR, spurious_handler, nullptr);
+    trapmanager_register_trap(&s_error_trap_handler, LAPIC_ERROR_VECTOR, error_handler, nullptr);
+    trapmanager_register_trap(&s_reschedule_trap_handler, LAPIC_RESCHEDULE_VECTOR, reschedule_handler, nullptr);
+    trapmanager_register_trap(&s_tlb_shootdown_trap_handler, LAPIC_TLB_SHOOTDOWN_VECTOR, tlb_shootdown_handler, nullptr);
+    init_current_lapic();
+    co_printf("apic: local APIC ID %u version %#x, I/O APIC with %zu pins\n", lapic_read(LAPIC_REG_ID) >> 24, lapic_read(LAPIC_REG_VERSION) & 0xffU, s_ioapic_pin_count);
+    return true;
+}
+
+/******************************** I/O APIC ************************************/
+
+void archi586_ioapic_route_isa_irq(uint8_t irq, uint8_t vector) {
+    assert(irq < ISA_IRQ_COUNT);
+    struct archi586_isa_irq_route route;
+    archi586_smp_get_isa_irq_route(&route, irq);
+    if ((route.gsi < s_ioapic_gsi_base) || ((s_ioapic_gsi_base + s_ioapic_pin_count) <= route.gsi)) {
+        co_printf("apic: IRQ %u is wired to GSI %u, which is not on the I/O APIC\n", irq, route.gsi);
+        return;
+    }
+    uint8_t pin = route.gsi - s_ioapic_gsi_base;
+    s_isa_irq_pins[irq] = pin;
+    uint32_t low = vector | IOAPIC_REDIRECTION_FLAG_MASKED;
+    if (route.active_low) {
+        low |= IOAPIC_REDIRECTION_FLAG_ACTIVE_LOW;
+    }
+    if (route.level_triggered) {
+        low |= IOAPIC_REDIRECTION_FLAG_LEVEL;
+    }
+    /* Fixed delivery, physical destination mode */
+    uint32_t high = cpu_get_boot()->arch_id << 24;
+    spinlock_lock(&s_ioapic_lock);
+    ioapic_write(IOAPIC_INDEX_REDIRECTION(pin), low);
+    ioapic_write(IOAPIC_INDEX_REDIRECTION(pin) + 1, high);
+    spinlock_unlock(&s_ioapic_lock);
+}
+
+bool archi586_ioapic_is_isa_irq_masked(uint8_t irq) {
+    assert(irq < ISA_IRQ_COUNT);
+    return ioapic_read(IOAPIC_INDEX_REDIRECTION(s_isa_irq_pins[irq])) & IOAPIC_REDIRECTION_FLAG_MASKED;
+}
+
+void archi586_ioapic_mask_isa_irq(uint8_t irq) {
+    assert(irq < ISA_IRQ_COUNT);
+    uint8_t index = IOAPIC_INDEX_REDIRECTION(s_isa_irq_pins[irq]);
+    spinlock_lock(&s_ioapic_lock);
+    ioapic_write(index, ioapic_read(index) | IOAPIC_REDIRECTION_FLAG_MASKED);
+    spinlock_unlock(&s_ioapic_lock);
+}
+
+void archi586_ioapic_unmask_isa_irq(uint8_t irq) {
+    assert(irq < ISA_IRQ_COUNT);
+    uint8_t index = IOAPIC_INDEX_REDIRECTION(s_isa_irq_pins[irq]);
+    spinlock_lock(&s_ioapic_lock);
+    ioapic_write(index, ioapic_read(index) & ~IOAPIC_REDIRECTION_FLAG_MASKED);
+    spinlock_unlock(&s_ioapic_lock);
+}
+
+/******************************** Local APIC timer ****************************/
+
+static uint32_t s_counts_per_tick;
+/*
+ * Ticks covered by the one-shot count that is currently running. 0 if the periodic tick is running.
+ */
+static TICKTIME s_stopped_ticks;
+static uint32_t s_oneshot_count;
+/* Counts that passed while ticks were stopped, but didn't make up a whole tick */
+static uint32_t s_leftover_counts;
+/* The one-shot count ran out while interrupts were disabled, and its interrupt was already counted by resume(). */
+static bool s_stale_irq_pending;
+
+static void start_periodic(void) {
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, s_counts_per_tick);
+}
+
+static void timer_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    (void)data;
+    if (cpu_get_current() != cpu_get_boot()) {
+        /* Only the boot CPU keeps track of time, and others only need to run the scheduler. */
+        archi586_lapic_send_eoi();
+        sched_tick();
+        return;
+    }
+    if (s_stale_irq_pending) {
+        s_stale_irq_pending = false;
+        archi586_lapic_send_eoi();
+        return;
+    }
+    TICKTIME ticks = 1;
+    if (s_stopped_ticks != 0) {
+        /* One-shot count ran out. */
+        ticks = s_stopped_ticks;
+        s_stopped_ticks = 0;
+        start_periodic();
+    }
+    archi586_tick_advance(ticks);
+    archi586_lapic_send_eoi();
+    sched_tick();
+}
+
+static TICKTIME get_max_stop_ticks(void) {
+    return UINT32_MAX / s_counts_per_tick;
+}
+
+static void stop(TICKTIME ticks) {
+    assert(s_stopped_ticks == 0);
+    if (get_max_stop_ticks() < ticks) {
+        ticks = get_max_stop_ticks();
+    }
+    if (ticks <= 1) {
+        return;
+    }
+    s_stopped_ticks = ticks;
+    s_oneshot_count = ticks * s_counts_per_tick;
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, s_oneshot_count);
+}
+
+static void resume(void) {
+    if (s_stopped_ticks == 0) {
+        return;
+    }
+    uint32_t current_count = lapic_read(LAPIC_REG_TIMER_CURRENT);
+    if (current_count == 0) {
+        /*
+         * The count already ran out, so its interrupt is pending. It's counted here, so the interrupt handler has to
+         * drop it.
+         */
+        s_stale_irq_pending = true;
+    }
+    uint64_t elapsed_counts = (uint64_t)s_oneshot_count - current_count;
+    elapsed_counts += s_leftover_counts;
+    s_leftover_counts = elapsed_counts % s_counts_per_tick;
+    s_stopped_ticks = 0;
+    start_periodic();
+    TICKTIME ticks = elapsed_counts / s_counts_per_tick;
+    if (ticks != 0) {
+        archi586_tick_advance(ticks);
+    }
+}
+
+static struct archi586_tick_source const TICK_SOURCE = {
+    .name = "local APIC timer",
+    .stop = stop,
+    .resume = resume,
+    .get_max_stop_ticks = get_max_stop_ticks,
+};
+
+/*
+ * Returns false if the tick source didn't tick in time.
+ */
+[[nodiscard]] static bool wait_for_tick(TICKTIME tick) {
+    uint64_t start_tsc = arch_read_tsc();
+    while (g_ticktime < tick) {
+        if (CALIBRATION_TIMEOUT_CYCLES < (arch_read_tsc() - start_tsc)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct trap_handler s_timer_trap_handler;
+
+void archi586_lapic_timer_init(void) {
+    if (!CONFIG_USE_LAPIC_TIMER || (s_lapic == nullptr)) {
+        return;
+    }
+    assert(arch_irq_are_enabled());
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_FLAG_MASKED | LAPIC_TIMER_VECTOR);
+    /* Start counting right after a tick, so that we count whole ticks. */
+    if (!wait_for_tick(g_ticktime + 1)) {
+        goto timeout;
+    }
+    TICKTIME start = g_ticktime;
+    lapic_write(LAPIC_REG_TIMER_INITIAL, UINT32_MAX);
+    if (!wait_for_tick(start + CALIBRATION_TICKS)) {
+        goto timeout;
+    }
+    uint32_t elapsed_counts = UINT32_MAX - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+    s_counts_per_tick = elapsed_counts / CALIBRATION_TICKS;
+    if (s_counts_per_tick == 0) {
+        co_printf("lapic: timer doesn't seem to count - keeping the PIT\n");
+        return;
+    }
+    co_printf("lapic: timer runs %u counts per tick\n", s_counts_per_tick);
+    trapmanager_register_trap(&s_timer_trap_handler, LAPIC_TIMER_VECTOR, timer_handler, nullptr);
+    bool prev_interrupts = arch_irq_disable();
+    archi586_pit_stop_tick();
+    archi586_tick_set_source(&TICK_SOURCE);
+    start_periodic();
+    arch_irq_restore(prev_interrupts);
+    return;
+timeout:
+    co_printf("lapic: timed out waiting for timer ticks - keeping the PIT\n");
+}
+
+void archi586_lapic_init_ap(void) {
+    ASSERT_IRQ_DISABLED();
+    init_current_lapic();
+    if (s_counts_per_tick == 0) {
+        /* Local APIC timer is not the tick source */
+        return;
+    }
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    start_periodic();
+}
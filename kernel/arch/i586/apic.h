@@ -0,0 +1,43 @@
+#pragma once
+#include <kernel/types.h>
+#include <stdint.h>
+
+/*
+ * Sets up local APIC of the boot CPU and the first I/O APIC. Returns false if either of them is missing, and in that
+ * case the caller should keep using the 8259 PIC.
+ */
+[[nodiscard]] bool archi586_apic_init(void);
+void archi586_lapic_send_eoi(void);
+/*
+ * Interrupts the CPU with given APIC ID, so that it looks at its run queue if it was idle. Does nothing without the
+ * local APIC.
+ */
+void archi586_lapic_send_reschedule(uint32_t apic_id);
+/*
+ * Interrupts the CPU with given APIC ID, so that it picks up TLB flush requests. See arch_smp_shootdown_tlb().
+ */
+void archi586_lapic_send_tlb_shootdown(uint32_t apic_id);
+/*
+ * Starts the CPU with given APIC ID with INIT-SIPI-SIPI sequence. It begins running in real mode at `startaddr`, which
+ * must be page aligned and below 1M. Returns once the sequence is sent, so the caller has to wait for the CPU to show
+ * up by itself. Returns false without the local APIC.
+ */
+[[nodiscard]] bool archi586_lapic_start_cpu(uint32_t apic_id, PHYSPTR startaddr);
+/*
+ * Sets up local APIC of the calling CPU that is not the boot CPU, and starts timer ticks there if the local APIC timer
+ * is used. Interrupts must be disabled.
+ */
+void archi586_lapic_init_ap(void);
+/*
+ * Routes ISA `irq` to `vector` of the boot CPU, following interrupt source overrides from the firmware.
+ * The IRQ is masked until archi586_ioapic_unmask_isa_irq() is called.
+ */
+void archi586_ioapic_route_isa_irq(uint8_t irq, uint8_t vector);
+bool archi586_ioapic_is_isa_irq_masked(uint8_t irq);
+void archi586_ioapic_mask_isa_irq(uint8_t irq);
+void archi586_ioapic_unmask_isa_irq(uint8_t irq);
+/*
+ * Calibrates local APIC timer against the current tick source, and makes it the new tick source.
+ * Does nothing if the local APIC is not used. Interrupts must be enabled, as calibration waits for timer ticks.
+ */
+void archi586_lapic_timer_init(void);
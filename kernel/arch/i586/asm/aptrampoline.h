@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * Where the trampoline is copied to. Other CPUs start in real mode at the page given by the startup IPI, so this must be
+ * page aligned and below 1M.
+ */
+#define ARCHI586_AP_TRAMPOLINE_ADDR 0x8000
+
+/* Offsets into struct archi586_ap_trampoline_params */
+#define ARCHI586_AP_TRAMPOLINE_PARAM_CR3 0
+#define ARCHI586_AP_TRAMPOLINE_PARAM_CR4 4
+#define ARCHI586_AP_TRAMPOLINE_PARAM_ESP 8
+#define ARCHI586_AP_TRAMPOLINE_PARAM_ENTRY 12
+#define ARCHI586_AP_TRAMPOLINE_PARAM_ARG 16
+#define ARCHI586_AP_TRAMPOLINE_PARAMS_SIZE 20
+
+#ifndef YJKERNEL_ASMFILE
+#include <kernel/lib/diagnostics.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct archi586_ap_trampoline_params {
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t esp; /* Top of the stack to call `entry` with */
+    void (*entry)(void *arg); /* Must not return */
+    void *arg;
+};
+STATIC_ASSERT_SIZE(struct archi586_ap_trampoline_params, ARCHI586_AP_TRAMPOLINE_PARAMS_SIZE);
+STATIC_ASSERT_TEST(offsetof(struct archi586_ap_trampoline_params, cr3) == ARCHI586_AP_TRAMPOLINE_PARAM_CR3);
+STATIC_ASSERT_TEST(offsetof(struct archi586_ap_trampoline_params, cr4) == ARCHI586_AP_TRAMPOLINE_PARAM_CR4);
+STATIC_ASSERT_TEST(offsetof(struct archi586_ap_trampoline_params, esp) == ARCHI586_AP_TRAMPOLINE_PARAM_ESP);
+STATIC_ASSERT_TEST(offsetof(struct archi586_ap_trampoline_params, entry) == ARCHI586_AP_TRAMPOLINE_PARAM_ENTRY);
+STATIC_ASSERT_TEST(offsetof(struct archi586_ap_trampoline_params, arg) == ARCHI586_AP_TRAMPOLINE_PARAM_ARG);
+
+/*
+ * The trampoline code itself is not run from here. It's copied to ARCHI586_AP_TRAMPOLINE_ADDR, and parameters are
+ * written to the copy, at the same offset as archi586_ap_trampoline_params from archi586_ap_trampoline_begin.
+ */
+extern uint8_t const archi586_ap_trampoline_begin[];
+extern uint8_t const archi586_ap_trampoline_params[];
+extern uint8_t const archi586_ap_trampoline_end[];
+#endif
@@ -7,12 +7,24 @@ void archi586_cli(void);
 void archi586_sti(void);
 void archi586_hlt(void);
 void archi586_rdtsc(uint32_t *upper, uint32_t *lower);
+void archi586_cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
 void archi586_invlpg(void *ptr);
 void archi586_reload_cr3(void);
 uint32_t archi586_read_cr0(void);
+void archi586_write_cr0(uint32_t value);
 void *archi586_read_cr2(void);
 uint32_t archi586_read_cr3(void);
 uint32_t archi586_read_cr4(void);
+void archi586_write_cr4(uint32_t value);
 uint32_t archi586_read_cr8(void);
 
 static uint32_t const EFLAGS_FLAG_IF = 1 << 9;
+
+/* CPUID leaf 1, EDX */
+static uint32_t const CPUID_1_EDX_FLAG_FPU = 1 << 0;
+static uint32_t const CPUID_1_EDX_FLAG_TSC = 1 << 4;
+static uint32_t const CPUID_1_EDX_FLAG_PAE = 1 << 6;
+static uint32_t const CPUID_1_EDX_FLAG_APIC = 1 << 9;
+static uint32_t const CPUID_1_EDX_FLAG_PGE = 1 << 13;
+static uint32_t const CPUID_1_EDX_FLAG_FXSR = 1 << 24;
+static uint32_t const CPUID_1_EDX_FLAG_SSE = 1 << 25;
@@ -1,17 +1,22 @@
+#include "apic.h"
 #include "asm/i586.h"
 #include "bootinfo.h"
 #include "dev/idebus.h"
 #include "dev/ps2ctrl.h"
 #include "exceptions.h"
+#include "fpu.h"
 #include "gdt.h"
 #include "idt.h"
 #include "mmu_ext.h"
 #include "pic.h"
 #include "pit.h"
 #include "serial.h"
+#include "smp.h"
 #include "thirdparty/multiboot.h"
+#include "tsc.h"
 #include "vgatty.h"
 #include <kernel/arch/interrupts.h>
+#include <kernel/cpu.h>
 #include <kernel/io/co.h>
 #include <kernel/kernel.h>
 #include <kernel/panic.h>
@@ -73,7 +78,7 @@ static void init_serial1(void) {
     co_printf("serial1 is ready\n");
 }
 
-[[noreturn]] void archi586_init(uint32_t mb_magic, PHYSPTR mb_info_addr) {
+[[noreturn]] void archi586_init(uint32_t mb_magic, uint32_t mb_info_addr) {
     if (CONFIG_EARLY_VGATTY) {
         archi586_vgatty_init_early_debug();
     }
@@ -93,7 +98,7 @@ static void init_serial1(void) {
     arch_mmu_write_protect_after_early_init();
     archi586_exceptions_init();
     archi586_gdt_load();
-    archi586_gdt_reload_selectors();
+    archi586_gdt_reload_selectors(cpu_get_boot());
     archi586_idt_load();
     /* archi586_idt_test(); */
 
@@ -101,10 +106,17 @@ static void init_serial1(void) {
         panic("bad multiboot magic");
     }
     archi586_bootinfo_process(mb_info_addr);
+    archi586_mmu_init_pae();
+    archi586_gdt_update_doublefault_cr3();
+    archi586_bootinfo_register_high_mem();
+    archi586_smp_init();
     archi586_pic_init();
     archi586_pit_init();
+    archi586_tsc_init();
+    archi586_fpu_init();
 
     arch_irq_enable();
+    archi586_lapic_timer_init();
     archi586_ps2ctrl_init();
     archi586_idebus_init();
     if (s_serial0_ready) {
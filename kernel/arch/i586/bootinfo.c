@@ -1,4 +1,5 @@
 #include "bootinfo.h"
+#include "mmu_ext.h"
 #include "sections.h"
 #include "thirdparty/multiboot.h"
 #include "vgatty.h"
@@ -15,12 +16,25 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/******************************** Configuration *******************************/
+
+/*
+ * Max number of memory regions above 4GiB that can be remembered until PAE is enabled.
+ */
+#define CONFIG_MAX_HIGH_REGIONS 16
+
+/******************************************************************************/
+
 struct mem_region {
     PHYSPTR base;
-    size_t len;
+    uint64_t len;
 };
 
-static void exclude_region(struct mem_region *before_out, struct mem_region *after_out, PHYSPTR addr, size_t len, PHYSPTR exclude_addr, size_t exclude_len) {
+/* Available memory regions above 4GiB. These are registered after we know whether PAE is available. */
+static struct mem_region s_high_regions[CONFIG_MAX_HIGH_REGIONS];
+static size_t s_high_regions_count;
+
+static void exclude_region(struct mem_region *before_out, struct mem_region *after_out, PHYSPTR addr, uint64_t len, PHYSPTR exclude_addr, uint64_t exclude_len) {
     PHYSPTR start = addr;
     PHYSPTR end = start + len;
     PHYSPTR exclude_start = exclude_addr;
@@ -32,11 +46,11 @@ static void exclude_region(struct mem_region *before_out, struct mem_region *aft
         after_out->len = 0;
         return;
     }
-    if (UINTPTR_MAX - start < len) {
-        end = UINTPTR_MAX;
+    if (PHYSICALPTR_MAX - start < len) {
+        end = PHYSICALPTR_MAX;
     }
-    if (UINTPTR_MAX - exclude_len < exclude_start) {
-        exclude_end = UINTPTR_MAX;
+    if (PHYSICALPTR_MAX - exclude_len < exclude_start) {
+        exclude_end = PHYSICALPTR_MAX;
     }
 
     PHYSPTR before_start = start;
@@ -56,7 +70,11 @@ static void exclude_region(struct mem_region *before_out, struct mem_region *aft
     }
 }
 
-static struct mem_region const REGIONS_TO_EXCLUDE[] = {
+/* These are always below 4GiB, so uintptr_t is enough(and we can't use addresses of linker symbols in 64-bit initializers). */
+static struct {
+    uintptr_t base;
+    uintptr_t len;
+} const REGIONS_TO_EXCLUDE[] = {
     {
         .base = 0x0,
         .len = 0x100000,
@@ -74,31 +92,31 @@ typedef enum {
     ADDRLIMIT_RESULT_OK,
 } ADDRLIMIT_RESULT;
 
-static ADDRLIMIT_RESULT limit_to_32bit_addr(PHYSPTR *addr_out, size_t *len_out, uint64_t addr, uint64_t len) {
+static ADDRLIMIT_RESULT limit_to_addr(PHYSPTR *addr_out, uint64_t *len_out, uint64_t addr, uint64_t len, PHYSPTR max_addr) {
     uint64_t first_addr = addr;
     uint64_t last_addr = addr + len - 1;
-    bool outside_32bit = false;
-    if (UINT32_MAX < first_addr) {
+    bool outside_limit = false;
+    if ((len == 0) || (max_addr < first_addr)) {
         return ADDRLIMIT_RESULT_IGNORE;
     }
-    if (UINT32_MAX < last_addr) {
-        outside_32bit = true;
-        last_addr = UINT32_MAX;
+    if ((last_addr < first_addr) || (max_addr < last_addr)) {
+        outside_limit = true;
+        last_addr = max_addr;
     }
     *addr_out = first_addr;
     *len_out = last_addr - first_addr + 1;
-    if (outside_32bit) {
+    if (outside_limit) {
         return ADDRLIMIT_RESULT_WARN;
     }
     return ADDRLIMIT_RESULT_OK;
 }
 
-static void human_readable_len(size_t *len_out, char const **unit_out, size_t len) {
+static void human_readable_len(uint64_t *len_out, char const **unit_out, uint64_t len) {
     static char const *const UNITS[] = {"B", "K", "M", "G", "T"};
     enum {
         UNITS_COUNT = sizeof(UNITS) / sizeof(*UNITS)
     };
-    size_t resultlen = len;
+    uint64_t resultlen = len;
     size_t idx = 0;
     while (1024 <= resultlen) {
         if (((UNITS_COUNT - 1) <= idx)) {
@@ -115,10 +133,9 @@ static void print_mem_map(struct multiboot_info const *info) {
     multiboot_uint32_t mmaplen = info->mmap_length;
     multiboot_uint32_t mmapaddr = info->mmap_addr;
     size_t readlen;
-    co_printf("----------------- Memory map -----------------\n");
-    co_printf("fromaddr  toaddr   length  type\n");
+    co_printf("------------------- Memory map -------------------\n");
+    co_printf("fromaddr    toaddr      length  type\n");
     size_t totalsize;
-    bool warn_too_much_mem = false;
     PHYSPTR entryaddr = mmapaddr;
     for (readlen = 0; readlen < mmaplen; entryaddr += totalsize) {
         struct multiboot_mmap_entry entry;
@@ -135,21 +152,10 @@ static void print_mem_map(struct multiboot_info const *info) {
         readlen += totalsize;
 
         PHYSPTR addr;
-        size_t len;
+        uint64_t len;
         uint32_t type = entry.type;
-        switch (limit_to_32bit_addr(&addr, &len, entry.addr, entry.len)) {
-        case ADDRLIMIT_RESULT_IGNORE:
-            if (type == MULTIBOOT_MEMORY_AVAILABLE) {
-                warn_too_much_mem = true;
-            }
+        if (limit_to_addr(&addr, &len, entry.addr, entry.len, PHYSICALPTR_MAX) == ADDRLIMIT_RESULT_IGNORE) {
             continue;
-        case ADDRLIMIT_RESULT_WARN:
-            if (type == MULTIBOOT_MEMORY_AVAILABLE) {
-                warn_too_much_mem = true;
-            }
-            break;
-        case ADDRLIMIT_RESULT_OK:
-            break;
         }
         char const *type_str;
         if (sizeof(MEMMAP_TYPES) / sizeof(*MEMMAP_TYPES) <= type) {
@@ -158,15 +164,12 @@ static void print_mem_map(struct multiboot_info const *info) {
             type_str = MEMMAP_TYPES[type];
         }
         char const *lenunit;
-        size_t displaylen;
+        uint64_t displaylen;
         human_readable_len(&displaylen, &lenunit, len);
 
-        co_printf("%08X  %08X  %4zu%s  %s(%u)\n", addr, addr + len - 1, displaylen, lenunit, type_str, type);
-    }
-    co_printf("----------------------------------------------\n");
-    if (warn_too_much_mem) {
-        co_printf("the system has more memory, but ignored due to being outside of 32-bit address space.\n");
+        co_printf("%010llX  %010llX  %4llu%s  %s(%u)\n", addr, addr + len - 1, displaylen, lenunit, type_str, type);
     }
+    co_printf("--------------------------------------------------\n");
 }
 
 /*
@@ -176,7 +179,7 @@ static void print_mem_map(struct multiboot_info const *info) {
  */
 #define MAX_RESULT_REGIONS (1 << EXCLUDE_COUNT)
 
-static size_t exclude_regions(struct mem_region *result_regions, PHYSPTR addr, size_t len) {
+static size_t exclude_regions(struct mem_region *result_regions, PHYSPTR addr, uint64_t len) {
     size_t result_regions_count = 1;
     result_regions[0].base = addr;
     result_regions[0].len = len;
@@ -215,20 +218,36 @@ static size_t exclude_regions(struct mem_region *result_regions, PHYSPTR addr, s
     return result_regions_count;
 }
 
-static void register_region(PHYSPTR addr, size_t len) {
+static void register_region(PHYSPTR addr, uint64_t len) {
     if ((addr % ARCH_PAGESIZE) != 0) {
         size_t incr = ARCH_PAGESIZE - (addr % ARCH_PAGESIZE);
+        if (len <= incr) {
+            return;
+        }
         addr += incr;
         len -= incr;
     }
-    size_t page_count = len / ARCH_PAGESIZE;
+    uint64_t page_count = len / ARCH_PAGESIZE;
     if (page_count == 0) {
         return;
     }
-    co_printf("register memory: %08x ~ %08x (%u pages)\n", addr, addr + len - 1, page_count);
+    if (SIZE_MAX < page_count) {
+        page_count = SIZE_MAX;
+    }
+    co_printf("register memory: %010llx ~ %010llx (%llu pages)\n", addr, addr + (page_count * ARCH_PAGESIZE) - 1, page_count);
     pmm_register_mem(addr, page_count);
 }
 
+static void remember_high_region(PHYSPTR addr, uint64_t len) {
+    if (CONFIG_MAX_HIGH_REGIONS <= s_high_regions_count) {
+        co_printf("too many memory regions above 4GiB. ignoring %010llx ~ %010llx\n", addr, addr + len - 1);
+        return;
+    }
+    s_high_regions[s_high_regions_count].base = addr;
+    s_high_regions[s_high_regions_count].len = len;
+    s_high_regions_count++;
+}
+
 static void process_mem_map(struct multiboot_info const *info) {
     multiboot_uint32_t mmaplen = info->mmap_length;
     multiboot_uint32_t mmapaddr = info->mmap_addr;
@@ -243,8 +262,8 @@ static void process_mem_map(struct multiboot_info const *info) {
         readlen += totalsize;
 
         PHYSPTR addr;
-        size_t len;
-        switch (limit_to_32bit_addr(&addr, &len, entry.addr, entry.len)) {
+        uint64_t len;
+        switch (limit_to_addr(&addr, &len, entry.addr, entry.len, PHYSICALPTR_MAX)) {
         case ADDRLIMIT_RESULT_IGNORE:
             continue;
         case ADDRLIMIT_RESULT_WARN:
@@ -256,19 +275,36 @@ static void process_mem_map(struct multiboot_info const *info) {
         if (type != MULTIBOOT_MEMORY_AVAILABLE) {
             continue;
         }
+        /*
+         * Memory above 4GiB can only be used with PAE, and we need some memory to setup PAE in the first place.
+         * So we only remember it here, and register later.
+         */
+        uint64_t high_len = 0;
+        if (UINT32_MAX < addr) {
+            high_len = len;
+        } else if ((UINT32_MAX - addr) < (len - 1)) {
+            high_len = len - ((uint64_t)UINT32_MAX - addr + 1);
+        }
+        if (high_len != 0) {
+            remember_high_region(addr + len - high_len, high_len);
+            len -= high_len;
+        }
+        if (len == 0) {
+            continue;
+        }
 
         struct mem_region result_regions[MAX_RESULT_REGIONS];
         size_t result_regions_count = exclude_regions(result_regions, addr, len);
         for (size_t i = 0; i < result_regions_count; i++) {
             PHYSPTR addr = result_regions[i].base;
-            size_t len = result_regions[i].len;
+            uint64_t len = result_regions[i].len;
             register_region(addr, len);
         }
     }
 }
 
 static void process_framebuffer_info(struct multiboot_info const *info) {
-    co_printf("framebuffer address is %p\n", info->framebuffer_addr);
+    co_printf("framebuffer address is %#llx\n", info->framebuffer_addr);
     if (info->framebuffer_type == MULTIBOOT_FRAMEBUFFER_TYPE_INDEXED) {
         uint8_t *colors = heap_alloc(info->framebuffer_palette_num_colors * 3, 0);
         if (colors == nullptr) {
@@ -312,6 +348,28 @@ static void process_framebuffer_info(struct multiboot_info const *info) {
     }
 }
 
+void archi586_bootinfo_register_high_mem(void) {
+    bool ignored_mem = false;
+    for (size_t i = 0; i < s_high_regions_count; i++) {
+        PHYSPTR addr;
+        uint64_t len;
+        switch (limit_to_addr(&addr, &len, s_high_regions[i].base, s_high_regions[i].len, archi586_mmu_get_max_physaddr())) {
+        case ADDRLIMIT_RESULT_IGNORE:
+            ignored_mem = true;
+            continue;
+        case ADDRLIMIT_RESULT_WARN:
+            ignored_mem = true;
+            break;
+        case ADDRLIMIT_RESULT_OK:
+            break;
+        }
+        register_region(addr, len);
+    }
+    if (ignored_mem) {
+        co_printf("the system has more memory, but ignored due to being outside of usable physical address space.\n");
+    }
+}
+
 void archi586_bootinfo_process(PHYSPTR infoaddr) {
     struct multiboot_info info;
     pmemcpy_in(&info, infoaddr, sizeof(info), false);
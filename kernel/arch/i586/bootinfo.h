@@ -2,4 +2,8 @@
 #include <kernel/types.h>
 
 void archi586_bootinfo_process(PHYSPTR infoaddr);
+/*
+ * Registers memory above 4GiB that was found by archi586_bootinfo_process(), if current paging mode can address it.
+ */
+void archi586_bootinfo_register_high_mem(void);
 
@@ -2,7 +2,10 @@ ARCH_CC         = i586-elf-gcc
 ARCH_STRIP      = i586-elf-strip
 ARCH_OBJCOPY    = i586-elf-objcopy
 
-ARCH_CFLAGS     = -mgeneral-regs-only -mno-mmx -mno-sse -mno-sse2 
+# Keeps the compiler away from FPU and SIMD registers. Code that only runs in threads that enabled the FPU(See
+# thread_enable_fpu()) is built without these.
+ARCH_CFLAGS_NOFPU = -mgeneral-regs-only -mno-mmx -mno-sse -mno-sse2
+ARCH_CFLAGS     = $(ARCH_CFLAGS_NOFPU)
 ARCH_CFLAGS    += -I$(PROJECT_DIR)/toolchain/$(ARCH)/include
 ARCH_CFLAGS    += -DYJKERNEL_ARCH_I586
 ARCH_CFLAGS    += -DYJKERNEL_ARCH_TRAP_COUNT=256
@@ -3,6 +3,7 @@
 #include "../pic.h"
 #include <assert.h>
 #include <errno.h>
+#include <kernel/arch/interrupts.h>
 #include <kernel/arch/iodelay.h>
 #include <kernel/arch/mmu.h>
 #include <kernel/dev/atadisk.h>
@@ -15,6 +16,10 @@
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
 #include <kernel/types.h>
 #include <stdalign.h>
 #include <stdarg.h>
@@ -52,6 +57,14 @@ struct prd {
     uint16_t flags; /* All bits are reserved(should be 0) except for top bit (PRD_FLAG_LAST_ENTRY_IN_PRDT) */
 };
 
+#define MAX_TRANSFTER_SIZE_PER_PRD 65536
+/*
+ * Transfers that go through bounce buffers are limited to this size. Others are only limited by how many PRDs fit in
+ * the PRDT, which is up to 32MiB if the buffer is physically contiguous.
+ */
+#define BOUNCE_BUFFER_SIZE (ATA_MAX_SECTORS_PER_TRANSFER * ATA_SECTOR_SIZE)
+#define BOUNCE_BUFFER_COUNT ((BOUNCE_BUFFER_SIZE + MAX_TRANSFTER_SIZE_PER_PRD - 1) / MAX_TRANSFTER_SIZE_PER_PRD)
+
 /* Shared data between two IDE buses in a controller */
 struct shared {
     struct bus *buses[2];
@@ -64,16 +77,25 @@ struct bus {
     PHYSPTR prdt_physbase;
     struct prd *prdt;
     struct shared *shared;
-    size_t prd_count;
+    size_t prd_count; /* Capacity of the PRDT */
     void *dma_buffer;
+    size_t dma_len;
+    /*
+     * Used when the caller's buffer can't be reached by the busmaster (e.g. above 4GiB), and data has to be copied
+     * through memory below 4GiB.
+     */
+    PHYSPTR bounce_physaddrs[BOUNCE_BUFFER_COUNT];
+    size_t bounce_page_counts[BOUNCE_BUFFER_COUNT];
     uint16_t io_iobase;
     uint16_t ctrl_iobase;
     uint16_t busmastrer_iobase;
     PCIPATH pcipath;
     int8_t last_selected_drive; /* -1: No device was selected before */
-    _Atomic bool bus_lock_flag;
+    struct mutex bus_lock; /* Held for the whole command, during which we sleep waiting for IRQs */
+    struct waitqueue irq_waitqueue;
     _Atomic bool got_irq;
     bool is_dma_read : 1;
+    bool is_dma_bounced : 1;
     bool busmaster_enabled : 1;
 };
 
@@ -212,6 +234,25 @@ static void atadisk_op_set_lba_param(struct atadisk *self, uint32_t data) {
     regvalue = (regvalue & ~0x0fU) | ((data >> 24) & 0x0fU);
     io_out8(disk->bus, IOREG_DRIVE_AND_HEAD, regvalue);
 }
+static void atadisk_op_set_count48_param(struct atadisk *self, uint16_t data) {
+    struct disk *disk = self->data;
+    /* Each register holds two bytes in FIFO fashion. Upper byte goes first. */
+    io_out8(disk->bus, IOREG_SECTORCOUNT, data >> 8);
+    io_out8(disk->bus, IOREG_SECTORCOUNT, data);
+}
+static void atadisk_op_set_lba48_param(struct atadisk *self, uint64_t data) {
+    struct disk *disk = self->data;
+    io_out8(disk->bus, IOREG_LBA_LO, data >> 24);
+    io_out8(disk->bus, IOREG_LBA_MID, data >> 32);
+    io_out8(disk->bus, IOREG_LBA_HI, data >> 40);
+    io_out8(disk->bus, IOREG_LBA_LO, data);
+    io_out8(disk->bus, IOREG_LBA_MID, data >> 8);
+    io_out8(disk->bus, IOREG_LBA_HI, data >> 16);
+    /* Lower 4-bit of the device register is not part of LBA for 48-bit commands. */
+    uint8_t regvalue = io_in8(disk->bus, IOREG_DRIVE_AND_HEAD);
+    regvalue = (regvalue & ~0x0fU) | DRIVE_AND_HEAD_FLAG_LBA;
+    io_out8(disk->bus, IOREG_DRIVE_AND_HEAD, regvalue);
+}
 static void atadisk_op_set_device_param(struct atadisk *self, uint8_t data) {
     struct disk *disk = self->data;
     uint8_t regvalue = io_in8(disk->bus, IOREG_DRIVE_AND_HEAD);
@@ -235,13 +276,21 @@ static void atadisk_op_issue_cmd(struct atadisk *self, ATA_CMD cmd) {
     struct disk *disk = self->data;
     io_out8(disk->bus, IOREG_COMMAND, cmd);
 }
-static bool atadisk_op_get_irq_flag(struct atadisk *self) {
+static bool atadisk_op_wait_irq(struct atadisk *self, TICKTIME deadline) {
     struct disk *disk = self->data;
-    return disk->bus->got_irq;
-}
-static void atadisk_op_clear_irq_flag(struct atadisk *self) {
-    struct disk *disk = self->data;
-    disk->bus->got_irq = false;
+    struct bus *bus = disk->bus;
+    /* IRQ handler sets the flag before waking us up, so that can't slip in between checking it and starting to wait. */
+    sched_lock();
+    bool ok = true;
+    while (!bus->got_irq) {
+        if (!waitqueue_wait_until(&bus->irq_waitqueue, deadline)) {
+            ok = bus->got_irq;
+            break;
+        }
+    }
+    bus->got_irq = false;
+    sched_unlock();
+    return ok;
 }
 static void atadisk_op_read_data(struct ata_data_buf *out, struct atadisk *self) {
     struct disk *disk = self->data;
@@ -281,9 +330,6 @@ static uint32_t busmaster_in32(struct bus *self, BUSMASTER_REG reg) {
 #define BUSMASTER_CMDFLAG_START (1U << 0)
 #define BUSMASTER_CMDFLAG_READ (1U << 3)
 
-#define MAX_TRANSFTER_SIZE_PER_PRD 65536
-#define MAX_DMA_TRANSFER_SIZE_NEEDED (ATA_MAX_SECTORS_PER_TRANSFER * ATA_SECTOR_SIZE)
-
 static bool atadisk_op_dma_begin_session(struct atadisk *self) {
     struct disk *disk = self->data;
     struct bus *bus = disk->bus;
@@ -321,50 +367,185 @@ static void atadisk_op_dma_end_session(struct atadisk *self) {
 
 static void atadisk_op_lock(struct atadisk *self) {
     struct disk *disk = self->data;
-    struct bus *bus = disk->bus;
-    bool expected = false;
-    bool desired = true;
-    while (!atomic_compare_exchange_strong_explicit(&bus->bus_lock_flag, &expected, desired, memory_order_acquire, memory_order_relaxed)) {
-    }
+    MUTEX_LOCK(&disk->bus->bus_lock);
 }
 
 static void atadisk_op_unlock(struct atadisk *self) {
     struct disk *disk = self->data;
-    struct bus *bus = disk->bus;
-    bool desired = false;
-    atomic_store_explicit(&bus->bus_lock_flag, desired, memory_order_release);
+    mutex_unlock(&disk->bus->bus_lock);
 }
 
-[[nodiscard]] static int atadisk_op_dma_init_transfter(struct atadisk *self, void *buffer, size_t len, bool is_read) {
-    struct disk *disk = self->data;
-    struct bus *bus = disk->bus;
-    assert(bus->busmaster_enabled);
-    assert(len <= MAX_DMA_TRANSFER_SIZE_NEEDED);
-    bus->dma_buffer = buffer;
-    bus->is_dma_read = is_read;
+static size_t prd_len(struct prd const *prd) {
+    if (prd->len == 0) {
+        return MAX_TRANSFTER_SIZE_PER_PRD;
+    }
+    return prd->len;
+}
+
+/*
+ * Adds physical memory range to the PRDT, splitting it at 64K boundaries (which a PRD can't cross), and merging it
+ * with the last PRD when it continues from there.
+ *
+ * Returns false if the PRDT is full.
+ */
+[[nodiscard]] static bool append_prd(struct bus *self, size_t *count_inout, PHYSPTR physaddr, size_t len) {
+    assert((physaddr + len - 1) <= UINT32_MAX);
+    while (len != 0) {
+        size_t current_len = MAX_TRANSFTER_SIZE_PER_PRD - (physaddr % MAX_TRANSFTER_SIZE_PER_PRD);
+        if (len < current_len) {
+            current_len = len;
+        }
+        struct prd *last = nullptr;
+        if (*count_inout != 0) {
+            last = &self->prdt[*count_inout - 1];
+        }
+        if ((last != nullptr) && ((last->buffer_physaddr + prd_len(last)) == physaddr) && ((physaddr % MAX_TRANSFTER_SIZE_PER_PRD) != 0)) {
+            /* Both are within the same 64K, so the sum can't go over 64K. */
+            last->len = (uint16_t)(prd_len(last) + current_len);
+        } else {
+            if (*count_inout == self->prd_count) {
+                return false;
+            }
+            struct prd *prd = &self->prdt[*count_inout];
+            prd->buffer_physaddr = physaddr;
+            prd->len = (uint16_t)current_len; /* 64K becomes 0, which is what the busmaster expects. */
+            prd->flags = 0;
+            (*count_inout)++;
+        }
+        physaddr += current_len;
+        len -= current_len;
+    }
+    return true;
+}
+
+/*
+ * Removes `len` bytes from the end of the PRDT.
+ */
+static void trim_prdt(struct bus *self, size_t *count_inout, size_t len) {
+    while ((len != 0) && (*count_inout != 0)) {
+        struct prd *last = &self->prdt[*count_inout - 1];
+        size_t last_len = prd_len(last);
+        if (last_len <= len) {
+            (*count_inout)--;
+            len -= last_len;
+        } else {
+            last->len = (uint16_t)(last_len - len);
+            len = 0;
+        }
+    }
+}
+
+/*
+ * Points PRDs directly at physical pages of the buffer, and returns how many bytes are covered, in whole sectors.
+ * This stops at the first page that can't be reached by the busmaster, or when the PRDT is full.
+ * Returns 0 if the buffer can't be used directly at all, and bounce buffers should be used instead.
+ */
+[[nodiscard]] static size_t build_prdt_from_buffer(struct bus *self, size_t *count_out, void *buffer, size_t len) {
+    size_t count = 0;
+    *count_out = 0;
+    if (((uintptr_t)buffer % 2) != 0) {
+        /* PRD buffer addresses must be word-aligned */
+        return 0;
+    }
+    if (vmm_is_swappable(buffer, len)) {
+        /*
+         * Pages may be moved out to swap space (and given to someone else) while the busmaster is still using them.
+         * Bounce buffers are copied with the CPU, which brings pages back as needed.
+         */
+        return 0;
+    }
+    uint8_t *ptr = buffer;
+    size_t covered_size = 0;
+    while (covered_size != len) {
+        size_t current_size = ARCH_PAGESIZE - ((uintptr_t)ptr % ARCH_PAGESIZE);
+        if ((len - covered_size) < current_size) {
+            current_size = len - covered_size;
+        }
+        PHYSPTR physaddr;
+        int ret = arch_mmu_virtual_to_physical(&physaddr, ptr);
+        if (ret < 0) {
+            break;
+        }
+        if ((UINT32_MAX - (current_size - 1)) < physaddr) {
+            /* Busmaster can only do 32-bit addresses */
+            break;
+        }
+        /* A chunk within a page never crosses 64K boundary, so nothing was added if this fails. */
+        if (!append_prd(self, &count, physaddr, current_size)) {
+            break;
+        }
+        ptr += current_size;
+        covered_size += current_size;
+    }
+    size_t excess_size = covered_size % ATA_SECTOR_SIZE;
+    trim_prdt(self, &count, excess_size);
+    *count_out = count;
+    return covered_size - excess_size;
+}
+
+static void build_prdt_from_bounce_buffers(struct bus *self, size_t *count_out, size_t len) {
+    assert(len <= BOUNCE_BUFFER_SIZE);
+    size_t count = 0;
     size_t remaining_size = len;
     for (size_t i = 0; remaining_size != 0; i++) {
-        assert(i < bus->prd_count);
-        size_t currentsize = remaining_size;
-        if (MAX_TRANSFTER_SIZE_PER_PRD < currentsize) {
-            currentsize = MAX_TRANSFTER_SIZE_PER_PRD;
+        assert(i < BOUNCE_BUFFER_COUNT);
+        size_t current_size = remaining_size;
+        if (MAX_TRANSFTER_SIZE_PER_PRD < current_size) {
+            current_size = MAX_TRANSFTER_SIZE_PER_PRD;
         }
-        if (currentsize == MAX_TRANSFTER_SIZE_PER_PRD) {
-            bus->prdt[i].len = 0;
-        } else {
-            bus->prdt[i].len = currentsize;
+        bool ok = append_prd(self, &count, self->bounce_physaddrs[i], current_size);
+        assert(ok);
+        (void)ok;
+        remaining_size -= current_size;
+    }
+    *count_out = count;
+}
+
+static void copy_bounce_buffers(struct bus *self, bool to_buffer) {
+    uint8_t *buffer = self->dma_buffer;
+    size_t remaining_size = self->dma_len;
+    for (size_t i = 0; remaining_size != 0; i++) {
+        size_t current_size = remaining_size;
+        if (MAX_TRANSFTER_SIZE_PER_PRD < current_size) {
+            current_size = MAX_TRANSFTER_SIZE_PER_PRD;
         }
-        if (remaining_size <= MAX_TRANSFTER_SIZE_PER_PRD) {
-            /* This should be the last PRD */
-            bus->prdt[i].flags |= PRD_FLAG_LAST_ENTRY_IN_PRDT;
+        if (to_buffer) {
+            pmemcpy_in(&buffer[i * MAX_TRANSFTER_SIZE_PER_PRD], self->bounce_physaddrs[i], current_size, true);
         } else {
-            bus->prdt[i].flags = 0;
+            pmemcpy_out(self->bounce_physaddrs[i], &buffer[i * MAX_TRANSFTER_SIZE_PER_PRD], current_size, true);
         }
+        remaining_size -= current_size;
+    }
+}
+
+[[nodiscard]] static int atadisk_op_dma_init_transfter(struct atadisk *self, void *buffer, size_t *len_inout, bool is_read) {
+    struct disk *disk = self->data;
+    struct bus *bus = disk->bus;
+    size_t len = *len_inout;
+    assert(bus->busmaster_enabled);
+    assert(len != 0);
+    assert((len % ATA_SECTOR_SIZE) == 0);
+    size_t prd_count;
+    size_t direct_len = build_prdt_from_buffer(bus, &prd_count, buffer, len);
+    bus->is_dma_bounced = (direct_len == 0);
+    if (bus->is_dma_bounced) {
+        if (BOUNCE_BUFFER_SIZE < len) {
+            len = BOUNCE_BUFFER_SIZE;
+        }
+    } else {
+        len = direct_len;
+    }
+    bus->dma_buffer = buffer;
+    bus->dma_len = len;
+    bus->is_dma_read = is_read;
+    *len_inout = len;
+    if (bus->is_dma_bounced) {
+        build_prdt_from_bounce_buffers(bus, &prd_count, len);
         if (!is_read) {
-            pmemcpy_out(bus->prdt[i].buffer_physaddr, &((uint8_t *)buffer)[i * MAX_TRANSFTER_SIZE_PER_PRD], currentsize, true);
+            copy_bounce_buffers(bus, false);
         }
-        remaining_size -= currentsize;
     }
+    bus->prdt[prd_count - 1].flags |= PRD_FLAG_LAST_ENTRY_IN_PRDT;
     /* Setup busmaster registers */
     busmaster_out32(bus, BUSMASTER_REG_PRDTADDR, bus->prdt_physbase);
     uint8_t cmdvalue = 0;
@@ -413,17 +594,8 @@ static void atadisk_op_dma_end_transfer(struct atadisk *self, bool wassuccess) {
     struct disk *disk = self->data;
     struct bus *bus = disk->bus;
     busmaster_out8(bus, BUSMASTER_REG_CMD, busmaster_in8(bus, BUSMASTER_REG_CMD) & ~BUSMASTER_CMDFLAG_START);
-    if (bus->is_dma_read && wassuccess) {
-        for (size_t i = 0; i < bus->prd_count; i++) {
-            size_t size = bus->prdt[i].len;
-            if (size == 0) {
-                size = 65536;
-            }
-            pmemcpy_in(&((uint8_t *)bus->dma_buffer)[i * MAX_TRANSFTER_SIZE_PER_PRD], bus->prdt[i].buffer_physaddr, size, true);
-            if (bus->prdt[i].flags & PRD_FLAG_LAST_ENTRY_IN_PRDT) {
-                break;
-            }
-        }
+    if (bus->is_dma_read && bus->is_dma_bounced && wassuccess) {
+        copy_bounce_buffers(bus, true);
     }
 }
 
@@ -443,11 +615,12 @@ static struct atadisk_ops const OPS = {
     .set_features_param = atadisk_op_set_features_param,
     .set_count_param = atadisk_op_set_count_param,
     .set_lba_param = atadisk_op_set_lba_param,
+    .set_count48_param = atadisk_op_set_count48_param,
+    .set_lba48_param = atadisk_op_set_lba48_param,
     .set_device_param = atadisk_op_set_device_param,
     .get_lba_output = atadisk_op_get_lba_output,
     .issue_command = atadisk_op_issue_cmd,
-    .get_irq_flag = atadisk_op_get_irq_flag,
-    .clear_irq_flag = atadisk_op_clear_irq_flag,
+    .wait_irq = atadisk_op_wait_irq,
     .read_data = atadisk_op_read_data,
     .write_data = atadisk_op_write_data,
     .dma_init_transfer = atadisk_op_dma_init_transfter,
@@ -459,25 +632,28 @@ static struct atadisk_ops const OPS = {
 };
 
 static void irq_handler(int irqnum, void *data) {
+    (void)irqnum;
     struct bus *bus = data;
     bus->got_irq = true;
     io_in8(bus, IOREG_STATUS);
-    archi586_pic_send_eoi(irqnum);
+    waitqueue_wake_all(&bus->irq_waitqueue);
 }
 
 static bool init_busmaster(struct bus *bus) {
-    /* This should be enough to store allocated page counts. */
-    size_t page_counts[(MAX_DMA_TRANSFER_SIZE_NEEDED / MAX_TRANSFTER_SIZE_PER_PRD) + 1];
-
     /* Allocate resources needed for busmastering DMA ************************/
-    bus->prd_count = size_to_blocks(MAX_DMA_TRANSFER_SIZE_NEEDED, MAX_TRANSFTER_SIZE_PER_PRD);
+    /*
+     * A page of PRDs. PRDT can't cross 64K boundary, so it can't be much larger anyway.
+     * (Bounce buffers need at most two PRDs each, as each may cross a 64K boundary)
+     */
+    bus->prd_count = ARCH_PAGESIZE / sizeof(*bus->prdt);
+    assert((BOUNCE_BUFFER_COUNT * 2) <= bus->prd_count);
     size_t prdtsize = bus->prd_count * sizeof(*bus->prdt);
     assert(prdtsize < MAX_TRANSFTER_SIZE_PER_PRD);
     size_t prdt_page_count = size_to_blocks(prdtsize, ARCH_PAGESIZE);
     bool phys_alloc_ok = false;
     struct vmm_object *prdt_vm_object = nullptr;
-    size_t allocated_prdt_count = 0;
-    bus->prdt_physbase = pmm_alloc(&prdt_page_count);
+    size_t allocated_bounce_count = 0;
+    bus->prdt_physbase = pmm_alloc_low(&prdt_page_count);
     if (bus->prdt_physbase == PHYSICALPTR_NULL) {
         goto fail_oom;
     }
@@ -487,31 +663,30 @@ static bool init_busmaster(struct bus *bus) {
         bus_printf(bus, "not enough memory for busmaster PRDT\n");
         goto fail_oom;
     }
-    /* Fill PRDT **************************************************************/
     bus->prdt = prdt_vm_object->start;
     vmemset(bus->prdt, 0, prdtsize);
-    size_t remaining_size = MAX_DMA_TRANSFER_SIZE_NEEDED;
-    for (size_t i = 0; i < bus->prd_count; i++) {
+    /* Allocate bounce buffers ************************************************/
+    /* NOTE: PRDs are filled when we initialize DMA transfer */
+    size_t remaining_size = BOUNCE_BUFFER_SIZE;
+    for (size_t i = 0; i < BOUNCE_BUFFER_COUNT; i++) {
         size_t current_size = remaining_size;
         if (MAX_TRANSFTER_SIZE_PER_PRD < current_size) {
             current_size = MAX_TRANSFTER_SIZE_PER_PRD;
         }
-        /* NOTE: We setup PRD's len and flags when we initialize DMA transfer */
         size_t current_page_count = size_to_blocks(current_size, ARCH_PAGESIZE);
-        bus->prdt[i].buffer_physaddr = pmm_alloc(&current_page_count);
-        if (bus->prdt[i].buffer_physaddr == PHYSICALPTR_NULL) {
+        bus->bounce_physaddrs[i] = pmm_alloc_low(&current_page_count);
+        if (bus->bounce_physaddrs[i] == PHYSICALPTR_NULL) {
             goto fail_oom;
         }
-        page_counts[i] = current_page_count;
-        pmemset(bus->prdt[i].buffer_physaddr, 0x00, current_size, true);
-        allocated_prdt_count++;
+        bus->bounce_page_counts[i] = current_page_count;
+        allocated_bounce_count++;
         remaining_size -= current_size;
     }
     return true;
 fail_oom:
     bus_printf(bus, "not enough memory for busmaster PRDT. falling back to PIO-only.\n");
-    for (size_t i = 0; i < allocated_prdt_count; i++) {
-        pmm_free(bus->prdt[i].buffer_physaddr, page_counts[i]);
+    for (size_t i = 0; i < allocated_bounce_count; i++) {
+        pmm_free(bus->bounce_physaddrs[i], bus->bounce_page_counts[i]);
     }
     if (prdt_vm_object != nullptr) {
         vmm_free(prdt_vm_object);
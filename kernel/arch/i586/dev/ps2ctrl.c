@@ -3,12 +3,13 @@
 #include "../pic.h"
 #include <assert.h>
 #include <errno.h>
+#include <kernel/clock.h>
 #include <kernel/dev/ps2.h>
 #include <kernel/io/co.h>
 #include <kernel/io/stream.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/mem/heap.h>
-#include <kernel/ticktime.h>
+#include <kernel/tasks/thread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -64,14 +65,15 @@ struct portcontext {
 };
 
 [[nodiscard]] static int waitforrecv(void) {
-    TICKTIME oldtime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     bool timeout = true;
-    while ((g_ticktime - oldtime) < PS2_TIMEOUT) {
+    while ((clock_get_ns() - start_ns) < (PS2_TIMEOUT * CLOCK_NS_PER_TICK)) {
         uint8_t ctrl_status = archi586_in8(STATUS_PORT);
         if (ctrl_status & STATUS_FLAG_OUTBUF_FULL) {
             timeout = false;
             break;
         }
+        thread_poll_backoff(start_ns);
     }
     if (timeout) {
         co_printf("ps2: receive wait timeout\n");
@@ -81,14 +83,15 @@ struct portcontext {
 }
 
 [[nodiscard]] static int waitforsend(void) {
-    TICKTIME oldtime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     bool timeout = true;
-    while ((g_ticktime - oldtime) < PS2_TIMEOUT) {
+    while ((clock_get_ns() - start_ns) < (PS2_TIMEOUT * CLOCK_NS_PER_TICK)) {
         uint8_t ctrl_status = archi586_in8(STATUS_PORT);
         if (!(ctrl_status & STATUS_FLAG_INBUF_FULL)) {
             timeout = false;
             break;
         }
+        thread_poll_backoff(start_ns);
     }
     if (timeout) {
         co_printf("ps2: send wait timeout\n");
@@ -158,13 +161,13 @@ static ssize_t stream_op_write(struct stream *self, void *data, size_t size) {
 }
 
 static void irqhandler(int irqnum, void *data) {
+    (void)irqnum;
     struct portcontext *port = data;
     uint8_t value = archi586_in8(DATA_PORT);
     if (CONFIG_COMM_DEBUG) {
         co_printf("ps2: irq on port %u - data %#x\n", port->portidx, value);
     }
     ps2port_received_byte(&port->ps2port, value);
-    archi586_pic_send_eoi(irqnum);
 }
 
 static struct stream_ops const OPS = {
@@ -1,5 +1,6 @@
 #include "exceptions.h"
 #include "asm/i586.h"
+#include "fpu.h"
 #include <kernel/arch/hcf.h>
 #include <kernel/arch/stacktrace.h>
 #include <kernel/io/co.h>
@@ -27,6 +28,14 @@ static void defaulthandler(int trapnum, void *trapframe, void *data) {
     arch_hcf();
 }
 
+static void devicenotavailablehandler(int trapnum, void *trapframe, void *data) {
+    if (archi586_fpu_handle_unavailable()) {
+        return;
+    }
+    co_printf("FPU was used by a thread that didn't enable it\n");
+    defaulthandler(trapnum, trapframe, data);
+}
+
 #define PF_FLAG_P (1U << 0) /* Present */
 #define PF_FLAG_W (1U << 1) /* write */
 #define PF_FLAG_U (1U << 2) /* User */
@@ -36,7 +45,7 @@ static void pagefaulthandler(int trapnum, void *trapframe, void *data) {
     (void)trapnum;
     struct trap_frame *frame = trapframe;
     void *faultaddr = archi586_read_cr2();
-    vmm_page_fault(faultaddr, frame->errcode & PF_FLAG_P, frame->errcode & PF_FLAG_W, frame->errcode & PF_FLAG_U, frame);
+    vmm_page_fault(faultaddr, frame->errcode & PF_FLAG_P, frame->errcode & PF_FLAG_W, frame->errcode & PF_FLAG_U, frame->eflags & EFLAGS_FLAG_IF, frame);
 }
 
 static struct trap_handler s_traphandler[32];
@@ -44,6 +53,9 @@ static struct trap_handler s_traphandler[32];
 void archi586_exceptions_init(void) {
     for (int i = 0; i < 32; i++) {
         switch (i) {
+        case 7:
+            trapmanager_register_trap(&s_traphandler[i], i, devicenotavailablehandler, nullptr);
+            break;
         case 14:
             trapmanager_register_trap(&s_traphandler[i], i, pagefaulthandler, nullptr);
             break;
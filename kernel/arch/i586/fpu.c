@@ -0,0 +1,210 @@
+#include "fpu.h"
+#include "asm/i586.h"
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/cpu.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/miscmath.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/heap.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CR0_FLAG_MP (1U << 1) /* WAIT/FWAIT also checks TS */
+#define CR0_FLAG_EM (1U << 2) /* No FPU. Every FPU instruction causes #NM. */
+#define CR0_FLAG_TS (1U << 3) /* Set by us on context switches. FPU instructions cause #NM until it's cleared. */
+#define CR0_FLAG_NE (1U << 5) /* Report FPU errors using #MF instead of the legacy IRQ13 */
+
+#define CR4_FLAG_OSFXSR (1U << 9)      /* Enables FXSAVE/FXRSTOR and SSE instructions */
+#define CR4_FLAG_OSXMMEXCPT (1U << 10) /* Enables #XM for SSE errors */
+
+/* Power-on default of MXCSR: Every SSE exception masked, round to nearest */
+#define MXCSR_DEFAULT 0x1f80
+
+struct archi586_fpu_state {
+    /* FXSAVE needs 512 bytes, and FNSAVE needs 108 bytes. */
+    alignas(16) uint8_t area[512];
+    void *alloc; /* What heap_alloc() returned */
+    /*
+     * CPU whose FPU registers are same as `area`, or nullptr. The thread may have moved to other CPU and used the FPU
+     * there since, so owner of a CPU below is only valid if this points back to that CPU.
+     */
+    struct cpu *loaded_cpu;
+};
+
+static bool s_present;
+static bool s_use_fxsave;
+/* Below are per-CPU, and each CPU only touches its own with interrupts disabled. */
+static bool s_ts_set[CPU_MAX_COUNT];
+/* State of the running thread */
+static struct archi586_fpu_state *s_current[CPU_MAX_COUNT];
+/* State that is currently loaded into the FPU */
+static struct archi586_fpu_state *s_owner[CPU_MAX_COUNT];
+/* What the FPU looks like after initialization. New states start from here. */
+static struct archi586_fpu_state s_initial_state;
+
+static void save_state(struct archi586_fpu_state *state) {
+    if (s_use_fxsave) {
+        __asm__ volatile("fxsave (%0)" ::"r"(state->area) : "memory");
+    } else {
+        /* This also reinitializes the FPU, but we are about to load something else anyway. */
+        __asm__ volatile("fnsave (%0)" ::"r"(state->area) : "memory");
+    }
+}
+
+static void load_state(struct archi586_fpu_state const *state) {
+    if (s_use_fxsave) {
+        __asm__ volatile("fxrstor (%0)" ::"r"(state->area) : "memory");
+    } else {
+        __asm__ volatile("frstor (%0)" ::"r"(state->area) : "memory");
+    }
+}
+
+static void set_ts(bool ts) {
+    if (ts) {
+        archi586_write_cr0(archi586_read_cr0() | CR0_FLAG_TS);
+    } else {
+        __asm__ volatile("clts");
+    }
+    s_ts_set[cpu_get_current()->index] = ts;
+}
+
+/*
+ * Sets up the FPU of current CPU. Returns whether the CPU has SSE.
+ */
+static bool init_current_cpu(uint32_t cpuid_1_edx) {
+    uint32_t cr0 = archi586_read_cr0();
+    cr0 &= ~(CR0_FLAG_EM | CR0_FLAG_TS);
+    cr0 |= CR0_FLAG_MP | CR0_FLAG_NE;
+    archi586_write_cr0(cr0);
+    bool has_sse = false;
+    if (cpuid_1_edx & CPUID_1_EDX_FLAG_FXSR) {
+        uint32_t cr4 = archi586_read_cr4() | CR4_FLAG_OSFXSR;
+        has_sse = cpuid_1_edx & CPUID_1_EDX_FLAG_SSE;
+        if (has_sse) {
+            cr4 |= CR4_FLAG_OSXMMEXCPT;
+        }
+        archi586_write_cr4(cr4);
+    }
+    __asm__ volatile("fninit");
+    if (has_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile("ldmxcsr %0" ::"m"(mxcsr));
+    }
+    return has_sse;
+}
+
+void archi586_fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_FLAG_FPU)) {
+        co_printf("fpu: CPU doesn't have FPU\n");
+        return;
+    }
+    s_use_fxsave = edx & CPUID_1_EDX_FLAG_FXSR;
+    bool has_sse = init_current_cpu(edx);
+    save_state(&s_initial_state);
+    set_ts(true);
+    s_present = true;
+    co_printf("fpu: x87%s, saved with %s\n", has_sse ? " and SSE" : "", s_use_fxsave ? "FXSAVE" : "FNSAVE");
+}
+
+void archi586_fpu_init_ap(void) {
+    ASSERT_IRQ_DISABLED();
+    if (!s_present) {
+        return;
+    }
+    /* We only use what the boot CPU has, and other CPUs are assumed to have the same. */
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    (void)init_current_cpu(edx);
+    set_ts(true);
+}
+
+bool archi586_fpu_is_present(void) {
+    return s_present;
+}
+
+struct archi586_fpu_state *archi586_fpu_state_create(void) {
+    assert(s_present);
+    void *alloc = heap_alloc(sizeof(struct archi586_fpu_state) + alignof(struct archi586_fpu_state) - 1, 0);
+    if (alloc == nullptr) {
+        return nullptr;
+    }
+    struct archi586_fpu_state *state = (void *)align_up((uintptr_t)alloc, alignof(struct archi586_fpu_state));
+    vmemcpy(state->area, s_initial_state.area, sizeof(state->area));
+    state->alloc = alloc;
+    state->loaded_cpu = nullptr;
+    return state;
+}
+
+void archi586_fpu_state_destroy(struct archi586_fpu_state *state) {
+    if (state == nullptr) {
+        return;
+    }
+    /*
+     * Other CPUs may still have it as their owner, but as the new state allocated at the same place starts with
+     * loaded_cpu cleared, they won't mistake it for what's in their FPU.
+     */
+    bool prev_interrupts = arch_irq_disable();
+    size_t index = cpu_get_current()->index;
+    if (s_owner[index] == state) {
+        /* Nobody needs what's in the FPU now */
+        s_owner[index] = nullptr;
+    }
+    if (s_current[index] == state) {
+        s_current[index] = nullptr;
+    }
+    arch_irq_restore(prev_interrupts);
+    heap_free(state->alloc);
+}
+
+void archi586_fpu_switch(struct archi586_fpu_state *next) {
+    ASSERT_IRQ_DISABLED();
+    if (!s_present) {
+        return;
+    }
+    struct cpu *cpu = cpu_get_current();
+    size_t index = cpu->index;
+    struct archi586_fpu_state *prev = s_current[index];
+    /*
+     * If the thread we are leaving used the FPU, save it now instead of when someone else needs the FPU, because the
+     * thread may run on other CPU next time.
+     */
+    if ((prev != nullptr) && (s_owner[index] == prev) && !s_ts_set[index]) {
+        save_state(prev);
+        if (!s_use_fxsave) {
+            /* FNSAVE reinitialized the FPU, so nothing is loaded anymore. */
+            prev->loaded_cpu = nullptr;
+            s_owner[index] = nullptr;
+        }
+    }
+    s_current[index] = next;
+    /*
+     * Threads that don't use the FPU keep TS set, so switching between them doesn't touch CR0 at all. If we are going
+     * back to the thread whose registers are still in the FPU, it can use them right away.
+     */
+    bool ts = (next == nullptr) || (next != s_owner[index]) || (next->loaded_cpu != cpu);
+    if (ts != s_ts_set[index]) {
+        set_ts(ts);
+    }
+}
+
+bool archi586_fpu_handle_unavailable(void) {
+    ASSERT_IRQ_DISABLED();
+    struct cpu *cpu = cpu_get_current();
+    size_t index = cpu->index;
+    struct archi586_fpu_state *current = s_current[index];
+    if (!s_present || (current == nullptr)) {
+        return false;
+    }
+    set_ts(false);
+    /* The previous owner was already saved when it was switched out, so we only have to load. */
+    if ((s_owner[index] != current) || (current->loaded_cpu != cpu)) {
+        load_state(current);
+        s_owner[index] = current;
+        current->loaded_cpu = cpu;
+    }
+    return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * FPU registers of a thread. Only threads that enabled the FPU have one.
+ */
+struct archi586_fpu_state;
+
+/*
+ * Sets up x87 FPU, and SSE if the CPU has it. FPU registers are loaded lazily: After a context switch, the FPU is
+ * left disabled, and the registers are loaded when the new thread actually uses the FPU. Registers of the thread we
+ * are leaving are saved right away, as it may continue on other CPU.
+ */
+void archi586_fpu_init(void);
+/*
+ * Sets up the FPU of other CPUs the same way as the boot CPU.
+ */
+void archi586_fpu_init_ap(void);
+bool archi586_fpu_is_present(void);
+/*
+ * Returns nullptr if there's not enough memory. The new state is what the FPU looks like right after initialization.
+ */
+[[nodiscard]] struct archi586_fpu_state *archi586_fpu_state_create(void);
+void archi586_fpu_state_destroy(struct archi586_fpu_state *state);
+/*
+ * Called on every context switch. `next` is the FPU state of the thread we are switching to, or nullptr if it doesn't
+ * use the FPU.
+ */
+void archi586_fpu_switch(struct archi586_fpu_state *next);
+/*
+ * Handles device-not-available exception. Returns false if the current thread didn't enable the FPU.
+ */
+[[nodiscard]] bool archi586_fpu_handle_unavailable(void);
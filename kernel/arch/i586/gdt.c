@@ -1,5 +1,10 @@
 #include "gdt.h"
+#include "asm/i586.h"
+#include <assert.h>
+#include <kernel/cpu.h>
+#include <kernel/io/co.h>
 #include <kernel/lib/diagnostics.h>
+#include <kernel/panic.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -78,24 +83,68 @@ static void init_descriptor(struct archi586_gdt_segment_descriptor *out, uint32_
 }
 
 static struct archi586_gdt s_gdt;
-static struct tss s_tss;
-static uint8_t s_esp0stack[4096];
+static struct tss s_tss[CPU_MAX_COUNT];
+static uint8_t s_esp0stack[CPU_MAX_COUNT][4096];
+/*
+ * Double fault task is shared by every CPU. If two CPUs double fault at the same time, the second one will triple
+ * fault, as the task is busy.
+ */
+static struct tss s_doublefault_tss;
+static uint8_t s_doublefault_stack[8192];
+
+[[noreturn]] static void doublefault_task_main(void) {
+    /* The CPU saved state of whatever was running to its TSS before switching to us, and the link points to that TSS. */
+    struct tss const *tss = &s_tss[(s_doublefault_tss.link - ARCHI586_GDT_TSS(0)) / sizeof(struct archi586_gdt_segment_descriptor)];
+    co_printf("double fault at eip=%08lx esp=%08lx (kernel stack overflow?)\n", tss->eip, tss->esp);
+    panic("double fault");
+}
 
 void archi586_gdt_init(void) {
     /* Setup TSS **************************************************************/
-    s_tss.ss0 = ARCHI586_GDT_KERNEL_DS;
-    s_tss.esp0 = (uintptr_t)s_esp0stack;
-    s_tss.iopb = sizeof(s_tss);
+    for (size_t i = 0; i < CPU_MAX_COUNT; i++) {
+        s_tss[i].ss0 = ARCHI586_GDT_KERNEL_DS;
+        s_tss[i].esp0 = (uintptr_t)s_esp0stack[i];
+        s_tss[i].iopb = sizeof(s_tss[i]);
+    }
+
+    /* Setup double fault TSS ************************************************/
+    s_doublefault_tss.eip = (uintptr_t)doublefault_task_main;
+    s_doublefault_tss.esp = (uintptr_t)&s_doublefault_stack[sizeof(s_doublefault_stack)];
+    s_doublefault_tss.eflags = 1U << 1; /* Bit 1 is reserved and always set */
+    s_doublefault_tss.cs = ARCHI586_GDT_KERNEL_CS;
+    s_doublefault_tss.ss = ARCHI586_GDT_KERNEL_DS;
+    s_doublefault_tss.ds = ARCHI586_GDT_KERNEL_DS;
+    s_doublefault_tss.es = ARCHI586_GDT_KERNEL_DS;
+    s_doublefault_tss.fs = ARCHI586_GDT_KERNEL_DS;
+    s_doublefault_tss.gs = ARCHI586_GDT_KERNEL_DS;
+    s_doublefault_tss.iopb = sizeof(s_doublefault_tss);
+    archi586_gdt_update_doublefault_cr3();
 
     /* Setup GDT **************************************************************/
     init_descriptor(&s_gdt.kernelcode, 0, 0xfffff, GDT_FLAG_G | GDT_FLAG_DB,
                     GDT_ACCESS_FLAG_P | GDT_ACCESS_FLAG_S | GDT_ACCESS_FLAG_RW | GDT_ACCESS_FLAG_DPL0 | GDT_ACCESS_FLAG_E | GDT_ACCESS_FLAG_ACCESSED);
     init_descriptor(&s_gdt.kerneldata, 0, 0xfffff, GDT_FLAG_G | GDT_FLAG_DB,
                     GDT_ACCESS_FLAG_P | GDT_ACCESS_FLAG_S | GDT_ACCESS_FLAG_RW | GDT_ACCESS_FLAG_DPL0 | GDT_ACCESS_FLAG_ACCESSED);
-    init_descriptor(&s_gdt.tss, (uintptr_t)&s_tss, sizeof(s_tss) - 1, GDT_FLAG_DB /* TSS size is expressed as bytes, so we don't use G flag */,
+    for (size_t i = 0; i < CPU_MAX_COUNT; i++) {
+        init_descriptor(&s_gdt.tss[i], (uintptr_t)&s_tss[i], sizeof(s_tss[i]) - 1, GDT_FLAG_DB /* TSS size is expressed as bytes, so we don't use G flag */,
+                        GDT_ACCESS_FLAG_P | GDT_ACCESS_FLAG_DPL0 | GDT_ACCESS_FLAG_TYPE_TSS32_AVL);
+    }
+    init_descriptor(&s_gdt.doublefault_tss, (uintptr_t)&s_doublefault_tss, sizeof(s_doublefault_tss) - 1, GDT_FLAG_DB,
                     GDT_ACCESS_FLAG_P | GDT_ACCESS_FLAG_DPL0 | GDT_ACCESS_FLAG_TYPE_TSS32_AVL);
 }
 
+void archi586_gdt_update_doublefault_cr3(void) {
+    s_doublefault_tss.cr3 = archi586_read_cr3();
+}
+
+void archi586_gdt_load_percpu(struct cpu *cpu) {
+    assert(cpu->index < CPU_MAX_COUNT);
+    init_descriptor(&s_gdt.percpu[cpu->index], (uintptr_t)cpu, sizeof(*cpu) - 1, GDT_FLAG_DB,
+                    GDT_ACCESS_FLAG_P | GDT_ACCESS_FLAG_S | GDT_ACCESS_FLAG_RW | GDT_ACCESS_FLAG_DPL0 | GDT_ACCESS_FLAG_ACCESSED);
+    uint32_t gs = ARCHI586_GDT_PERCPU(cpu->index);
+    __asm__ volatile("mov %0, %%gs" ::"r"(gs));
+}
+
 void archi586_gdt_load(void) {
     struct [[gnu::packed]] gdtr {
         uint16_t size;
@@ -108,10 +157,11 @@ void archi586_gdt_load(void) {
     __asm__ volatile("lgdt (%0)" ::"r"(&gdtr));
 }
 
-void archi586_gdt_reload_selectors(void) {
+void archi586_gdt_reload_selectors(struct cpu *cpu) {
+    assert(cpu->index < CPU_MAX_COUNT);
     uint32_t cs = ARCHI586_GDT_KERNEL_CS;
     uint32_t ds = ARCHI586_GDT_KERNEL_DS;
-    uint16_t tss = ARCHI586_GDT_TSS;
+    uint16_t tss = ARCHI586_GDT_TSS(cpu->index);
 
     __asm__ volatile(
         "  lea 1f, %%eax\n"
@@ -1,4 +1,5 @@
 #pragma once
+#include <kernel/cpu.h>
 #include <kernel/lib/diagnostics.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -19,14 +20,31 @@ struct archi586_gdt {
     struct archi586_gdt_segment_descriptor nulldescriptor;
     struct archi586_gdt_segment_descriptor kernelcode;
     struct archi586_gdt_segment_descriptor kerneldata;
-    struct archi586_gdt_segment_descriptor tss;
+    struct archi586_gdt_segment_descriptor doublefault_tss;
+    struct archi586_gdt_segment_descriptor tss[CPU_MAX_COUNT];    /* TSS can't be shared, as the CPU marks it busy. */
+    struct archi586_gdt_segment_descriptor percpu[CPU_MAX_COUNT]; /* Loaded into GS. Base points to struct cpu. */
 };
-STATIC_ASSERT_SIZE(struct archi586_gdt, sizeof(struct archi586_gdt_segment_descriptor) * 4);
+STATIC_ASSERT_SIZE(struct archi586_gdt, sizeof(struct archi586_gdt_segment_descriptor) * (4 + (CPU_MAX_COUNT * 2)));
 
 #define ARCHI586_GDT_KERNEL_CS offsetof(struct archi586_gdt, kernelcode)
 #define ARCHI586_GDT_KERNEL_DS offsetof(struct archi586_gdt, kerneldata)
-#define ARCHI586_GDT_TSS offsetof(struct archi586_gdt, tss)
+#define ARCHI586_GDT_DOUBLEFAULT_TSS offsetof(struct archi586_gdt, doublefault_tss)
+#define ARCHI586_GDT_TSS(_index) (offsetof(struct archi586_gdt, tss) + (sizeof(struct archi586_gdt_segment_descriptor) * (_index)))
+#define ARCHI586_GDT_PERCPU(_index) (offsetof(struct archi586_gdt, percpu) + (sizeof(struct archi586_gdt_segment_descriptor) * (_index)))
 
 void archi586_gdt_init(void);
 void archi586_gdt_load(void);
-void archi586_gdt_reload_selectors(void);
+/*
+ * Reloads segment registers, and loads TSS of `cpu`. GS is set to the kernel data segment, so
+ * archi586_gdt_load_percpu() must be called again after this.
+ */
+void archi586_gdt_reload_selectors(struct cpu *cpu);
+/*
+ * Double fault task uses page directory that was active at the time of call, so this must be called again if the
+ * kernel switches to a new one.
+ */
+void archi586_gdt_update_doublefault_cr3(void);
+/*
+ * Sets up per-CPU segment of `cpu`, and loads it into GS of the current CPU.
+ */
+void archi586_gdt_load_percpu(struct cpu *cpu);
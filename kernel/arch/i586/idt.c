@@ -15,6 +15,7 @@ struct gate_descriptor {
 };
 STATIC_ASSERT_SIZE(struct gate_descriptor, 8);
 
+#define IDT_FLAG_TYPE_TASK (0x5U << 0)
 #define IDT_FLAG_TYPE_INT32 (0xeU << 0)
 #define IDT_FLAG_TYPE_TRAP32 (0xfU << 0)
 #define IDT_FLAG_DPL(_n) ((_n) << 5)
@@ -316,6 +317,12 @@ void archi586_idt_init(void) {
     for (size_t i = 0; i < KERNEL_INT_HANDLER_COUNT; ++i) {
         init_descriptor(&s_idt.entries[i + KERNEL_TRAP_COUNT], (uintptr_t)KERNEL_INTERRUPT_HANDLERS[i], IDT_FLAG_P | IDT_FLAG_TYPE_INT32 | IDT_FLAG_DPL0);
     }
+    /*
+     * Double faults usually mean the stack is gone (e.g. stack overflow hit the guard page), and then the CPU can't even
+     * push the exception frame. Use a task gate, so that the CPU switches to a separate stack instead.
+     */
+    init_descriptor(&s_idt.entries[8], 0, IDT_FLAG_P | IDT_FLAG_TYPE_TASK | IDT_FLAG_DPL0);
+    s_idt.entries[8].segmentselector = ARCHI586_GDT_DOUBLEFAULT_TSS;
 }
 
 void archi586_idt_load(void) {
@@ -16,3 +16,7 @@ ARCH_IRQSTATE arch_irq_disable(void) {
     archi586_cli();
     return prev_state;
 }
+
+void arch_irq_wait(void) {
+    archi586_hlt();
+}
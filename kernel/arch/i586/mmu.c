@@ -7,16 +7,25 @@
 #include <kernel/io/co.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/miscmath.h>
+#include <kernel/lib/pstring.h>
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/types.h>
 #include <stdint.h>
 
-struct pagetable {
-    uint32_t entry[ARCHI586_MMU_ENTRY_COUNT];
-};
-STATIC_ASSERT_TEST(sizeof(struct pagetable) == ARCHI586_MMU_PAGE_SIZE);
+/******************************** Configuration *******************************/
+
+/*
+ * Use PAE paging if the CPU supports it? Without PAE, memory above 4GiB cannot be used.
+ */
+static bool const CONFIG_USE_PAE = true;
+/*
+ * Mark kernel area mappings global if the CPU supports it? Global TLB entries survive CR3 reloads.
+ */
+static bool const CONFIG_USE_GLOBAL_PAGES = true;
+
+/******************************************************************************/
 
 #define ENTRY_BIT_MASK 0x3ffU
 
@@ -29,16 +38,42 @@ STATIC_ASSERT_TEST(sizeof(struct pagetable) == ARCHI586_MMU_PAGE_SIZE);
 #define PDE_BIT_OFFSET 22
 #define PDE_BIT_MASK (ENTRY_BIT_MASK << PDE_BIT_OFFSET)
 
+#define PAE_PDE_BIT_OFFSET 21
+
+/* Physical address bits in an entry. Only bits 12~31 can be set in 32-bit paging entries. */
+#define ENTRY_ADDR_MASK 0x000ffffffffff000ULL
+#define ENTRY_FLAGS_MASK 0xfffU
+
 #define MAKE_VIRTADDR(_pde, _pte, _offset)              \
     (((uintptr_t)(_pde) << (uintptr_t)PDE_BIT_OFFSET) | \
      ((uintptr_t)(_pte) << (uintptr_t)PTE_BIT_OFFSET) | \
      ((uintptr_t)(_offset) << (uintptr_t)OFFSET_BIT_OFFSET))
 
+/*
+ * With recursive mapping, all page tables appear as one big array in virtual memory, indexed by (virtual address >> 12).
+ * For PAE, all four page directories also appear as one big array, indexed by (virtual address >> 21).
+ */
 #define PAGEDIR_PD_BASE MAKE_VIRTADDR(ARCHI586_MMU_PAGEDIR_PDE, ARCHI586_MMU_PAGEDIR_PDE, 0)
 #define PAGEDIR_PT_BASE(_pde) MAKE_VIRTADDR(ARCHI586_MMU_PAGEDIR_PDE, _pde, 0)
+#define PAE_PAGEDIR_INDEX (((ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT - 1) * ARCHI586_MMU_PAE_ENTRY_COUNT) + ARCHI586_MMU_PAE_PAGEDIR_PDE)
+#define PAE_PAGEDIR_PT_BASE ((uintptr_t)PAE_PAGEDIR_INDEX << PAE_PDE_BIT_OFFSET)
+#define PAE_PAGEDIR_PD_BASE (PAE_PAGEDIR_PT_BASE + (PAE_PAGEDIR_INDEX * ARCHI586_MMU_PAGE_SIZE))
+
+/* PAE entries are accessed in 32-bit halves, so that we can control the order of writes. */
+struct pae_entry {
+    uint32_t low;
+    uint32_t high;
+};
+STATIC_ASSERT_TEST(sizeof(struct pae_entry) == ARCHI586_MMU_PAE_ENTRY_SIZE);
 
 static uint32_t *s_pagedir = (uint32_t *)PAGEDIR_PD_BASE;
-static struct pagetable *s_pagetables = (struct pagetable *)PAGEDIR_PT_BASE(0);
+static uint32_t *s_pagetables = (uint32_t *)PAGEDIR_PT_BASE(0);
+static struct pae_entry volatile *s_pae_pagedirs = (struct pae_entry *)PAE_PAGEDIR_PD_BASE;
+static struct pae_entry volatile *s_pae_pagetables = (struct pae_entry *)PAE_PAGEDIR_PT_BASE;
+static struct pae_entry s_pae_pdpt[ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT] [[gnu::aligned(32)]];
+static bool s_pae_enabled = false;
+static bool s_global_pages_enabled = false;
+static PHYSPTR s_max_physaddr = UINT32_MAX;
 
 #define KERNEL_SPACE_BASE MAKE_VIRTADDR(ARCHI586_MMU_KERNEL_PDE_START, 0, 0)
 #define SCRATCH_MAP_BASE MAKE_VIRTADDR(ARCHI586_MMU_SCRATCH_PDE, ARCHI586_MMU_SCRATCH_PTE, 0)
@@ -47,6 +82,9 @@ static struct pagetable *s_pagetables = (struct pagetable *)PAGEDIR_PT_BASE(0);
 #define KERNEL_VM_START (KERNEL_IMAGE_ADDRESS_END + 1)
 #define KERNEL_VM_END (SCRATCH_MAP_BASE - 1)
 
+STATIC_ASSERT_TEST(PAE_PAGEDIR_PT_BASE == MAKE_VIRTADDR(ARCHI586_MMU_ENTRY_COUNT - ARCHI586_MMU_RECURSIVE_PDE_COUNT, 0, 0));
+STATIC_ASSERT_TEST(SCRATCH_MAP_BASE < PAE_PAGEDIR_PT_BASE);
+
 void *const ARCH_KERNEL_SPACE_BASE = (void *)KERNEL_SPACE_BASE;
 void *const ARCH_SCRATCH_MAP_BASE = (void *)SCRATCH_MAP_BASE;
 void *const ARCH_KERNEL_IMAGE_ADDRESS_START = (void *)KERNEL_IMAGE_ADDRESS_START;
@@ -56,11 +94,104 @@ void *const ARCH_KERNEL_VM_END = (void *)KERNEL_VM_END;
 
 size_t const ARCH_PAGESIZE = ARCHI586_MMU_PAGE_SIZE;
 
+static uint64_t read_pae_entry(struct pae_entry volatile *entry) {
+    return ((uint64_t)entry->high << 32) | entry->low;
+}
+
+static void write_pae_entry(struct pae_entry volatile *entry, uint64_t value) {
+    if (entry->high != (uint32_t)(value >> 32)) {
+        /* Make it non-present first, so that CPU never sees a mix of old and new entry. */
+        entry->low = 0;
+        entry->high = value >> 32;
+    }
+    entry->low = (uint32_t)value;
+}
+
 static size_t pde_index(void *ptr) {
+    if (s_pae_enabled) {
+        return (uintptr_t)ptr >> PAE_PDE_BIT_OFFSET;
+    }
     return ((uintptr_t)ptr & PDE_BIT_MASK) >> PDE_BIT_OFFSET;
 }
+
+/* Index into the page table array, which covers the whole address space. */
 static size_t pte_index(void *ptr) {
-    return ((uintptr_t)ptr & PTE_BIT_MASK) >> PTE_BIT_OFFSET;
+    return (uintptr_t)ptr >> PTE_BIT_OFFSET;
+}
+
+static uint64_t get_pde(void *ptr) {
+    if (s_pae_enabled) {
+        return read_pae_entry(&s_pae_pagedirs[pde_index(ptr)]);
+    }
+    return s_pagedir[pde_index(ptr)];
+}
+
+static void set_pde(void *ptr, uint64_t entry) {
+    if (s_pae_enabled) {
+        write_pae_entry(&s_pae_pagedirs[pde_index(ptr)], entry);
+        return;
+    }
+    assert(entry <= UINT32_MAX);
+    s_pagedir[pde_index(ptr)] = entry;
+}
+
+static uint64_t get_pte(void *ptr) {
+    if (s_pae_enabled) {
+        return read_pae_entry(&s_pae_pagetables[pte_index(ptr)]);
+    }
+    return s_pagetables[pte_index(ptr)];
+}
+
+static void set_pte(void *ptr, uint64_t entry) {
+    if (s_pae_enabled) {
+        write_pae_entry(&s_pae_pagetables[pte_index(ptr)], entry);
+        return;
+    }
+    assert(entry <= UINT32_MAX);
+    s_pagetables[pte_index(ptr)] = entry;
+}
+
+/*
+ * Clears the entry and returns what it was, in a single atomic step, so that A and D bits other CPUs set in the
+ * meantime can't be lost.
+ */
+static uint64_t take_pte(void *ptr) {
+    if (s_pae_enabled) {
+        struct pae_entry volatile *entry = &s_pae_pagetables[pte_index(ptr)];
+        /* Flags live in the low half, and clearing P there makes the whole entry non-present. */
+        uint32_t low = __atomic_exchange_n(&entry->low, 0, __ATOMIC_SEQ_CST);
+        uint64_t result = ((uint64_t)entry->high << 32) | low;
+        entry->high = 0;
+        return result;
+    }
+    return __atomic_exchange_n(&s_pagetables[pte_index(ptr)], 0, __ATOMIC_SEQ_CST);
+}
+
+/* Returns PTE flags that every mapping at `ptr` should have */
+static uint64_t extra_pte_flags_for(void *ptr) {
+    if (s_global_pages_enabled && (KERNEL_SPACE_BASE <= (uintptr_t)ptr)) {
+        return ARCHI586_MMU_PTE_FLAG_G;
+    }
+    return 0;
+}
+
+/* Returns number of entries in a page table */
+static size_t pagetable_entry_count(void) {
+    return s_pae_enabled ? ARCHI586_MMU_PAE_ENTRY_COUNT : ARCHI586_MMU_ENTRY_COUNT;
+}
+
+/* Returns first virtual address that is covered by the same page table as `ptr` */
+static void *pagetable_coverage_base(void *ptr) {
+    return align_ptr_down(ptr, pagetable_entry_count() * ARCHI586_MMU_PAGE_SIZE);
+}
+
+/* Returns where the page table for `ptr` is mapped in the recursive mapping */
+static void *pagetable_of(void *ptr) {
+    size_t first_pte = pte_index(pagetable_coverage_base(ptr));
+    if (s_pae_enabled) {
+        return (void *)&s_pae_pagetables[first_pte];
+    }
+    return &s_pagetables[first_pte];
 }
 
 void arch_mmu_flush_tlb_for(void *ptr) {
@@ -71,11 +202,20 @@ void arch_mmu_flush_tlb(void) {
     archi586_reload_cr3();
 }
 
+void archi586_mmu_flush_tlb_all(void) {
+    if (!s_global_pages_enabled) {
+        archi586_reload_cr3();
+        return;
+    }
+    /* Changing CR4.PGE flushes the whole TLB, including global entries. */
+    uint32_t cr4 = archi586_read_cr4();
+    archi586_write_cr4(cr4 & ~ARCHI586_CR4_FLAG_PGE);
+    archi586_write_cr4(cr4);
+}
+
 [[nodiscard]] int arch_mmu_emulate(PHYSPTR *physaddr_out, void *virtaddr, uint8_t flags, MMU_USER_ACCESS is_from_user) {
-    uint16_t pde = pde_index(virtaddr);
-    uint16_t pte = pte_index(virtaddr);
     bool is_write = flags & MAP_PROT_WRITE;
-    uint32_t pd_entry = s_pagedir[pde];
+    uint64_t pd_entry = get_pde(virtaddr);
     if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
         return -EFAULT;
     }
@@ -85,7 +225,7 @@ void arch_mmu_flush_tlb(void) {
     if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_US) && is_from_user) {
         return -EPERM;
     }
-    uint32_t pt_entry = s_pagetables[pde].entry[pte];
+    uint64_t pt_entry = get_pte(virtaddr);
     if (!(pt_entry & ARCHI586_MMU_PTE_FLAG_P)) {
         return -EFAULT;
     }
@@ -95,23 +235,21 @@ void arch_mmu_flush_tlb(void) {
     if (!(pt_entry & ARCHI586_MMU_PTE_FLAG_US) && (is_from_user == MMU_USER_ACCESS_YES)) {
         return -EPERM;
     }
-    *physaddr_out = pt_entry & ~0xfffU;
+    *physaddr_out = pt_entry & ENTRY_ADDR_MASK;
     return 0;
 }
 
 [[nodiscard]] int arch_mmu_virtual_to_physical(PHYSPTR *physaddr_out, void *virt) {
-    uint16_t pde = pde_index(virt);
-    uint16_t pte = pte_index(virt);
-    uint32_t pd_entry = s_pagedir[pde];
+    uint64_t pd_entry = get_pde(virt);
     *physaddr_out = 0;
     if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
         return -EFAULT;
     }
-    uint32_t pt_entry = s_pagetables[pde].entry[pte];
+    uint64_t pt_entry = get_pte(virt);
     if (!(pt_entry & ARCHI586_MMU_PTE_FLAG_P)) {
         return -EFAULT;
     }
-    *physaddr_out = (pt_entry & ~0xfffU) + ((uintptr_t)virt & 0xfffU);
+    *physaddr_out = (pt_entry & ENTRY_ADDR_MASK) + ((uintptr_t)virt & OFFSET_BIT_MASK);
     return 0;
 }
 
@@ -122,26 +260,32 @@ void arch_mmu_flush_tlb(void) {
         assert(!WILL_ADD_OVERFLOW((uintptr_t)(_addr), ((_count) * ARCHI586_MMU_PAGE_SIZE), UINTPTR_MAX)); \
     }
 
-static int create_pd(uint8_t pde) {
+#define ASSERT_PHYSADDR_VALID(_addr, _count)                                                                     \
+    {                                                                                                            \
+        assert((_addr) != 0);                                                                                    \
+        assert(!WILL_ADD_OVERFLOW((_addr), ((PHYSPTR)(_count) * ARCHI586_MMU_PAGE_SIZE) - 1, s_max_physaddr)); \
+    }
+
+static int create_pd(void *virt) {
     size_t size = 1;
     PHYSPTR addr = pmm_alloc(&size);
     if (addr == PHYSICALPTR_NULL) {
         return -ENOMEM;
     }
-    s_pagedir[pde] = addr | ARCHI586_MMU_PDE_FLAG_P | ARCHI586_MMU_PDE_FLAG_RW | ARCHI586_MMU_PDE_FLAG_US;
-    arch_mmu_flush_tlb_for(&s_pagetables[pde]);
-    vmemset(&s_pagetables[pde], 0, sizeof(s_pagetables[pde]));
-    /* Flush TLB just to be safe **********************************************/
-    for (size_t i = 0; i < ARCHI586_MMU_ENTRY_COUNT; i++) {
-        arch_mmu_flush_tlb_for((void *)MAKE_VIRTADDR(pde, i, 0));
-    }
+    set_pde(virt, addr | ARCHI586_MMU_PDE_FLAG_P | ARCHI586_MMU_PDE_FLAG_RW | ARCHI586_MMU_PDE_FLAG_US);
+    void *table = pagetable_of(virt);
+    arch_mmu_flush_tlb_for(table);
+    vmemset(table, 0, ARCHI586_MMU_PAGE_SIZE);
+    /*
+     * Flush TLB just to be safe. Reloading CR3 is much cheaper than doing INVLPG on every page the table covers, and
+     * global entries it leaves behind can't be in this area, since nothing was mapped here.
+     */
+    arch_mmu_flush_tlb();
     return 0;
 }
 
 static void map_single_page(void *virt, PHYSPTR phys, uint8_t flags, MMU_USER_ACCESS user_access) {
-    uint16_t pde = pde_index(virt);
-    uint16_t pte = pte_index(virt);
-    uint32_t oldpte = s_pagetables[pde].entry[pte];
+    uint64_t oldpte = get_pte(virt);
     bool shouldflush = false;
     if (oldpte & ARCHI586_MMU_PTE_FLAG_P) {
         /* See if we need to invalidate old TLB *******************************/
@@ -151,21 +295,22 @@ static void map_single_page(void *virt, PHYSPTR phys, uint8_t flags, MMU_USER_AC
         if ((oldpte & ARCHI586_MMU_PTE_FLAG_US) && user_access == MMU_USER_ACCESS_NO) {
             shouldflush = true;
         }
-        PHYSPTR oldaddr = oldpte & ~0xfffU;
+        PHYSPTR oldaddr = oldpte & ENTRY_ADDR_MASK;
         if (oldaddr != phys) {
             shouldflush = true;
         }
     }
-    s_pagetables[pde].entry[pte] = phys | ARCHI586_MMU_PTE_FLAG_P;
+    uint64_t newpte = phys | ARCHI586_MMU_PTE_FLAG_P | extra_pte_flags_for(virt);
     if (flags & MAP_PROT_WRITE) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_RW;
+        newpte |= ARCHI586_MMU_PTE_FLAG_RW;
     }
     if (flags & MAP_PROT_NOCACHE) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_PCD;
+        newpte |= ARCHI586_MMU_PTE_FLAG_PCD;
     }
     if (user_access == MMU_USER_ACCESS_YES) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_US;
+        newpte |= ARCHI586_MMU_PTE_FLAG_US;
     }
+    set_pte(virt, newpte);
     if (shouldflush) {
         arch_mmu_flush_tlb_for(virt);
     }
@@ -176,7 +321,7 @@ static void map_single_page(void *virt, PHYSPTR phys, uint8_t flags, MMU_USER_AC
     int ret = 0;
     bool pdcreated = false;
     ASSERT_ADDR_VALID(virt_base, page_count);
-    ASSERT_ADDR_VALID(physbase, page_count);
+    ASSERT_PHYSADDR_VALID(physbase, page_count);
     assert(is_aligned(physbase, ARCHI586_MMU_PAGE_SIZE));
     if (!(flags & MAP_PROT_READ)) {
         ret = -EPERM;
@@ -184,13 +329,12 @@ static void map_single_page(void *virt, PHYSPTR phys, uint8_t flags, MMU_USER_AC
     }
     for (size_t i = 0; i < page_count; i++) {
         void *current_virt = (char *)virt_base + (i * ARCHI586_MMU_PAGE_SIZE);
-        uint16_t pde = pde_index(current_virt);
-        uint32_t pd_entry = s_pagedir[pde];
+        uint64_t pd_entry = get_pde(current_virt);
         if ((pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
             continue;
         }
         /* Create new PD ******************************************************/
-        int ret = create_pd(pde);
+        int ret = create_pd(current_virt);
         if (ret < 0) {
             goto fail;
         }
@@ -212,13 +356,11 @@ out:
 }
 
 static int check_presence(void *virt) {
-    uint16_t pde = pde_index(virt);
-    uint16_t pte = pte_index(virt);
-    uint32_t pd_entry = s_pagedir[pde];
+    uint64_t pd_entry = get_pde(virt);
     if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
         return -EFAULT;
     }
-    uint32_t oldpte = s_pagetables[pde].entry[pte];
+    uint64_t oldpte = get_pte(virt);
     if (!(oldpte & ARCHI586_MMU_PTE_FLAG_P)) {
         return -EFAULT;
     }
@@ -226,9 +368,7 @@ static int check_presence(void *virt) {
 }
 
 static void remap_single_page(void *virt, uint8_t flags, MMU_USER_ACCESS user_access) {
-    uint16_t pde = pde_index(virt);
-    uint16_t pte = pte_index(virt);
-    uint32_t oldpte = s_pagetables[pde].entry[pte];
+    uint64_t oldpte = get_pte(virt);
     bool should_flush = false;
     /* See if we need to invalidate old TLB ***********************************/
     if ((oldpte & ARCHI586_MMU_PTE_FLAG_RW) && !(flags & MAP_PROT_WRITE)) {
@@ -238,16 +378,18 @@ static void remap_single_page(void *virt, uint8_t flags, MMU_USER_ACCESS user_ac
         should_flush = true;
     }
     /* Update the table *******************************************************/
-    s_pagetables[pde].entry[pte] &= ~(0xfffU & (~ARCHI586_MMU_COMMON_FLAG_P));
+    uint64_t newpte = oldpte & ~(uint64_t)(ENTRY_FLAGS_MASK & (~ARCHI586_MMU_COMMON_FLAG_P));
+    newpte |= extra_pte_flags_for(virt);
     if (flags & MAP_PROT_WRITE) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_RW;
+        newpte |= ARCHI586_MMU_PTE_FLAG_RW;
     }
     if (flags & MAP_PROT_NOCACHE) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_PCD;
+        newpte |= ARCHI586_MMU_PTE_FLAG_PCD;
     }
     if (user_access) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_US;
+        newpte |= ARCHI586_MMU_PTE_FLAG_US;
     }
+    set_pte(virt, newpte);
     if (should_flush) {
         arch_mmu_flush_tlb_for(virt);
     }
@@ -286,45 +428,102 @@ static void remap_single_page(void *virt, uint8_t flags, MMU_USER_ACCESS user_ac
     }
     for (size_t i = 0; i < page_count; i++) {
         void *current_virt_base = (char *)virt_base + (i * ARCHI586_MMU_PAGE_SIZE);
-        uint16_t pde = pde_index(current_virt_base);
-        uint16_t pte = pte_index(current_virt_base);
-        s_pagetables[pde].entry[pte] = 0;
+        set_pte(current_virt_base, 0);
         arch_mmu_flush_tlb_for(current_virt_base);
     }
     /* TODO: Clean-up unused PD entries */
     return true;
 }
 
-STATIC_ASSERT_TEST(ARCHI586_MMU_SCRATCH_PDE == (ARCHI586_MMU_KERNEL_PDE_START + ARCHI586_MMU_KERNEL_PDE_COUNT - 1));
-
-void arch_mmu_scratch_map(PHYSPTR physaddr, MMU_CACHE_INHIBIT cache_inhibit) {
+[[nodiscard]] int arch_mmu_unmap_and_get_usage(void *virt, PHYSPTR *physaddr_out) {
     ASSERT_IRQ_DISABLED();
-    assert(is_aligned(physaddr, ARCHI586_MMU_PAGE_SIZE));
-    uint16_t pde = ARCHI586_MMU_SCRATCH_PDE;
-    uint16_t pte = ARCHI586_MMU_SCRATCH_PTE;
-    uint32_t pd_entry = s_pagedir[pde];
-    assert(pd_entry & ARCHI586_MMU_PDE_FLAG_P);
-    uint32_t oldpte = s_pagetables[pde].entry[pte];
-    bool should_flush = false;
-    PHYSPTR oldaddr = 0;
+    ASSERT_ADDR_VALID(virt, 1);
+    int ret = check_presence(virt);
+    if (ret < 0) {
+        return ret;
+    }
+    uint64_t oldpte = take_pte(virt);
+    arch_mmu_flush_tlb_for(virt);
+    *physaddr_out = oldpte & ENTRY_ADDR_MASK;
+    int result = 0;
+    if (oldpte & ARCHI586_MMU_PTE_FLAG_A) {
+        result |= MMU_USAGE_ACCESSED;
+    }
+    if (oldpte & ARCHI586_MMU_PTE_FLAG_D) {
+        result |= MMU_USAGE_DIRTY;
+    }
+    return result;
+}
 
-    if (oldpte & ARCHI586_MMU_PTE_FLAG_P) {
-        /* See if we need to invalidate old TLB *******************************/
-        if (oldpte & ARCHI586_MMU_PTE_FLAG_US) {
-            should_flush = true;
+[[nodiscard]] int arch_mmu_get_and_clear_usage(void *virt, uint8_t clear_flags) {
+    ASSERT_IRQ_DISABLED();
+    int ret = check_presence(virt);
+    if (ret < 0) {
+        return ret;
+    }
+    uint64_t oldpte = get_pte(virt);
+    uint64_t newpte = oldpte;
+    int result = 0;
+    if (oldpte & ARCHI586_MMU_PTE_FLAG_A) {
+        result |= MMU_USAGE_ACCESSED;
+        if (clear_flags & MMU_USAGE_ACCESSED) {
+            newpte &= ~(uint64_t)ARCHI586_MMU_PTE_FLAG_A;
         }
-        oldaddr = oldpte & ~0xfffU;
-        if (oldaddr != physaddr) {
-            should_flush = true;
+    }
+    if (oldpte & ARCHI586_MMU_PTE_FLAG_D) {
+        result |= MMU_USAGE_DIRTY;
+        if (clear_flags & MMU_USAGE_DIRTY) {
+            newpte &= ~(uint64_t)ARCHI586_MMU_PTE_FLAG_D;
         }
     }
-    s_pagetables[pde].entry[pte] = physaddr | ARCHI586_MMU_PTE_FLAG_P | ARCHI586_MMU_PTE_FLAG_RW;
-    if (cache_inhibit == MMU_CACHE_INHIBIT_YES) {
-        s_pagetables[pde].entry[pte] |= ARCHI586_MMU_PTE_FLAG_PCD;
+    if (newpte != oldpte) {
+        set_pte(virt, newpte);
+        /* CPU only sets A and D bits when it loads the entry into TLB, so we have to throw away the old one. */
+        arch_mmu_flush_tlb_for(virt);
     }
-    if (should_flush) {
-        arch_mmu_flush_tlb_for(ARCH_SCRATCH_MAP_BASE);
+    return result;
+}
+
+bool arch_mmu_free_pagetable_if_unused(void *virt) {
+    ASSERT_IRQ_DISABLED();
+    if ((uintptr_t)KERNEL_SPACE_BASE <= (uintptr_t)virt) {
+        return false;
+    }
+    uint64_t pd_entry = get_pde(virt);
+    if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
+        return false;
+    }
+    char *base = pagetable_coverage_base(virt);
+    for (size_t i = 0; i < pagetable_entry_count(); i++) {
+        if (get_pte(base + (i * ARCHI586_MMU_PAGE_SIZE)) & ARCHI586_MMU_PTE_FLAG_P) {
+            return false;
+        }
     }
+    set_pde(virt, 0);
+    /* This also throws away the recursive mapping of the table itself. */
+    arch_mmu_flush_tlb();
+    pmm_free(pd_entry & ENTRY_ADDR_MASK, 1);
+    return true;
+}
+
+STATIC_ASSERT_TEST(ARCHI586_MMU_SCRATCH_PDE == (ARCHI586_MMU_KERNEL_PDE_START + ARCHI586_MMU_KERNEL_PDE_COUNT - 1));
+
+void arch_mmu_scratch_map(PHYSPTR physaddr, MMU_CACHE_INHIBIT cache_inhibit) {
+    ASSERT_IRQ_DISABLED();
+    assert(is_aligned(physaddr, ARCHI586_MMU_PAGE_SIZE));
+    assert(physaddr <= s_max_physaddr);
+    uint64_t pd_entry = get_pde(ARCH_SCRATCH_MAP_BASE);
+    assert(pd_entry & ARCHI586_MMU_PDE_FLAG_P);
+    uint64_t newpte = physaddr | ARCHI586_MMU_PTE_FLAG_P | ARCHI586_MMU_PTE_FLAG_RW | extra_pte_flags_for(ARCH_SCRATCH_MAP_BASE);
+    if (cache_inhibit == MMU_CACHE_INHIBIT_YES) {
+        newpte |= ARCHI586_MMU_PTE_FLAG_PCD;
+    }
+    set_pte(ARCH_SCRATCH_MAP_BASE, newpte);
+    /*
+     * Always flush, as the entry may have been changed by other CPU since we last used it, and our TLB may still have
+     * what we used back then.
+     */
+    arch_mmu_flush_tlb_for(ARCH_SCRATCH_MAP_BASE);
 }
 
 /*******************************************************************************
@@ -352,11 +551,40 @@ void arch_mmu_write_protect_after_early_init(void) {
 
 extern const void *archi586_stackbottomtrap;
 
+static bool is_pge_supported(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return false;
+    }
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx & CPUID_1_EDX_FLAG_PGE;
+}
+
+static void enable_global_pages(void) {
+    /* Mark what early boot code mapped in kernel area global first. */
+    for (size_t pde = ARCHI586_MMU_KERNEL_PDE_START; pde < (ARCHI586_MMU_KERNEL_PDE_START + ARCHI586_MMU_KERNEL_PDE_COUNT); pde++) {
+        if (!(get_pde((void *)MAKE_VIRTADDR(pde, 0, 0)) & ARCHI586_MMU_PDE_FLAG_P)) {
+            continue;
+        }
+        for (size_t pte = 0; pte < ARCHI586_MMU_ENTRY_COUNT; pte++) {
+            void *virt = (void *)MAKE_VIRTADDR(pde, pte, 0);
+            uint64_t entry = get_pte(virt);
+            if (entry & ARCHI586_MMU_PTE_FLAG_P) {
+                set_pte(virt, entry | ARCHI586_MMU_PTE_FLAG_G);
+            }
+        }
+    }
+    /* Changing CR4.PGE flushes the whole TLB, including global entries. */
+    archi586_write_cr4(archi586_read_cr4() | ARCHI586_CR4_FLAG_PGE);
+    s_global_pages_enabled = true;
+}
+
 void archi586_mmu_init(void) {
 #if 0
     /* Unmap lower 2MB area ***************************************************/
     for (size_t i = 0; i < ARCHI586_MMU_ENTRY_COUNT; i++) {
-        s_pagetables[0].entry[i] = 0;
+        s_pagetables[i] = 0;
         arch_mmu_flush_tlb_for((void *)MAKE_VIRTADDR(0, i, 0));
     }
 #endif
@@ -368,4 +596,175 @@ void archi586_mmu_init(void) {
         ARCH_KERNEL_VM_START,
         ((uintptr_t)ARCH_KERNEL_VM_END - (uintptr_t)ARCH_KERNEL_VM_START + 1) / ARCHI586_MMU_PAGE_SIZE);
     MUST_SUCCEED(ret);
+    if (CONFIG_USE_GLOBAL_PAGES && is_pge_supported()) {
+        enable_global_pages();
+    } else {
+        co_printf("mmu: global pages are not supported\n");
+    }
+}
+
+bool archi586_mmu_is_pae_enabled(void) {
+    return s_pae_enabled;
+}
+
+PHYSPTR archi586_mmu_get_max_physaddr(void) {
+    return s_max_physaddr;
+}
+
+static bool is_pae_supported(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return false;
+    }
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx & CPUID_1_EDX_FLAG_PAE;
+}
+
+static PHYSPTR get_pae_max_physaddr(void) {
+    /* CPUs that don't report MAXPHYADDR support 36-bit physical addresses. */
+    uint32_t addr_bits = 36;
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (0x80000008 <= eax) {
+        archi586_cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+        addr_bits = eax & 0xffU;
+    }
+    if ((addr_bits < 32) || (52 < addr_bits)) {
+        addr_bits = 36;
+    }
+    return ((PHYSPTR)1 << addr_bits) - 1;
+}
+
+/*
+ * Frees PAE page tables pointed by given page directories, as well as page directories themselves.
+ */
+static void free_pae_tables(PHYSPTR const *pagedirs) {
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT; i++) {
+        if (pagedirs[i] == PHYSICALPTR_NULL) {
+            continue;
+        }
+        for (size_t j = 0; j < ARCHI586_MMU_PAE_ENTRY_COUNT; j++) {
+            struct pae_entry entry;
+            pmemcpy_in(&entry, pagedirs[i] + (j * sizeof(entry)), sizeof(entry), false);
+            if (entry.low & ARCHI586_MMU_PDE_FLAG_P) {
+                pmm_free(read_pae_entry(&entry) & ENTRY_ADDR_MASK, 1);
+            }
+        }
+        pmm_free(pagedirs[i], 1);
+    }
+}
+
+/*
+ * Converts the half of 32-bit page table into new PAE page table.
+ * Returns PHYSICALPTR_NULL if there's nothing to convert, or it ran out of memory(*oom_out is set in that case).
+ */
+static PHYSPTR convert_to_pae_pagetable(uint32_t const *entries, bool *oom_out) {
+    enum {
+        CHUNK_SIZE = 64,
+    };
+    *oom_out = false;
+    bool empty = true;
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_ENTRY_COUNT; i++) {
+        if (entries[i] & ARCHI586_MMU_PTE_FLAG_P) {
+            empty = false;
+            break;
+        }
+    }
+    if (empty) {
+        return PHYSICALPTR_NULL;
+    }
+    size_t page_count = 1;
+    PHYSPTR table = pmm_alloc(&page_count);
+    if (table == PHYSICALPTR_NULL) {
+        *oom_out = true;
+        return PHYSICALPTR_NULL;
+    }
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_ENTRY_COUNT; i += CHUNK_SIZE) {
+        struct pae_entry buf[CHUNK_SIZE];
+        for (size_t j = 0; j < CHUNK_SIZE; j++) {
+            buf[j].low = entries[i + j];
+            buf[j].high = 0;
+        }
+        pmemcpy_out(table + (i * sizeof(*buf)), buf, sizeof(buf), false);
+    }
+    return table;
+}
+
+void archi586_mmu_init_pae(void) {
+    if (!CONFIG_USE_PAE) {
+        return;
+    }
+    if (!is_pae_supported()) {
+        co_printf("mmu: CPU doesn't support PAE. memory above 4GiB will not be used.\n");
+        return;
+    }
+    bool prev_interrupts = arch_irq_disable();
+    PHYSPTR pagedirs[ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT] = {0};
+    /* Allocate page directories **********************************************/
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT; i++) {
+        size_t page_count = 1;
+        pagedirs[i] = pmm_alloc(&page_count);
+        if (pagedirs[i] == PHYSICALPTR_NULL) {
+            goto fail_oom;
+        }
+        pmemset(pagedirs[i], 0, ARCHI586_MMU_PAGE_SIZE, false);
+    }
+    /*
+     * Convert existing page tables ********************************************
+     * Each 32-bit page table becomes two PAE page tables. Empty ones are not converted, and will be created when needed.
+     */
+    for (size_t pde = 0; pde < (ARCHI586_MMU_KERNEL_PDE_START + ARCHI586_MMU_KERNEL_PDE_COUNT); pde++) {
+        uint32_t pd_entry = s_pagedir[pde];
+        if (!(pd_entry & ARCHI586_MMU_PDE_FLAG_P)) {
+            continue;
+        }
+        for (size_t half = 0; half < 2; half++) {
+            bool oom = false;
+            PHYSPTR table = convert_to_pae_pagetable(&s_pagetables[(pde * ARCHI586_MMU_ENTRY_COUNT) + (half * ARCHI586_MMU_PAE_ENTRY_COUNT)], &oom);
+            if (oom) {
+                goto fail_oom;
+            }
+            if (table == PHYSICALPTR_NULL) {
+                continue;
+            }
+            size_t pae_pde = (pde * 2) + half;
+            uint64_t flags = pd_entry & (ARCHI586_MMU_PDE_FLAG_P | ARCHI586_MMU_PDE_FLAG_RW | ARCHI586_MMU_PDE_FLAG_US | ARCHI586_MMU_PDE_FLAG_PWT | ARCHI586_MMU_PDE_FLAG_PCD);
+            struct pae_entry entry = {
+                .low = (uint32_t)(table | flags),
+                .high = table >> 32,
+            };
+            PHYSPTR pagedir = pagedirs[pae_pde / ARCHI586_MMU_PAE_ENTRY_COUNT];
+            pmemcpy_out(pagedir + ((pae_pde % ARCHI586_MMU_PAE_ENTRY_COUNT) * sizeof(entry)), &entry, sizeof(entry), false);
+        }
+    }
+    /* Map page directories themselves ****************************************/
+    PHYSPTR last_pagedir = pagedirs[ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT - 1];
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT; i++) {
+        struct pae_entry entry = {
+            .low = (uint32_t)(pagedirs[i] | ARCHI586_MMU_PDE_FLAG_P | ARCHI586_MMU_PDE_FLAG_RW),
+            .high = pagedirs[i] >> 32,
+        };
+        pmemcpy_out(last_pagedir + ((ARCHI586_MMU_PAE_PAGEDIR_PDE + i) * sizeof(entry)), &entry, sizeof(entry), false);
+    }
+    /* Fill PDPT and switch to it. Note that PDPT entries don't have RW and US flags. */
+    for (size_t i = 0; i < ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT; i++) {
+        s_pae_pdpt[i].low = (uint32_t)(pagedirs[i] | ARCHI586_MMU_COMMON_FLAG_P);
+        s_pae_pdpt[i].high = pagedirs[i] >> 32;
+    }
+    PHYSPTR pdpt_physaddr;
+    int ret = arch_mmu_virtual_to_physical(&pdpt_physaddr, s_pae_pdpt);
+    MUST_SUCCEED(ret);
+    assert(pdpt_physaddr <= UINT32_MAX);
+    archi586_mmu_enable_pae_paging(pdpt_physaddr);
+    s_pae_enabled = true;
+    s_max_physaddr = get_pae_max_physaddr();
+    /* NOTE: Old 32-bit page tables were allocated in .bss.init during boot, so there's nothing to free here. */
+    co_printf("mmu: PAE paging enabled (max physical address %#llx)\n", s_max_physaddr);
+    goto out;
+fail_oom:
+    co_printf("mmu: not enough memory for PAE page tables. using 32-bit paging.\n");
+    free_pae_tables(pagedirs);
+out:
+    arch_irq_restore(prev_interrupts);
 }
@@ -35,8 +35,22 @@
 #define ARCHI586_MMU_ENTRY_SIZE 4
 #define ARCHI586_MMU_ENTRY_COUNT 1024
 
+/*
+ * PAE paging uses 64-bit entries, so each table only has half as many entries, and there is additional 4-entry
+ * PDPT(Page Directory Pointer Table) above page directories.
+ */
+#define ARCHI586_MMU_PAE_ENTRY_SIZE 8
+#define ARCHI586_MMU_PAE_ENTRY_COUNT 512
+#define ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT 4
+
+/*
+ * Top 8MB of the address space is reserved for recursive mapping of paging structures. 32-bit paging only needs top
+ * 4MB, but PAE needs all four page directories mapped, so we always reserve what PAE needs to keep the layout same.
+ */
+#define ARCHI586_MMU_RECURSIVE_PDE_COUNT 2
+
 #define ARCHI586_MMU_KERNEL_PDE_START 768
-#define ARCHI586_MMU_KERNEL_PDE_COUNT (ARCHI586_MMU_ENTRY_COUNT - ARCHI586_MMU_KERNEL_PDE_START - 1)
+#define ARCHI586_MMU_KERNEL_PDE_COUNT (ARCHI586_MMU_ENTRY_COUNT - ARCHI586_MMU_KERNEL_PDE_START - ARCHI586_MMU_RECURSIVE_PDE_COUNT)
 
 #define ARCHI586_MMU_SCRATCH_PDE (ARCHI586_MMU_KERNEL_PDE_START + ARCHI586_MMU_KERNEL_PDE_COUNT - 1)
 #define ARCHI586_MMU_SCRATCH_PTE (ARCHI586_MMU_ENTRY_COUNT - 1)
@@ -47,6 +61,11 @@
 
 /* PDE for recursive mapping the PD itself */
 #define ARCHI586_MMU_PAGEDIR_PDE (ARCHI586_MMU_ENTRY_COUNT - 1)
+/* First PDE(in the last page directory) for recursive mapping of all four page directories, when PAE is enabled */
+#define ARCHI586_MMU_PAE_PAGEDIR_PDE (ARCHI586_MMU_PAE_ENTRY_COUNT - ARCHI586_MMU_PAE_PDPT_ENTRY_COUNT)
+
+#define ARCHI586_CR4_FLAG_PAE (1U << 5)
+#define ARCHI586_CR4_FLAG_PGE (1U << 7)
 
 /*******************************************************************************
  * Below are only applicable to C
@@ -60,6 +79,8 @@
 
 STATIC_ASSERT_TEST(sizeof(uint32_t) == ARCHI586_MMU_ENTRY_SIZE);
 STATIC_ASSERT_TEST(ARCHI586_MMU_ENTRY_COUNT == (ARCHI586_MMU_PAGE_SIZE / ARCHI586_MMU_ENTRY_SIZE));
+STATIC_ASSERT_TEST(sizeof(uint64_t) == ARCHI586_MMU_PAE_ENTRY_SIZE);
+STATIC_ASSERT_TEST(ARCHI586_MMU_PAE_ENTRY_COUNT == (ARCHI586_MMU_PAGE_SIZE / ARCHI586_MMU_PAE_ENTRY_SIZE));
 
 static uint8_t const ARCHI586_MMU_EMUTRANS_FAULT_FLAG_PDE_MISSING = 1 << 0;
 static uint8_t const ARCHI586_MMU_EMUTRANS_FAULT_FLAG_PDE_WRITE = 1 << 1;
@@ -76,6 +97,22 @@ struct archi586_mmu_emulate_result {
 void archi586_mmu_write_protect_kernel_text(void);
 void arch_mmu_write_protect_after_early_init(void);
 void archi586_mmu_init(void);
+/*
+ * Flushes the whole TLB of current CPU, including global entries.
+ */
+void archi586_mmu_flush_tlb_all(void);
+/*
+ * Switches to PAE paging if CPU supports it. Page tables are allocated from PMM, so this must be called after
+ * registering memory below 4GiB.
+ */
+void archi586_mmu_init_pae(void);
+bool archi586_mmu_is_pae_enabled(void);
+/*
+ * Returns the last physical address that can be mapped with current paging mode.
+ */
+PHYSPTR archi586_mmu_get_max_physaddr(void);
+/* Implemented in entry.S */
+void archi586_mmu_enable_pae_paging(uint32_t pdpt_physaddr);
 void archi586_setup_stack_bottom_trap(void);
 
 #endif
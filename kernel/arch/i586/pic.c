@@ -1,13 +1,25 @@
 #include "pic.h"
+#include "apic.h"
 #include "ioport.h"
 #include <assert.h>
 #include <kernel/arch/interrupts.h>
 #include <kernel/io/co.h>
 #include <kernel/lib/list.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
 #include <kernel/trapmanager.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/******************************** Configuration *******************************/
+
+/*
+ * Use local APIC and I/O APIC instead of the 8259 PIC, if they are present?
+ */
+static bool const CONFIG_USE_APIC = true;
+
+/******************************************************************************/
+
 #define CMDPORT_MASTER 0x20
 #define DATAPORT_MASTER 0x21
 #define CMDPORT_SLAVE 0xa0
@@ -21,6 +33,10 @@
 #define IRQS_PER_PIC 8
 #define IRQS_TOTAL (IRQS_PER_PIC * 2)
 #define PIC_VECTOR_BASE 0x20
+#define APIC_VECTOR_BASE 0x30
+
+/* Set if IRQs are delivered through the I/O APIC. 8259 is fully masked in that case. */
+static bool s_use_apic;
 
 static uint8_t const PIC_ICW1_FLAG_ICW4 = 1 << 0;
 static uint8_t const PIC_ICW1_FLAG_INIT = 1 << 4;
@@ -51,13 +67,21 @@ static void setirqmask(uint16_t mask) {
     archi586_out8(DATAPORT_SLAVE, mask >> 8);
 }
 
-void archi586_pic_send_eoi(uint8_t irq) {
+static void send_legacy_eoi(uint8_t irq) {
     if (irq >= IRQS_PER_PIC) {
         archi586_out8(CMDPORT_SLAVE, CMD_EOI);
     }
     archi586_out8(CMDPORT_MASTER, CMD_EOI);
 }
 
+static void send_eoi(uint8_t irq) {
+    if (s_use_apic) {
+        archi586_lapic_send_eoi();
+        return;
+    }
+    send_legacy_eoi(irq);
+}
+
 static bool checkspuriousirq(uint8_t irq) {
     bool is_real = readisr() & (1U << irq);
     if (irq == 7) {
@@ -74,7 +98,7 @@ static bool checkspuriousirq(uint8_t irq) {
              * that it is spurious at all.
              * So we must send EOI to the master.
              */
-            archi586_pic_send_eoi(SLAVEPIN_ON_MASTER);
+            send_legacy_eoi(SLAVEPIN_ON_MASTER);
         }
         return is_real;
     }
@@ -82,41 +106,99 @@ static bool checkspuriousirq(uint8_t irq) {
 }
 
 bool archi586_pic_is_irq_masked(uint8_t irq) {
+    if (s_use_apic) {
+        return archi586_ioapic_is_isa_irq_masked(irq);
+    }
     return getirqmask() & (1U << irq);
 }
 
 void archi586_pic_mask_irq(uint8_t irq) {
+    if (s_use_apic) {
+        archi586_ioapic_mask_isa_irq(irq);
+        return;
+    }
     setirqmask(getirqmask() | (1U << irq));
 }
 
 void archi586_pic_unmask_irq(uint8_t irq) {
+    if (s_use_apic) {
+        archi586_ioapic_unmask_isa_irq(irq);
+        return;
+    }
     setirqmask(getirqmask() & ~(1U << irq));
 }
 
 static struct trap_handler s_traphandler[IRQS_TOTAL];
 
+/*
+ * What run_irq_handlers() calls for each IRQ. If there's only one handler, this is the handler itself. Otherwise it is
+ * run_irq_handler_chain() with the list of handlers.
+ */
+struct irq_dispatch {
+    void (*callback)(int irqnum, void *data);
+    void *data;
+};
+
+static struct irq_dispatch s_irq_dispatch[IRQS_TOTAL];
 /* Each IRQ entry is a list of IRQ handlers. */
 static struct list s_irqs[IRQS_TOTAL];
+/* Protects both of above. Handlers are called without holding this. */
+static struct spinlock s_irqs_lock;
+/* Set by archi586_pic_sched_tick_after_eoi() */
+static bool s_sched_tick_pending;
+
+static void run_irq_handler_chain(int irqnum, void *data) {
+    struct list *handlers = data;
+    LIST_FOREACH(handlers, handlernode) {
+        struct archi586_pic_irq_handler *handler = handlernode->data;
+        assert(handler != nullptr);
+        handler->callback(irqnum, handler->data);
+    }
+}
 
-/* Default handler that just EOIs given IRQ */
-static void default_irq_handler(int trapnum, void *trapframe, void *data) {
+static void run_irq_handlers(int irqnum) {
+    spinlock_lock(&s_irqs_lock);
+    struct irq_dispatch dispatch = s_irq_dispatch[irqnum];
+    spinlock_unlock(&s_irqs_lock);
+    if (dispatch.callback == nullptr) {
+        co_printf("no irq handler registered for irq %d\n", irqnum);
+    } else {
+        dispatch.callback(irqnum, dispatch.data);
+    }
+    send_eoi(irqnum);
+    if (s_sched_tick_pending) {
+        s_sched_tick_pending = false;
+        sched_tick();
+    }
+}
+
+void archi586_pic_sched_tick_after_eoi(void) {
+    ASSERT_IRQ_DISABLED();
+    s_sched_tick_pending = true;
+}
+
+static void legacy_irq_handler(int trapnum, void *trapframe, void *data) {
     (void)trapframe;
     (void)data;
     int irqnum = trapnum - PIC_VECTOR_BASE;
     assert(irqnum < IRQS_TOTAL);
-    bool is_suprious_irq = checkspuriousirq(irqnum);
-    if (s_irqs[irqnum].front == nullptr) {
-        co_printf("no irq handler registered for irq %d\n", trapnum);
+    if (s_use_apic) {
+        /* Every line is masked, so this can only be a spurious IRQ. These don't need EOI on the master PIC. */
+        co_printf("pic: spurious irq %d received while using APIC\n", irqnum);
         return;
     }
-    LIST_FOREACH(&s_irqs[irqnum], handlernode) {
-        struct archi586_pic_irq_handler *handler = handlernode->data;
-        assert(handler != nullptr);
-        handler->callback(irqnum, handler->data);
-    }
-    if (!is_suprious_irq) {
-        archi586_pic_send_eoi(irqnum);
+    if (!checkspuriousirq(irqnum)) {
+        return;
     }
+    run_irq_handlers(irqnum);
+}
+
+static void apic_irq_handler(int trapnum, void *trapframe, void *data) {
+    (void)trapframe;
+    (void)data;
+    int irqnum = trapnum - APIC_VECTOR_BASE;
+    assert(irqnum < IRQS_TOTAL);
+    run_irq_handlers(irqnum);
 }
 
 void archi586_pic_init(void) {
@@ -132,19 +214,45 @@ void archi586_pic_init(void) {
     /* ICW4 *******************************************************************/
     archi586_out8(DATAPORT_MASTER, PIC_ICW4_FLAG_8086MODE);
     archi586_out8(DATAPORT_SLAVE, PIC_ICW4_FLAG_8086MODE);
-    /* Setup default PIC handler **********************************************/
-    for (size_t i = 0; i < 8; i++) {
-        trapmanager_register_trap(&s_traphandler[i], PIC_VECTOR_BASE + i, default_irq_handler, nullptr);
-        trapmanager_register_trap(&s_traphandler[IRQS_PER_PIC + i], PIC_VECTOR_BASE + IRQS_PER_PIC + i, default_irq_handler, nullptr);
+    /*
+     * Setup legacy PIC handler ***********************************************
+     * These are still needed when using the APIC, as the 8259 may send spurious IRQs even if every line is masked.
+     */
+    for (size_t i = 0; i < IRQS_TOTAL; i++) {
+        trapmanager_register_trap(&s_traphandler[i], PIC_VECTOR_BASE + i, legacy_irq_handler, nullptr);
+    }
+    if (CONFIG_USE_APIC && archi586_apic_init()) {
+        setirqmask(0xffff);
+        /* Each IRQ gets its own vector */
+        static struct trap_handler apic_traphandler[IRQS_TOTAL];
+        for (size_t i = 0; i < IRQS_TOTAL; i++) {
+            if (i == SLAVEPIN_ON_MASTER) {
+                /* Cascade line of the 8259. Nothing is wired to it. */
+                continue;
+            }
+            trapmanager_register_trap(&apic_traphandler[i], APIC_VECTOR_BASE + i, apic_irq_handler, nullptr);
+            archi586_ioapic_route_isa_irq(i, APIC_VECTOR_BASE + i);
+        }
+        s_use_apic = true;
+        co_printf("pic: using I/O APIC\n");
+        return;
     }
     /* Disable IRQs except for IRQ2(which is connected to slave PIC) **********/
     setirqmask(~(uint16_t)(1U << 2));
 }
 
 void archi586_pic_register_handler(struct archi586_pic_irq_handler *out, int irqnum, void (*callback)(int irqnum, void *data), void *data) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_irqs_lock);
     out->callback = callback;
     out->data = data;
     list_insert_back(&s_irqs[irqnum], &out->node, out);
-    arch_irq_restore(prev_interrupts);
+    struct irq_dispatch *dispatch = &s_irq_dispatch[irqnum];
+    if (s_irqs[irqnum].front == s_irqs[irqnum].back) {
+        dispatch->callback = callback;
+        dispatch->data = data;
+    } else {
+        dispatch->callback = run_irq_handler_chain;
+        dispatch->data = &s_irqs[irqnum];
+    }
+    spinlock_unlock(&s_irqs_lock);
 }
@@ -8,10 +8,21 @@ struct archi586_pic_irq_handler {
     struct list_node node;
 };
 
-void archi586_pic_send_eoi(uint8_t irq);
+/*
+ * IRQs are delivered through local APIC and I/O APIC if they are present, and through the 8259 PIC otherwise.
+ * IRQ numbers are always ISA IRQ numbers.
+ */
+
 bool archi586_pic_is_irq_masked(uint8_t irq);
 void archi586_pic_mask_irq(uint8_t irq);
 void archi586_pic_unmask_irq(uint8_t irq);
 void archi586_pic_init(void);
-/* NOTE: Each handler is responsible for sending EOI. This is to support cases where EOI is not sent at the end of handler, like timer IRQ. */
+/*
+ * Makes the current IRQ call sched_tick() after its EOI was sent. This is for timer IRQs: sched_tick() may switch to
+ * another thread, and the IRQ must not stay unacknowledged until we come back to this one.
+ */
+void archi586_pic_sched_tick_after_eoi(void);
+/*
+ * NOTE: EOI is sent once after every handler of the IRQ has run, so handlers must not send it themselves.
+ */
 void archi586_pic_register_handler(struct archi586_pic_irq_handler *out, int irqnum, void (*callback)(int irqnum, void *data), void *data);
@@ -1,22 +1,44 @@
 #include "pit.h"
 #include "ioport.h"
 #include "pic.h"
-#include <kernel/tasks/sched.h>
+#include "tick.h"
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/tsc.h>
 #include <kernel/ticktime.h>
 #include <stdint.h>
 
 #define PIT_CH0_DATA_PORT 0x40
+#define PIT_CH2_DATA_PORT 0x42
 #define PIT_MODE_PORT 0x43
+/* Channel 2 gate and output are on the keyboard controller's port B (a.k.a. NMI status and control port) */
+#define PORT_B 0x61
+#define PORT_B_FLAG_CH2_GATE (1U << 0)
+#define PORT_B_FLAG_SPEAKER (1U << 1)
+#define PORT_B_FLAG_CH2_OUT (1U << 5)
 
 #define PIT_FREQ 1193182
 
 #define PIT_MODEFLAG_SELECT_CH0 (0U << 6)     /* Channel select (Bit 7:6) */
+#define PIT_MODEFLAG_SELECT_CH2 (2U << 6)     /* Channel select (Bit 7:6) */
+#define PIT_MODEFLAG_READBACK (3U << 6)       /* Read-back command (Bit 7:6) */
+#define PIT_MODEFLAG_ACCESS_LATCH (0U << 4)   /* Access mode (Bit 5:4) */
 #define PIT_MODEFLAG_ACCESS_LSB_MSB (3U << 4) /* Access mode (Bit 5:4) */
+#define PIT_MODEFLAG_OP_ONESHOT (0U << 1)     /* Operation mode (Bit 3:1) - Interrupt on terminal count */
 #define PIT_MODEFLAG_OP_RATEGEN (2U << 1)     /* Operation mode (Bit 3:1) */
 #define PIT_MODEFLAG_BINMODE (0U << 0)        /* Binary/BCD mode (Bit 0) */
 
+#define PIT_READBACK_FLAG_CH0 (1U << 1)
+#define PIT_STATUS_FLAG_OUT (1U << 7)
+
 #define PIT_IRQ 0
 #define FREQ_MILLIS 1
+#define MAX_COUNTER 0xffff
+
+/* TSC is measured over this many milliseconds */
+#define TSC_MEASURE_MILLIS 50
+/* Give up if channel 2 output doesn't go high after polling this many times */
+#define TSC_MEASURE_MAX_POLLS 10000000
 
 static uint32_t countervaluefromhz(uint32_t hz) {
     return PIT_FREQ / hz;
@@ -34,22 +56,146 @@ static void shortinternaldelay(void) {
     archi586_in8(PIT_MODE_PORT);
 }
 
+static uint16_t s_tick_counter;
+/*
+ * Ticks covered by the one-shot counter that is currently running. 0 if the periodic tick is running.
+ */
+static TICKTIME s_stopped_ticks;
+static uint16_t s_oneshot_counter;
+/* Counts that passed while ticks were stopped, but didn't make up a whole tick */
+static uint32_t s_leftover_counts;
+/* The one-shot counter ran out while interrupts were disabled, and its interrupt was already counted by resume(). */
+static bool s_stale_irq_pending;
+
+static void set_counter(uint8_t opmode, uint16_t counter) {
+    archi586_out8(PIT_MODE_PORT, PIT_MODEFLAG_SELECT_CH0 | PIT_MODEFLAG_ACCESS_LSB_MSB | opmode | PIT_MODEFLAG_BINMODE);
+    archi586_out8(PIT_CH0_DATA_PORT, counter);
+    shortinternaldelay();
+    archi586_out8(PIT_CH0_DATA_PORT, counter >> 8);
+}
+
+/*
+ * Latches status and counter at the same time, so that they always agree with each other.
+ */
+static uint16_t read_counter(uint8_t *status_out) {
+    archi586_out8(PIT_MODE_PORT, PIT_MODEFLAG_READBACK | PIT_READBACK_FLAG_CH0);
+    *status_out = archi586_in8(PIT_CH0_DATA_PORT);
+    shortinternaldelay();
+    uint16_t counter = archi586_in8(PIT_CH0_DATA_PORT);
+    shortinternaldelay();
+    counter |= (uint16_t)archi586_in8(PIT_CH0_DATA_PORT) << 8;
+    return counter;
+}
+
 static void irqhandler(int irqnum, void *data) {
+    (void)irqnum;
     (void)data;
-    g_ticktime++;
-    archi586_pic_send_eoi(irqnum);
-    sched_schedule();
+    if (s_stale_irq_pending) {
+        s_stale_irq_pending = false;
+        return;
+    }
+    TICKTIME ticks = 1;
+    if (s_stopped_ticks != 0) {
+        /* One-shot counter ran out. */
+        ticks = s_stopped_ticks;
+        s_stopped_ticks = 0;
+        set_counter(PIT_MODEFLAG_OP_RATEGEN, s_tick_counter);
+    }
+    archi586_tick_advance(ticks);
+    archi586_pic_sched_tick_after_eoi();
+}
+
+static TICKTIME get_max_stop_ticks(void) {
+    return MAX_COUNTER / s_tick_counter;
 }
 
+static void stop(TICKTIME ticks) {
+    assert(s_stopped_ticks == 0);
+    if (get_max_stop_ticks() < ticks) {
+        ticks = get_max_stop_ticks();
+    }
+    if (ticks <= 1) {
+        return;
+    }
+    s_stopped_ticks = ticks;
+    s_oneshot_counter = ticks * s_tick_counter;
+    set_counter(PIT_MODEFLAG_OP_ONESHOT, s_oneshot_counter);
+}
+
+static void resume(void) {
+    if (s_stopped_ticks == 0) {
+        return;
+    }
+    uint8_t status;
+    uint16_t counter = read_counter(&status);
+    uint32_t elapsed_counts = s_oneshot_counter;
+    if (status & PIT_STATUS_FLAG_OUT) {
+        /*
+         * The counter already ran out(and kept counting down from 0xffff), so its interrupt is pending. It's counted
+         * here, so the interrupt handler has to drop it.
+         */
+        elapsed_counts += (0x10000 - counter) & 0xffff;
+        s_stale_irq_pending = true;
+    } else {
+        elapsed_counts -= counter;
+    }
+    elapsed_counts += s_leftover_counts;
+    s_leftover_counts = elapsed_counts % s_tick_counter;
+    s_stopped_ticks = 0;
+    set_counter(PIT_MODEFLAG_OP_RATEGEN, s_tick_counter);
+    TICKTIME ticks = elapsed_counts / s_tick_counter;
+    if (ticks != 0) {
+        archi586_tick_advance(ticks);
+    }
+}
+
+static struct archi586_tick_source const TICK_SOURCE = {
+    .name = "PIT",
+    .stop = stop,
+    .resume = resume,
+    .get_max_stop_ticks = get_max_stop_ticks,
+};
+
 static struct archi586_pic_irq_handler s_irqhandler;
 
 void archi586_pit_init(void) {
     archi586_pic_mask_irq(PIT_IRQ);
-    uint32_t initial_counter = countefrommillis(FREQ_MILLIS);
-    archi586_out8(PIT_MODE_PORT, PIT_MODEFLAG_SELECT_CH0 | PIT_MODEFLAG_ACCESS_LSB_MSB | PIT_MODEFLAG_OP_RATEGEN | PIT_MODEFLAG_BINMODE);
-    archi586_out8(PIT_CH0_DATA_PORT, initial_counter);
-    shortinternaldelay();
-    archi586_out8(PIT_CH0_DATA_PORT, initial_counter >> 8);
+    s_tick_counter = countefrommillis(FREQ_MILLIS);
+    set_counter(PIT_MODEFLAG_OP_RATEGEN, s_tick_counter);
     archi586_pic_register_handler(&s_irqhandler, PIT_IRQ, irqhandler, nullptr);
+    archi586_tick_set_source(&TICK_SOURCE);
     archi586_pic_unmask_irq(PIT_IRQ);
 }
+
+void archi586_pit_stop_tick(void) {
+    bool prev_interrupts = arch_irq_disable();
+    assert(s_stopped_ticks == 0);
+    archi586_pic_mask_irq(PIT_IRQ);
+    arch_irq_restore(prev_interrupts);
+}
+
+uint64_t archi586_pit_measure_tsc_hz(void) {
+    bool prev_interrupts = arch_irq_disable();
+    uint8_t portb = archi586_in8(PORT_B);
+    archi586_out8(PORT_B, (portb & ~PORT_B_FLAG_SPEAKER) | PORT_B_FLAG_CH2_GATE);
+    uint16_t counter = countefrommillis(1) * TSC_MEASURE_MILLIS;
+    archi586_out8(PIT_MODE_PORT, PIT_MODEFLAG_SELECT_CH2 | PIT_MODEFLAG_ACCESS_LSB_MSB | PIT_MODEFLAG_OP_ONESHOT | PIT_MODEFLAG_BINMODE);
+    archi586_out8(PIT_CH2_DATA_PORT, counter);
+    shortinternaldelay();
+    archi586_out8(PIT_CH2_DATA_PORT, counter >> 8);
+    /* Counting starts right after writing the counter, and the output goes high when it reaches 0. */
+    uint64_t start_tsc = arch_read_tsc();
+    uint64_t end_tsc = 0;
+    for (uint32_t i = 0; i < TSC_MEASURE_MAX_POLLS; i++) {
+        if (archi586_in8(PORT_B) & PORT_B_FLAG_CH2_OUT) {
+            end_tsc = arch_read_tsc();
+            break;
+        }
+    }
+    archi586_out8(PORT_B, portb);
+    arch_irq_restore(prev_interrupts);
+    if (end_tsc == 0) {
+        return 0;
+    }
+    return ((end_tsc - start_tsc) * PIT_FREQ) / counter;
+}
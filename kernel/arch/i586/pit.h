@@ -1,3 +1,12 @@
 #pragma once
+#include <stdint.h>
 
 void archi586_pit_init(void);
+/*
+ * Stops PIT interrupts, after another tick source took over.
+ */
+void archi586_pit_stop_tick(void);
+/*
+ * Measures TSC frequency using PIT channel 2, without relying on interrupts. Returns 0 if channel 2 didn't seem to work.
+ */
+[[nodiscard]] uint64_t archi586_pit_measure_tsc_hz(void);
@@ -11,6 +11,9 @@
 #include <kernel/io/tty.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/waitqueue.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -126,7 +129,8 @@ static void write_dl(struct archi586_serial *self, uint16_t dl) {
 }
 
 static bool should_use_irq(struct archi586_serial *self) {
-    return self->use_irq && arch_irq_are_enabled();
+    /* IRQ work thread can't wait for tx_work, as it is the one running it. */
+    return self->use_irq && arch_irq_are_enabled() && !irqwork_is_worker_thread();
 }
 
 static void write_data(struct archi586_serial *self, uint8_t val) {
@@ -156,14 +160,16 @@ static void wait_lsr_ready_to_recv(struct archi586_serial *self) {
 
 static void wait_and_send(struct archi586_serial *self, char ch) {
     if (!is_ready_to_send(self) && should_use_irq(self)) {
-        while (1) {
-            ARCH_IRQSTATE prev_irq = arch_irq_disable();
-            bool ok = QUEUE_ENQUEUE(&self->tx_queue, &ch);
-            arch_irq_restore(prev_irq);
-            if (ok) {
-                break;
-            }
+        sched_lock();
+        while (QUEUE_ENQUEUE(&self->tx_queue, &ch) < 0) {
+            /* tx_work wakes us up once it sends out what's in the queue. */
+            waitqueue_wait(&self->tx_waitqueue);
+        }
+        if (is_ready_to_send(self)) {
+            /* Transmitter went idle before we queued the data, so there won't be an IRQ for it. */
+            irqwork_schedule(&self->tx_work);
         }
+        sched_unlock();
     } else {
         wait_lsr_ready_to_send(self);
         write_data(self, ch);
@@ -172,15 +178,14 @@ static void wait_and_send(struct archi586_serial *self, char ch) {
 
 static char wait_and_recv(struct archi586_serial *self) {
     if (!is_ready_to_recv(self) && should_use_irq(self)) {
-        while (1) {
-            char ch;
-            ARCH_IRQSTATE prev_irq = arch_irq_disable();
-            bool ok = QUEUE_DEQUEUE(&ch, &self->rx_queue);
-            arch_irq_restore(prev_irq);
-            if (ok) {
-                return ch;
-            }
+        char ch;
+        sched_lock();
+        while (!QUEUE_DEQUEUE(&ch, &self->rx_queue)) {
+            /* IRQ handler wakes us up once something arrives. */
+            waitqueue_wait(&self->rx_waitqueue);
         }
+        sched_unlock();
+        return ch;
     } else {
         wait_lsr_ready_to_recv(self);
         return read_data(self);
@@ -251,7 +256,29 @@ static struct stream_ops const OPS = {
     .write = stream_op_write,
 };
 
+static void send_queued_data(void *data) {
+    struct archi586_serial *self = data;
+    while (1) {
+        sched_lock();
+        char ch;
+        /* If the transmitter is still busy, next TX interrupt schedules us again. */
+        bool sent = is_ready_to_send(self) && QUEUE_DEQUEUE(&ch, &self->tx_queue);
+        if (sent) {
+            write_data(self, ch);
+        }
+        waitqueue_wake_all(&self->tx_waitqueue);
+        sched_unlock();
+        if (!sent) {
+            break;
+        }
+    }
+}
+
+/*
+ * Received data has to be read here to clear the interrupt, but sending out queued data is left to tx_work.
+ */
 static void irq_handler(int irqnum, void *data) {
+    (void)irqnum;
     struct archi586_serial *self = data;
     uint8_t ier = read_reg(self, REG_IER);
     uint8_t iir = read_reg(self, REG_IIR);
@@ -259,26 +286,21 @@ static void irq_handler(int irqnum, void *data) {
     (void)ier;
     (void)lsr;
     switch (iir & (0x3U << 1)) {
-    case 0x1 << 1: {
-        char data;
-        while (1) {
-            [[maybe_unused]] bool ok = QUEUE_DEQUEUE(&data, &self->tx_queue);
-            if (!ok) {
-                break;
-            }
-            write_data(self, data);
-        }
+    case 0x1 << 1:
+        irqwork_schedule(&self->tx_work);
         break;
-    }
     case 0x2 << 1: {
         char data = read_data(self);
+        /* The queue is protected by the scheduler lock, same as the waitqueue for it. */
+        sched_lock();
         [[maybe_unused]] bool ok = QUEUE_ENQUEUE(&self->rx_queue, &data);
+        waitqueue_wake_one(&self->rx_waitqueue);
+        sched_unlock();
         break;
     }
     default:
         break;
     }
-    archi586_pic_send_eoi(irqnum);
 }
 
 [[nodiscard]] int archi586_serial_init(struct archi586_serial *out, uint16_t baseaddr, int32_t masterclock, uint8_t irq) {
@@ -310,6 +332,9 @@ static void irq_handler(int irqnum, void *data) {
 void archi586_serial_use_irq(struct archi586_serial *self) {
     QUEUE_INIT_FOR_ARRAY(&self->rx_queue, self->rx_queue_buf);
     QUEUE_INIT_FOR_ARRAY(&self->tx_queue, self->tx_queue_buf);
+    waitqueue_init(&self->rx_waitqueue);
+    waitqueue_init(&self->tx_waitqueue);
+    irqwork_init(&self->tx_work, send_queued_data, self);
     archi586_pic_register_handler(&self->irqhandler, self->irq, irq_handler, self);
     archi586_pic_unmask_irq(self->irq);
     write_ier(self, 0x3); /* Transmit and Receive interrupts */
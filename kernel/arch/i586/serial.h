@@ -2,6 +2,8 @@
 #include "pic.h"
 #include <kernel/io/tty.h>
 #include <kernel/lib/queue.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/waitqueue.h>
 #include <stdint.h>
 
 /*#define OLD_IRQ_DRIVER*/
@@ -20,6 +22,8 @@ struct archi586_serial {
     struct queue tx_queue, rx_queue;
     char tx_queue_buf[ARCHI586_SERIAL_QUEUE_SIZE];
     char rx_queue_buf[ARCHI586_SERIAL_QUEUE_SIZE];
+    struct waitqueue tx_waitqueue, rx_waitqueue;
+    struct irqwork tx_work; /* Sends out what's in tx_queue */
 #endif
     /* Config flags ***********************************************************/
     bool cr_to_crlf : 1;
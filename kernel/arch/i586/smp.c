@@ -0,0 +1,579 @@
+#include "smp.h"
+#include "apic.h"
+#include "asm/aptrampoline.h"
+#include "asm/i586.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "mmu_ext.h"
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/smp.h>
+#include <kernel/cpu.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/pstring.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/vmm.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <kernel/types.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************** Configuration *******************************/
+
+/*
+ * Print CPUs found in firmware tables?
+ */
+static bool const CONFIG_PRINT_CPUS = true;
+
+/******************************************************************************/
+
+#define BDA_EBDA_SEGMENT_ADDR 0x40e
+#define BIOS_ROM_START 0xe0000
+#define BIOS_ROM_END 0x100000
+#define BASE_MEM_LAST_KB 0x9fc00
+#define DEFAULT_LAPIC_BASE 0xfee00000
+#define DEFAULT_IOAPIC_BASE 0xfec00000
+#define ISA_IRQ_COUNT 16
+/* Stack of other CPUs. Their idle threads run on it. */
+#define AP_STACK_SIZE THREAD_STACK_SIZE
+/* Give up on a CPU that doesn't come online in time */
+#define AP_START_TIMEOUT_TICKS 1000
+
+struct [[gnu::packed]] acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oemid[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+};
+STATIC_ASSERT_SIZE(struct acpi_rsdp, 20);
+
+struct [[gnu::packed]] acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oemid[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+STATIC_ASSERT_SIZE(struct acpi_sdt_header, 36);
+
+struct [[gnu::packed]] acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+};
+STATIC_ASSERT_SIZE(struct acpi_madt, 44);
+
+#define MADT_ENTRY_TYPE_LAPIC 0
+#define MADT_ENTRY_TYPE_IOAPIC 1
+#define MADT_ENTRY_TYPE_OVERRIDE 2
+
+struct [[gnu::packed]] acpi_madt_lapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t acpi_processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+};
+STATIC_ASSERT_SIZE(struct acpi_madt_lapic, 8);
+
+#define MADT_LAPIC_FLAG_ENABLED (1U << 0)
+#define MADT_LAPIC_FLAG_ONLINE_CAPABLE (1U << 1)
+
+struct [[gnu::packed]] acpi_madt_ioapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t ioapic_id;
+    uint8_t _reserved;
+    uint32_t ioapic_addr;
+    uint32_t gsi_base;
+};
+STATIC_ASSERT_SIZE(struct acpi_madt_ioapic, 12);
+
+struct [[gnu::packed]] acpi_madt_override {
+    uint8_t type;
+    uint8_t length;
+    uint8_t bus;
+    uint8_t source_irq;
+    uint32_t gsi;
+    uint16_t flags;
+};
+STATIC_ASSERT_SIZE(struct acpi_madt_override, 10);
+
+/* Interrupt flags. These are shared by MADT and MP tables. */
+#define INTI_POLARITY_MASK (3U << 0)
+#define INTI_POLARITY_ACTIVE_LOW (3U << 0)
+#define INTI_TRIGGER_MASK (3U << 2)
+#define INTI_TRIGGER_LEVEL (3U << 2)
+
+struct [[gnu::packed]] mp_floating_pointer {
+    char signature[4];
+    uint32_t config_addr;
+    uint8_t length; /* In 16-byte units */
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];
+};
+STATIC_ASSERT_SIZE(struct mp_floating_pointer, 16);
+
+struct [[gnu::packed]] mp_config_header {
+    char signature[4];
+    uint16_t base_table_length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oemid[8];
+    char productid[12];
+    uint32_t oem_table_addr;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_addr;
+    uint16_t ext_table_length;
+    uint8_t ext_table_checksum;
+    uint8_t _reserved;
+};
+STATIC_ASSERT_SIZE(struct mp_config_header, 44);
+
+#define MP_ENTRY_TYPE_PROCESSOR 0
+#define MP_ENTRY_TYPE_BUS 1
+#define MP_ENTRY_TYPE_IOAPIC 2
+#define MP_ENTRY_TYPE_IOINT 3
+
+struct [[gnu::packed]] mp_processor_entry {
+    uint8_t type;
+    uint8_t lapic_id;
+    uint8_t lapic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t _reserved[2];
+};
+STATIC_ASSERT_SIZE(struct mp_processor_entry, 20);
+
+struct [[gnu::packed]] mp_bus_entry {
+    uint8_t type;
+    uint8_t bus_id;
+    char bus_type[6];
+};
+STATIC_ASSERT_SIZE(struct mp_bus_entry, 8);
+
+struct [[gnu::packed]] mp_ioapic_entry {
+    uint8_t type;
+    uint8_t ioapic_id;
+    uint8_t ioapic_version;
+    uint8_t flags;
+    uint32_t ioapic_addr;
+};
+STATIC_ASSERT_SIZE(struct mp_ioapic_entry, 8);
+
+struct [[gnu::packed]] mp_ioint_entry {
+    uint8_t type;
+    uint8_t int_type;
+    uint16_t flags;
+    uint8_t source_bus_id;
+    uint8_t source_bus_irq;
+    uint8_t dest_ioapic_id;
+    uint8_t dest_ioapic_intin;
+};
+STATIC_ASSERT_SIZE(struct mp_ioint_entry, 8);
+
+#define MP_PROCESSOR_ENTRY_SIZE 20
+#define MP_OTHER_ENTRY_SIZE 8
+#define MP_PROCESSOR_FLAG_EN (1U << 0)
+#define MP_IOAPIC_FLAG_EN (1U << 0)
+#define MP_IOINT_TYPE_INT 0
+
+static PHYSPTR s_lapic_base;
+/* Only the first I/O APIC is used */
+static PHYSPTR s_ioapic_base;
+static uint32_t s_ioapic_gsi_base;
+static struct archi586_isa_irq_route s_isa_routes[ISA_IRQ_COUNT];
+/*
+ * TLB shootdown requests of each CPU. Requesters bump `requested`, and the CPU catches `done` up to it once it flushed
+ * TLB. Counting requests instead of setting a flag keeps requests that arrive in the middle of flushing from getting lost.
+ */
+static _Atomic uint32_t s_tlb_flush_requested[CPU_MAX_COUNT];
+static _Atomic uint32_t s_tlb_flush_done[CPU_MAX_COUNT];
+
+struct cpu *arch_smp_get_current_cpu(void) {
+    uint32_t gs;
+    __asm__ volatile("mov %%gs, %0" : "=r"(gs));
+    if (gs < ARCHI586_GDT_PERCPU(0)) {
+        /* Per-CPU segment is not loaded yet(or we are in the double fault task) */
+        return cpu_get_boot();
+    }
+    struct cpu *cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void arch_smp_spin_pause(void) {
+    archi586_smp_flush_tlb_if_requested();
+    __asm__ volatile("pause");
+}
+
+void archi586_smp_flush_tlb_if_requested(void) {
+    size_t index = cpu_get_current()->index;
+    uint32_t requested = atomic_load_explicit(&s_tlb_flush_requested[index], memory_order_acquire);
+    if (atomic_load_explicit(&s_tlb_flush_done[index], memory_order_relaxed) == requested) {
+        return;
+    }
+    archi586_mmu_flush_tlb_all();
+    atomic_store_explicit(&s_tlb_flush_done[index], requested, memory_order_release);
+}
+
+void arch_smp_shootdown_tlb(void) {
+    uint32_t waiting_for[CPU_MAX_COUNT];
+    bool is_waiting[CPU_MAX_COUNT] = {0};
+    /* We must stay on this CPU, as we skip it below. */
+    bool prev_interrupts = arch_irq_disable();
+    struct cpu *current = cpu_get_current();
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        struct cpu *cpu = cpu_get(i);
+        if ((cpu == current) || !cpu->online) {
+            continue;
+        }
+        waiting_for[i] = atomic_fetch_add_explicit(&s_tlb_flush_requested[i], 1, memory_order_acq_rel) + 1;
+        is_waiting[i] = true;
+        archi586_lapic_send_tlb_shootdown(cpu->arch_id);
+    }
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        if (!is_waiting[i]) {
+            continue;
+        }
+        /* Other requesters may have moved it past ours, which is also fine. */
+        while ((int32_t)(atomic_load_explicit(&s_tlb_flush_done[i], memory_order_acquire) - waiting_for[i]) < 0) {
+            arch_smp_spin_pause();
+        }
+    }
+    arch_irq_restore(prev_interrupts);
+}
+
+void arch_smp_send_reschedule(struct cpu *cpu) {
+    archi586_lapic_send_reschedule(cpu->arch_id);
+}
+
+PHYSPTR archi586_smp_get_lapic_base(void) {
+    return s_lapic_base;
+}
+
+PHYSPTR archi586_smp_get_ioapic_base(uint32_t *gsi_base_out) {
+    *gsi_base_out = s_ioapic_gsi_base;
+    return s_ioapic_base;
+}
+
+void archi586_smp_get_isa_irq_route(struct archi586_isa_irq_route *out, uint8_t irq) {
+    assert(irq < ISA_IRQ_COUNT);
+    *out = s_isa_routes[irq];
+}
+
+static void set_isa_irq_route(uint8_t irq, uint32_t gsi, uint16_t flags) {
+    if (ISA_IRQ_COUNT <= irq) {
+        return;
+    }
+    s_isa_routes[irq].gsi = gsi;
+    /* "Conforms to the bus" means active high and edge triggered for ISA. */
+    s_isa_routes[irq].active_low = (flags & INTI_POLARITY_MASK) == INTI_POLARITY_ACTIVE_LOW;
+    s_isa_routes[irq].level_triggered = (flags & INTI_TRIGGER_MASK) == INTI_TRIGGER_LEVEL;
+}
+
+static bool is_checksum_valid(PHYSPTR addr, size_t len) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += ppeek8(addr + i, MMU_CACHE_INHIBIT_NO);
+    }
+    return sum == 0;
+}
+
+/*
+ * Looks for 16-byte aligned `signature` with valid checksum over `checksum_len` bytes.
+ * Returns 0 if not found.
+ */
+static PHYSPTR find_signature(PHYSPTR start, PHYSPTR end, char const *signature, size_t checksum_len) {
+    size_t sig_len = kstrlen(signature);
+    for (PHYSPTR addr = start; (addr + checksum_len) <= end; addr += 16) {
+        char buf[8];
+        assert(sig_len <= sizeof(buf));
+        pmemcpy_in(buf, addr, sig_len, MMU_CACHE_INHIBIT_NO);
+        if ((kstrncmp(buf, signature, sig_len) == 0) && is_checksum_valid(addr, checksum_len)) {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+static PHYSPTR ebda_addr(void) {
+    return (PHYSPTR)ppeek16(BDA_EBDA_SEGMENT_ADDR, MMU_CACHE_INHIBIT_NO) << 4;
+}
+
+static void add_cpu(uint32_t apic_id) {
+    struct cpu *boot_cpu = cpu_get_boot();
+    if (apic_id == boot_cpu->arch_id) {
+        return;
+    }
+    if (cpu_add(apic_id) == nullptr) {
+        co_printf("smp: too many CPUs, ignoring CPU with APIC ID %u\n", apic_id);
+    }
+}
+
+/*
+ * Returns false if there's no MADT.
+ */
+static bool find_cpus_from_madt(void) {
+    PHYSPTR rsdp_addr = 0;
+    PHYSPTR ebda = ebda_addr();
+    if (ebda != 0) {
+        rsdp_addr = find_signature(ebda, ebda + 1024, "RSD PTR ", sizeof(struct acpi_rsdp));
+    }
+    if (rsdp_addr == 0) {
+        rsdp_addr = find_signature(BIOS_ROM_START, BIOS_ROM_END, "RSD PTR ", sizeof(struct acpi_rsdp));
+    }
+    if (rsdp_addr == 0) {
+        return false;
+    }
+    struct acpi_rsdp rsdp;
+    pmemcpy_in(&rsdp, rsdp_addr, sizeof(rsdp), MMU_CACHE_INHIBIT_NO);
+    struct acpi_sdt_header rsdt;
+    pmemcpy_in(&rsdt, rsdp.rsdt_addr, sizeof(rsdt), MMU_CACHE_INHIBIT_NO);
+    if ((kstrncmp(rsdt.signature, "RSDT", sizeof(rsdt.signature)) != 0) || (rsdt.length < sizeof(rsdt)) || !is_checksum_valid(rsdp.rsdt_addr, rsdt.length)) {
+        co_printf("smp: bad RSDT at %#lx\n", rsdp.rsdt_addr);
+        return false;
+    }
+    size_t table_count = (rsdt.length - sizeof(rsdt)) / sizeof(uint32_t);
+    for (size_t i = 0; i < table_count; i++) {
+        PHYSPTR table_addr = ppeek32(rsdp.rsdt_addr + sizeof(rsdt) + (i * sizeof(uint32_t)), MMU_CACHE_INHIBIT_NO);
+        struct acpi_madt madt;
+        pmemcpy_in(&madt, table_addr, sizeof(madt), MMU_CACHE_INHIBIT_NO);
+        if ((kstrncmp(madt.header.signature, "APIC", sizeof(madt.header.signature)) != 0) || !is_checksum_valid(table_addr, madt.header.length)) {
+            continue;
+        }
+        s_lapic_base = madt.lapic_addr;
+        PHYSPTR entry_addr = table_addr + sizeof(madt);
+        PHYSPTR table_end = table_addr + madt.header.length;
+        while ((entry_addr + 2) <= table_end) {
+            uint8_t type = ppeek8(entry_addr, MMU_CACHE_INHIBIT_NO);
+            uint8_t length = ppeek8(entry_addr + 1, MMU_CACHE_INHIBIT_NO);
+            if ((length < 2) || (table_end < (entry_addr + length))) {
+                co_printf("smp: bad MADT entry at %#llx\n", entry_addr);
+                break;
+            }
+            if ((type == MADT_ENTRY_TYPE_LAPIC) && (sizeof(struct acpi_madt_lapic) <= length)) {
+                struct acpi_madt_lapic entry;
+                pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+                if (entry.flags & (MADT_LAPIC_FLAG_ENABLED | MADT_LAPIC_FLAG_ONLINE_CAPABLE)) {
+                    add_cpu(entry.apic_id);
+                }
+            } else if ((type == MADT_ENTRY_TYPE_IOAPIC) && (sizeof(struct acpi_madt_ioapic) <= length)) {
+                struct acpi_madt_ioapic entry;
+                pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+                if (s_ioapic_base == 0) {
+                    s_ioapic_base = entry.ioapic_addr;
+                    s_ioapic_gsi_base = entry.gsi_base;
+                }
+            } else if ((type == MADT_ENTRY_TYPE_OVERRIDE) && (sizeof(struct acpi_madt_override) <= length)) {
+                struct acpi_madt_override entry;
+                pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+                set_isa_irq_route(entry.source_irq, entry.gsi, entry.flags);
+            }
+            entry_addr += length;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Returns false if there are no MP tables.
+ */
+static bool find_cpus_from_mp_tables(void) {
+    PHYSPTR fp_addr = 0;
+    PHYSPTR ebda = ebda_addr();
+    if (ebda != 0) {
+        fp_addr = find_signature(ebda, ebda + 1024, "_MP_", sizeof(struct mp_floating_pointer));
+    }
+    if (fp_addr == 0) {
+        fp_addr = find_signature(BASE_MEM_LAST_KB, BASE_MEM_LAST_KB + 1024, "_MP_", sizeof(struct mp_floating_pointer));
+    }
+    if (fp_addr == 0) {
+        fp_addr = find_signature(BIOS_ROM_START, BIOS_ROM_END, "_MP_", sizeof(struct mp_floating_pointer));
+    }
+    if (fp_addr == 0) {
+        return false;
+    }
+    struct mp_floating_pointer fp;
+    pmemcpy_in(&fp, fp_addr, sizeof(fp), MMU_CACHE_INHIBIT_NO);
+    if (fp.features[0] != 0) {
+        /* One of default configurations, and all of them have two CPUs and ISA IRQs wired to same I/O APIC pins. */
+        s_lapic_base = DEFAULT_LAPIC_BASE;
+        s_ioapic_base = DEFAULT_IOAPIC_BASE;
+        add_cpu(0);
+        add_cpu(1);
+        return true;
+    }
+    struct mp_config_header header;
+    pmemcpy_in(&header, fp.config_addr, sizeof(header), MMU_CACHE_INHIBIT_NO);
+    if ((kstrncmp(header.signature, "PCMP", sizeof(header.signature)) != 0) || !is_checksum_valid(fp.config_addr, header.base_table_length)) {
+        co_printf("smp: bad MP configuration table at %#lx\n", fp.config_addr);
+        return false;
+    }
+    s_lapic_base = header.lapic_addr;
+    int isa_bus_id = -1;
+    int ioapic_id = -1;
+    PHYSPTR entry_addr = fp.config_addr + sizeof(header);
+    for (size_t i = 0; i < header.entry_count; i++) {
+        uint8_t type = ppeek8(entry_addr, MMU_CACHE_INHIBIT_NO);
+        if (type == MP_ENTRY_TYPE_PROCESSOR) {
+            struct mp_processor_entry entry;
+            pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+            if (entry.flags & MP_PROCESSOR_FLAG_EN) {
+                add_cpu(entry.lapic_id);
+            }
+            entry_addr += MP_PROCESSOR_ENTRY_SIZE;
+            continue;
+        }
+        if (type == MP_ENTRY_TYPE_BUS) {
+            struct mp_bus_entry entry;
+            pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+            if (kstrncmp(entry.bus_type, "ISA   ", sizeof(entry.bus_type)) == 0) {
+                isa_bus_id = entry.bus_id;
+            }
+        } else if (type == MP_ENTRY_TYPE_IOAPIC) {
+            struct mp_ioapic_entry entry;
+            pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+            if ((entry.flags & MP_IOAPIC_FLAG_EN) && (s_ioapic_base == 0)) {
+                s_ioapic_base = entry.ioapic_addr;
+                ioapic_id = entry.ioapic_id;
+            }
+        } else if (type == MP_ENTRY_TYPE_IOINT) {
+            /* Bus and I/O APIC entries come before these. */
+            struct mp_ioint_entry entry;
+            pmemcpy_in(&entry, entry_addr, sizeof(entry), MMU_CACHE_INHIBIT_NO);
+            if ((entry.int_type == MP_IOINT_TYPE_INT) && (entry.source_bus_id == isa_bus_id) && (entry.dest_ioapic_id == ioapic_id)) {
+                set_isa_irq_route(entry.source_bus_irq, entry.dest_ioapic_intin, entry.flags);
+            }
+        }
+        entry_addr += MP_OTHER_ENTRY_SIZE;
+    }
+    return true;
+}
+
+static uint32_t read_boot_apic_id(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return 0;
+    }
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+void archi586_smp_init(void) {
+    struct cpu *boot_cpu = cpu_get_boot();
+    boot_cpu->arch_id = read_boot_apic_id();
+    archi586_gdt_load_percpu(boot_cpu);
+    for (uint8_t irq = 0; irq < ISA_IRQ_COUNT; irq++) {
+        set_isa_irq_route(irq, irq, 0);
+    }
+
+    char const *source = "ACPI MADT";
+    if (!find_cpus_from_madt()) {
+        source = "MP tables";
+        if (!find_cpus_from_mp_tables()) {
+            source = nullptr;
+        }
+    }
+    if (source == nullptr) {
+        co_printf("smp: no ACPI or MP tables - assuming single CPU\n");
+        return;
+    }
+    if (CONFIG_PRINT_CPUS) {
+        co_printf("smp: found %zu CPUs from %s, local APIC at %#llx, I/O APIC at %#llx\n", cpu_get_count(), source, s_lapic_base, s_ioapic_base);
+        for (size_t i = 0; i < cpu_get_count(); i++) {
+            struct cpu *cpu = cpu_get(i);
+            co_printf("smp: CPU %zu: APIC ID %u%s\n", cpu->index, cpu->arch_id, cpu->online ? " [online]" : "");
+        }
+    }
+}
+
+/*
+ * Where other CPUs come to after the trampoline, with paging set up and interrupts disabled.
+ */
+[[noreturn]] static void ap_main(void *arg) {
+    struct cpu *cpu = arg;
+    archi586_gdt_load();
+    archi586_gdt_reload_selectors(cpu);
+    archi586_gdt_load_percpu(cpu);
+    archi586_idt_load();
+    archi586_lapic_init_ap();
+    archi586_fpu_init_ap();
+    cpu->online = true;
+    /* Mappings may have changed before we were online, as shootdowns only go to online CPUs. */
+    archi586_mmu_flush_tlb_all();
+    sched_start_cpu();
+}
+
+/*
+ * Returns false if the CPU didn't come online.
+ */
+[[nodiscard]] static bool start_cpu(struct cpu *cpu) {
+    struct vmm_object *stack = vmm_alloc_stack(vmm_get_kernel_address_space(), AP_STACK_SIZE, AP_STACK_SIZE);
+    if (stack == nullptr) {
+        co_printf("smp: not enough memory to start CPU %zu\n", cpu->index);
+        return false;
+    }
+    struct archi586_ap_trampoline_params params = {
+        .cr3 = archi586_read_cr3(),
+        .cr4 = archi586_read_cr4(),
+        .esp = (uintptr_t)stack->end,
+        .entry = ap_main,
+        .arg = cpu,
+    };
+    PHYSPTR params_addr = ARCHI586_AP_TRAMPOLINE_ADDR + (archi586_ap_trampoline_params - archi586_ap_trampoline_begin);
+    pmemcpy_out(params_addr, &params, sizeof(params), MMU_CACHE_INHIBIT_NO);
+    if (!archi586_lapic_start_cpu(cpu->arch_id, ARCHI586_AP_TRAMPOLINE_ADDR)) {
+        vmm_free(stack);
+        return false;
+    }
+    TICKTIME deadline = g_ticktime + AP_START_TIMEOUT_TICKS;
+    while (!cpu->online) {
+        if (deadline <= g_ticktime) {
+            /* It may still come up later, so the stack stays. */
+            co_printf("smp: CPU %zu didn't come online\n", cpu->index);
+            return false;
+        }
+        thread_sleep(1);
+    }
+    return true;
+}
+
+void arch_smp_start_cpus(void) {
+    if (cpu_get_count() == 1) {
+        return;
+    }
+    if (archi586_smp_get_lapic_base() == 0) {
+        co_printf("smp: no local APIC - only the boot CPU will be used\n");
+        return;
+    }
+    /* Nothing else lives below 1M, as the kernel doesn't use that memory. */
+    size_t trampoline_size = archi586_ap_trampoline_end - archi586_ap_trampoline_begin;
+    assert(trampoline_size <= ARCH_PAGESIZE);
+    pmemcpy_out(ARCHI586_AP_TRAMPOLINE_ADDR, archi586_ap_trampoline_begin, trampoline_size, MMU_CACHE_INHIBIT_NO);
+    for (size_t i = 1; i < cpu_get_count(); i++) {
+        /*
+         * One at a time, as they share the trampoline parameters. If one didn't show up, it may still read them later,
+         * so we stop there.
+         */
+        if (!start_cpu(cpu_get(i))) {
+            break;
+        }
+    }
+    co_printf("smp: %zu of %zu CPUs are online\n", cpu_get_online_count(), cpu_get_count());
+}
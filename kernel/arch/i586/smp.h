@@ -0,0 +1,32 @@
+#pragma once
+#include <kernel/types.h>
+#include <stdint.h>
+
+struct archi586_isa_irq_route {
+    uint32_t gsi; /* Global system interrupt. I/O APIC pin is this minus GSI base of the I/O APIC. */
+    bool active_low;
+    bool level_triggered;
+};
+
+/*
+ * Finds CPUs and interrupt routing from ACPI MADT, or from MP tables if there's no ACPI, and sets up per-CPU data of
+ * the boot CPU. Other CPUs are only recorded here, and started later by arch_smp_start_cpus().
+ */
+void archi586_smp_init(void);
+/*
+ * Physical address of local APIC registers reported by the firmware, or 0 if there were no tables to look at.
+ */
+PHYSPTR archi586_smp_get_lapic_base(void);
+/*
+ * Physical address of the first I/O APIC, or 0 if there isn't one.
+ */
+PHYSPTR archi586_smp_get_ioapic_base(uint32_t *gsi_base_out);
+/*
+ * ISA IRQs are wired to I/O APIC pins with the same number, unless the firmware says otherwise.
+ */
+void archi586_smp_get_isa_irq_route(struct archi586_isa_irq_route *out, uint8_t irq);
+/*
+ * Flushes TLB of current CPU if other CPUs asked for it. Called by the shootdown IPI, and while spinning, as other CPUs
+ * may be waiting for us while we are waiting for them with interrupts disabled.
+ */
+void archi586_smp_flush_tlb_if_requested(void);
@@ -1,20 +1,73 @@
 #include "asm/contextswitch.h"
+#include "fpu.h"
+#include <errno.h>
+#include <kernel/arch/interrupts.h>
 #include <kernel/arch/stacktrace.h>
 #include <kernel/arch/thread.h>
 #include <kernel/io/co.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/miscmath.h>
 #include <kernel/mem/heap.h>
+#include <kernel/mem/vmm.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/tasks/thread.h>
 #include <stddef.h>
 #include <stdint.h>
 
 static bool const CONFIG_DEBUG_CONTEXT_SWITCH = false;
 
+/* Maximum number of stacks kept around for new threads */
+#define STACK_CACHE_MAX_COUNT 16
+
 struct arch_thread {
     void *saved_esp;
-    uint32_t stack[];
+    size_t stack_size;
+    struct vmm_object *stack_object; /* Has unmapped guard pages below the stack */
+    struct archi586_fpu_state *fpu_state; /* nullptr if the thread didn't enable the FPU */
+    struct arch_thread *next_cached; /* Only used while the stack is in the stack cache */
 };
 
+/*
+ * Stacks of deleted threads are kept here, so that creating a new thread usually doesn't have to allocate one.
+ */
+static struct arch_thread *s_stack_cache;
+static size_t s_stack_cache_count;
+static struct spinlock s_stack_cache_lock;
+
+/*
+ * Returns nullptr if there's no cached stack with given size.
+ */
+static struct arch_thread *take_cached_stack(size_t stacksize) {
+    spinlock_lock(&s_stack_cache_lock);
+    struct arch_thread *result = nullptr;
+    for (struct arch_thread **ptr = &s_stack_cache; *ptr != nullptr; ptr = &(*ptr)->next_cached) {
+        if ((*ptr)->stack_size == stacksize) {
+            result = *ptr;
+            *ptr = result->next_cached;
+            s_stack_cache_count--;
+            break;
+        }
+    }
+    spinlock_unlock(&s_stack_cache_lock);
+    return result;
+}
+
+/*
+ * Returns false if the cache is full.
+ */
+static bool put_cached_stack(struct arch_thread *thread) {
+    spinlock_lock(&s_stack_cache_lock);
+    bool result = false;
+    if (s_stack_cache_count < STACK_CACHE_MAX_COUNT) {
+        thread->next_cached = s_stack_cache;
+        s_stack_cache = thread;
+        s_stack_cache_count++;
+        result = true;
+    }
+    spinlock_unlock(&s_stack_cache_lock);
+    return result;
+}
+
 typedef enum {
     STACK_IDX_EDI,
     STACK_IDX_ESI,
@@ -28,10 +81,7 @@ typedef enum {
 } STACK_IDX;
 
 static void exitcallback(void) {
-    /* tty_printf("thread done - going home\n"); */
-    while (1) {
-        ;
-    }
+    thread_exit(0);
 }
 
 #define STACK_MINSIZE STACK_ITEM_COUNT * sizeof(uint32_t)
@@ -49,15 +99,27 @@ static void exitcallback(void) {
     co_printf("creating thread with %uk stack and entry point %p\n", stacksize / 1024, init_mainfunc);
     struct arch_thread *thread = nullptr;
 
-    if ((SIZE_MAX - sizeof(struct arch_thread)) < stacksize) {
-        goto out;
-    }
-    thread = heap_alloc(sizeof(*thread) + stacksize, 0);
+    thread = take_cached_stack(stacksize);
     if (thread == nullptr) {
-        goto out;
+        thread = heap_alloc(sizeof(*thread), 0);
+        if (thread == nullptr) {
+            goto out;
+        }
+        size_t commit_size = stacksize;
+        if (THREAD_STACK_COMMIT_SIZE < commit_size) {
+            commit_size = THREAD_STACK_COMMIT_SIZE;
+        }
+        thread->stack_object = vmm_alloc_stack(vmm_get_kernel_address_space(), stacksize, commit_size);
+        if (thread->stack_object == nullptr) {
+            heap_free(thread);
+            thread = nullptr;
+            goto out;
+        }
     }
-    size_t stack_top = stacksize / sizeof(uint32_t);
-    uint32_t *esp = &thread->stack[stack_top - STACK_ITEM_COUNT];
+    thread->stack_size = stacksize;
+    thread->fpu_state = nullptr;
+    uint32_t *stack_top = (uint32_t *)((char *)thread->stack_object->end + 1);
+    uint32_t *esp = stack_top - STACK_ITEM_COUNT;
     esp[STACK_IDX_MAIN_RETADDR] = (uintptr_t)exitcallback;
     esp[STACK_IDX_MAIN_ARG0] = (uintptr_t)init_data;
     esp[STACK_IDX_EIP] = (uintptr_t)init_mainfunc;
@@ -72,6 +134,15 @@ out:
 }
 
 void arch_thread_destroy(struct arch_thread *thread) {
+    if (thread == nullptr) {
+        return;
+    }
+    archi586_fpu_state_destroy(thread->fpu_state);
+    thread->fpu_state = nullptr;
+    if (put_cached_stack(thread)) {
+        return;
+    }
+    vmm_free(thread->stack_object);
     heap_free(thread);
 }
 
@@ -89,6 +160,7 @@ void arch_thread_switch(struct arch_thread *from, struct arch_thread *to) {
         co_printf("ebp=%08lx eip=%08lx efl=%08lx\n", ebp, eip, eflags);
     }
     assert(from != nullptr);
+    archi586_fpu_switch(to->fpu_state);
     archi586_context_switch(&from->saved_esp, to->saved_esp);
     if (CONFIG_DEBUG_CONTEXT_SWITCH) {
         co_printf("context switch returned! from=%p(esp=%p), to=%p\n", from, from->saved_esp, to);
@@ -103,3 +175,22 @@ void arch_thread_switch(struct arch_thread *from, struct arch_thread *to) {
         co_printf("ebp=%08lx eip=%08lx efl=%08lx\n", ebp, eip, eflags);
     }
 }
+
+int arch_thread_enable_fpu(struct arch_thread *thread) {
+    if (!archi586_fpu_is_present()) {
+        return -ENOTSUP;
+    }
+    if (thread->fpu_state != nullptr) {
+        return 0;
+    }
+    struct archi586_fpu_state *state = archi586_fpu_state_create();
+    if (state == nullptr) {
+        return -ENOMEM;
+    }
+    bool prev_interrupts = arch_irq_disable();
+    thread->fpu_state = state;
+    /* We are the running thread, so we have to tell the FPU code about it now. */
+    archi586_fpu_switch(state);
+    arch_irq_restore(prev_interrupts);
+    return 0;
+}
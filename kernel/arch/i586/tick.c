@@ -0,0 +1,42 @@
+#include "tick.h"
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/tick.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+
+/* Only the first CPU runs the tick source, but others may read it while it's being changed. */
+static struct archi586_tick_source const *_Atomic s_source;
+
+void archi586_tick_set_source(struct archi586_tick_source const *source) {
+    s_source = source;
+    co_printf("tick: using %s as tick source\n", source->name);
+}
+
+void archi586_tick_advance(TICKTIME ticks) {
+    ASSERT_IRQ_DISABLED();
+    sched_lock();
+    g_ticktime += ticks;
+    timer_tick(g_ticktime);
+    sched_unlock();
+}
+
+TICKTIME arch_tick_get_max_stop_ticks(void) {
+    assert(s_source != nullptr);
+    return s_source->get_max_stop_ticks();
+}
+
+void arch_tick_stop(TICKTIME ticks) {
+    ASSERT_IRQ_DISABLED();
+    assert(s_source != nullptr);
+    s_source->stop(ticks);
+}
+
+void arch_tick_resume(void) {
+    ASSERT_IRQ_DISABLED();
+    assert(s_source != nullptr);
+    s_source->resume();
+}
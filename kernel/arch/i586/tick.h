@@ -0,0 +1,23 @@
+#pragma once
+#include <kernel/ticktime.h>
+
+/*
+ * Timer hardware that drives g_ticktime. See kernel/arch/tick.h for what each operation does.
+ */
+struct archi586_tick_source {
+    char const *name;
+    void (*stop)(TICKTIME ticks);
+    void (*resume)(void);
+    TICKTIME (*get_max_stop_ticks)(void);
+};
+
+/*
+ * Makes `source` the one that arch_tick_*() functions use. The previous source must not be stopped, and it should stop
+ * sending timer interrupts.
+ */
+void archi586_tick_set_source(struct archi586_tick_source const *source);
+/*
+ * Called by the timer interrupt of current source, after `ticks` ticks have passed. Caller still has to send EOI and
+ * call sched_tick() afterwards.
+ */
+void archi586_tick_advance(TICKTIME ticks);
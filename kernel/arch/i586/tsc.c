@@ -1,10 +1,35 @@
+#include "tsc.h"
 #include "asm/i586.h"
+#include "pit.h"
 #include <kernel/arch/tsc.h>
+#include <kernel/io/co.h>
 #include <stdint.h>
 
+static uint64_t s_tsc_hz;
+
+void archi586_tsc_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    archi586_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_FLAG_TSC)) {
+        co_printf("tsc: CPU doesn't have TSC\n");
+        return;
+    }
+    uint64_t hz = archi586_pit_measure_tsc_hz();
+    if (hz == 0) {
+        co_printf("tsc: could not measure TSC frequency\n");
+        return;
+    }
+    s_tsc_hz = hz;
+    co_printf("tsc: %llu kHz\n", hz / 1000);
+}
+
 uint64_t arch_read_tsc(void) {
     uint32_t upper;
     uint32_t lower;
     archi586_rdtsc(&upper, &lower);
     return ((uint64_t)upper << 32) | (uint64_t)lower;
 }
+
+uint64_t arch_tsc_get_frequency(void) {
+    return s_tsc_hz;
+}
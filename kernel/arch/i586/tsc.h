@@ -0,0 +1,6 @@
+#pragma once
+
+/*
+ * Checks if the CPU has TSC, and measures its frequency using the PIT.
+ */
+void archi586_tsc_init(void);
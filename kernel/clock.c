@@ -0,0 +1,53 @@
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/clock.h>
+#include <kernel/io/co.h>
+#include <kernel/ticktime.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+/*
+ * TSC cycles are turned into nanoseconds with (cycles * s_mult) >> MULT_SHIFT, so that reading the clock doesn't need
+ * 64-bit division.
+ */
+#define MULT_SHIFT 24
+
+/*
+ * These are written once before s_mult is published, so readers don't need any lock.
+ */
+static uint64_t s_base_tsc;
+static uint64_t s_base_ns;
+/* 0 if TSC isn't used */
+static _Atomic uint32_t s_mult;
+
+void clock_init(void) {
+    uint64_t hz = arch_tsc_get_frequency();
+    if (hz == 0) {
+        co_printf("clock: no usable TSC, using timer ticks\n");
+        return;
+    }
+    uint64_t mult = (NS_PER_SEC << MULT_SHIFT) / hz;
+    if ((mult == 0) || (UINT32_MAX < mult)) {
+        co_printf("clock: TSC frequency %llu Hz is out of range, using timer ticks\n", hz);
+        return;
+    }
+    bool prev_interrupts = arch_irq_disable();
+    s_base_ns = g_ticktime * CLOCK_NS_PER_TICK;
+    s_base_tsc = arch_read_tsc();
+    atomic_store_explicit(&s_mult, mult, memory_order_release);
+    arch_irq_restore(prev_interrupts);
+}
+
+uint64_t clock_get_ns(void) {
+    uint32_t mult = atomic_load_explicit(&s_mult, memory_order_acquire);
+    if (mult == 0) {
+        return g_ticktime * CLOCK_NS_PER_TICK;
+    }
+    /* Split the delta so that neither multiplication overflows */
+    uint64_t delta = arch_read_tsc() - s_base_tsc;
+    uint64_t hi = delta >> 32;
+    uint64_t lo = delta & 0xffffffffU;
+    return s_base_ns + ((hi * mult) << (32 - MULT_SHIFT)) + ((lo * mult) >> MULT_SHIFT);
+}
@@ -0,0 +1,46 @@
+#include <kernel/cpu.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static struct cpu s_cpus[CPU_MAX_COUNT] = {
+    [0] = {.self = &s_cpus[0], .index = 0, .online = true},
+};
+static size_t s_cpu_count = 1;
+
+struct cpu *cpu_get_boot(void) {
+    return &s_cpus[0];
+}
+
+struct cpu *cpu_get(size_t index) {
+    if (s_cpu_count <= index) {
+        return nullptr;
+    }
+    return &s_cpus[index];
+}
+
+size_t cpu_get_count(void) {
+    return s_cpu_count;
+}
+
+size_t cpu_get_online_count(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < s_cpu_count; i++) {
+        if (s_cpus[i].online) {
+            count++;
+        }
+    }
+    return count;
+}
+
+struct cpu *cpu_add(uint32_t arch_id) {
+    if (s_cpu_count == CPU_MAX_COUNT) {
+        return nullptr;
+    }
+    struct cpu *cpu = &s_cpus[s_cpu_count];
+    cpu->self = cpu;
+    cpu->index = s_cpu_count;
+    cpu->arch_id = arch_id;
+    cpu->online = false;
+    s_cpu_count++;
+    return cpu;
+}
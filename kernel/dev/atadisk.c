@@ -1,37 +1,47 @@
+#include <assert.h>
 #include <errno.h>
+#include <kernel/clock.h>
 #include <kernel/dev/atadisk.h>
 #include <kernel/io/disk.h>
 #include <kernel/io/iodev.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/tasks/thread.h>
 #include <kernel/ticktime.h>
 #include <stdint.h>
 
-#define TIMEOUT 5000
+#define TIMEOUT_NS (5000 * CLOCK_NS_PER_TICK)
 #define MAX_RETRIES 3
 
 [[nodiscard]] static int wait_irq(struct atadisk *disk) {
     enum {
-        STATUS_POLL_PERIOD = 10,
+        /*
+         * Disks normally raise an IRQ on errors too, so this is only for ones that don't. We sleep in between, so
+         * it doesn't cost much.
+         */
+        STATUS_POLL_PERIOD = 100,
     };
     int ret = 0;
-    TICKTIME starttime = g_ticktime;
-    TICKTIME lastchecktime = 0;
+    uint64_t deadline_ns = clock_get_ns() + TIMEOUT_NS;
     bool ok = false;
-    while ((g_ticktime - starttime) < TIMEOUT) {
-        if (STATUS_POLL_PERIOD <= (lastchecktime - g_ticktime)) {
-            uint8_t diskstatus = disk->ops->read_status(disk);
-            if (diskstatus & (ATA_STATUSFLAG_ERR | ATA_STATUSFLAG_DF)) {
-                ret = -EIO;
-                goto out;
-            }
-            lastchecktime = g_ticktime;
+    while (1) {
+        uint64_t now_ns = clock_get_ns();
+        if (deadline_ns <= now_ns) {
+            break;
+        }
+        TICKTIME poll_ticks = ((deadline_ns - now_ns) + (CLOCK_NS_PER_TICK - 1)) / CLOCK_NS_PER_TICK;
+        if (STATUS_POLL_PERIOD < poll_ticks) {
+            poll_ticks = STATUS_POLL_PERIOD;
         }
-        if (disk->ops->get_irq_flag(disk)) {
-            disk->ops->clear_irq_flag(disk);
+        if (disk->ops->wait_irq(disk, g_ticktime + poll_ticks)) {
             ok = true;
             break;
         }
+        uint8_t diskstatus = disk->ops->read_status(disk);
+        if (diskstatus & (ATA_STATUSFLAG_ERR | ATA_STATUSFLAG_DF)) {
+            ret = -EIO;
+            goto out;
+        }
     }
     if (!ok) {
         ret = -EIO;
@@ -43,9 +53,9 @@ out:
 
 [[nodiscard]] static int wait_busy_clear(struct atadisk *disk) {
     int ret = 0;
-    TICKTIME starttime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     bool ok = false;
-    while ((g_ticktime - starttime) < TIMEOUT) {
+    while ((clock_get_ns() - start_ns) < TIMEOUT_NS) {
         uint8_t diskstatus = disk->ops->read_status(disk);
         if (!(diskstatus & ATA_STATUSFLAG_BSY)) {
             ok = true;
@@ -55,6 +65,7 @@ out:
             ret = -EIO;
             goto out;
         }
+        thread_poll_backoff(start_ns);
     }
     if (!ok) {
         ret = -EIO;
@@ -83,9 +94,9 @@ out:
 
 [[nodiscard]] static int wait_drq_set(struct atadisk *disk) {
     int ret = 0;
-    TICKTIME starttime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     bool ok = false;
-    while ((g_ticktime - starttime) < TIMEOUT) {
+    while ((clock_get_ns() - start_ns) < TIMEOUT_NS) {
         uint8_t diskstatus = disk->ops->read_status(disk);
         if (diskstatus & (ATA_STATUSFLAG_ERR | ATA_STATUSFLAG_DF)) {
             ret = -EIO;
@@ -95,6 +106,7 @@ out:
             ok = true;
             break;
         }
+        thread_poll_backoff(start_ns);
     }
     if (!ok) {
         ret = -EIO;
@@ -116,8 +128,16 @@ struct identify_result {
     uint8_t serial[41];
     uint8_t firmware[9];
     uint8_t modelnum[41];
+    uint64_t sector_count;
+    bool lba48_supported;
 };
 
+/* ACS-3 7.12.7 IDENTIFY DEVICE data */
+#define IDENTIFY_WORD_LBA28_SECTOR_COUNT 60   /* 2 words */
+#define IDENTIFY_WORD_COMMAND_SET_SUPPORTED 83
+#define IDENTIFY_WORD_LBA48_SECTOR_COUNT 100  /* 4 words */
+#define IDENTIFY_COMMAND_SET_FLAG_LBA48 (1U << 10)
+
 [[nodiscard]] static int identify_device(struct identify_result *out, struct atadisk *disk) {
     int ret = 0;
     disk->ops->select_disk(disk);
@@ -138,9 +158,9 @@ struct identify_result {
      * Wait for DRQ. waitdrqset() isn't used, because we also check LBA outputs
      * while waiting.
      */
-    TICKTIME starttime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     bool ok = false;
-    while ((g_ticktime - starttime) < TIMEOUT) {
+    while ((clock_get_ns() - start_ns) < TIMEOUT_NS) {
         uint32_t lba = disk->ops->get_lba_output(disk);
         if ((lba & 0xffff00U) != 0) {
             /* Not an ATA device */
@@ -156,6 +176,7 @@ struct identify_result {
             ok = true;
             break;
         }
+        thread_poll_backoff(start_ns);
     }
     if (!ok) {
         ret = -EIO;
@@ -167,16 +188,49 @@ struct identify_result {
     extract_string_from_identify_data(out->serial, &buffer, 10, 19);
     extract_string_from_identify_data(out->firmware, &buffer, 23, 26);
     extract_string_from_identify_data(out->modelnum, &buffer, 27, 46);
+    out->lba48_supported = buffer.data[IDENTIFY_WORD_COMMAND_SET_SUPPORTED] & IDENTIFY_COMMAND_SET_FLAG_LBA48;
+    if (out->lba48_supported) {
+        for (size_t i = 0; i < 4; i++) {
+            out->sector_count |= (uint64_t)buffer.data[IDENTIFY_WORD_LBA48_SECTOR_COUNT + i] << (i * 16);
+        }
+    } else {
+        out->sector_count = ((uint32_t)buffer.data[IDENTIFY_WORD_LBA28_SECTOR_COUNT + 1] << 16) | buffer.data[IDENTIFY_WORD_LBA28_SECTOR_COUNT];
+    }
     goto out;
 out:
     return ret;
 }
 
+static size_t max_sectors_per_transfer(struct atadisk const *disk) {
+    if (disk->lba48_supported) {
+        return ATA_MAX_SECTORS_PER_TRANSFER_LBA48;
+    }
+    return ATA_MAX_SECTORS_PER_TRANSFER;
+}
+
+/*
+ * Sets up parameters for READ/WRITE commands. 48-bit(EXT) commands are used if the disk supports them.
+ */
+static void set_transfer_params(struct atadisk *disk, DISK_BLOCK_ADDR lba, size_t sector_count) {
+    assert(sector_count <= max_sectors_per_transfer(disk));
+    disk->ops->select_disk(disk);
+    disk->ops->set_features_param(disk, 0);
+    /* Maximum sector count is written as 0. */
+    if (disk->lba48_supported) {
+        disk->ops->set_count48_param(disk, sector_count & 0xffffU);
+        disk->ops->set_lba48_param(disk, lba);
+    } else {
+        disk->ops->set_count_param(disk, sector_count & 0xffU);
+        disk->ops->set_lba_param(disk, lba);
+    }
+}
+
 [[nodiscard]] static int flush_cache(struct atadisk *disk) {
     int ret = 0;
     disk->ops->select_disk(disk);
-    disk->ops->issue_command(disk, ATA_CMD_FLUSH_CACHE);
-    ret = wait_busy_clear(disk);
+    disk->ops->issue_command(disk, disk->lba48_supported ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    /* Wait for the IRQ as well, so that it isn't mistaken as completion of the next command. */
+    ret = wait_busy_clear_irq(disk);
     if (ret < 0) {
         goto out;
     }
@@ -190,7 +244,7 @@ static int try_write_dma(bool *is_crc_error_out, struct atadisk *disk) {
     bool is_crc_error = false;
     bool dma_running = false;
 
-    disk->ops->issue_command(disk, ATA_CMD_WRITE_DMA);
+    disk->ops->issue_command(disk, disk->lba48_supported ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
     ret = disk->ops->dma_begin_transfer(disk);
     if (ret < 0) {
         iodev_printf(&disk->physdisk.iodev, "failed to start DMA transfer\n");
@@ -233,7 +287,7 @@ out:
 
 static int try_write_pio(struct atadisk *disk, uint8_t const *srcbuf, size_t sector_count) {
     int ret = 0;
-    disk->ops->issue_command(disk, ATA_CMD_WRITE_SECTORS);
+    disk->ops->issue_command(disk, disk->lba48_supported ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS);
     for (size_t sector = 0; sector < sector_count; sector++) {
         struct ata_data_buf buffer;
         ret = wait_busy_clear(disk);
@@ -258,25 +312,25 @@ out:
     return ret;
 }
 
-static int try_write(bool *is_crc_error_out, struct atadisk *disk, uint8_t const *srcbuf, bool can_dma, uint32_t lba, size_t sector_count) {
+/*
+ * DMA controller may not be able to do all sectors at once, so `sector_count_inout` is updated to what was written.
+ */
+static int try_write(bool *is_crc_error_out, struct atadisk *disk, uint8_t const *srcbuf, bool can_dma, DISK_BLOCK_ADDR lba, size_t *sector_count_inout) {
     int ret;
     bool dma_initialized = false;
+    size_t sector_count = *sector_count_inout;
     if (can_dma) {
-        ret = disk->ops->dma_init_transfer(disk, (uint8_t *)srcbuf, sector_count * ATA_SECTOR_SIZE, false);
+        size_t len = sector_count * ATA_SECTOR_SIZE;
+        ret = disk->ops->dma_init_transfer(disk, (uint8_t *)srcbuf, &len, false);
         if (ret < 0) {
             iodev_printf(&disk->physdisk.iodev, "failed to initialize DMA transfer\n");
             goto out;
         }
         dma_initialized = true;
+        sector_count = len / ATA_SECTOR_SIZE;
+        *sector_count_inout = sector_count;
     }
-    disk->ops->select_disk(disk);
-    disk->ops->set_features_param(disk, 0);
-    if (sector_count == ATA_MAX_SECTORS_PER_TRANSFER) {
-        disk->ops->set_count_param(disk, 0);
-    } else {
-        disk->ops->set_count_param(disk, sector_count);
-    }
-    disk->ops->set_lba_param(disk, lba);
+    set_transfer_params(disk, lba, sector_count);
     if (can_dma) {
         ret = try_write_dma(is_crc_error_out, disk);
     } else {
@@ -290,11 +344,6 @@ static int try_write(bool *is_crc_error_out, struct atadisk *disk, uint8_t const
         iodev_printf(&disk->physdisk.iodev, "failed to wait for write to finish\n");
         goto out;
     }
-    ret = flush_cache(disk);
-    if (ret < 0) {
-        iodev_printf(&disk->physdisk.iodev, "disk flush failed after writing\n");
-        goto out;
-    }
 out:
     if (dma_initialized) {
         disk->ops->dma_deinit_transfer(disk);
@@ -302,22 +351,22 @@ out:
     return ret;
 }
 
-[[nodiscard]] static int write_sectors(struct atadisk *disk, uint32_t lba, size_t sector_count, void const *buf) {
+[[nodiscard]] static int write_sectors(struct atadisk *disk, DISK_BLOCK_ADDR lba, size_t sector_count, void const *buf) {
     int ret = 0;
     disk->ops->lock(disk);
     bool can_dma = disk->ops->dma_begin_session(disk);
     size_t remaining_sector_count = sector_count;
-    uint32_t current_lba = lba;
+    DISK_BLOCK_ADDR current_lba = lba;
     uint8_t const *srcbuf = buf;
 
     while (remaining_sector_count > 0) {
         for (int try = 0;; try++) {
             bool is_crc_error = false;
             size_t current_sector_count = remaining_sector_count;
-            if (ATA_MAX_SECTORS_PER_TRANSFER < remaining_sector_count) {
-                current_sector_count = ATA_MAX_SECTORS_PER_TRANSFER;
+            if (max_sectors_per_transfer(disk) < remaining_sector_count) {
+                current_sector_count = max_sectors_per_transfer(disk);
             }
-            ret = try_write(&is_crc_error, disk, srcbuf, can_dma, current_lba, current_sector_count);
+            ret = try_write(&is_crc_error, disk, srcbuf, can_dma, current_lba, &current_sector_count);
             if (ret < 0) {
                 goto tryfailed;
             }
@@ -351,7 +400,7 @@ static int try_read_dma(bool *is_crc_error_out, struct atadisk *disk) {
     bool dma_running = false;
     bool is_crc_error = false;
 
-    disk->ops->issue_command(disk, ATA_CMD_READ_DMA);
+    disk->ops->issue_command(disk, disk->lba48_supported ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
     ret = disk->ops->dma_begin_transfer(disk);
     if (ret < 0) {
         iodev_printf(&disk->physdisk.iodev, "failed to start DMA transfer\n");
@@ -394,7 +443,7 @@ tryfailed:
 
 static int try_read_pio(struct atadisk *disk, uint8_t *destbuf, size_t sector_count) {
     int ret = 0;
-    disk->ops->issue_command(disk, ATA_CMD_READ_SECTORS);
+    disk->ops->issue_command(disk, disk->lba48_supported ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS);
     for (size_t sector = 0; sector < sector_count; sector++) {
         struct ata_data_buf buffer;
         ret = wait_busy_clear_irq(disk);
@@ -415,28 +464,28 @@ out:
     return ret;
 }
 
-[[nodiscard]] static int try_read(bool *is_crc_error_out, struct atadisk *disk, uint8_t *destbuf, bool can_dma, uint32_t lba, size_t sector_count) {
+/*
+ * DMA controller may not be able to do all sectors at once, so `sector_count_inout` is updated to what was read.
+ */
+[[nodiscard]] static int try_read(bool *is_crc_error_out, struct atadisk *disk, uint8_t *destbuf, bool can_dma, DISK_BLOCK_ADDR lba, size_t *sector_count_inout) {
     int ret = 0;
     bool is_crc_error = false;
     bool dma_initialized = false;
+    size_t sector_count = *sector_count_inout;
     if (can_dma) {
-        ret = disk->ops->dma_init_transfer(disk, destbuf, sector_count * ATA_SECTOR_SIZE, true);
+        size_t len = sector_count * ATA_SECTOR_SIZE;
+        ret = disk->ops->dma_init_transfer(disk, destbuf, &len, true);
         if (ret < 0) {
             iodev_printf(&disk->physdisk.iodev, "failed to initialize DMA transfer\n");
             goto tryfailed;
         }
         dma_initialized = true;
+        sector_count = len / ATA_SECTOR_SIZE;
+        *sector_count_inout = sector_count;
     }
-    disk->ops->select_disk(disk);
-    disk->ops->set_features_param(disk, 0);
-    if (sector_count == ATA_MAX_SECTORS_PER_TRANSFER) {
-        disk->ops->set_count_param(disk, 0);
-    } else {
-        disk->ops->set_count_param(disk, sector_count);
-    }
-    disk->ops->set_lba_param(disk, lba);
+    set_transfer_params(disk, lba, sector_count);
     if (can_dma) {
-        ret = try_read_dma(is_crc_error_out, disk);
+        ret = try_read_dma(&is_crc_error, disk);
     } else {
         ret = try_read_pio(disk, destbuf, sector_count);
     }
@@ -448,22 +497,22 @@ tryfailed:
     return ret;
 }
 
-[[nodiscard]] static int read_sectors(struct atadisk *disk, uint32_t lba, size_t sector_count, void *buf) {
+[[nodiscard]] static int read_sectors(struct atadisk *disk, DISK_BLOCK_ADDR lba, size_t sector_count, void *buf) {
     int ret = 0;
     disk->ops->lock(disk);
     bool can_dma = disk->ops->dma_begin_session(disk);
     size_t remaining_sector_count = sector_count;
-    uint32_t current_lba = lba;
+    DISK_BLOCK_ADDR current_lba = lba;
     uint8_t *destbuf = buf;
 
     while (remaining_sector_count > 0) {
         for (int try = 0;; try++) {
             bool is_crc_error = false;
             size_t current_sector_count = remaining_sector_count;
-            if (ATA_MAX_SECTORS_PER_TRANSFER < remaining_sector_count) {
-                current_sector_count = ATA_MAX_SECTORS_PER_TRANSFER;
+            if (max_sectors_per_transfer(disk) < remaining_sector_count) {
+                current_sector_count = max_sectors_per_transfer(disk);
             }
-            ret = try_read(&is_crc_error, disk, destbuf, can_dma, current_lba, current_sector_count);
+            ret = try_read(&is_crc_error, disk, destbuf, can_dma, current_lba, &current_sector_count);
             if (ret < 0) {
                 goto tryfailed;
             }
@@ -492,19 +541,41 @@ out:
     return ret;
 }
 
-[[nodiscard]] static int op_read(struct pdisk *self, void *buf, size_t block_addr, size_t block_count) {
+static bool is_valid_range(struct atadisk const *disk, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    return (block_addr <= disk->sector_count) && (block_count <= (disk->sector_count - block_addr));
+}
+
+[[nodiscard]] static int op_read(struct pdisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
     struct atadisk *disk = self->data;
+    if (!is_valid_range(disk, block_addr, block_count)) {
+        return -EINVAL;
+    }
     return read_sectors(disk, block_addr, block_count, buf);
 }
 
-[[nodiscard]] static int op_write(struct pdisk *self, void const *buf, size_t block_addr, size_t block_count) {
+[[nodiscard]] static int op_write(struct pdisk *self, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
     struct atadisk *disk = self->data;
+    if (!is_valid_range(disk, block_addr, block_count)) {
+        return -EINVAL;
+    }
     return write_sectors(disk, block_addr, block_count, buf);
 }
 
+[[nodiscard]] static int op_flush(struct pdisk *self) {
+    struct atadisk *disk = self->data;
+    disk->ops->lock(disk);
+    int ret = flush_cache(disk);
+    if (ret < 0) {
+        iodev_printf(&disk->physdisk.iodev, "disk flush failed (error %d)\n", ret);
+    }
+    disk->ops->unlock(disk);
+    return ret;
+}
+
 static struct pdisk_ops const OPS = {
     .read = op_read,
     .write = op_write,
+    .flush = op_flush,
 };
 
 [[nodiscard]] int atadisk_register(struct atadisk *disk_out, struct atadisk_ops const *ops, void *data) {
@@ -517,6 +588,8 @@ static struct pdisk_ops const OPS = {
     if (ret < 0) {
         goto fail;
     }
+    disk_out->sector_count = result.sector_count;
+    disk_out->lba48_supported = result.lba48_supported;
     ret = pdisk_register(&disk_out->physdisk, ATA_SECTOR_SIZE, &OPS, disk_out);
     if (ret < 0) {
         goto fail;
@@ -524,6 +597,7 @@ static struct pdisk_ops const OPS = {
     iodev_printf(&disk_out->physdisk.iodev, "   model: %s\n", result.modelnum);
     iodev_printf(&disk_out->physdisk.iodev, "firmware: %s\n", result.firmware);
     iodev_printf(&disk_out->physdisk.iodev, "  serial: %s\n", result.serial);
+    iodev_printf(&disk_out->physdisk.iodev, "    size: %llu MiB (%s LBA)\n", result.sector_count / ((1024 * 1024) / ATA_SECTOR_SIZE), result.lba48_supported ? "48-bit" : "28-bit");
     goto out;
 fail:
 out:
@@ -1,6 +1,5 @@
 #include <assert.h>
 #include <errno.h>
-#include <kernel/arch/interrupts.h>
 #include <kernel/arch/iodelay.h>
 #include <kernel/dev/ps2.h>
 #include <kernel/dev/ps2kbd.h>
@@ -11,6 +10,7 @@
 #include <kernel/lib/list.h>
 #include <kernel/lib/queue.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/tasks/irqwork.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -21,7 +21,7 @@ static struct list s_ports;
     struct ps2port *port = self->data;
     size_t writtensize = 0;
     /**************************************************************************/
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&port->queue_lock);
     arch_iodelay();
     for (size_t idx = 0; idx < size; idx++) {
         bool ok = QUEUE_DEQUEUE(&((uint8_t *)buf)[idx], &port->recvqueue);
@@ -30,7 +30,7 @@ static struct list s_ports;
         }
         writtensize++;
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&port->queue_lock);
     /**************************************************************************/
     return (ssize_t)writtensize;
 }
@@ -208,12 +208,45 @@ out:
     return ret;
 }
 
+static void process_byte(struct ps2port *port, uint8_t byte) {
+    if (port->ops == nullptr) {
+        spinlock_lock(&port->queue_lock);
+        int ret = QUEUE_ENQUEUE(&port->recvqueue, &byte);
+        spinlock_unlock(&port->queue_lock);
+        if (ret < 0) {
+            iodev_printf(&port->device, "failed to enqueue data from the device (error %d)\n", ret);
+        }
+    } else {
+        int ret = port->ops->byte_received(port, byte);
+        if (ret < 0) {
+            iodev_printf(&port->device, "error occured while processing received data from the device (error %d)\n", ret);
+        }
+    }
+}
+
+static void process_received_bytes(void *data) {
+    struct ps2port *port = data;
+    while (1) {
+        uint8_t byte;
+        spinlock_lock(&port->queue_lock);
+        bool ok = QUEUE_DEQUEUE(&byte, &port->irqqueue);
+        spinlock_unlock(&port->queue_lock);
+        if (!ok) {
+            break;
+        }
+        process_byte(port, byte);
+    }
+}
+
 [[nodiscard]] int ps2port_register(struct ps2port *port_out, struct stream_ops const *ops, void *data) {
     port_out->ops = nullptr;
     port_out->stream.ops = ops;
     port_out->stream.data = data;
     assert(port_out->stream.ops->read == ps2port_stream_op_read);
     QUEUE_INIT_FOR_ARRAY(&port_out->recvqueue, port_out->recv_queue_buf);
+    QUEUE_INIT_FOR_ARRAY(&port_out->irqqueue, port_out->irq_queue_buf);
+    port_out->queue_lock = (struct spinlock){0};
+    irqwork_init(&port_out->irqwork, process_received_bytes, port_out);
     list_insert_back(&s_ports, &port_out->node, port_out);
     return iodev_register(&port_out->device, IODEV_TYPE_PS2PORT, port_out);
 }
@@ -230,15 +263,13 @@ void ps2_init_devices(void) {
 }
 
 void ps2port_received_byte(struct ps2port *port, uint8_t byte) {
-    if (port->ops == nullptr) {
-        int ret = QUEUE_ENQUEUE(&port->recvqueue, &byte);
-        if (ret < 0) {
-            iodev_printf(&port->device, "failed to enqueue data from the device (error %d)\n", ret);
-        }
-    } else {
-        int ret = port->ops->byte_received(port, byte);
-        if (ret < 0) {
-            iodev_printf(&port->device, "error occured while processing received data from the device (error %d)\n", ret);
-        }
+    ASSERT_IRQ_DISABLED();
+    spinlock_lock(&port->queue_lock);
+    int ret = QUEUE_ENQUEUE(&port->irqqueue, &byte);
+    spinlock_unlock(&port->queue_lock);
+    if (ret < 0) {
+        iodev_printf(&port->device, "dropped byte %#x from the device (error %d)\n", byte, ret);
+        return;
     }
+    irqwork_schedule(&port->irqwork);
 }
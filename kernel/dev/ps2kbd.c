@@ -1,6 +1,5 @@
 #include <assert.h>
 #include <errno.h>
-#include <kernel/arch/interrupts.h>
 #include <kernel/dev/ps2.h>
 #include <kernel/dev/ps2kbd.h>
 #include <kernel/io/iodev.h>
@@ -10,6 +9,7 @@
 #include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/heap.h>
+#include <kernel/tasks/spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -62,26 +62,34 @@ struct kbdcontext {
     INPUTSTATE state;
     struct ps2port *port;
     struct list cmd_queue;
+    struct spinlock cmd_queue_lock;
     uint8_t flags, keybytes[8], next_key_byte_index;
 };
 
 static void cmd_finished(struct ps2port *port, CMDSTATE finalstate) {
     struct kbdcontext *ctx = port->device_data;
     assert(ctx);
+    /* Bytes are processed by the IRQ work thread, so request_cmd() may add commands in the meantime. */
+    spinlock_lock(&ctx->cmd_queue_lock);
     struct list_node *cmd_node = list_remove_back(&ctx->cmd_queue);
     assert(cmd_node);
     struct cmd_context *cmd = cmd_node->data;
+    /* Synchronous commands may be freed by the waiting thread as soon as the state is set. */
+    bool async = cmd->async;
     cmd->state = finalstate;
-    if (cmd->async) {
+    struct list_node *next_cmd_node = ctx->cmd_queue.back;
+    if (next_cmd_node != nullptr) {
+        ((struct cmd_context *)next_cmd_node->data)->state = CMDSTATE_WAITINGRESPONSE;
+    }
+    spinlock_unlock(&ctx->cmd_queue_lock);
+    if (async) {
         heap_free(cmd);
     }
     /* Send reset command *****************************************************/
-    cmd_node = ctx->cmd_queue.back;
-    if (!cmd_node) {
+    if (next_cmd_node == nullptr) {
         return;
     }
-    cmd = cmd_node->data;
-    cmd->state = CMDSTATE_WAITINGRESPONSE;
+    cmd = next_cmd_node->data;
     if (CONFIG_COMMDEBUG) {
         iodev_printf(&ctx->device.iodev, "sending command %#x from queue\n", cmd->cmdbyte);
     }
@@ -616,27 +624,24 @@ out:
     cmd->resendcount = MAX_RESEND_COUNT;
     cmd->noretry = noretry;
     cmd->async = async;
-    bool isqueueempty = ctx->cmd_queue.front == nullptr;
-    cmd->state = CMDSTATE_QUEUED;
     if (result_out) {
         cmd->needdata = true;
         *result_out = 0;
     }
-    if (isqueueempty) {
-        cmd->state = CMDSTATE_WAITINGRESPONSE;
-        if (CONFIG_COMMDEBUG) {
+    /**************************************************************************/
+    spinlock_lock(&ctx->cmd_queue_lock);
+    bool isqueueempty = ctx->cmd_queue.front == nullptr;
+    cmd->state = isqueueempty ? CMDSTATE_WAITINGRESPONSE : CMDSTATE_QUEUED;
+    list_insert_front(&ctx->cmd_queue, &cmd->node, cmd);
+    spinlock_unlock(&ctx->cmd_queue_lock);
+    /**************************************************************************/
+    if (CONFIG_COMMDEBUG) {
+        if (isqueueempty) {
             iodev_printf(&ctx->device.iodev, "executing command %#x\n", cmd->cmdbyte);
-        }
-    } else {
-        if (CONFIG_COMMDEBUG) {
+        } else {
             iodev_printf(&ctx->device.iodev, "adding command %#x to Queue\n", cmd->cmdbyte);
         }
     }
-    /**************************************************************************/
-    bool prev_interrupts = arch_irq_disable();
-    list_insert_front(&ctx->cmd_queue, &cmd->node, cmd);
-    arch_irq_restore(prev_interrupts);
-    /**************************************************************************/
     if (isqueueempty) {
         ret = stream_put_char(&port->stream, cmdbyte);
         if (ret < 0) {
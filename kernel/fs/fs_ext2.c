@@ -159,7 +159,7 @@ struct ino_context {
     int ret = 0;
     /* TODO: support cases where self->blocksize < self->disk->physdisk->blocksize */
     assert((self->blocksize % self->disk->physdisk->block_size) == 0);
-    DISK_BLOCK_ADDR diskblockaddr = block_addr * (self->blocksize / self->disk->physdisk->block_size);
+    DISK_BLOCK_ADDR diskblockaddr = (DISK_BLOCK_ADDR)block_addr * (self->blocksize / self->disk->physdisk->block_size);
     blkcnt_t diskblkcount = blkcount * (self->blocksize / self->disk->physdisk->block_size);
     ret = (ldisk_read_exact(self->disk, buf, diskblockaddr, diskblkcount));
     if (ret < 0) {
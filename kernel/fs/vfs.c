@@ -129,6 +129,7 @@ out:
     list_insert_back(&s_mounts, &context->node, context);
     context->mount_path = newmountpath;
     context->fstype = fstype;
+    context->disk = disk;
     goto out;
 fail:
     heap_free(newmountpath);
@@ -201,6 +202,24 @@ out:
     return ret;
 }
 
+[[nodiscard]] static int sync_fs(struct vfs_fscontext *fscontext) {
+    int ret = 0;
+    if (fscontext->fstype->ops->sync != nullptr) {
+        ret = fscontext->fstype->ops->sync(fscontext);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (fscontext->disk != nullptr) {
+        ret = ldisk_flush(fscontext->disk);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+out:
+    return ret;
+}
+
 [[nodiscard]] int vfs_umount(char const *mountpath) {
     int ret = 0;
     struct vfs_fscontext *fscontext;
@@ -209,6 +228,10 @@ out:
         goto out;
     }
     char *contextmountpath = fscontext->mount_path;
+    ret = sync_fs(fscontext);
+    if (ret < 0) {
+        goto out;
+    }
     ret = fscontext->fstype->ops->umount(fscontext);
     if (ret < 0) {
         goto out;
@@ -218,6 +241,19 @@ out:
     return ret;
 }
 
+[[nodiscard]] int vfs_sync(void) {
+    int result = 0;
+    LIST_FOREACH(&s_mounts, mountnode) {
+        struct vfs_fscontext *fscontext = mountnode->data;
+        int ret = sync_fs(fscontext);
+        if (ret < 0) {
+            co_printf("vfs: failed to sync %s (error %d)\n", fscontext->mount_path, ret);
+            result = ret;
+        }
+    }
+    return result;
+}
+
 void vfs_register_fstype(struct vfs_fstype *out, char const *name, struct vfs_fstype_ops const *ops) {
     vmemset(out, 0, sizeof(*out));
     out->name = name;
@@ -0,0 +1,553 @@
+#include <assert.h>
+#include <errno.h>
+#include <kernel/io/bcache.h>
+#include <kernel/io/co.h>
+#include <kernel/io/disk.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/heap.h>
+#include <kernel/panic.h>
+#include <kernel/tasks/condvar.h>
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************** Configuration *******************************/
+
+/*
+ * Initial memory budget of the cache, in bytes.
+ */
+static size_t const CONFIG_DEFAULT_MAX_SIZE = 4 * 1024 * 1024;
+
+/*
+ * How often the writeback thread writes dirty blocks, in ticks.
+ */
+static TICKTIME const CONFIG_WRITEBACK_INTERVAL = 5000;
+
+/******************************************************************************/
+
+#define HASH_BITS 10
+#define HASH_BUCKET_COUNT (1U << HASH_BITS)
+
+enum entry_state {
+    ENTRY_STATE_IDLE,
+    ENTRY_STATE_READING, /* Being read from the disk, and the data isn't valid yet. */
+    ENTRY_STATE_WRITING, /* Being written to the disk. The data is valid, but it must not change. */
+};
+
+struct bcache_entry {
+    struct list_node hash_node;
+    struct list_node lru_node;
+    struct list_node dirty_node;
+    struct pdisk *disk;
+    DISK_BLOCK_ADDR block_addr;
+    uint64_t dirty_since; /* Value of s_dirty_seq when it became dirty */
+    enum entry_state state;
+    bool dirty;
+    uint8_t data[];
+};
+
+/*
+ * Blocks that are being written to the disk without going through the cache. Entries for those can't be created until
+ * the write is done, or they could end up with data that the write is about to overwrite.
+ */
+struct uncached_write {
+    struct list_node node;
+    struct pdisk *disk;
+    DISK_BLOCK_ADDR block_addr;
+    size_t block_count;
+};
+
+static struct list s_buckets[HASH_BUCKET_COUNT];
+/* Front is the most recently used one */
+static struct list s_lru;
+/* Dirty entries, in the order they became dirty */
+static struct list s_dirty;
+static struct list s_uncached_writes;
+static uint64_t s_dirty_seq;
+static struct bcache_stats s_stats = {.max_size = CONFIG_DEFAULT_MAX_SIZE};
+/*
+ * s_lock is never held during disk I/O, so that cache hits don't have to wait for someone else's I/O. Entries under
+ * I/O are marked with their state instead, and s_io_done is broadcast whenever I/O finishes.
+ */
+static struct mutex s_lock;
+static struct condvar s_io_done;
+
+static size_t hash_of(struct pdisk const *disk, DISK_BLOCK_ADDR block_addr) {
+    uint64_t key = (uint64_t)block_addr ^ (uint64_t)((uintptr_t)disk >> 4);
+    uint32_t folded = (uint32_t)key ^ (uint32_t)(key >> 32);
+    /* Fibonacci hashing */
+    return (folded * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Memory taken by an entry, which is what counts against the budget */
+static size_t entry_footprint(struct pdisk const *disk) {
+    return heap_get_footprint(sizeof(struct bcache_entry) + disk->block_size);
+}
+
+static struct bcache_entry *find_entry(struct pdisk *disk, DISK_BLOCK_ADDR block_addr) {
+    assert(s_lock.locked);
+    LIST_FOREACH(&s_buckets[hash_of(disk, block_addr)], node) {
+        struct bcache_entry *entry = node->data;
+        if ((entry->disk == disk) && (entry->block_addr == block_addr)) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+static bool overlaps_uncached_write(struct pdisk *disk, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    LIST_FOREACH(&s_uncached_writes, node) {
+        struct uncached_write *write = node->data;
+        if ((write->disk == disk) && (write->block_addr < (block_addr + block_count)) && (block_addr < (write->block_addr + write->block_count))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Waits until someone finishes disk I/O. s_lock is released while waiting, so look up entries again after this.
+ */
+static void wait_for_io(void) {
+    condvar_wait(&s_io_done, &s_lock);
+}
+
+static void touch_entry(struct bcache_entry *entry) {
+    list_remove_node(&s_lru, &entry->lru_node);
+    list_insert_front(&s_lru, &entry->lru_node, entry);
+}
+
+static void set_dirty(struct bcache_entry *entry, bool dirty) {
+    if (entry->dirty == dirty) {
+        return;
+    }
+    entry->dirty = dirty;
+    if (dirty) {
+        entry->dirty_since = ++s_dirty_seq;
+        list_insert_back(&s_dirty, &entry->dirty_node, entry);
+        s_stats.dirty_count++;
+    } else {
+        list_remove_node(&s_dirty, &entry->dirty_node);
+        s_stats.dirty_count--;
+    }
+}
+
+/*
+ * s_lock is released during the write, but the entry stays in the cache and doesn't change until it returns. If it
+ * fails, the entry stays dirty, and it goes to the back of the dirty list.
+ */
+[[nodiscard]] static int write_back_entry(struct bcache_entry *entry) {
+    assert(entry->state == ENTRY_STATE_IDLE);
+    assert(entry->dirty);
+    entry->state = ENTRY_STATE_WRITING;
+    mutex_unlock(&s_lock);
+    int ret = entry->disk->ops->write(entry->disk, entry->data, entry->block_addr, 1);
+    MUTEX_LOCK(&s_lock);
+    entry->state = ENTRY_STATE_IDLE;
+    condvar_broadcast(&s_io_done);
+    set_dirty(entry, false);
+    if (ret < 0) {
+        set_dirty(entry, true);
+        return ret;
+    }
+    s_stats.writebacks++;
+    return 0;
+}
+
+static void remove_entry(struct bcache_entry *entry) {
+    assert(entry->state == ENTRY_STATE_IDLE);
+    assert(!entry->dirty);
+    list_remove_node(&s_buckets[hash_of(entry->disk, entry->block_addr)], &entry->hash_node);
+    list_remove_node(&s_lru, &entry->lru_node);
+    s_stats.cached_size -= entry_footprint(entry->disk);
+    heap_free(entry);
+}
+
+/*
+ * Evicts least recently used blocks until `needed_size` more bytes fit in the budget, and returns whether they fit.
+ * Blocks under I/O are skipped, but it stops at a dirty block and returns it through `dirty_out`, so that the caller
+ * can write it back first. (nullptr if it didn't stop at one)
+ */
+static bool evict_entries(size_t needed_size, struct bcache_entry **dirty_out) {
+    *dirty_out = nullptr;
+    struct list_node *node = s_lru.back;
+    while ((node != nullptr) && (s_stats.max_size < (s_stats.cached_size + needed_size))) {
+        struct list_node *prev = node->prev;
+        struct bcache_entry *entry = node->data;
+        if (entry->state == ENTRY_STATE_IDLE) {
+            if (entry->dirty) {
+                *dirty_out = entry;
+                return false;
+            }
+            remove_entry(entry);
+            s_stats.evictions++;
+        }
+        node = prev;
+    }
+    return (s_stats.cached_size + needed_size) <= s_stats.max_size;
+}
+
+/*
+ * Same as evict_entries(), but writes back dirty blocks on the way. s_lock is released during writes, so the cache may
+ * look different when it returns.
+ */
+[[nodiscard]] static int make_room(size_t needed_size) {
+    while (1) {
+        struct bcache_entry *dirty;
+        if (evict_entries(needed_size, &dirty)) {
+            return 0;
+        }
+        if (dirty == nullptr) {
+            /* Everything else is under I/O */
+            return -ENOMEM;
+        }
+        int ret = write_back_entry(dirty);
+        if (ret < 0) {
+            co_printf("bcache: failed to write back block %llu (error %d)\n", (unsigned long long)dirty->block_addr, ret);
+            return ret;
+        }
+    }
+}
+
+/*
+ * Creates a clean entry, with data left uninitialized. Unlike make_room(), this never releases s_lock, so it only
+ * evicts clean blocks, and returns nullptr if there's no room.
+ */
+static struct bcache_entry *new_entry(struct pdisk *disk, DISK_BLOCK_ADDR block_addr, enum entry_state state) {
+    assert(find_entry(disk, block_addr) == nullptr);
+    assert(!overlaps_uncached_write(disk, block_addr, 1));
+    struct bcache_entry *dirty;
+    if (!evict_entries(entry_footprint(disk), &dirty)) {
+        return nullptr;
+    }
+    struct bcache_entry *entry = heap_alloc(sizeof(*entry) + disk->block_size, 0);
+    if (entry == nullptr) {
+        return nullptr;
+    }
+    entry->disk = disk;
+    entry->block_addr = block_addr;
+    entry->state = state;
+    entry->dirty = false;
+    list_insert_front(&s_buckets[hash_of(disk, block_addr)], &entry->hash_node, entry);
+    list_insert_front(&s_lru, &entry->lru_node, entry);
+    s_stats.cached_size += entry_footprint(disk);
+    return entry;
+}
+
+static bool is_large_request(struct pdisk const *disk, size_t block_count) {
+    return (s_stats.max_size / 4) < (block_count * disk->block_size);
+}
+
+/*
+ * Writes blocks to the disk directly, and updates cached copies. s_lock is released during the write.
+ */
+[[nodiscard]] static int write_uncached(struct pdisk *disk, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    uint8_t const *src = buf;
+    size_t block_size = disk->block_size;
+    /* Wait until nobody else is doing I/O on those blocks. */
+    for (size_t i = 0; i < block_count;) {
+        struct bcache_entry *entry = find_entry(disk, block_addr + i);
+        if ((entry != nullptr) && (entry->state != ENTRY_STATE_IDLE)) {
+            wait_for_io();
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    /*
+     * Cached copies get the new data right away, and stay dirty until the write is done. If it fails, they still have
+     * the new data, and it will be written back later.
+     */
+    for (size_t i = 0; i < block_count; i++) {
+        struct bcache_entry *entry = find_entry(disk, block_addr + i);
+        if (entry != nullptr) {
+            vmemcpy(entry->data, &src[i * block_size], block_size);
+            set_dirty(entry, true);
+            entry->state = ENTRY_STATE_WRITING;
+        }
+    }
+    struct uncached_write write = {
+        .disk = disk,
+        .block_addr = block_addr,
+        .block_count = block_count,
+    };
+    list_insert_back(&s_uncached_writes, &write.node, &write);
+    mutex_unlock(&s_lock);
+    int ret = disk->ops->write(disk, buf, block_addr, block_count);
+    MUTEX_LOCK(&s_lock);
+    list_remove_node(&s_uncached_writes, &write.node);
+    for (size_t i = 0; i < block_count; i++) {
+        struct bcache_entry *entry = find_entry(disk, block_addr + i);
+        if (entry != nullptr) {
+            entry->state = ENTRY_STATE_IDLE;
+            if (ret == 0) {
+                set_dirty(entry, false);
+            }
+        }
+    }
+    condvar_broadcast(&s_io_done);
+    return ret;
+}
+
+[[nodiscard]] int bcache_read(struct pdisk *disk, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    int ret = 0;
+    uint8_t *dest = buf;
+    size_t block_size = disk->block_size;
+    MUTEX_LOCK(&s_lock);
+    bool populate = !is_large_request(disk, block_count);
+    bool made_room = false;
+    size_t i = 0;
+    while (i < block_count) {
+        struct bcache_entry *entry = find_entry(disk, block_addr + i);
+        if (entry != nullptr) {
+            if (entry->state == ENTRY_STATE_READING) {
+                wait_for_io();
+                continue;
+            }
+            vmemcpy(&dest[i * block_size], entry->data, block_size);
+            touch_entry(entry);
+            s_stats.hits++;
+            i++;
+            continue;
+        }
+        /* Read every consecutive block that isn't cached with single read */
+        size_t miss_start = i;
+        do {
+            i++;
+        } while ((i < block_count) && (find_entry(disk, block_addr + i) == nullptr));
+        size_t miss_count = i - miss_start;
+        size_t placeholder_count = 0;
+        if (populate && !overlaps_uncached_write(disk, block_addr + miss_start, miss_count)) {
+            struct bcache_entry *dirty;
+            if (!made_room && !evict_entries(miss_count * entry_footprint(disk), &dirty)) {
+                /*
+                 * Write back dirty blocks to make room, and then start over from the first missed block, as others
+                 * may have cached some of them in the meantime. If it doesn't work, blocks that don't fit aren't cached.
+                 */
+                (void)make_room(miss_count * entry_footprint(disk));
+                made_room = true;
+                i = miss_start;
+                continue;
+            }
+            /* Others wait for these, instead of reading the same blocks again. */
+            while ((placeholder_count < miss_count) && (new_entry(disk, block_addr + miss_start + placeholder_count, ENTRY_STATE_READING) != nullptr)) {
+                placeholder_count++;
+            }
+        }
+        made_room = false;
+        s_stats.misses += miss_count;
+        mutex_unlock(&s_lock);
+        ret = disk->ops->read(disk, &dest[miss_start * block_size], block_addr + miss_start, miss_count);
+        MUTEX_LOCK(&s_lock);
+        for (size_t j = 0; j < placeholder_count; j++) {
+            struct bcache_entry *placeholder = find_entry(disk, block_addr + miss_start + j);
+            assert((placeholder != nullptr) && (placeholder->state == ENTRY_STATE_READING));
+            placeholder->state = ENTRY_STATE_IDLE;
+            if (ret < 0) {
+                remove_entry(placeholder);
+            } else {
+                vmemcpy(placeholder->data, &dest[(miss_start + j) * block_size], block_size);
+            }
+        }
+        if (placeholder_count != 0) {
+            condvar_broadcast(&s_io_done);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    }
+out:
+    mutex_unlock(&s_lock);
+    return ret;
+}
+
+[[nodiscard]] int bcache_write(struct pdisk *disk, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    int ret = 0;
+    uint8_t const *src = buf;
+    size_t block_size = disk->block_size;
+    MUTEX_LOCK(&s_lock);
+    if (is_large_request(disk, block_count)) {
+        ret = write_uncached(disk, buf, block_addr, block_count);
+        goto out;
+    }
+    bool made_room = false;
+    size_t i = 0;
+    while (i < block_count) {
+        struct bcache_entry *entry = find_entry(disk, block_addr + i);
+        if ((entry != nullptr) && (entry->state != ENTRY_STATE_IDLE)) {
+            wait_for_io();
+            continue;
+        }
+        if (entry == nullptr) {
+            if (overlaps_uncached_write(disk, block_addr + i, 1)) {
+                wait_for_io();
+                continue;
+            }
+            struct bcache_entry *dirty;
+            if (!made_room && !evict_entries(entry_footprint(disk), &dirty)) {
+                (void)make_room(entry_footprint(disk));
+                made_room = true;
+                continue;
+            }
+            entry = new_entry(disk, block_addr + i, ENTRY_STATE_IDLE);
+        }
+        made_room = false;
+        if (entry == nullptr) {
+            /* Couldn't cache it, so write it through. */
+            ret = write_uncached(disk, &src[i * block_size], block_addr + i, 1);
+            if (ret < 0) {
+                goto out;
+            }
+            i++;
+            continue;
+        }
+        vmemcpy(entry->data, &src[i * block_size], block_size);
+        touch_entry(entry);
+        set_dirty(entry, true);
+        i++;
+    }
+out:
+    mutex_unlock(&s_lock);
+    return ret;
+}
+
+/*
+ * Writes back blocks of `disk`(or every disk if it's nullptr) that were dirty when this was called. Blocks that become
+ * dirty after that are left for the next time, so that busy writers can't keep this going forever. Blocks that failed
+ * to be written are also left, as they go to the back of the dirty list.
+ */
+[[nodiscard]] static int write_back_dirty_entries(struct pdisk *disk, bool stop_on_error) {
+    int result = 0;
+    uint64_t last_seq = s_dirty_seq;
+    while (1) {
+        struct bcache_entry *target = nullptr;
+        bool found_busy = false;
+        LIST_FOREACH(&s_dirty, node) {
+            struct bcache_entry *entry = node->data;
+            if (last_seq < entry->dirty_since) {
+                break;
+            }
+            if ((disk != nullptr) && (entry->disk != disk)) {
+                continue;
+            }
+            if (entry->state != ENTRY_STATE_IDLE) {
+                found_busy = true;
+                continue;
+            }
+            target = entry;
+            break;
+        }
+        if (target == nullptr) {
+            if (!found_busy) {
+                break;
+            }
+            /* Someone else is writing those. Wait for it, as that may fail. */
+            wait_for_io();
+            continue;
+        }
+        int ret = write_back_entry(target);
+        if (ret < 0) {
+            co_printf("bcache: failed to write back block %llu (error %d)\n", (unsigned long long)target->block_addr, ret);
+            result = ret;
+            if (stop_on_error) {
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+[[nodiscard]] int bcache_sync(void) {
+    MUTEX_LOCK(&s_lock);
+    /* Keep going, so that one bad block doesn't hold back everything else. */
+    int ret = write_back_dirty_entries(nullptr, false);
+    mutex_unlock(&s_lock);
+    return ret;
+}
+
+[[nodiscard]] int bcache_flush(struct pdisk *disk) {
+    MUTEX_LOCK(&s_lock);
+    int ret = write_back_dirty_entries(disk, true);
+    mutex_unlock(&s_lock);
+    if ((ret == 0) && (disk->ops->flush != nullptr)) {
+        ret = disk->ops->flush(disk);
+    }
+    return ret;
+}
+
+[[nodiscard]] int bcache_invalidate(struct pdisk *disk, DISK_BLOCK_ADDR block_addr, DISK_BLOCK_ADDR block_count) {
+    int result = 0;
+    MUTEX_LOCK(&s_lock);
+    uint64_t last_seq = s_dirty_seq;
+    struct list_node *node = s_lru.front;
+    while (node != nullptr) {
+        struct list_node *next = node->next;
+        struct bcache_entry *entry = node->data;
+        if ((entry->disk != disk) || (entry->block_addr < block_addr) || (block_count <= (entry->block_addr - block_addr))) {
+            node = next;
+            continue;
+        }
+        if (entry->state != ENTRY_STATE_IDLE) {
+            wait_for_io();
+            node = s_lru.front;
+            continue;
+        }
+        if (entry->dirty) {
+            /* Failed ones get newer dirty_since, and they stay in the cache. */
+            if (entry->dirty_since <= last_seq) {
+                int ret = write_back_entry(entry);
+                if (ret < 0) {
+                    result = ret;
+                }
+                node = s_lru.front;
+            } else {
+                node = next;
+            }
+            continue;
+        }
+        remove_entry(entry);
+        node = next;
+    }
+    mutex_unlock(&s_lock);
+    return result;
+}
+
+void bcache_set_max_size(size_t size) {
+    MUTEX_LOCK(&s_lock);
+    s_stats.max_size = size;
+    /* If some dirty blocks can't be written back, we stay above the budget until next time. */
+    (void)make_room(0);
+    mutex_unlock(&s_lock);
+}
+
+void bcache_get_stats(struct bcache_stats *out) {
+    MUTEX_LOCK(&s_lock);
+    vmemcpy(out, &s_stats, sizeof(*out));
+    mutex_unlock(&s_lock);
+}
+
+static void writeback_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        thread_sleep(CONFIG_WRITEBACK_INTERVAL);
+        int ret = bcache_sync();
+        if (ret < 0) {
+            co_printf("bcache: writeback failed (error %d)\n", ret);
+        }
+    }
+}
+
+void bcache_start_writeback(void) {
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, writeback_thread_main, nullptr);
+    if (thread == nullptr) {
+        panic("bcache: not enough memory to create the writeback thread");
+    }
+    int ret = sched_queue(thread);
+    MUST_SUCCEED(ret);
+    thread_detach(thread);
+}
@@ -1,7 +1,7 @@
 #include <kernel/arch/hcf.h>
-#include <kernel/arch/interrupts.h>
 #include <kernel/io/co.h>
 #include <kernel/io/stream.h>
+#include <kernel/tasks/spinlock.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,6 +9,11 @@
 static struct stream *s_primary_stream;
 /* NOTE: Debug console is output only */
 static struct stream *s_debug_stream;
+/*
+ * Keeps output from different CPUs from getting mixed up. Everyone prints, so this comes after every other lock.
+ * (Output is only written with polling while this is held, as interrupts are disabled)
+ */
+static struct spinlock s_lock;
 
 void co_set_primary_console(struct stream *device) {
     s_primary_stream = device;
@@ -51,7 +56,7 @@ void co_ask_primary_console(void) {
 }
 
 void co_put_char(char c) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     if (s_primary_stream != nullptr) {
         int ret = stream_put_char(s_primary_stream, c);
         (void)ret;
@@ -62,11 +67,11 @@ void co_put_char(char c) {
         (void)ret;
         stream_flush(s_debug_stream);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
 }
 
 void co_put_string(char const *s) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     if (s_primary_stream != nullptr) {
         int ret = stream_put_string(s_primary_stream, s);
         (void)ret;
@@ -77,11 +82,11 @@ void co_put_string(char const *s) {
         (void)ret;
         stream_flush(s_debug_stream);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
 }
 
 void co_vprintf(char const *fmt, va_list ap) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     if (s_primary_stream != nullptr) {
         int ret = stream_vprintf(s_primary_stream, fmt, ap);
         (void)ret;
@@ -92,7 +97,7 @@ void co_vprintf(char const *fmt, va_list ap) {
         (void)ret;
         stream_flush(s_debug_stream);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
 }
 
 void co_printf(char const *fmt, ...) {
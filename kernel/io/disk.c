@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <kernel/io/bcache.h>
 #include <kernel/io/co.h>
 #include <kernel/io/disk.h>
 #include <kernel/io/iodev.h>
@@ -12,17 +13,16 @@
 #include <stdint.h>
 #include <sys/types.h>
 
-static void to_abs_block_range(size_t *firstaddr_out, struct ldisk *self, DISK_BLOCK_ADDR block_addr, size_t *blockcount_inout) {
-    size_t disk_first_blockaddr = self->startblockaddr;
-    size_t disk_last_blockaddr = self->startblockaddr + (self->block_count - 1);
-    size_t first_abs_addr = 0;
+static void to_abs_block_range(DISK_BLOCK_ADDR *firstaddr_out, struct ldisk *self, DISK_BLOCK_ADDR block_addr, size_t *blockcount_inout) {
+    DISK_BLOCK_ADDR first_abs_addr = 0;
     size_t final_block_count = *blockcount_inout;
-    if (disk_last_blockaddr - disk_first_blockaddr < block_addr) {
+    if (self->block_count <= block_addr) {
         final_block_count = 0;
     } else {
-        first_abs_addr = disk_first_blockaddr + block_addr;
-        if (disk_last_blockaddr - first_abs_addr + 1 < final_block_count) {
-            final_block_count = disk_last_blockaddr - first_abs_addr + 1;
+        first_abs_addr = self->startblockaddr + block_addr;
+        DISK_BLOCK_ADDR blocks_left = self->block_count - block_addr;
+        if (blocks_left < final_block_count) {
+            final_block_count = (size_t)blocks_left;
         }
     }
     *firstaddr_out = first_abs_addr;
@@ -31,10 +31,15 @@ static void to_abs_block_range(size_t *firstaddr_out, struct ldisk *self, DISK_B
 
 [[nodiscard]] ssize_t ldisk_read(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
     size_t final_blockcount = block_count;
-    size_t first_abs_addr = 0;
+    DISK_BLOCK_ADDR first_abs_addr = 0;
     to_abs_block_range(&first_abs_addr, self, block_addr, &final_blockcount);
     if (final_blockcount != 0) {
-        int ret = self->physdisk->ops->read(self->physdisk, buf, first_abs_addr, final_blockcount);
+        int ret;
+        if (self->cache_disabled) {
+            ret = self->physdisk->ops->read(self->physdisk, buf, first_abs_addr, final_blockcount);
+        } else {
+            ret = bcache_read(self->physdisk, buf, first_abs_addr, final_blockcount);
+        }
         if (ret < 0) {
             return ret;
         }
@@ -43,11 +48,16 @@ static void to_abs_block_range(size_t *firstaddr_out, struct ldisk *self, DISK_B
 }
 
 [[nodiscard]] ssize_t ldisk_write(struct ldisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
-    size_t firstabsaddr = 0;
+    DISK_BLOCK_ADDR firstabsaddr = 0;
     size_t final_block_count = block_count;
     to_abs_block_range(&firstabsaddr, self, block_addr, &final_block_count);
     if (final_block_count != 0) {
-        int ret = self->physdisk->ops->write(self->physdisk, buf, firstabsaddr, final_block_count);
+        int ret;
+        if (self->cache_disabled) {
+            ret = self->physdisk->ops->write(self->physdisk, buf, firstabsaddr, final_block_count);
+        } else {
+            ret = bcache_write(self->physdisk, buf, firstabsaddr, final_block_count);
+        }
         if (ret < 0) {
             return ret;
         }
@@ -74,7 +84,20 @@ static void to_abs_block_range(size_t *firstaddr_out, struct ldisk *self, DISK_B
     return 0;
 }
 
-static int register_ldisk(struct pdisk *pdisk, DISK_BLOCK_ADDR startblockaddr, size_t block_count) {
+[[nodiscard]] int ldisk_flush(struct ldisk *self) {
+    return bcache_flush(self->physdisk);
+}
+
+[[nodiscard]] int ldisk_disable_cache(struct ldisk *self) {
+    int ret = bcache_invalidate(self->physdisk, self->startblockaddr, self->block_count);
+    if (ret < 0) {
+        return ret;
+    }
+    self->cache_disabled = true;
+    return 0;
+}
+
+static int register_ldisk(struct pdisk *pdisk, DISK_BLOCK_ADDR startblockaddr, DISK_BLOCK_ADDR block_count) {
     int result;
     struct ldisk *disk = heap_alloc(sizeof(*disk), HEAP_FLAG_ZEROMEMORY);
     if (disk == nullptr) {
@@ -1,5 +1,4 @@
 #include <errno.h>
-#include <kernel/arch/interrupts.h>
 #include <kernel/io/co.h>
 #include <kernel/io/iodev.h>
 #include <kernel/lib/diagnostics.h>
@@ -7,6 +6,7 @@
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/heap.h>
 #include <kernel/panic.h>
+#include <kernel/tasks/spinlock.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -19,6 +19,8 @@ struct iodevtype {
 };
 
 static struct list s_iodevtypes;
+/* Protects the lists above. This comes before the heap lock. */
+static struct spinlock s_lock;
 
 static struct iodevtype *getiodevtypefor(char const *devtype) {
     LIST_FOREACH(&s_iodevtypes, typenode) {
@@ -32,7 +34,7 @@ static struct iodevtype *getiodevtypefor(char const *devtype) {
 
 [[nodiscard]] int iodev_register(struct iodev *dev_out, char const *devtype, void *data) {
     int result = 0;
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     /* Look for existing iodevtype */
     dev_out->devtype = devtype;
     dev_out->data = data;
@@ -57,7 +59,7 @@ static struct iodevtype *getiodevtypefor(char const *devtype) {
 fail_oom:
     result = -ENOMEM;
 out:
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
     return result;
 }
 
@@ -70,7 +72,9 @@ void iodev_printf(struct iodev *device, char const *fmt, ...) {
 }
 
 struct list *iodev_get_list(char const *devtype) {
+    spinlock_lock(&s_lock);
     struct iodevtype *type = getiodevtypefor(devtype);
+    spinlock_unlock(&s_lock);
     if (type == nullptr) {
         return nullptr;
     }
@@ -7,6 +7,7 @@
 #include <kernel/lib/list.h>
 #include <kernel/lib/queue.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/tasks/spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -23,6 +24,8 @@ static bool const CONFIG_PRINT_KEYS = false;
 static struct queue s_event_queue;
 /* 500 should be more than enough */
 static struct kbd_key_event s_event_queue_buf[500];
+/* Protects the event queue, which is read from any CPU. */
+static struct spinlock s_event_queue_lock;
 static struct list s_keyboard_list;
 static uint16_t s_flags;
 /* TODO: Use bitmap instead? */
@@ -208,18 +211,18 @@ static struct queue *event_queue(void) {
 }
 
 static void enqueue_event(struct kbd_key_event const *event) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_event_queue_lock);
     int ret = QUEUE_ENQUEUE(event_queue(), event);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_event_queue_lock);
     if (ret < 0) {
         co_printf("kbd: failed to enqueue key event (error %d)\n", ret);
     }
 }
 
 bool kbd_pull_event(struct kbd_key_event *out) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_event_queue_lock);
     bool result = QUEUE_DEQUEUE(out, event_queue());
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_event_queue_lock);
     return result;
 }
 
@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <kernel/arch/interrupts.h>
+#include <kernel/clock.h>
 #include <kernel/io/stream.h>
 #include <kernel/lib/diagnostics.h>
+#include <kernel/tasks/thread.h>
 #include <kernel/ticktime.h>
 #include <kernel/types.h>
 #include <stdarg.h>
@@ -460,10 +462,10 @@ int stream_wait_char(struct stream *self, TICKTIME timeout) {
         assert(arch_irq_are_enabled());
     }
 
-    TICKTIME starttime = g_ticktime;
+    uint64_t start_ns = clock_get_ns();
     uint8_t chr;
     while (1) {
-        if ((timeout != 0) && (timeout <= (g_ticktime - starttime))) {
+        if ((timeout != 0) && ((timeout * CLOCK_NS_PER_TICK) <= (clock_get_ns() - start_ns))) {
             return STREAM_EOF;
         }
         size = self->ops->read(self, &chr, 1);
@@ -473,6 +475,7 @@ int stream_wait_char(struct stream *self, TICKTIME timeout) {
         if (size != 0) {
             break;
         }
+        thread_poll_backoff(start_ns);
     }
     return chr;
 }
@@ -2,15 +2,20 @@
 #include "kernel/kobject.h"
 #include "shell/shell.h"
 #include "windowd.h"
+#include <kernel/arch/smp.h>
+#include <kernel/clock.h>
 #include <kernel/dev/pci.h>
 #include <kernel/dev/ps2.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/io/bcache.h>
 #include <kernel/io/co.h>
 #include <kernel/io/disk.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/tasks/irqwork.h>
 #include <kernel/tasks/sched.h>
+#include <kernel/trapmanager.h>
 #include <kernel/version.h>
 #include <stdalign.h>
 
@@ -19,12 +24,18 @@ struct kobject_ops test_ops;
 [[noreturn]] void kernel_init(void) {
     co_printf("\nYJK Operating System " YJKOS_RELEASE "-" YJKOS_VERSION "\n");
     co_printf("Copyright (c) 2025 YJK(Oh Inseo)\n\n");
-    co_printf("%zu mibytes allocatable memory\n", pmm_get_total_mem_size() / (1024 * 1024));
+    co_printf("%llu mibytes allocatable memory\n", pmm_get_total_mem_size() / (1024 * 1024));
 
     heap_expand();
+    clock_init();
     fsinit_init_all();
     shell_init();
     sched_init_boot_thread();
+    irqwork_start();
+    bcache_start_writeback();
+    vmm_start_reclaim_thread();
+    trapmanager_start_periodic_audit();
+    arch_smp_start_cpus();
     co_printf("\n:: system is now listing PCI devices...\n");
     pci_print_bus();
     co_printf("\n:: system is now initializing PS/2 devices\n");
@@ -14,13 +14,7 @@ static long findfirstsetbit(UINT word, long startpos) {
     if (shifted == 0) {
         return -1;
     }
-    long index = startpos;
-    for (; (shifted & 1U) == 0; shifted >>= 1U, index++) {
-        if (index == (BITS_PER_WORD - 1)) {
-            return -1;
-        }
-    }
-    return index;
+    return startpos + __builtin_ctz(shifted);
 }
 
 static long findlastcontiguousbit(UINT word, long startpos) {
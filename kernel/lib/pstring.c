@@ -1,15 +1,18 @@
-#include <kernel/arch/interrupts.h>
 #include <kernel/arch/mmu.h>
 #include <kernel/lib/miscmath.h>
 #include <kernel/lib/pstring.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/tasks/spinlock.h>
 #include <kernel/types.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Every CPU shares the same scratch page */
+static struct spinlock s_scratch_lock;
+
 void pmemcpy_in(void *dest, PHYSPTR src, size_t len, MMU_CACHE_INHIBIT cache_inhibit) {
-    bool prev_interrupts = arch_irq_disable();
-    PHYSPTR srcpage = align_down(src, ARCH_PAGESIZE);
+    spinlock_lock(&s_scratch_lock);
+    PHYSPTR srcpage = src - (src % ARCH_PAGESIZE);
     size_t offset = src - srcpage;
     uint8_t *dest_byte = dest;
     size_t copylen;
@@ -22,12 +25,12 @@ void pmemcpy_in(void *dest, PHYSPTR src, size_t len, MMU_CACHE_INHIBIT cache_inh
         arch_mmu_scratch_map(srcpage, cache_inhibit);
         vmemcpy(dest_byte, (char *)ARCH_SCRATCH_MAP_BASE + offset, copylen);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_scratch_lock);
 }
 
 void pmemcpy_out(PHYSPTR dest, void const *src, size_t len, MMU_CACHE_INHIBIT cache_inhibit) {
-    bool prev_interrupts = arch_irq_disable();
-    PHYSPTR destpage = align_down(dest, ARCH_PAGESIZE);
+    spinlock_lock(&s_scratch_lock);
+    PHYSPTR destpage = dest - (dest % ARCH_PAGESIZE);
     size_t offset = dest - destpage;
     uint8_t const *src_byte = src;
     size_t copylen;
@@ -40,12 +43,12 @@ void pmemcpy_out(PHYSPTR dest, void const *src, size_t len, MMU_CACHE_INHIBIT ca
         arch_mmu_scratch_map(destpage, cache_inhibit);
         vmemcpy((char *)ARCH_SCRATCH_MAP_BASE + offset, src_byte, copylen);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_scratch_lock);
 }
 
 void pmemset(PHYSPTR dest, int byte, size_t len, MMU_CACHE_INHIBIT cache_inhibit) {
-    bool prev_interrupts = arch_irq_disable();
-    PHYSPTR destpage = align_down(dest, ARCH_PAGESIZE);
+    spinlock_lock(&s_scratch_lock);
+    PHYSPTR destpage = dest - (dest % ARCH_PAGESIZE);
     size_t offset = dest - destpage;
     size_t copylen;
     for (size_t i = 0; i < len; destpage += ARCH_PAGESIZE, i += copylen, offset = 0) {
@@ -57,7 +60,7 @@ void pmemset(PHYSPTR dest, int byte, size_t len, MMU_CACHE_INHIBIT cache_inhibit
         arch_mmu_scratch_map(destpage, cache_inhibit);
         vmemset((char *)ARCH_SCRATCH_MAP_BASE + offset, byte, copylen);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_scratch_lock);
 }
 
 uint8_t ppeek8(PHYSPTR at, MMU_CACHE_INHIBIT cache_inhibit) {
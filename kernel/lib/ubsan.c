@@ -1,7 +1,7 @@
-#include <kernel/arch/interrupts.h>
 #include <kernel/arch/stacktrace.h>
 #include <kernel/io/co.h>
 #include <kernel/panic.h>
+#include <kernel/tasks/spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -48,6 +48,9 @@ struct type_descriptor {
 
 #define UBSAN_KIND_UNKNOWN 0xffff
 
+/* Keeps reports from different CPUs from getting mixed up. */
+static struct spinlock s_report_lock;
+
 static void print_type_descriptor(struct type_descriptor const *desc) {
     if (desc == nullptr) {
         co_printf("<no info>");
@@ -88,14 +91,14 @@ static void printheadermessage(void) {
 }
 
 static void type_mismatch(struct type_mismatch_data *data, void *ptr) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("type mismatch error at %s:%d:%d!\n", data->loc.filename, data->loc.line, data->loc.column);
     co_printf("pointer: %p\n", ptr);
     co_printf("   type: ");
     print_type_descriptor(data->type);
     co_printf("\n");
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 void __ubsan_handle_type_mismatch_v1(struct type_mismatch_data *data, void *ptr) {
     type_mismatch(data, ptr);
@@ -111,12 +114,12 @@ struct pointer_overflow_data {
 
 DEFINE_RECOVERABLE_ERROR(pointer_overflow, struct pointer_overflow_data *data, void *base, void *result);
 static void pointer_overflow(struct pointer_overflow_data *data, void *base, void *result) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("pointer overflow error at %s:%d:%d!\n", data->loc.filename, data->loc.line, data->loc.column);
     co_printf("     base pointer: %p\n", base);
     co_printf("resulting pointer: %p\n", result);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 void __ubsan_handle_pointer_overflow(struct pointer_overflow_data *data, void *base, void *result) {
     pointer_overflow(data, base, result);
@@ -134,7 +137,7 @@ struct out_of_bounds_data {
 
 DEFINE_RECOVERABLE_ERROR(out_of_bounds, struct out_of_bounds_data *data, void *index);
 static void out_of_bounds(struct out_of_bounds_data *data, void *index) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("out of bounds error at %s:%d:%d!\n", data->loc.filename, data->loc.column, data->loc.line);
     co_printf(" array type: ");
@@ -144,7 +147,7 @@ static void out_of_bounds(struct out_of_bounds_data *data, void *index) {
     print_type_descriptor(data->index_type);
     co_printf("\n");
     co_printf("index value: %zu\n", (size_t)index);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 void __ubsan_handle_out_of_bounds(struct out_of_bounds_data *data, void *index) {
     out_of_bounds(data, index);
@@ -161,7 +164,7 @@ struct shift_out_of_bounds_data {
 };
 DEFINE_RECOVERABLE_ERROR(shift_out_of_bounds, struct shift_out_of_bounds_data *data, void *lhs, void *rhs);
 static void shift_out_of_bounds(struct shift_out_of_bounds_data *data, void *lhs, void *rhs) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("shift out of bounds error at %s:%d:%d!\n", data->loc.filename, data->loc.column, data->loc.line);
     co_printf("            lhs type: ");
@@ -172,7 +175,7 @@ static void shift_out_of_bounds(struct shift_out_of_bounds_data *data, void *lhs
     co_printf("\n");
     co_printf("lhs value(as size_t): %zu\n", (size_t)lhs);
     co_printf("rhs value(as size_t): %zu\n", (size_t)rhs);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 void __ubsan_handle_shift_out_of_bounds(struct shift_out_of_bounds_data *data, void *lhs, void *rhs) {
     shift_out_of_bounds(data, lhs, rhs);
@@ -188,14 +191,14 @@ struct invalid_value_data {
 };
 DEFINE_RECOVERABLE_ERROR(load_invalid_value, struct invalid_value_data *data, void *val);
 static void load_invalid_value(struct invalid_value_data *data, void *val) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("load invalid value error at %s:%d:%d!\n", data->loc.filename, data->loc.column, data->loc.line);
     co_printf("           type: ");
     print_type_descriptor(data->type);
     co_printf("\n");
     co_printf("value(as size_t): %zu\n", (size_t)val);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 void __ubsan_handle_load_invalid_value(struct invalid_value_data *data, void *val) {
     load_invalid_value(data, val);
@@ -212,7 +215,7 @@ struct overflow_data {
 
 DEFINE_RECOVERABLE_ERROR(add_overflow, struct overflow_data *data, void *lhs, void *rhs);
 static void overflow(char const *type, struct overflow_data *data, void *lhs, void *rhs) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_report_lock);
     printheadermessage();
     co_printf("%s overflow error at %s:%d:%d!\n", type, data->loc.filename, data->loc.column, data->loc.line);
     co_printf("                type: ");
@@ -220,7 +223,7 @@ static void overflow(char const *type, struct overflow_data *data, void *lhs, vo
     co_printf("\n");
     co_printf("lhs value(as size_t): %zu\n", (size_t)lhs);
     co_printf("rhs value(as size_t): %zu\n", (size_t)rhs);
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_report_lock);
 }
 
 #define DEFINE_OVERFLOW_ERROR(type, name)                                                                         \
@@ -10,6 +10,7 @@
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/panic.h>
+#include <kernel/tasks/spinlock.h>
 #include <kernel/types.h>
 #include <stdalign.h>
 #include <stddef.h>
@@ -56,6 +57,7 @@ struct alloc_header {
 
 static size_t s_free_block_count = 0;
 static struct list s_heap_pool_list; /* pool_header items */
+static struct spinlock s_lock;
 static struct list s_alloc_list;     /* alloc_header items */
 static bool s_initial_heap_initialized = false;
 
@@ -73,7 +75,7 @@ static size_t actual_alloc_size(size_t size) {
 }
 
 void __heap_check_overflow(struct source_location srcloc) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     bool die = false;
     LIST_FOREACH(&s_alloc_list, allocnode) {
         bool corrupted = false;
@@ -107,11 +109,11 @@ void __heap_check_overflow(struct source_location srcloc) {
     if (die) {
         panic("heap overflow detected");
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
 }
 
 static void *alloc_from_pool(struct pool_header *self, size_t size) {
-    ASSERT_IRQ_DISABLED();
+    assert(spinlock_is_held(&s_lock));
     if (size == 0) {
         return nullptr;
     }
@@ -451,7 +453,7 @@ static pool_header_t *createpool(size_t minmemsize) {
 #endif
 
 static struct pool_header *add_mem(void *mem, size_t memsize) {
-    ASSERT_IRQ_DISABLED();
+    assert(spinlock_is_held(&s_lock));
     size_t max_block_count = size_to_blocks(memsize, BLOCK_SIZE);
 
     size_t word_count = bitmap_needed_word_count(max_block_count);
@@ -516,7 +518,7 @@ void *heap_alloc(size_t size, uint8_t flags) {
     if ((SIZE_MAX - sizeof(struct alloc_header)) < size) {
         return nullptr;
     }
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     HEAP_CHECKOVERFLOW();
     if (!s_initial_heap_initialized) {
         add_mem(s_initial_heap_memory, sizeof(s_initial_heap_memory));
@@ -533,18 +535,22 @@ void *heap_alloc(size_t size, uint8_t flags) {
         }
     }
     HEAP_CHECKOVERFLOW();
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
     if (flags & HEAP_FLAG_ZEROMEMORY) {
         vmemset(result, 0, size);
     }
     return result;
 }
 
+size_t heap_get_footprint(size_t size) {
+    return size_to_blocks(actual_alloc_size(size), BLOCK_SIZE) * BLOCK_SIZE;
+}
+
 void heap_free(void *ptr) {
     if (ptr == nullptr) {
         return;
     }
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     struct alloc_header *alloc = alloc_header_of(ptr);
     HEAP_CHECKOVERFLOW();
     list_remove_node(&s_alloc_list, &alloc->node);
@@ -574,7 +580,7 @@ void heap_free(void *ptr) {
     s_free_block_count += alloc->block_count;
     vmemset(alloc, 0x6f, alloc->block_count * BLOCK_SIZE);
     HEAP_CHECKOVERFLOW();
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
     return;
 die:
     panic("heap_free: bad pointer");
@@ -584,7 +590,7 @@ void *heap_realloc(void *ptr, size_t newsize, uint8_t flags) {
     if (ptr == nullptr) {
         return heap_alloc(newsize, flags);
     }
-    bool prev_interrupts = arch_irq_disable();
+    /* The allocation belongs to the caller, so its header can be read without taking the lock. */
     struct alloc_header *alloc = alloc_header_of(ptr);
     HEAP_CHECKOVERFLOW();
     if (alloc == nullptr) {
@@ -603,7 +609,6 @@ void *heap_realloc(void *ptr, size_t newsize, uint8_t flags) {
     vmemcpy(newmem, ptr, copysize);
     heap_free(ptr);
 out:
-    arch_irq_restore(prev_interrupts);
     return newmem;
 die:
     panic("heap_realloc: bad pointer");
@@ -626,20 +631,20 @@ void *heap_realloc_array(void *ptr, size_t newsize, size_t newelements, uint8_t
 static size_t const MAXEXPANDSIZE = 16 * 1024 * 1024;
 
 void heap_expand(void) {
-    bool prev_interrupts = arch_irq_disable();
     struct vmm_object *object = nullptr;
-    size_t heapsize = pmm_get_total_mem_size();
-    if (MAXEXPANDSIZE < heapsize) {
-        heapsize = MAXEXPANDSIZE;
+    uint64_t memsize = pmm_get_total_mem_size();
+    size_t heapsize = MAXEXPANDSIZE;
+    if (memsize < MAXEXPANDSIZE) {
+        heapsize = memsize;
     }
     object = vmm_alloc(vmm_get_kernel_address_space(), heapsize, MAP_PROT_READ | MAP_PROT_WRITE);
     if (object == nullptr) {
         co_printf("not enough memory to expand heap\n");
-        goto out;
+        return;
     }
+    spinlock_lock(&s_lock);
     add_mem(object->start, vmm_get_object_size((object)));
-out:
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
 }
 
 /******************************************************************************/
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <kernel/arch/interrupts.h>
 #include <kernel/arch/mmu.h>
 #include <kernel/io/co.h>
 #include <kernel/lib/bitmap.h>
@@ -9,6 +8,7 @@
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/panic.h>
+#include <kernel/tasks/spinlock.h>
 #include <kernel/types.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -39,6 +39,7 @@ struct pagepool {
 };
 
 static struct pagepool *s_firstpool;
+static struct spinlock s_lock;
 
 /*
  * Physical memory management is done using buddy allocation algorithm.
@@ -176,7 +177,7 @@ static PHYSPTR alloc_from_pool(struct pagepool *pool, size_t *page_count_inout)
     /* Mark resulting block as unavailable ************************************/
     long bit_index = bit_index_for_pagepool_block(wanted_level, current_block_index);
     bitmap_clear_bit(&pool->bitmap, bit_index);
-    result = pool->base_addr + (block_size * current_block_index * ARCH_PAGESIZE);
+    result = pool->base_addr + ((PHYSPTR)block_size * current_block_index * ARCH_PAGESIZE);
     goto out;
 fail_oom:
     result = PHYSICALPTR_NULL;
@@ -188,7 +189,7 @@ static void free_from_pool(struct pagepool *pool, PHYSPTR ptr, size_t page_count
     if (ptr == 0) {
         return;
     }
-    if ((ptr < pool->base_addr) || (pool->base_addr + (ARCH_PAGESIZE * pool->page_count)) < (ptr + (ARCH_PAGESIZE * page_count))) {
+    if ((ptr < pool->base_addr) || (pool->base_addr + ((PHYSPTR)ARCH_PAGESIZE * pool->page_count)) < (ptr + ((PHYSPTR)ARCH_PAGESIZE * page_count))) {
         goto die;
     }
     size_t block_size = 1;
@@ -202,9 +203,9 @@ static void free_from_pool(struct pagepool *pool, PHYSPTR ptr, size_t page_count
         goto die;
     }
 
-    size_t current_block_index = (ptr - pool->base_addr) / (block_size * ARCH_PAGESIZE);
+    size_t current_block_index = (ptr - pool->base_addr) / ((PHYSPTR)block_size * ARCH_PAGESIZE);
     size_t current_level = block_size_to_pagepool_level(pool, block_size);
-    assert(((ptr - pool->base_addr) % (block_size * ARCH_PAGESIZE)) == 0);
+    assert(((ptr - pool->base_addr) % ((PHYSPTR)block_size * ARCH_PAGESIZE)) == 0);
     while (1) {
         /* Mark it as available ***********************************************/
         long bit_index = bit_index_for_pagepool_block(current_level, current_block_index);
@@ -254,7 +255,7 @@ die:
             return false;
         }
         if (expected_ptr != allocptr) {
-            co_printf("expected address %p pages, got %p(allocation %zu)\n", expected_ptr, allocptr, i);
+            co_printf("expected address %#llx pages, got %#llx(allocation %zu)\n", expected_ptr, allocptr, i);
             return false;
         }
     }
@@ -267,8 +268,7 @@ static void test_pagepool_fill(struct pagepool *pool, size_t alloc_size, size_t
     for (size_t i = 0; i < alloc_count; i++, alloc_ptr += alloc_size) {
         for (size_t j = 0; j < test_ptr_count; j++) {
             PHYSPTR dest_addr = alloc_ptr + (sizeof(PHYSPTR) * j);
-            STATIC_ASSERT_TEST(sizeof(UINT) == sizeof(uint32_t));
-            ppoke32(dest_addr, dest_addr, false);
+            ppoke32(dest_addr, (uint32_t)dest_addr, false);
         }
     }
 }
@@ -279,10 +279,10 @@ static void test_pagepool_fill(struct pagepool *pool, size_t alloc_size, size_t
     for (size_t i = 0; i < alloc_count; i++, alloc_ptr += alloc_size) {
         for (size_t j = 0; j < test_ptr_count; j++) {
             PHYSPTR srcaddr = alloc_ptr + (sizeof(PHYSPTR) * j);
-            PHYSPTR expectedvalue = srcaddr;
-            PHYSPTR gotvalue = ppeek32(srcaddr, false);
+            uint32_t expectedvalue = (uint32_t)srcaddr;
+            uint32_t gotvalue = ppeek32(srcaddr, false);
             if (expectedvalue != gotvalue) {
-                co_printf("value mismatch at %p(allocation %zu, base %p, offset %zu): expected %p, got %p\n", srcaddr, i, alloc_ptr, j, expectedvalue, gotvalue);
+                co_printf("value mismatch at %#llx(allocation %zu, base %#llx, offset %zu): expected %#x, got %#x\n", srcaddr, i, alloc_ptr, j, expectedvalue, gotvalue);
                 return false;
             }
         }
@@ -340,7 +340,7 @@ void pmm_test_pagepools(void) {
 void pmm_register_mem(PHYSPTR base, size_t page_count) {
     assert(base != 0);
 
-    uintptr_t current_baseaddress = base;
+    PHYSPTR current_baseaddress = base;
     size_t remaining_page_count = page_count;
     while (remaining_page_count != 0) {
         size_t poolpage_count = 0;
@@ -356,7 +356,7 @@ void pmm_register_mem(PHYSPTR base, size_t page_count) {
             continue;
         }
         if (CONFIG_PRINT_POOL_INIT) {
-            co_printf("pmm: initializing %zuk pool at %#x\n", (poolpage_count * ARCH_PAGESIZE) / 1024, current_baseaddress);
+            co_printf("pmm: initializing %zuk pool at %#llx\n", (poolpage_count * ARCH_PAGESIZE) / 1024, current_baseaddress);
         }
         pool->nextpool = s_firstpool;
         pool->bitmap.words = pool->bitmap_data;
@@ -368,21 +368,28 @@ void pmm_register_mem(PHYSPTR base, size_t page_count) {
         bitmap_set_bit(&pool->bitmap, 0);
         remaining_page_count -= poolpage_count;
         if (CONFIG_TEST_POOL) {
-            co_printf("pmm: testing the new page pool at %#lx\n", current_baseaddress);
+            co_printf("pmm: testing the new page pool at %#llx\n", current_baseaddress);
             if (!test_pagepool(pool)) {
                 panic("pmm: page pool test failed");
             }
         }
         s_firstpool = pool;
-        current_baseaddress += ARCH_PAGESIZE * poolpage_count;
+        current_baseaddress += (PHYSPTR)ARCH_PAGESIZE * poolpage_count;
     }
 }
 
-PHYSPTR pmm_alloc(size_t *page_count_inout) {
+static PHYSPTR pool_last_addr(struct pagepool const *pool) {
+    return pool->base_addr + ((PHYSPTR)ARCH_PAGESIZE * pool->page_count) - 1;
+}
+
+static PHYSPTR alloc_below(size_t *page_count_inout, PHYSPTR max_addr) {
     assert(*page_count_inout != 0);
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     PHYSPTR result = PHYSICALPTR_NULL;
     for (struct pagepool *pool = s_firstpool; pool != nullptr; pool = pool->nextpool) {
+        if (max_addr < pool_last_addr(pool)) {
+            continue;
+        }
         size_t newpage_count = *page_count_inout;
         result = alloc_from_pool(pool, &newpage_count);
         if (result != PHYSICALPTR_NULL) {
@@ -390,39 +397,46 @@ PHYSPTR pmm_alloc(size_t *page_count_inout) {
             break;
         }
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
     return result;
 }
 
+PHYSPTR pmm_alloc(size_t *page_count_inout) {
+    return alloc_below(page_count_inout, PHYSICALPTR_MAX);
+}
+
+PHYSPTR pmm_alloc_low(size_t *page_count_inout) {
+    return alloc_below(page_count_inout, UINT32_MAX);
+}
+
 void pmm_free(PHYSPTR ptr, size_t page_count) {
     if ((ptr == 0) || (page_count == 0)) {
         return;
     }
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     for (struct pagepool *pool = s_firstpool; pool != nullptr; pool = pool->nextpool) {
-        uintptr_t pool_data_start = pool->base_addr;
-        uintptr_t pool_data_end = pool_data_start + (ARCH_PAGESIZE * pool->page_count - 1);
+        PHYSPTR pool_data_start = pool->base_addr;
+        PHYSPTR pool_data_end = pool_last_addr(pool);
         if ((ptr < pool_data_start) || (pool_data_end < ptr)) {
             continue;
         }
-        uintptr_t end = ptr + (ARCH_PAGESIZE * page_count - 1);
+        PHYSPTR end = ptr + ((PHYSPTR)ARCH_PAGESIZE * page_count - 1);
         if ((end <= pool_data_start) || (pool_data_end < end)) {
             goto badptr;
         }
         free_from_pool(pool, ptr, page_count);
-        arch_irq_restore(prev_interrupts);
+        spinlock_unlock(&s_lock);
         return;
     }
 badptr:
     panic("pmm: bad pointer");
 }
 
-size_t pmm_get_total_mem_size(void) {
-    size_t page_count = 0;
+uint64_t pmm_get_total_mem_size(void) {
+    uint64_t page_count = 0;
     for (struct pagepool *pool = s_firstpool; pool != nullptr; pool = pool->nextpool) {
         page_count += pool->page_count;
     }
-    assert(page_count <= (SIZE_MAX / ARCH_PAGESIZE));
     return page_count * ARCH_PAGESIZE;
 }
 
@@ -458,18 +472,17 @@ bool pmm_page_pool_test_random(void) {
         size_t test_ptr_count = (alloc_sizes[i] * ARCH_PAGESIZE) / sizeof(void *);
         for (size_t j = 0; j < test_ptr_count; j++) {
             PHYSPTR destaddr = allocptrs[i] + sizeof(PHYSPTR) * 4;
-            STATIC_ASSERT_TEST(sizeof(PHYSPTR) == sizeof(uint32_t));
-            ppoke32(destaddr, destaddr, false);
+            ppoke32(destaddr, (uint32_t)destaddr, false);
         }
     }
     for (size_t i = 0; i < RAND_TEST_ALLOC_COUNT; i++) {
         size_t test_ptr_count = (alloc_sizes[i] * ARCH_PAGESIZE) / sizeof(void *);
         for (size_t j = 0; j < test_ptr_count; j++) {
             PHYSPTR srcaddr = allocptrs[i] + sizeof(PHYSPTR) * 4;
-            PHYSPTR expectedvalue = srcaddr;
-            PHYSPTR gotvalue = ppeek32(srcaddr, false);
+            uint32_t expectedvalue = (uint32_t)srcaddr;
+            uint32_t gotvalue = ppeek32(srcaddr, false);
             if (gotvalue != expectedvalue) {
-                co_printf("value mismatch at %p(allocation %zu, base %p, offset %zu): expected %p, got %p\n", srcaddr, i, allocptrs[i], j, expectedvalue, gotvalue);
+                co_printf("value mismatch at %#llx(allocation %zu, base %#llx, offset %zu): expected %#x, got %#x\n", srcaddr, i, allocptrs[i], j, expectedvalue, gotvalue);
                 goto testfail;
             }
         }
@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <errno.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/mmu.h>
+#include <kernel/io/co.h>
+#include <kernel/io/disk.h>
+#include <kernel/io/iodev.h>
+#include <kernel/lib/bitmap.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/pstring.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/heap.h>
+#include <kernel/mem/swap.h>
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Swap space is just an array of page-sized slots in the disk, and a bitmap keeps track of which slots are in use.
+ * All disk I/O goes through the cluster buffer, so that the caller doesn't have to worry about what the disk driver
+ * does with the buffer, and single disk write can carry several pages that are scattered around in the memory.
+ */
+
+static struct ldisk *s_disk;
+static size_t s_blocks_per_page;
+static struct bitmap s_slot_bitmap; /* Set bit = Free slot */
+static void *s_cluster_buf;
+static struct mutex s_io_lock;
+/* Protects the bitmap and stats. VMM frees slots with its own lock held, so this comes after the VMM lock. */
+static struct spinlock s_lock;
+static struct swap_stats s_stats;
+
+[[nodiscard]] int swap_enable(struct ldisk *disk) {
+    int result = 0;
+    UINT *bitmap_words = nullptr;
+    void *cluster_buf = nullptr;
+    size_t block_size = disk->physdisk->block_size;
+    if (s_disk != nullptr) {
+        result = -EBUSY;
+        goto fail;
+    }
+    if ((block_size == 0) || (ARCH_PAGESIZE < block_size) || ((ARCH_PAGESIZE % block_size) != 0)) {
+        iodev_printf(&disk->iodev, "swap: block size %zu is not supported\n", block_size);
+        result = -EINVAL;
+        goto fail;
+    }
+    size_t blocks_per_page = ARCH_PAGESIZE / block_size;
+    DISK_BLOCK_ADDR page_count = disk->block_count / blocks_per_page;
+    if (SWAP_SLOT_NONE < page_count) {
+        page_count = SWAP_SLOT_NONE;
+    }
+    size_t slot_count = (size_t)page_count;
+    if (slot_count == 0) {
+        iodev_printf(&disk->iodev, "swap: disk is too small\n");
+        result = -EINVAL;
+        goto fail;
+    }
+    size_t word_count = bitmap_needed_word_count(slot_count);
+    bitmap_words = heap_alloc(word_count * sizeof(*bitmap_words), HEAP_FLAG_ZEROMEMORY);
+    cluster_buf = heap_alloc(SWAP_CLUSTER_PAGE_COUNT * ARCH_PAGESIZE, 0);
+    if ((bitmap_words == nullptr) || (cluster_buf == nullptr)) {
+        result = -ENOMEM;
+        goto fail;
+    }
+    /*
+     * Swap-out happens when we are low on memory, so the cache must not try to allocate on that path.
+     * This is the last thing that can fail, so the disk is never left with its cache turned off.
+     */
+    result = ldisk_disable_cache(disk);
+    if (result < 0) {
+        goto fail;
+    }
+    s_slot_bitmap.words = bitmap_words;
+    s_slot_bitmap.word_count = word_count;
+    bitmap_set_bits(&s_slot_bitmap, 0, slot_count);
+    mutex_init(&s_io_lock);
+    vmemset(&s_stats, 0, sizeof(s_stats));
+    s_stats.total_slots = slot_count;
+    s_blocks_per_page = blocks_per_page;
+    s_cluster_buf = cluster_buf;
+    s_disk = disk;
+    iodev_printf(&disk->iodev, "swap: using %zu pages of swap space\n", slot_count);
+    goto out;
+fail:
+    heap_free(bitmap_words);
+    heap_free(cluster_buf);
+out:
+    return result;
+}
+
+bool swap_is_enabled(void) {
+    return s_disk != nullptr;
+}
+
+void swap_get_stats(struct swap_stats *out) {
+    spinlock_lock(&s_lock);
+    vmemcpy(out, &s_stats, sizeof(*out));
+    spinlock_unlock(&s_lock);
+}
+
+/*
+ * Returns -ENOSPC if there aren't enough consecutive free slots.
+ */
+[[nodiscard]] static int alloc_slots(SWAP_SLOT *first_slot_out, size_t count) {
+    spinlock_lock(&s_lock);
+    int result = 0;
+    long first_slot = bitmap_find_set_bits(&s_slot_bitmap, 0, count);
+    if (first_slot < 0) {
+        result = -ENOSPC;
+        goto out;
+    }
+    bitmap_clear_bits(&s_slot_bitmap, first_slot, count);
+    s_stats.used_slots += count;
+    *first_slot_out = first_slot;
+out:
+    spinlock_unlock(&s_lock);
+    return result;
+}
+
+static void free_slots(SWAP_SLOT first_slot, size_t count) {
+    spinlock_lock(&s_lock);
+    assert(first_slot < s_stats.total_slots);
+    assert(count <= (s_stats.total_slots - first_slot));
+    assert(!bitmap_is_bit_set(&s_slot_bitmap, first_slot));
+    bitmap_set_bits(&s_slot_bitmap, first_slot, count);
+    s_stats.used_slots -= count;
+    spinlock_unlock(&s_lock);
+}
+
+void swap_free_slot(SWAP_SLOT slot) {
+    free_slots(slot, 1);
+}
+
+/*
+ * Disk drivers wait for IRQs, so interrupts are enabled while the disk is busy, even if the caller is the page fault handler.
+ * Callers must be holding s_io_lock.
+ */
+[[nodiscard]] static int do_disk_io(SWAP_SLOT first_slot, size_t page_count, bool is_write) {
+    DISK_BLOCK_ADDR block_addr = first_slot * s_blocks_per_page;
+    size_t block_count = page_count * s_blocks_per_page;
+    bool prev_interrupts = arch_irq_enable();
+    ssize_t ret;
+    if (is_write) {
+        ret = ldisk_write(s_disk, s_cluster_buf, block_addr, block_count);
+    } else {
+        ret = ldisk_read(s_disk, s_cluster_buf, block_addr, block_count);
+    }
+    arch_irq_restore(prev_interrupts);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t)ret != block_count) {
+        return -EIO;
+    }
+    return 0;
+}
+
+[[nodiscard]] int swap_write_cluster(SWAP_SLOT *first_slot_out, void *const *pages, size_t page_count) {
+    assert(page_count != 0);
+    assert(page_count <= SWAP_CLUSTER_PAGE_COUNT);
+    if (s_disk == nullptr) {
+        return -ENODEV;
+    }
+    SWAP_SLOT first_slot;
+    int ret = alloc_slots(&first_slot, page_count);
+    if (ret < 0) {
+        return ret;
+    }
+    MUTEX_LOCK(&s_io_lock);
+    for (size_t i = 0; i < page_count; i++) {
+        vmemcpy((char *)s_cluster_buf + (i * ARCH_PAGESIZE), pages[i], ARCH_PAGESIZE);
+    }
+    ret = do_disk_io(first_slot, page_count, true);
+    mutex_unlock(&s_io_lock);
+    if (ret < 0) {
+        iodev_printf(&s_disk->iodev, "swap: failed to write %zu pages at slot %u (error %d)\n", page_count, first_slot, ret);
+        free_slots(first_slot, page_count);
+        return ret;
+    }
+    spinlock_lock(&s_lock);
+    s_stats.page_outs += page_count;
+    s_stats.cluster_writes++;
+    spinlock_unlock(&s_lock);
+    *first_slot_out = first_slot;
+    return 0;
+}
+
+[[nodiscard]] int swap_read_page(PHYSPTR dest, SWAP_SLOT slot) {
+    assert(s_disk != nullptr);
+    assert(slot < s_stats.total_slots);
+    MUTEX_LOCK(&s_io_lock);
+    int ret = do_disk_io(slot, 1, false);
+    if (ret == 0) {
+        pmemcpy_out(dest, s_cluster_buf, ARCH_PAGESIZE, MMU_CACHE_INHIBIT_NO);
+    }
+    mutex_unlock(&s_io_lock);
+    if (ret < 0) {
+        iodev_printf(&s_disk->iodev, "swap: failed to read slot %u (error %d)\n", slot, ret);
+        return ret;
+    }
+    spinlock_lock(&s_lock);
+    s_stats.page_ins++;
+    spinlock_unlock(&s_lock);
+    return 0;
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <kernel/arch/interrupts.h>
 #include <kernel/arch/mmu.h>
+#include <kernel/arch/smp.h>
 #include <kernel/arch/stacktrace.h>
+#include <kernel/cpu.h>
 #include <kernel/io/co.h>
 #include <kernel/lib/bitmap.h>
 #include <kernel/lib/bst.h>
@@ -11,9 +13,15 @@
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
+#include <kernel/mem/swap.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/panic.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/tasks/waitqueue.h>
 #include <kernel/types.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -22,16 +30,49 @@
 
 /* Print when page fault occurs? */
 static bool const CONFIG_PRINT_PAGE_FAULTS = false;
+/* Print when pages are moved out to swap space? */
+static bool const CONFIG_PRINT_RECLAIM = false;
+/* Pages kept aside for page faults that can't wait for pages to be moved out to swap space */
+#define CONFIG_RESERVE_PAGE_COUNT 32
 
 /******************************************************************************/
 
+/*
+ * Set bits in the bitmap are pages that are not in the memory. For swappable objects, such pages may be in the swap space,
+ * and swap_slots tells where it is. (Swappable objects keep their uncommited_object until the object is freed)
+ */
 struct uncommited_object {
     struct list_node node;
     struct vmm_object *object;
+    SWAP_SLOT *swap_slots; /* nullptr if the object is not swappable */
     struct bitmap bitmap;
     UINT bitmap_data[];
 };
 
+/*
+ * Protects address spaces, their page tables, and everything below.
+ *
+ * Lock order: The heap writes to its memory with its lock held, and the scheduler lock may be held while touching
+ * thread stacks, so page faults may come with either of those held, and those come before this. That means we must
+ * never call the heap or the scheduler(including waking up threads) while holding this lock. PMM and swap slots come
+ * after this.
+ *
+ * Page faults also take this lock, so what this lock protects must never be touched before it's commited. Everything
+ * here is allocated with HEAP_FLAG_ZEROMEMORY or initialized right away, so it's commited from the start.
+ */
+static struct spinlock s_lock;
+
+/* Clock hand for vmm_reclaim() */
+static struct uncommited_object *s_reclaim_hand_object;
+static size_t s_reclaim_hand_page;
+
+static PHYSPTR s_reserve_pages[CONFIG_RESERVE_PAGE_COUNT];
+static size_t s_reserve_page_count;
+/* The reclaim thread waits here until the reserve needs refilling */
+static struct waitqueue s_reclaim_waitqueue;
+/* Someone took from the reserve where the reclaim thread couldn't be woken up. See take_reserved_page(). */
+static _Atomic bool s_reclaim_wakeup_pending;
+
 #ifdef NEW_VMM
 
 static struct vmm_object *take_object(struct vmm_address_space *self, struct vmm_object *object) {
@@ -404,8 +445,13 @@ void vmm_deinit_address_space(struct address_space *self) {
      */
     struct vmm_object *newobject = create_object(self, 0, 0, phys_base, mapflags);
     struct uncommited_object *uobject = create_uncommited_object(newobject, page_count);
+    if ((newobject == nullptr) || (uobject == nullptr)) {
+        goto fail_oom;
+    }
+    spinlock_lock(&s_lock);
     oldobject = take_object_with_min_size(self, page_count);
-    if ((newobject == nullptr) || (oldobject == nullptr)) {
+    if (oldobject == nullptr) {
+        spinlock_unlock(&s_lock);
         goto fail_oom;
     }
     size_t newsize = page_count * ARCH_PAGESIZE;
@@ -413,29 +459,28 @@ void vmm_deinit_address_space(struct address_space *self) {
     newobject->end = (char *)newobject->start + newsize - 1;
     /* Shrink the existing object */
     oldobject->start = (char *)oldobject->start + newsize;
-    if (oldobject->end < oldobject->start) {
-        /* The object is no longer valid. Remove it. */
-        heap_free(oldobject);
-    } else {
+    if (!(oldobject->end < oldobject->start)) {
         /* Add modified object back to the tree. */
         int ret = add_object_to_address_space(self, oldobject);
         if (ret < 0) {
             co_printf("vmm: could not add modified vm object back to vmm(error %d)\n", ret);
         }
+        oldobject = nullptr;
     }
-    oldobject = nullptr;
     list_insert_back(&self->uncommited_objects, &uobject->node, uobject);
+    spinlock_unlock(&s_lock);
+    /* If it's still here, the object is no longer valid. */
+    heap_free(oldobject);
     goto out;
 fail_oom:
     heap_free(uobject);
-    heap_free(oldobject);
     heap_free(newobject);
+    newobject = nullptr;
 out:
     return newobject;
 }
 
 [[nodiscard]] struct vmm_object *vmm_alloc_object_at(struct vmm_address_space *self, void *virt_base, PHYSPTR phys_base, size_t size, uint8_t mapflags) {
-    bool prev_interrupts = arch_irq_disable();
     assert(virt_base);
     size_t page_count = size_to_blocks(size, ARCH_PAGESIZE);
     if (phys_base != VMM_PHYSADDR_NOMAP) {
@@ -464,8 +509,10 @@ out:
         goto fail_oom;
     }
 
+    spinlock_lock(&s_lock);
     lobject = take_object_including(self, virt_base, end);
     if (lobject == nullptr) {
+        spinlock_unlock(&s_lock);
         goto fail_oom;
     }
     void *old_end = lobject->end;
@@ -479,47 +526,55 @@ out:
     rightobject->start = (char *)virt_base + (page_count * ARCH_PAGESIZE);
     rightobject->end = old_end;
 
-    if (lobject->end < lobject->start) {
-        heap_free(lobject);
-    } else {
+    if (!(lobject->end < lobject->start)) {
         /* Add modified object back to the tree. */
         int ret = add_object_to_address_space(self, lobject);
         if (ret < 0) {
             co_printf("vmm: could not add modified vm object back to vmm(error %d)\n", ret);
         }
+        lobject = nullptr;
     }
-    lobject = nullptr;
-    if (rightobject->end < rightobject->start) {
-        heap_free(rightobject);
-    } else {
+    if (!(rightobject->end < rightobject->start)) {
         /* Add modified object back to the tree. */
         int ret = add_object_to_address_space(self, rightobject);
         if (ret < 0) {
             co_printf("vmm: could not add modified vm object back to vmm(error %d)\n", ret);
         }
+        rightobject = nullptr;
     }
-    rightobject = nullptr;
     list_insert_back(&self->uncommited_objects, &uobject->node, uobject);
+    spinlock_unlock(&s_lock);
+    /* If these are still here, those are no longer valid. */
+    heap_free(lobject);
+    heap_free(rightobject);
     goto out;
 fail_oom:
     heap_free(uobject);
     heap_free(newobject);
-    heap_free(lobject);
     heap_free(rightobject);
 fail_badsize:
     newobject = nullptr;
 out:
-    arch_irq_restore(prev_interrupts);
     return newobject;
 }
 
 void vmm_free(struct vmm_object *object) {
-    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&s_lock);
     /* Remove from uncommited memory list *************************************/
     struct uncommited_object *uobject = find_object_in_uncommited(object->address_space, object->start);
     if (uobject != nullptr) {
+        if (uobject->swap_slots != nullptr) {
+            size_t page_count = vmm_get_object_size(object) / ARCH_PAGESIZE;
+            for (size_t i = 0; i < page_count; i++) {
+                if (uobject->swap_slots[i] != SWAP_SLOT_NONE) {
+                    swap_free_slot(uobject->swap_slots[i]);
+                }
+            }
+        }
+        if (s_reclaim_hand_object == uobject) {
+            s_reclaim_hand_object = nullptr;
+        }
         list_remove_node(&object->address_space->uncommited_objects, &uobject->node);
-        heap_free(uobject);
     }
     /* Free commited physical pages and unmap it. *****************************/
     for (char *ptr = object->start; (uintptr_t)ptr <= (uintptr_t)object->end; ptr += ARCH_PAGESIZE) {
@@ -535,12 +590,23 @@ void vmm_free(struct vmm_object *object) {
             }
         }
     }
+    /*
+     * Other CPUs may still have the pages in their TLB. Nobody may touch the object once it's freed, so that only matters
+     * once the address is handed out again.
+     */
+    arch_smp_shootdown_tlb();
     /* Return object back to the tree */
+    object->is_swappable = false;
+    object->guard_page_count = 0;
     int ret = add_object_to_address_space(object->address_space, object);
     if (ret < 0) {
         co_printf("vmm: could not register returned virtual memory(error %d). this may decrease usable virtual memory.\n", ret);
     }
-    arch_irq_restore(prev_interrupts);
+    spinlock_unlock(&s_lock);
+    if (uobject != nullptr) {
+        heap_free(uobject->swap_slots);
+        heap_free(uobject);
+    }
 }
 
 [[nodiscard]] struct vmm_object *vmm_alloc(struct vmm_address_space *self, size_t size, uint8_t mapflags) {
@@ -549,6 +615,138 @@ void vmm_free(struct vmm_object *object) {
 [[nodiscard]] struct vmm_object *vmm_alloc_at(struct vmm_address_space *self, void *virt_base, size_t size, uint8_t mapflags) {
     return vmm_alloc_object_at(self, virt_base, VMM_PHYSADDR_NOMAP, size, mapflags);
 }
+[[nodiscard]] struct vmm_object *vmm_alloc_swappable(struct vmm_address_space *self, size_t size, uint8_t mapflags) {
+    if (self != vmm_get_kernel_address_space()) {
+        /* vmm_reclaim() only looks at the kernel address space. */
+        return nullptr;
+    }
+    size_t page_count = size_to_blocks(size, ARCH_PAGESIZE);
+    SWAP_SLOT *swap_slots = heap_alloc(page_count * sizeof(*swap_slots), 0);
+    if (swap_slots == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < page_count; i++) {
+        swap_slots[i] = SWAP_SLOT_NONE;
+    }
+    struct vmm_object *object = vmm_alloc_object(self, VMM_PHYSADDR_NOMAP, size, mapflags);
+    if (object == nullptr) {
+        heap_free(swap_slots);
+        return nullptr;
+    }
+    spinlock_lock(&s_lock);
+    struct uncommited_object *uobject = find_object_in_uncommited(self, object->start);
+    assert(uobject != nullptr);
+    uobject->swap_slots = swap_slots;
+    object->is_swappable = true;
+    spinlock_unlock(&s_lock);
+    return object;
+}
+/*
+ * Moving out pages means swap I/O, which enables interrupts and sleeps. That's only fine if the context we allocate for
+ * had interrupts enabled, and doesn't hold any spinlock. (e.g. The heap writes to fresh vmm_alloc() memory with its lock
+ * held)
+ */
+static bool can_reclaim_for(bool irq_were_enabled) {
+    return irq_were_enabled && (cpu_get_current()->spinlock_count == 0);
+}
+
+/*
+ * Wakes up the reclaim thread if we can. It can't be done while holding other spinlocks(see s_lock), so in that case
+ * the next caller that doesn't hold any does it.
+ */
+static void wake_reclaim_thread(bool is_needed) {
+    if (!is_needed && !atomic_load_explicit(&s_reclaim_wakeup_pending, memory_order_relaxed)) {
+        return;
+    }
+    if (cpu_get_current()->spinlock_count != 0) {
+        atomic_store_explicit(&s_reclaim_wakeup_pending, true, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(&s_reclaim_wakeup_pending, false, memory_order_relaxed);
+    waitqueue_wake_one(&s_reclaim_waitqueue);
+}
+
+static PHYSPTR take_reserved_page(void) {
+    spinlock_lock(&s_lock);
+    PHYSPTR physaddr = PHYSICALPTR_NULL;
+    if (s_reserve_page_count != 0) {
+        s_reserve_page_count--;
+        physaddr = s_reserve_pages[s_reserve_page_count];
+    }
+    spinlock_unlock(&s_lock);
+    wake_reclaim_thread(true);
+    return physaddr;
+}
+
+/*
+ * Allocates a page for committing. When we are out of memory, other pages are moved out to swap space if `can_reclaim`
+ * is set(see can_reclaim_for()), and the page comes from the reserve otherwise.
+ * Returns PHYSICALPTR_NULL on failure.
+ */
+static PHYSPTR alloc_page(bool can_reclaim) {
+    assert(!spinlock_is_held(&s_lock));
+    wake_reclaim_thread(false);
+    size_t page_count = 1;
+    PHYSPTR physaddr = pmm_alloc(&page_count);
+    if (physaddr != PHYSICALPTR_NULL) {
+        return physaddr;
+    }
+    if (can_reclaim && (vmm_reclaim(SWAP_CLUSTER_PAGE_COUNT) != 0)) {
+        page_count = 1;
+        physaddr = pmm_alloc(&page_count);
+        if (physaddr != PHYSICALPTR_NULL) {
+            return physaddr;
+        }
+    }
+    return take_reserved_page();
+}
+
+[[nodiscard]] struct vmm_object *vmm_alloc_stack(struct vmm_address_space *self, size_t size, size_t commit_size) {
+    size_t page_count = size_to_blocks(size, ARCH_PAGESIZE);
+    size_t commit_page_count = size_to_blocks(commit_size, ARCH_PAGESIZE);
+    if (page_count < commit_page_count) {
+        page_count = commit_page_count;
+    }
+    if ((SIZE_MAX / ARCH_PAGESIZE) <= page_count) {
+        return nullptr;
+    }
+    size_t guard_page_count = (page_count + 1) - commit_page_count;
+    struct vmm_object *object = vmm_alloc(self, (page_count + 1) * ARCH_PAGESIZE, MAP_PROT_READ | MAP_PROT_WRITE);
+    if (object == nullptr) {
+        return nullptr;
+    }
+    spinlock_lock(&s_lock);
+    struct uncommited_object *uobject = find_object_in_uncommited(self, object->start);
+    assert(uobject != nullptr);
+    object->guard_page_count = guard_page_count;
+    spinlock_unlock(&s_lock);
+    /*
+     * Pages below guard_page_count(including the extra page 0) stay uncommited forever.
+     * alloc_page() may have to move out other pages to swap space, so interrupts must stay enabled while it runs.
+     */
+    bool can_reclaim = can_reclaim_for(arch_irq_are_enabled());
+    for (size_t i = guard_page_count; i <= page_count; i++) {
+        PHYSPTR physaddr = alloc_page(can_reclaim);
+        if (physaddr == PHYSICALPTR_NULL) {
+            goto fail_oom;
+        }
+        void *page = (char *)object->start + (i * ARCH_PAGESIZE);
+        spinlock_lock(&s_lock);
+        int ret = arch_mmu_map(page, physaddr, 1, object->mapflags, self->is_user);
+        if (ret == 0) {
+            bitmap_clear_bit(&uobject->bitmap, (long)i);
+        }
+        spinlock_unlock(&s_lock);
+        if (ret < 0) {
+            pmm_free(physaddr, 1);
+            goto fail_oom;
+        }
+    }
+    return object;
+fail_oom:
+    vmm_free(object);
+    return nullptr;
+}
 [[nodiscard]] struct vmm_object *vmm_map_mem(struct vmm_address_space *self, PHYSPTR phys_base, size_t size, uint8_t mapflags) {
     assert(phys_base != VMM_PHYSADDR_NOMAP);
     return vmm_alloc_object(self, phys_base, size, mapflags);
@@ -596,19 +794,279 @@ struct vmm_address_space *vmm_get_address_space_of(void *ptr) {
     return nullptr;
 }
 
-void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user, void *trapframe) {
+bool vmm_is_swappable(void *ptr, size_t size) {
+    struct vmm_address_space *address_space = vmm_get_address_space_of(ptr);
+    if ((address_space == nullptr) || (size == 0)) {
+        return false;
+    }
+    bool result = false;
+    uintptr_t first_page = (uintptr_t)align_ptr_down(ptr, ARCH_PAGESIZE);
+    size_t page_count = (((uintptr_t)ptr + (size - 1) - first_page) / ARCH_PAGESIZE) + 1;
+    spinlock_lock(&s_lock);
+    for (size_t i = 0; i < page_count; i++) {
+        struct uncommited_object *uobject = find_object_in_uncommited(address_space, (void *)(first_page + (i * ARCH_PAGESIZE)));
+        if ((uobject != nullptr) && (uobject->swap_slots != nullptr)) {
+            result = true;
+            break;
+        }
+    }
+    spinlock_unlock(&s_lock);
+    return result;
+}
+
+/*
+ * Returns the next uncommited_object of swappable object after `uobject`, wrapping around at the end of the list.
+ * If `uobject` is nullptr, it starts from the beginning.
+ * Returns nullptr if there are no swappable objects.
+ */
+static struct uncommited_object *next_swappable_object(struct vmm_address_space *self, struct uncommited_object *uobject) {
+    struct list_node *start_node = (uobject != nullptr) ? uobject->node.next : self->uncommited_objects.front;
+    for (int round = 0; round < 2; round++) {
+        for (struct list_node *node = (round == 0) ? start_node : self->uncommited_objects.front; node != nullptr; node = node->next) {
+            struct uncommited_object *current = node->data;
+            if (current->swap_slots != nullptr) {
+                return current;
+            }
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Picks pages to move out with the clock algorithm(which approximates LRU): Accessed flag of each page is cleared as
+ * the hand passes by, and pages that still have the flag cleared when the hand comes back are chosen.
+ * Dirty flag of chosen pages is cleared, so that we can tell whether the page was modified while it was being written.
+ */
+static size_t pick_victims(void **victims_out, size_t max_count) {
+    assert(spinlock_is_held(&s_lock));
+    struct vmm_address_space *address_space = vmm_get_kernel_address_space();
+    size_t total_pages = 0;
+    LIST_FOREACH(&address_space->uncommited_objects, object_node) {
+        struct uncommited_object *uobject = object_node->data;
+        if (uobject->swap_slots != nullptr) {
+            total_pages += vmm_get_object_size(uobject->object) / ARCH_PAGESIZE;
+        }
+    }
+    size_t count = 0;
+    /* First round may only clear accessed flags, so we need two rounds to see every page. */
+    for (size_t i = 0; (i < (total_pages * 2)) && (count < max_count); i++) {
+        struct uncommited_object *uobject = s_reclaim_hand_object;
+        if ((uobject == nullptr) || ((vmm_get_object_size(uobject->object) / ARCH_PAGESIZE) <= s_reclaim_hand_page)) {
+            uobject = next_swappable_object(address_space, uobject);
+            if (uobject == nullptr) {
+                break;
+            }
+            s_reclaim_hand_object = uobject;
+            s_reclaim_hand_page = 0;
+        }
+        size_t page_index = s_reclaim_hand_page;
+        s_reclaim_hand_page++;
+        if (bitmap_is_bit_set(&uobject->bitmap, (long)page_index)) {
+            /* Not in the memory */
+            continue;
+        }
+        void *page = (char *)uobject->object->start + (page_index * ARCH_PAGESIZE);
+        int usage = arch_mmu_get_and_clear_usage(page, MMU_USAGE_ACCESSED);
+        if ((usage < 0) || (usage & MMU_USAGE_ACCESSED)) {
+            continue;
+        }
+        bool already_picked = false;
+        for (size_t j = 0; j < count; j++) {
+            if (victims_out[j] == page) {
+                already_picked = true;
+                break;
+            }
+        }
+        if (already_picked) {
+            continue;
+        }
+        usage = arch_mmu_get_and_clear_usage(page, MMU_USAGE_DIRTY);
+        MUST_SUCCEED(usage);
+        victims_out[count] = page;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Unmaps the page that was written to swap space, and stores its physical address to `physaddr_out`.
+ * Returns false if the page can't be evicted anymore, because it was freed in the meantime.
+ */
+[[nodiscard]] static bool unmap_victim(void *page, PHYSPTR *physaddr_out, bool *was_dirty_out) {
+    assert(spinlock_is_held(&s_lock));
+    struct uncommited_object *uobject = find_object_in_uncommited(vmm_get_kernel_address_space(), page);
+    if ((uobject == nullptr) || (uobject->swap_slots == nullptr)) {
+        return false;
+    }
+    long page_index = (long)(((uintptr_t)page - (uintptr_t)uobject->object->start) / ARCH_PAGESIZE);
+    if (bitmap_is_bit_set(&uobject->bitmap, page_index)) {
+        return false;
+    }
+    int usage = arch_mmu_unmap_and_get_usage(page, physaddr_out);
+    if (usage < 0) {
+        return false;
+    }
+    *was_dirty_out = usage & MMU_USAGE_DIRTY;
+    return true;
+}
+
+/*
+ * Finishes evicting the page unmapped by unmap_victim(). Returns false if the page was modified after it was written
+ * to `slot`, and in that case it's mapped back instead.
+ */
+[[nodiscard]] static bool evict_page(void *page, PHYSPTR physaddr, bool was_dirty, SWAP_SLOT slot) {
+    assert(spinlock_is_held(&s_lock));
+    struct uncommited_object *uobject = find_object_in_uncommited(vmm_get_kernel_address_space(), page);
+    assert(uobject != nullptr);
+    long page_index = (long)(((uintptr_t)page - (uintptr_t)uobject->object->start) / ARCH_PAGESIZE);
+    if (was_dirty) {
+        int ret = arch_mmu_map(page, physaddr, 1, uobject->object->mapflags, uobject->object->address_space->is_user);
+        MUST_SUCCEED(ret);
+        return false;
+    }
+    pmm_free(physaddr, 1);
+    uobject->swap_slots[page_index] = slot;
+    bitmap_set_bit(&uobject->bitmap, page_index);
+    return true;
+}
+
+/*
+ * Picks up to `max_count` pages and writes them with single swap_write_cluster() call.
+ * Returns number of pages that were freed.
+ */
+static size_t page_out_cluster(size_t max_count) {
+    void *victims[SWAP_CLUSTER_PAGE_COUNT];
+    PHYSPTR physaddrs[SWAP_CLUSTER_PAGE_COUNT];
+    bool was_dirty[SWAP_CLUSTER_PAGE_COUNT];
+    assert(max_count <= SWAP_CLUSTER_PAGE_COUNT);
+    spinlock_lock(&s_lock);
+    size_t count = pick_victims(victims, max_count);
+    /* Other CPUs may have the dirty flag we just cleared in their TLB, and writing through that won't set it again. */
+    if (count != 0) {
+        arch_smp_shootdown_tlb();
+    }
+    spinlock_unlock(&s_lock);
+    if (count == 0) {
+        return 0;
+    }
+    SWAP_SLOT first_slot;
+    int ret = swap_write_cluster(&first_slot, victims, count);
+    if (ret < 0) {
+        return 0;
+    }
+    size_t freed_count = 0;
+    spinlock_lock(&s_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (!unmap_victim(victims[i], &physaddrs[i], &was_dirty[i])) {
+            victims[i] = nullptr;
+        }
+    }
+    /*
+     * Other CPUs may still write to the pages through their TLB until they flush it, and we can only trust the dirty
+     * flag after that.
+     */
+    arch_smp_shootdown_tlb();
+    for (size_t i = 0; i < count; i++) {
+        if ((victims[i] != nullptr) && evict_page(victims[i], physaddrs[i], was_dirty[i], first_slot + i)) {
+            freed_count++;
+        } else {
+            swap_free_slot(first_slot + i);
+        }
+    }
+    spinlock_unlock(&s_lock);
+    if (CONFIG_PRINT_RECLAIM) {
+        co_printf("vmm: moved out %zu of %zu pages to swap slot %u~\n", freed_count, count, first_slot);
+    }
+    return freed_count;
+}
+
+size_t vmm_reclaim(size_t page_count) {
+    if (!swap_is_enabled()) {
+        return 0;
+    }
+    size_t freed_count = 0;
+    while (freed_count < page_count) {
+        size_t count = page_count - freed_count;
+        if (SWAP_CLUSTER_PAGE_COUNT < count) {
+            count = SWAP_CLUSTER_PAGE_COUNT;
+        }
+        size_t result = page_out_cluster(count);
+        if (result == 0) {
+            break;
+        }
+        freed_count += result;
+    }
+    return freed_count;
+}
+
+/*
+ * Returns false if there's no memory left to refill it with.
+ */
+static bool refill_reserve(void) {
+    while (1) {
+        spinlock_lock(&s_lock);
+        bool is_full = (CONFIG_RESERVE_PAGE_COUNT <= s_reserve_page_count);
+        spinlock_unlock(&s_lock);
+        if (is_full) {
+            return true;
+        }
+        size_t page_count = 1;
+        PHYSPTR physaddr = pmm_alloc(&page_count);
+        if (physaddr == PHYSICALPTR_NULL) {
+            if (vmm_reclaim(SWAP_CLUSTER_PAGE_COUNT) == 0) {
+                return false;
+            }
+            continue;
+        }
+        spinlock_lock(&s_lock);
+        assert(s_reserve_page_count < CONFIG_RESERVE_PAGE_COUNT);
+        s_reserve_pages[s_reserve_page_count] = physaddr;
+        s_reserve_page_count++;
+        spinlock_unlock(&s_lock);
+    }
+}
+
+static void reclaim_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        if (!refill_reserve() && CONFIG_PRINT_RECLAIM) {
+            co_printf("vmm: could not refill the page reserve(%zu pages left)\n", s_reserve_page_count);
+        }
+        sched_lock();
+        waitqueue_wait(&s_reclaim_waitqueue);
+        sched_unlock();
+    }
+}
+
+void vmm_start_reclaim_thread(void) {
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, reclaim_thread_main, nullptr);
+    if (thread == nullptr) {
+        panic("vmm: not enough memory to create the reclaim thread");
+    }
+    int ret = sched_queue(thread);
+    MUST_SUCCEED(ret);
+    thread_detach(thread);
+}
+
+void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user, bool was_irq_enabled, void *trapframe) {
     if (CONFIG_PRINT_PAGE_FAULTS) {
         co_printf("[PF] addr=%p, was_present=%d, was_write=%d, was_user=%d\n", ptr, was_present, was_write, was_user);
     }
     void *page_base = align_ptr_down(ptr, ARCH_PAGESIZE);
     PHYSPTR physaddr = 0;
+    struct uncommited_object *uobject_to_free = nullptr;
+    bool can_reclaim = can_reclaim_for(was_irq_enabled);
+    bool can_use_heap = (cpu_get_current()->spinlock_count == 0);
+    /* Nothing we touch with the lock held should be uncommited. */
+    assert(!spinlock_is_held(&s_lock));
+    spinlock_lock(&s_lock);
 
     /* Is it valid address? ***************************************************/
     int ret = arch_mmu_emulate(&physaddr, ptr, MAP_PROT_READ | (was_write ? MAP_PROT_WRITE : 0U), was_user);
     if (ret == 0) {
-        /* It's a valid access, but TLB was out of sync. */
+        /* It's a valid access, but TLB was out of sync, or another CPU commited the page in the meantime. */
         arch_mmu_flush_tlb_for(ptr);
-        return;
+        goto out;
     }
     if (was_present) {
         co_printf("privilege violation: attempted to %s on page at %p\n", was_write ? "read" : "write", ptr);
@@ -633,6 +1091,10 @@ void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user,
     }
 
     long page_index = (long)(((uintptr_t)page_base - (uintptr_t)uobject->object->start) / ARCH_PAGESIZE);
+    if (page_index < (long)uobject->object->guard_page_count) {
+        co_printf("stack overflow: attempted to %s on guard page at %p\n", was_write ? "write" : "read", ptr);
+        goto realfault;
+    }
     if (!bitmap_is_bit_set(&uobject->bitmap, page_index)) {
         /* Already commited page...? */
         co_printf("non-present page %p(base: %p) but it's already commited. WTF?\n", ptr, page_base);
@@ -640,30 +1102,64 @@ void vmm_page_fault(void *ptr, bool was_present, bool was_write, bool was_user,
     }
 
     /* It is uncommited object *************************************************/
-    bitmap_clear_bit(&uobject->bitmap, page_index);
-    size_t page_count = 1;
     if (uobject->object->phys_base != VMM_PHYSADDR_NOMAP) {
         physaddr = uobject->object->phys_base + (page_index * ARCH_PAGESIZE);
     } else {
-        physaddr = pmm_alloc(&page_count);
+        SWAP_SLOT slot = (uobject->swap_slots != nullptr) ? uobject->swap_slots[page_index] : SWAP_SLOT_NONE;
+        if ((slot != SWAP_SLOT_NONE) && !can_reclaim) {
+            co_printf("swapped out page %p was accessed where we can't wait for disk I/O\n", page_base);
+            panic("swapped out page accessed with interrupts disabled or spinlock held");
+        }
+        spinlock_unlock(&s_lock);
+        physaddr = alloc_page(can_reclaim);
         if (physaddr == PHYSICALPTR_NULL) {
             /* TODO: Run the OOM killer */
             panic("ran out of memory while trying to commit the page");
         }
+        if (slot != SWAP_SLOT_NONE) {
+            ret = swap_read_page(physaddr, slot);
+            if (ret < 0) {
+                co_printf("could not read page %p back from swap space (error %d)\n", page_base, ret);
+                panic("failed to read swapped out page");
+            }
+        }
+        spinlock_lock(&s_lock);
+        /*
+         * We didn't hold the lock while allocating and reading the page, so someone else may have brought in the page
+         * or freed the object in the meantime. In that case just throw away the page, and let the CPU retry the access.
+         */
+        if ((find_object_in_uncommited(address_space, page_base) != uobject) || !bitmap_is_bit_set(&uobject->bitmap, page_index) || ((uobject->swap_slots != nullptr) && (uobject->swap_slots[page_index] != slot))) {
+            spinlock_unlock(&s_lock);
+            pmm_free(physaddr, 1);
+            return;
+        }
+        if (slot != SWAP_SLOT_NONE) {
+            uobject->swap_slots[page_index] = SWAP_SLOT_NONE;
+            swap_free_slot(slot);
+        }
     }
+    bitmap_clear_bit(&uobject->bitmap, page_index);
     ret = arch_mmu_map(page_base, physaddr, 1, uobject->object->mapflags, uobject->object->address_space->is_user);
     if (ret < 0) {
         co_printf("arch_mmu_map failed (error %d)\n", ret);
         panic("failed to map allocated memory");
     }
-    if (bitmap_find_first_set_bit(&uobject->bitmap, 0) < 0) {
+    /*
+     * The fault may have come from inside the heap, and then we can't give the uncommited_object back. It's harmless to
+     * keep it, and vmm_free() frees it later.
+     */
+    if ((uobject->swap_slots == nullptr) && (bitmap_find_first_set_bit(&uobject->bitmap, 0) < 0) && can_use_heap) {
         list_remove_node(&uobject->object->address_space->uncommited_objects, &uobject->node);
-        heap_free(uobject);
+        uobject_to_free = uobject;
     }
+out:
+    spinlock_unlock(&s_lock);
+    heap_free(uobject_to_free);
     return;
 nonpresent:
     co_printf("attempted to %s on non-present page at %p\n", was_write ? "read" : "write", ptr);
 realfault:
+    spinlock_unlock(&s_lock);
     arch_stacktrace_for_trapframe(trapframe);
     panic("fatal memory access fault");
 }
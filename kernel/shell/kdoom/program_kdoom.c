@@ -5,10 +5,13 @@
 #include <assert.h>
 #include <kernel/arch/hcf.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/heap.h>
+#include <kernel/mem/vmm.h>
 #include <kernel/panic.h>
 #include <kernel/raster/fb.h>
+#include <kernel/tasks/thread.h>
 #include <kernel/ticktime.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -20,36 +23,58 @@
 #define false false
 #include "thirdparty/PureDOOM.h"
 
-void __floatsidf(void) {
-    /* STUB */
-    assert(0);
-}
-void __divdf3(void) {
-    /* STUB */
-    assert(0);
-}
-void __muldf3(void) {
-    /* STUB */
-    assert(0);
-}
-void __gedf2(void) {
-    /* STUB */
-    assert(0);
-}
-void __ltdf2(void) {
-    /* STUB */
-    assert(0);
-}
-void __fixdfsi(void) {
-    /* STUB */
-    assert(0);
-}
+/******************************** Configuration *******************************/
+
+/*
+ * Allocations at least this large(most notably DOOM's zone memory) are made swappable, so that they can be moved out to
+ * swap space when the system runs low on memory.
+ */
+static size_t const CONFIG_MIN_SWAPPABLE_ALLOC_SIZE = 64 * 1024;
 
 /******************************************************************************/
 
+struct swappable_alloc {
+    struct list_node node;
+    struct vmm_object *object;
+};
+
+static struct list s_swappable_allocs;
+
+static void *alloc_swappable(size_t size) {
+    struct swappable_alloc *alloc = heap_alloc(sizeof(*alloc), 0);
+    if (alloc == nullptr) {
+        return nullptr;
+    }
+    alloc->object = vmm_alloc_swappable(vmm_get_kernel_address_space(), size, MAP_PROT_READ | MAP_PROT_WRITE);
+    if (alloc->object == nullptr) {
+        heap_free(alloc);
+        return nullptr;
+    }
+    list_insert_back(&s_swappable_allocs, &alloc->node, alloc);
+    return alloc->object->start;
+}
+
+static bool free_swappable(void *ptr) {
+    LIST_FOREACH(&s_swappable_allocs, node) {
+        struct swappable_alloc *alloc = node->data;
+        if (alloc->object->start == ptr) {
+            list_remove_node(&s_swappable_allocs, &alloc->node);
+            vmm_free(alloc->object);
+            heap_free(alloc);
+            return true;
+        }
+    }
+    return false;
+}
+
 static void *dmalloc(int size) {
     size_t finalsize = size * 2;
-    void *ptr = heap_alloc(finalsize, 0);
+    void *ptr;
+    if (CONFIG_MIN_SWAPPABLE_ALLOC_SIZE <= finalsize) {
+        ptr = alloc_swappable(finalsize);
+    } else {
+        ptr = heap_alloc(finalsize, 0);
+    }
     if (ptr == nullptr) {
         co_printf("[kdoom] not enough memory (Requested %d bytes)\n", size);
     }
@@ -57,6 +82,9 @@ static void *dmalloc(int size) {
 }
 
 static void dfree(void *ptr) {
+    if (free_swappable(ptr)) {
+        return;
+    }
     return;
     heap_free(ptr);
 }
@@ -166,6 +194,11 @@ static void dgettime(int *sec, int *usec) {
 #define MIDIPERIOD (1000 / 140) /* 140Hz */
 
 static int program_main(int argc, char *argv[]) {
+    int ret = thread_enable_fpu();
+    if (ret < 0) {
+        co_printf("[kdoom] can't use FPU (error %d)\n", ret);
+        return 1;
+    }
     doom_set_malloc(dmalloc, dfree);
     doom_set_print(dprint);
     doom_set_exit(dexit);
@@ -0,0 +1,68 @@
+#include "shell.h"
+#include <kernel/io/bcache.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/strutil.h>
+#include <stdio.h>
+#include <unistd.h>
+
+struct opts {
+    bool sync : 1;
+};
+
+[[nodiscard]] static bool getopts(struct opts *out, int argc, char *argv[]) {
+    bool ok = true;
+    int c;
+    vmemset(out, 0, sizeof(*out));
+    while (1) {
+        c = getopt(argc, argv, "s");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 's':
+            out->sync = true;
+            break;
+        case '?':
+        case ':':
+            ok = false;
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return ok;
+}
+
+static int program_main(int argc, char *argv[]) {
+    struct opts opts;
+    if (!getopts(&opts, argc, argv) || (argc != optind)) {
+        co_printf("usage: %s [-s]\n", argv[0]);
+        return 1;
+    }
+    if (opts.sync) {
+        int ret = bcache_sync();
+        if (ret < 0) {
+            co_printf("%s: failed to write back dirty blocks (error %d)\n", argv[0], ret);
+            return 1;
+        }
+    }
+    struct bcache_stats stats;
+    bcache_get_stats(&stats);
+    uint64_t total = stats.hits + stats.misses;
+    co_printf("hits:         %llu\n", stats.hits);
+    co_printf("misses:       %llu\n", stats.misses);
+    if (total != 0) {
+        co_printf("hit ratio:    %llu%%\n", (stats.hits * 100) / total);
+    }
+    co_printf("writebacks:   %llu\n", stats.writebacks);
+    co_printf("evictions:    %llu\n", stats.evictions);
+    co_printf("dirty blocks: %zu\n", stats.dirty_count);
+    co_printf("cached:       %zu KiB / %zu KiB\n", stats.cached_size / 1024, stats.max_size / 1024);
+    return 0;
+}
+
+struct shell_program g_shell_program_bcachestat = {
+    .name = "bcachestat",
+    .main = program_main,
+};
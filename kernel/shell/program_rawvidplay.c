@@ -2,10 +2,15 @@
 #include <assert.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/io/co.h>
+#include <kernel/lib/diagnostics.h>
 #include <kernel/raster/fb.h>
+#include <kernel/tasks/sched.h>
 #include <stddef.h>
 
 #define FRAME_SIZE (640 * 480 * 2)
+/* Frames are shown at 30fps, and each frame may take up to this much CPU time, in ticks. */
+#define FRAME_PERIOD 33
+#define FRAME_BUDGET 20
 
 static FB_COLOR s_framebuffer[FRAME_SIZE];
 
@@ -20,6 +25,12 @@ static int program_main(int argc, char *argv[]) {
         co_printf("can't open file\n");
         return 1;
     }
+    struct thread *thread = sched_get_current_thread();
+    ret = sched_set_deadline(thread, FRAME_PERIOD, FRAME_BUDGET);
+    bool paced = (0 <= ret);
+    if (!paced) {
+        co_printf("can't reserve CPU time for playback(error %d), frames will not be paced\n", ret);
+    }
     for (size_t i = 0;; i++) {
         ret = vfs_read_file(fd, s_framebuffer, FRAME_SIZE);
         if (ret == 0) {
@@ -33,6 +44,13 @@ static int program_main(int argc, char *argv[]) {
         }
         fb_draw_image(s_framebuffer, 640, 480, 640, 0, 0);
         fb_update();
+        if (paced) {
+            sched_wait_next_period();
+        }
+    }
+    if (paced) {
+        ret = sched_set_deadline(thread, 0, 0);
+        MUST_SUCCEED(ret);
     }
     return 0;
 }
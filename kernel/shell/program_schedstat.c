@@ -0,0 +1,27 @@
+#include "shell.h"
+#include <kernel/io/co.h>
+#include <kernel/tasks/sched.h>
+#include <stdint.h>
+
+static int program_main(int argc, char *argv[]) {
+    if (argc != 1) {
+        co_printf("usage: %s\n", argv[0]);
+        return 1;
+    }
+    struct sched_stats stats;
+    sched_get_stats(&stats);
+    co_printf("context switches:     %llu\n", stats.context_switches);
+    co_printf("slice expirations:    %llu\n", stats.slice_expirations);
+    co_printf("priority preemptions: %llu\n", stats.priority_preemptions);
+    co_printf("deadline throttles:   %llu\n", stats.deadline_throttles);
+    co_printf("deadline misses:      %llu\n", stats.deadline_misses);
+    co_printf("migrations:           %llu\n", stats.migrations);
+    co_printf("reserved by deadline threads: %u.%u%%\n", (unsigned)(stats.deadline_utilization / 10), (unsigned)(stats.deadline_utilization % 10));
+    co_printf("time slices: %llu ticks (priority < 0), %llu ticks (priority 0), %llu ticks (priority %d)\n", sched_get_time_slice(-1), sched_get_time_slice(0), sched_get_time_slice(INT8_MAX), INT8_MAX);
+    return 0;
+}
+
+struct shell_program g_shell_program_schedstat = {
+    .name = "schedstat",
+    .main = program_main,
+};
@@ -0,0 +1,102 @@
+#include "shell.h"
+#include <kernel/io/co.h>
+#include <kernel/io/disk.h>
+#include <kernel/io/iodev.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/swap.h>
+#include <stdio.h>
+#include <unistd.h>
+
+struct opts {
+    bool summary : 1;
+};
+
+[[nodiscard]] static bool getopts(struct opts *out, int argc, char *argv[]) {
+    bool ok = true;
+    int c;
+    vmemset(out, 0, sizeof(*out));
+    while (1) {
+        c = getopt(argc, argv, "s");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 's':
+            out->summary = true;
+            break;
+        case '?':
+        case ':':
+            ok = false;
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Returns nullptr if not found.
+ */
+static struct ldisk *find_ldisk(char const *name) {
+    struct list *list = iodev_get_list(IODEV_TYPE_LOGICAL_DISK);
+    if (list == nullptr) {
+        return nullptr;
+    }
+    LIST_FOREACH(list, devnode) {
+        struct iodev *dev = devnode->data;
+        char devname[32];
+        snprintf(devname, sizeof(devname), "%s%zu", dev->devtype, dev->id);
+        if (kstrcmp(devname, name) == 0) {
+            return dev->data;
+        }
+    }
+    return nullptr;
+}
+
+static void show_summary(void) {
+    if (!swap_is_enabled()) {
+        co_printf("swap is not enabled\n");
+        return;
+    }
+    struct swap_stats stats;
+    swap_get_stats(&stats);
+    co_printf("total pages:    %zu\n", stats.total_slots);
+    co_printf("used pages:     %zu\n", stats.used_slots);
+    co_printf("page-ins:       %llu\n", stats.page_ins);
+    co_printf("page-outs:      %llu\n", stats.page_outs);
+    co_printf("cluster writes: %llu\n", stats.cluster_writes);
+}
+
+static int program_main(int argc, char *argv[]) {
+    struct opts opts;
+    if (!getopts(&opts, argc, argv)) {
+        return 1;
+    }
+    if (opts.summary) {
+        show_summary();
+        return 0;
+    }
+    if ((argc - optind) != 1) {
+        co_printf("usage: %s [-s] [disk]\n", argv[0]);
+        return 1;
+    }
+    struct ldisk *disk = find_ldisk(argv[optind]);
+    if (disk == nullptr) {
+        co_printf("%s: no such logical disk %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+    int ret = swap_enable(disk);
+    if (ret < 0) {
+        co_printf("%s: failed to enable swap on %s (error %d)\n", argv[0], argv[optind], ret);
+        return 1;
+    }
+    return 0;
+}
+
+struct shell_program g_shell_program_swapon = {
+    .name = "swapon",
+    .main = program_main,
+};
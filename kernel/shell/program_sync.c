@@ -0,0 +1,21 @@
+#include "shell.h"
+#include <kernel/fs/vfs.h>
+#include <kernel/io/co.h>
+
+static int program_main(int argc, char *argv[]) {
+    if (argc != 1) {
+        co_printf("usage: %s\n", argv[0]);
+        return 1;
+    }
+    int ret = vfs_sync();
+    if (ret < 0) {
+        co_printf("%s: failed to sync (error %d)\n", argv[0], ret);
+        return 1;
+    }
+    return 0;
+}
+
+struct shell_program g_shell_program_sync = {
+    .name = "sync",
+    .main = program_main,
+};
@@ -0,0 +1,155 @@
+#include "shell.h"
+#include <ctype.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/mem/heap.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Threads beyond this are not shown */
+#define MAX_THREAD_COUNT 64
+
+struct opts {
+    size_t count;
+    TICKTIME delay;
+};
+
+/*
+ * Returns false if `str` is not a decimal number.
+ */
+[[nodiscard]] static bool parse_number(uint64_t *out, char const *str) {
+    uint64_t result = 0;
+    if (*str == '\0') {
+        return false;
+    }
+    for (char const *c = str; *c != '\0'; c++) {
+        if (!isdigit(*c)) {
+            return false;
+        }
+        result = (result * 10) + (uint64_t)(*c - '0');
+    }
+    *out = result;
+    return true;
+}
+
+[[nodiscard]] static bool getopts(struct opts *out, int argc, char *argv[]) {
+    bool ok = true;
+    int c;
+    uint64_t value;
+    vmemset(out, 0, sizeof(*out));
+    out->count = 5;
+    out->delay = 1000;
+    while (1) {
+        c = getopt(argc, argv, "d:n:");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            if (!parse_number(&value, optarg) || (value == 0)) {
+                co_printf("%s: bad delay %s\n", argv[0], optarg);
+                ok = false;
+                break;
+            }
+            out->delay = value;
+            break;
+        case 'n':
+            if (!parse_number(&value, optarg) || (value == 0)) {
+                co_printf("%s: bad count %s\n", argv[0], optarg);
+                ok = false;
+                break;
+            }
+            out->count = value;
+            break;
+        case '?':
+        case ':':
+            ok = false;
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Returns nullptr if the thread didn't exist in the previous sample.
+ */
+static struct thread_stats const *find_thread(struct thread_stats const *samples, size_t count, size_t id) {
+    for (size_t i = 0; i < count; i++) {
+        if (samples[i].id == id) {
+            return &samples[i];
+        }
+    }
+    return nullptr;
+}
+
+static void print_table(struct thread_stats const *oldsamples, size_t oldcount, struct thread_stats const *newsamples, size_t newcount, uint64_t elapsed_cycles) {
+    co_printf("   ID  PRI   CPU%%   WAIT%%      VOL    INVOL   MISSED\n");
+    for (size_t i = 0; i < newcount; i++) {
+        struct thread_stats const *new = &newsamples[i];
+        struct thread_stats const *old = find_thread(oldsamples, oldcount, new->id);
+        uint64_t run = new->run_cycles;
+        uint64_t wait = new->wait_cycles;
+        if (old != nullptr) {
+            run -= old->run_cycles;
+            wait -= old->wait_cycles;
+        }
+        /* In 0.1% units */
+        uint64_t run_permille = (elapsed_cycles != 0) ? ((run * 1000) / elapsed_cycles) : 0;
+        uint64_t wait_permille = (elapsed_cycles != 0) ? ((wait * 1000) / elapsed_cycles) : 0;
+        co_printf("%5zu %4d %4llu.%llu %5llu.%llu %8llu %8llu %8llu%s%s%s\n", new->id, new->priority, run_permille / 10, run_permille % 10, wait_permille / 10, wait_permille % 10, new->voluntary_switches, new->involuntary_switches, new->missed_deadlines, new->is_idle ? " [idle]" : "", new->is_deadline ? " [deadline]" : "", new->exited ? " [exited]" : "");
+    }
+}
+
+static int program_main(int argc, char *argv[]) {
+    struct opts opts;
+    int result = 0;
+    if (!getopts(&opts, argc, argv)) {
+        return 1;
+    }
+    if (optind != argc) {
+        co_printf("usage: %s [-d delay] [-n count]\n", argv[0]);
+        return 1;
+    }
+    struct thread_stats *oldsamples = heap_alloc(sizeof(*oldsamples) * MAX_THREAD_COUNT, 0);
+    struct thread_stats *newsamples = heap_alloc(sizeof(*newsamples) * MAX_THREAD_COUNT, 0);
+    if ((oldsamples == nullptr) || (newsamples == nullptr)) {
+        co_printf("%s: not enough memory\n", argv[0]);
+        result = SHELL_EXITCODE_OUTOFMEMORY;
+        goto out;
+    }
+    size_t oldcount = thread_get_all_stats(oldsamples, MAX_THREAD_COUNT);
+    if (MAX_THREAD_COUNT < oldcount) {
+        oldcount = MAX_THREAD_COUNT;
+    }
+    uint64_t oldtsc = arch_read_tsc();
+    for (size_t i = 0; i < opts.count; i++) {
+        thread_sleep(opts.delay);
+        size_t newcount = thread_get_all_stats(newsamples, MAX_THREAD_COUNT);
+        uint64_t newtsc = arch_read_tsc();
+        size_t shown_count = (MAX_THREAD_COUNT < newcount) ? MAX_THREAD_COUNT : newcount;
+        co_printf("\n%zu threads, last %llu ms\n", newcount, opts.delay);
+        print_table(oldsamples, oldcount, newsamples, shown_count, newtsc - oldtsc);
+        /* New sample becomes the old one for the next round */
+        struct thread_stats *temp = oldsamples;
+        oldsamples = newsamples;
+        newsamples = temp;
+        oldcount = shown_count;
+        oldtsc = newtsc;
+    }
+out:
+    heap_free(oldsamples);
+    heap_free(newsamples);
+    return result;
+}
+
+struct shell_program g_shell_program_top = {
+    .name = "top",
+    .main = program_main,
+};
@@ -30,6 +30,11 @@ void shell_init(void);
     _x(g_shell_program_false)       \
     _x(g_shell_program_cat)         \
     _x(g_shell_program_uname)       \
+    _x(g_shell_program_swapon)      \
+    _x(g_shell_program_schedstat)   \
+    _x(g_shell_program_bcachestat)  \
+    _x(g_shell_program_sync)        \
+    _x(g_shell_program_top)         \
 
 #define X(_x)   extern struct shell_program _x;
 ENUMERATE_SHELLPROGRAMS(X)
@@ -0,0 +1,260 @@
+#include "../test.h"
+#include <errno.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/bcache.h>
+#include <kernel/io/disk.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/semaphore.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    BLOCK_SIZE = 512,
+    BLOCK_COUNT = 16,
+    TEST_TIMEOUT = 1000,
+};
+
+/* Disk in memory that isn't registered anywhere, so that only we touch it. */
+struct ramdisk {
+    uint8_t blocks[BLOCK_COUNT][BLOCK_SIZE];
+    size_t read_count;
+    size_t write_count;
+    size_t flush_count;
+    /* If set, reads wait for read_gate after posting read_started. */
+    bool gate_reads;
+    struct semaphore read_started;
+    struct semaphore read_gate;
+};
+
+static int ramdisk_op_read(struct pdisk *self, void *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    struct ramdisk *disk = self->data;
+    if (BLOCK_COUNT < (block_addr + block_count)) {
+        return -EIO;
+    }
+    if (disk->gate_reads) {
+        semaphore_post(&disk->read_started);
+        semaphore_wait(&disk->read_gate);
+    }
+    vmemcpy(buf, disk->blocks[block_addr], block_count * BLOCK_SIZE);
+    disk->read_count++;
+    return 0;
+}
+
+static int ramdisk_op_write(struct pdisk *self, void const *buf, DISK_BLOCK_ADDR block_addr, size_t block_count) {
+    struct ramdisk *disk = self->data;
+    if (BLOCK_COUNT < (block_addr + block_count)) {
+        return -EIO;
+    }
+    vmemcpy(disk->blocks[block_addr], buf, block_count * BLOCK_SIZE);
+    disk->write_count++;
+    return 0;
+}
+
+static int ramdisk_op_flush(struct pdisk *self) {
+    struct ramdisk *disk = self->data;
+    disk->flush_count++;
+    return 0;
+}
+
+static struct pdisk_ops const OPS = {
+    .read = ramdisk_op_read,
+    .write = ramdisk_op_write,
+    .flush = ramdisk_op_flush,
+};
+
+static struct ramdisk s_ramdisk;
+static struct pdisk s_pdisk = {
+    .ops = &OPS,
+    .block_size = BLOCK_SIZE,
+    .data = &s_ramdisk,
+};
+
+static void init_ramdisk(void) {
+    vmemset(&s_ramdisk, 0, sizeof(s_ramdisk));
+    for (size_t i = 0; i < BLOCK_COUNT; i++) {
+        vmemset(s_ramdisk.blocks[i], (int)i, BLOCK_SIZE);
+    }
+}
+
+static bool do_read_cache(void) {
+    static uint8_t buf[4 * BLOCK_SIZE];
+    init_ramdisk();
+    struct bcache_stats old_stats;
+    bcache_get_stats(&old_stats);
+    int ret = bcache_read(&s_pdisk, buf, 0, 4);
+    TEST_EXPECT(ret == 0);
+    /* Consecutive misses should be read at once */
+    TEST_EXPECT(s_ramdisk.read_count == 1);
+    vmemset(buf, 0xff, sizeof(buf));
+    ret = bcache_read(&s_pdisk, buf, 0, 4);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.read_count == 1);
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        TEST_EXPECT(buf[i] == (i / BLOCK_SIZE));
+    }
+    struct bcache_stats stats;
+    bcache_get_stats(&stats);
+    TEST_EXPECT((old_stats.misses + 4) <= stats.misses);
+    TEST_EXPECT((old_stats.hits + 4) <= stats.hits);
+    /* Entry headers and allocation overhead count against the budget too */
+    TEST_EXPECT((old_stats.cached_size + (4 * BLOCK_SIZE)) < stats.cached_size);
+    ret = bcache_invalidate(&s_pdisk, 0, BLOCK_COUNT);
+    TEST_EXPECT(ret == 0);
+    return true;
+}
+
+static bool do_write_back(void) {
+    static uint8_t buf[2 * BLOCK_SIZE];
+    init_ramdisk();
+    vmemset(buf, 0xaa, sizeof(buf));
+    int ret = bcache_write(&s_pdisk, buf, 2, 2);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.write_count == 0);
+    TEST_EXPECT(s_ramdisk.blocks[2][0] == 2);
+    vmemset(buf, 0, sizeof(buf));
+    ret = bcache_read(&s_pdisk, buf, 2, 2);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.read_count == 0);
+    TEST_EXPECT(buf[0] == 0xaa);
+    TEST_EXPECT(buf[sizeof(buf) - 1] == 0xaa);
+    ret = bcache_sync();
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.write_count == 2);
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        TEST_EXPECT(s_ramdisk.blocks[2][i] == 0xaa);
+        TEST_EXPECT(s_ramdisk.blocks[3][i] == 0xaa);
+    }
+    /* Clean blocks shouldn't be written again */
+    ret = bcache_sync();
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.write_count == 2);
+    /* Syncing alone doesn't flush the disk */
+    TEST_EXPECT(s_ramdisk.flush_count == 0);
+    ret = bcache_invalidate(&s_pdisk, 0, BLOCK_COUNT);
+    TEST_EXPECT(ret == 0);
+    return true;
+}
+
+static bool do_eviction(void) {
+    static uint8_t buf[BLOCK_SIZE];
+    init_ramdisk();
+    struct bcache_stats old_stats;
+    bcache_get_stats(&old_stats);
+    bcache_set_max_size(4 * BLOCK_SIZE);
+    /* Dirty block should be written back when it's evicted */
+    vmemset(buf, 0xcc, sizeof(buf));
+    int ret = bcache_write(&s_pdisk, buf, 0, 1);
+    TEST_EXPECT(ret == 0);
+    for (DISK_BLOCK_ADDR i = 1; i < 8; i++) {
+        ret = bcache_read(&s_pdisk, buf, i, 1);
+        TEST_EXPECT(ret == 0);
+        TEST_EXPECT(buf[0] == i);
+    }
+    struct bcache_stats stats;
+    bcache_get_stats(&stats);
+    TEST_EXPECT(stats.cached_size <= (4 * BLOCK_SIZE));
+    TEST_EXPECT((old_stats.evictions + 4) <= stats.evictions);
+    TEST_EXPECT(s_ramdisk.blocks[0][0] == 0xcc);
+    /* Most recently used block should still be there, and the first one shouldn't */
+    size_t old_read_count = s_ramdisk.read_count;
+    ret = bcache_read(&s_pdisk, buf, 7, 1);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.read_count == old_read_count);
+    ret = bcache_read(&s_pdisk, buf, 0, 1);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.read_count == (old_read_count + 1));
+    TEST_EXPECT(buf[0] == 0xcc);
+    bcache_set_max_size(old_stats.max_size);
+    ret = bcache_invalidate(&s_pdisk, 0, BLOCK_COUNT);
+    TEST_EXPECT(ret == 0);
+    return true;
+}
+
+static bool do_flush(void) {
+    static uint8_t buf[BLOCK_SIZE];
+    init_ramdisk();
+    vmemset(buf, 0x55, sizeof(buf));
+    int ret = bcache_write(&s_pdisk, buf, 5, 1);
+    TEST_EXPECT(ret == 0);
+    ret = bcache_flush(&s_pdisk);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.write_count == 1);
+    TEST_EXPECT(s_ramdisk.flush_count == 1);
+    TEST_EXPECT(s_ramdisk.blocks[5][0] == 0x55);
+    ret = bcache_invalidate(&s_pdisk, 0, BLOCK_COUNT);
+    TEST_EXPECT(ret == 0);
+    return true;
+}
+
+struct slow_read_context {
+    uint8_t buf[BLOCK_SIZE];
+    int ret;
+};
+
+static void slow_read_thread(void *arg) {
+    arch_irq_enable();
+    struct slow_read_context *ctx = arg;
+    ctx->ret = bcache_read(&s_pdisk, ctx->buf, 8, 1);
+}
+
+static bool do_hit_during_miss(void) {
+    static uint8_t buf[BLOCK_SIZE];
+    static struct slow_read_context ctx;
+    init_ramdisk();
+    semaphore_init(&s_ramdisk.read_started, 0);
+    semaphore_init(&s_ramdisk.read_gate, 0);
+    int ret = bcache_read(&s_pdisk, buf, 0, 1);
+    TEST_EXPECT(ret == 0);
+    size_t old_read_count = s_ramdisk.read_count;
+
+    /* Block 8 isn't cached, so the thread gets stuck in the middle of reading it. */
+    ctx.ret = -EIO;
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, slow_read_thread, &ctx);
+    TEST_EXPECT(thread != nullptr);
+    s_ramdisk.gate_reads = true;
+    ret = sched_queue(thread);
+    if (ret < 0) {
+        s_ramdisk.gate_reads = false;
+        thread_delete(thread);
+    }
+    TEST_EXPECT(ret == 0);
+    bool started = semaphore_wait_until(&s_ramdisk.read_started, g_ticktime + TEST_TIMEOUT);
+    s_ramdisk.gate_reads = false;
+
+    /* Cached blocks shouldn't have to wait for that read. */
+    vmemset(buf, 0xff, sizeof(buf));
+    int hit_ret = bcache_read(&s_pdisk, buf, 0, 1);
+    vmemset(buf, 0x77, sizeof(buf));
+    int write_ret = bcache_write(&s_pdisk, buf, 1, 1);
+    bool read_done = (s_ramdisk.read_count != old_read_count);
+
+    semaphore_post(&s_ramdisk.read_gate);
+    thread_join(thread);
+    TEST_EXPECT(started);
+    TEST_EXPECT(hit_ret == 0);
+    TEST_EXPECT(write_ret == 0);
+    TEST_EXPECT(!read_done);
+    TEST_EXPECT(ctx.ret == 0);
+    TEST_EXPECT(ctx.buf[0] == 8);
+    ret = bcache_invalidate(&s_pdisk, 0, BLOCK_COUNT);
+    TEST_EXPECT(ret == 0);
+    TEST_EXPECT(s_ramdisk.blocks[1][0] == 0x77);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    { .name = "read caching", .fn = do_read_cache },
+    { .name = "write-back", .fn = do_write_back },
+    { .name = "eviction", .fn = do_eviction },
+    { .name = "flush", .fn = do_flush },
+    { .name = "cache hit during a miss", .fn = do_hit_during_miss },
+};
+
+const struct test_group TESTGROUP_BCACHE = {
+    .name = "bcache",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS)/sizeof(*TESTS),
+};
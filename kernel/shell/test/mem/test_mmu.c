@@ -0,0 +1,83 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/mmu.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/io/co.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/mem/vmm.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Creating an address space mostly comes down to creating page tables, and each new page table used to be followed by
+ * INVLPG on every page it covers. This compares that against a single full flush, and measures how long it takes to map
+ * a page that needs a new page table.
+ *
+ * Kernel page tables are shared and never go away(and without PAE, all of them are created during boot), so this uses the
+ * user area right below the kernel, which nothing uses yet.
+ */
+static bool do_pagetable_benchmark(void) {
+    enum {
+        REGION_SIZE = 4 * 1024 * 1024, /* Area covered by a page table (Or two, if PAE is used) */
+        REGION_COUNT = 8,
+    };
+    size_t page_count = 1;
+    PHYSPTR page = pmm_alloc(&page_count);
+    TEST_EXPECT(page != PHYSICALPTR_NULL);
+    char *regions = (char *)ARCH_KERNEL_SPACE_BASE - (REGION_COUNT * REGION_SIZE);
+
+    uint64_t invlpg_cycles = 0;
+    uint64_t full_flush_cycles = 0;
+    uint64_t map_cycles = 0;
+    bool map_failed = false;
+    bool table_not_freed = false;
+    size_t pages_per_region = REGION_SIZE / ARCH_PAGESIZE;
+    bool prev_interrupts = arch_irq_disable();
+    for (size_t i = 0; i < REGION_COUNT; i++) {
+        char *region = regions + (i * REGION_SIZE);
+        /* Make sure the map below has to create a new page table. */
+        (void)arch_mmu_free_pagetable_if_unused(region);
+
+        uint64_t start = arch_read_tsc();
+        for (size_t j = 0; j < pages_per_region; j++) {
+            arch_mmu_flush_tlb_for(region + (j * ARCH_PAGESIZE));
+        }
+        invlpg_cycles += arch_read_tsc() - start;
+
+        start = arch_read_tsc();
+        arch_mmu_flush_tlb();
+        full_flush_cycles += arch_read_tsc() - start;
+
+        start = arch_read_tsc();
+        int ret = arch_mmu_map(region, page, 1, MAP_PROT_READ | MAP_PROT_WRITE, MMU_USER_ACCESS_NO);
+        map_cycles += arch_read_tsc() - start;
+        if (ret < 0) {
+            map_failed = true;
+            break;
+        }
+        ret = arch_mmu_unmap(region, 1);
+        MUST_SUCCEED(ret);
+        if (!arch_mmu_free_pagetable_if_unused(region)) {
+            table_not_freed = true;
+            break;
+        }
+    }
+    arch_irq_restore(prev_interrupts);
+    pmm_free(page, 1);
+    TEST_EXPECT(!map_failed);
+    TEST_EXPECT(!table_not_freed);
+    co_printf("INVLPG over %zu pages: %llu cycles\n", pages_per_region, invlpg_cycles / REGION_COUNT);
+    co_printf("full TLB flush:        %llu cycles\n", full_flush_cycles / REGION_COUNT);
+    co_printf("map with new table:    %llu cycles\n", map_cycles / REGION_COUNT);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    { .name = "page table creation benchmark", .fn = do_pagetable_benchmark },
+};
+
+const struct test_group TESTGROUP_MMU = {
+    .name = "mmu",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS)/sizeof(*TESTS),
+};
@@ -1,7 +1,9 @@
 #include "../test.h"
 #include <kernel/arch/interrupts.h>
+#include <kernel/arch/mmu.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/types.h>
+#include <stdint.h>
 
 static bool do_randalloc(void) {
     bool prev_interrupts = arch_irq_disable();
@@ -18,9 +20,21 @@ static bool do_badalloc(void) {
     return true;
 }
 
+static bool do_lowalloc(void) {
+    bool prev_interrupts = arch_irq_disable();
+    size_t page_count = 4;
+    PHYSPTR addr = pmm_alloc_low(&page_count);
+    TEST_EXPECT(addr != PHYSICALPTR_NULL);
+    TEST_EXPECT((addr + (page_count * ARCH_PAGESIZE) - 1) <= UINT32_MAX);
+    pmm_free(addr, page_count);
+    arch_irq_restore(prev_interrupts);
+    return true;
+}
+
 static struct test const TESTS[] = {
     { .name = "random allocation test", .fn = do_randalloc },
     { .name = "bad allocation",         .fn = do_badalloc  },
+    { .name = "low memory allocation",  .fn = do_lowalloc  },
 };
 
 const struct test_group TESTGROUP_PMM = {
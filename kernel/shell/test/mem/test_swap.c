@@ -0,0 +1,75 @@
+#include "../test.h"
+#include <kernel/arch/mmu.h>
+#include <kernel/io/co.h>
+#include <kernel/mem/swap.h>
+#include <kernel/mem/vmm.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static bool do_roundtrip(void) {
+    enum {
+        PAGE_COUNT = SWAP_CLUSTER_PAGE_COUNT * 2,
+    };
+    if (!swap_is_enabled()) {
+        co_printf("swap is not enabled. skipping the test.\n");
+        return true;
+    }
+    struct vmm_object *object = vmm_alloc_swappable(vmm_get_kernel_address_space(), PAGE_COUNT * ARCH_PAGESIZE, MAP_PROT_READ | MAP_PROT_WRITE);
+    TEST_EXPECT(object != nullptr);
+    uint32_t *words = object->start;
+    size_t word_count = (PAGE_COUNT * ARCH_PAGESIZE) / sizeof(*words);
+    for (size_t i = 0; i < word_count; i++) {
+        words[i] = i ^ 0xa5a5a5a5;
+    }
+    struct swap_stats old_stats;
+    swap_get_stats(&old_stats);
+    size_t freed_count = vmm_reclaim(PAGE_COUNT);
+    TEST_EXPECT(freed_count != 0);
+    struct swap_stats stats;
+    swap_get_stats(&stats);
+    TEST_EXPECT(old_stats.page_outs < stats.page_outs);
+    TEST_EXPECT(old_stats.cluster_writes < stats.cluster_writes);
+    TEST_EXPECT((stats.cluster_writes - old_stats.cluster_writes) < freed_count);
+    for (size_t i = 0; i < word_count; i++) {
+        TEST_EXPECT(words[i] == (i ^ 0xa5a5a5a5));
+    }
+    swap_get_stats(&stats);
+    TEST_EXPECT(old_stats.page_ins < stats.page_ins);
+    vmm_free(object);
+    swap_get_stats(&stats);
+    TEST_EXPECT(stats.used_slots == old_stats.used_slots);
+    return true;
+}
+
+static bool do_is_swappable(void) {
+    enum {
+        PAGE_COUNT = 4,
+    };
+    struct vmm_object *swappable_object = vmm_alloc_swappable(vmm_get_kernel_address_space(), PAGE_COUNT * ARCH_PAGESIZE, MAP_PROT_READ | MAP_PROT_WRITE);
+    TEST_EXPECT(swappable_object != nullptr);
+    struct vmm_object *object = vmm_alloc(vmm_get_kernel_address_space(), PAGE_COUNT * ARCH_PAGESIZE, MAP_PROT_READ | MAP_PROT_WRITE);
+    TEST_EXPECT(object != nullptr);
+    uint8_t *swappable_start = swappable_object->start;
+    bool whole = vmm_is_swappable(swappable_start, PAGE_COUNT * ARCH_PAGESIZE);
+    bool last_byte = vmm_is_swappable(&swappable_start[(PAGE_COUNT * ARCH_PAGESIZE) - 1], 1);
+    bool across_pages = vmm_is_swappable(&swappable_start[ARCH_PAGESIZE - 16], 32);
+    bool normal = vmm_is_swappable(object->start, PAGE_COUNT * ARCH_PAGESIZE);
+    vmm_free(object);
+    vmm_free(swappable_object);
+    TEST_EXPECT(whole);
+    TEST_EXPECT(last_byte);
+    TEST_EXPECT(across_pages);
+    TEST_EXPECT(!normal);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    { .name = "page out and page in", .fn = do_roundtrip },
+    { .name = "swappable range lookup", .fn = do_is_swappable },
+};
+
+const struct test_group TESTGROUP_SWAP = {
+    .name = "swap",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS)/sizeof(*TESTS),
+};
@@ -0,0 +1,41 @@
+#include "../test.h"
+#include <kernel/clock.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <stdint.h>
+
+static bool do_monotonic(void) {
+    uint64_t last = clock_get_ns();
+    for (int i = 0; i < 10000; i++) {
+        uint64_t now = clock_get_ns();
+        if (now < last) {
+            co_printf("clock went backwards: %llu -> %llu\n", last, now);
+            return false;
+        }
+        last = now;
+    }
+    return true;
+}
+
+static bool do_sleep(void) {
+    uint64_t start = clock_get_ns();
+    thread_sleep_until(g_ticktime + 10);
+    uint64_t elapsed = clock_get_ns() - start;
+    co_printf("slept 10 ticks, clock says %llu ns\n", elapsed);
+    /* One tick is 1ms. Be generous with the upper bound, since emulators can be slow. */
+    TEST_EXPECT(9000000 <= elapsed);
+    TEST_EXPECT(elapsed < 1000000000);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "clock never goes backwards", .fn = do_monotonic},
+    {.name = "clock follows timer ticks", .fn = do_sleep},
+};
+
+const struct test_group TESTGROUP_CLOCK = {
+    .name = "clock",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
@@ -0,0 +1,73 @@
+#include "../test.h"
+#include <errno.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+#include <stdint.h>
+
+static bool do_admission(void) {
+    struct thread *thread = sched_get_current_thread();
+    struct sched_stats before, during, after;
+    sched_get_stats(&before);
+    TEST_EXPECT(sched_set_deadline(thread, 10, 0) == -EINVAL);
+    TEST_EXPECT(sched_set_deadline(thread, 10, 11) == -EINVAL);
+    /* 90% is more than deadline threads are allowed to have */
+    TEST_EXPECT(sched_set_deadline(thread, 10, 9) == -EBUSY);
+    TEST_EXPECT(sched_set_deadline(thread, 10, 2) == 0);
+    sched_get_stats(&during);
+    TEST_EXPECT(during.deadline_utilization == (before.deadline_utilization + 200));
+    TEST_EXPECT(sched_set_deadline(thread, 0, 0) == 0);
+    sched_get_stats(&after);
+    TEST_EXPECT(after.deadline_utilization == before.deadline_utilization);
+    return true;
+}
+
+static bool do_periodic(void) {
+    struct thread *thread = sched_get_current_thread();
+    uint64_t oldmissed = thread->dl_missed_deadlines;
+    TICKTIME starttime = g_ticktime;
+    TEST_EXPECT(sched_set_deadline(thread, 10, 2) == 0);
+    for (int i = 0; i < 5; i++) {
+        sched_wait_next_period();
+    }
+    TICKTIME elapsed = g_ticktime - starttime;
+    uint64_t missed = thread->dl_missed_deadlines - oldmissed;
+    int ret = sched_set_deadline(thread, 0, 0);
+    TEST_EXPECT(ret == 0);
+    co_printf("5 periods of 10 ticks took %llu ticks, %llu missed\n", elapsed, missed);
+    TEST_EXPECT(50 <= elapsed);
+    TEST_EXPECT(missed == 0);
+    return true;
+}
+
+static bool do_budget(void) {
+    struct thread *thread = sched_get_current_thread();
+    uint64_t oldmissed = thread->dl_missed_deadlines;
+    struct sched_stats before, after;
+    sched_get_stats(&before);
+    TEST_EXPECT(sched_set_deadline(thread, 20, 2) == 0);
+    /* Keep running past the budget. We should be stopped, and miss the deadline as well. */
+    TICKTIME starttime = g_ticktime;
+    while (g_ticktime < (starttime + 30)) {
+    }
+    uint64_t missed = thread->dl_missed_deadlines - oldmissed;
+    int ret = sched_set_deadline(thread, 0, 0);
+    TEST_EXPECT(ret == 0);
+    sched_get_stats(&after);
+    TEST_EXPECT(before.deadline_throttles < after.deadline_throttles);
+    TEST_EXPECT(missed != 0);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "admission control", .fn = do_admission},
+    {.name = "wait for next period", .fn = do_periodic},
+    {.name = "budget enforcement", .fn = do_budget},
+};
+
+const struct test_group TESTGROUP_DEADLINE = {
+    .name = "deadline",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
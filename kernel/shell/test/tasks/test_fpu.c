@@ -0,0 +1,87 @@
+/*
+ * NOTE: This file is built with floating point enabled(See FPU_C_SRCS in the Makefile), but only the threads started
+ *       here get to use it. Test functions themselves must stay away from floating point.
+ */
+#include "../test.h"
+#include <errno.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <stdint.h>
+
+#define THREAD_COUNT 3
+#define ITERATION_COUNT 100
+
+struct fpurecord {
+    int seed;
+    int ret;
+    int32_t result;
+};
+
+static void fputhread(void *arg) {
+    struct fpurecord *record = arg;
+    arch_irq_enable();
+    record->ret = thread_enable_fpu();
+    if (record->ret < 0) {
+        return;
+    }
+    /* Values stay in FPU registers across the yields, so they have to survive other threads using the FPU. */
+    double step = record->seed * 0.25;
+    double sum = 0;
+    for (int i = 0; i < ITERATION_COUNT; i++) {
+        sum += step * i;
+        thread_sleep(0);
+    }
+    record->result = (int32_t)(sum * 4);
+}
+
+static bool do_fpu_threads(void) {
+    struct fpurecord records[THREAD_COUNT] = {0};
+    struct thread *threads[THREAD_COUNT] = {0};
+    bool result = true;
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        records[i].seed = i + 1;
+        threads[i] = thread_create(THREAD_STACK_SIZE, fputhread, &records[i]);
+        if (threads[i] == nullptr) {
+            co_printf("not enough memory to spawn threads\n");
+            result = false;
+            continue;
+        }
+        int ret = sched_queue(threads[i]);
+        MUST_SUCCEED(ret);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        if (threads[i] == nullptr) {
+            continue;
+        }
+        thread_join(threads[i]);
+        if (records[i].ret == -ENOTSUP) {
+            co_printf("no FPU - skipping\n");
+            continue;
+        }
+        if (records[i].ret < 0) {
+            co_printf("thread %d: thread_enable_fpu failed (error %d)\n", i, records[i].ret);
+            result = false;
+            continue;
+        }
+        /* sum of (seed / 4) * i, times 4 */
+        int32_t expected = records[i].seed * ((ITERATION_COUNT * (ITERATION_COUNT - 1)) / 2);
+        if (records[i].result != expected) {
+            co_printf("thread %d: expected %ld, got %ld\n", i, expected, records[i].result);
+            result = false;
+        }
+    }
+    return result;
+}
+
+static struct test const TESTS[] = {
+    {.name = "threads keep their own FPU registers", .fn = do_fpu_threads},
+};
+
+const struct test_group TESTGROUP_FPU = {
+    .name = "fpu",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
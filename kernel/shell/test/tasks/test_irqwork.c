@@ -0,0 +1,56 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
+
+struct workrecord {
+    struct irqwork work;
+    int runcount;
+    bool ran_with_irq_enabled;
+    bool ran_on_worker;
+};
+
+static void workcallback(void *data) {
+    struct workrecord *record = data;
+    record->runcount++;
+    record->ran_with_irq_enabled = arch_irq_are_enabled();
+    record->ran_on_worker = irqwork_is_worker_thread();
+}
+
+/* Runs from the timer interrupt, like an interrupt handler would. */
+static void timercallback(void *data) {
+    struct workrecord *record = data;
+    irqwork_schedule(&record->work);
+    /* Already pending, so this should not run it twice. */
+    irqwork_schedule(&record->work);
+}
+
+static bool do_deferred(void) {
+    struct workrecord record = {0};
+    struct timer timer = {0};
+    irqwork_init(&record.work, workcallback, &record);
+    timer_start(&timer, g_ticktime + 1, timercallback, &record);
+    TICKTIME deadline = g_ticktime + 100;
+    while ((record.runcount == 0) && (g_ticktime < deadline)) {
+        thread_sleep(1);
+    }
+    /* Give it a chance to run again, if it's going to. */
+    thread_sleep(5);
+    TEST_EXPECT(record.runcount == 1);
+    TEST_EXPECT(record.ran_with_irq_enabled);
+    TEST_EXPECT(record.ran_on_worker);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "work scheduled from interrupt", .fn = do_deferred},
+};
+
+const struct test_group TESTGROUP_IRQWORK = {
+    .name = "irqwork",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
@@ -81,18 +81,234 @@ static bool do_threadsync(void) {
     co_printf("\n", ctx.cnt);
     result = true;
 out:
-    co_printf("shutting down...\n");
+    co_printf("waiting for threads to exit...\n");
     for (int i = 0; i < TEST_THREADCOUNT; i++) {
         if (threads[i] != nullptr) {
-            threads[i]->shutdown = true;
+            thread_join(threads[i]);
         }
     }
     return result;
 }
 
+struct handoffcontext {
+    struct mutex mtx;
+    int order[TEST_THREADCOUNT];
+    int finishedcount;
+};
+
+struct handoffthreadarg {
+    struct handoffcontext *ctx;
+    int index;
+};
+
+static void handoffthread(void *arg) {
+    arch_irq_enable();
+    struct handoffthreadarg *threadarg = arg;
+    struct handoffcontext *ctx = threadarg->ctx;
+    MUTEX_LOCK(&ctx->mtx);
+    ctx->order[ctx->finishedcount] = threadarg->index;
+    ctx->finishedcount++;
+    mutex_unlock(&ctx->mtx);
+}
+
+static bool do_handoff(void) {
+    bool result = false;
+    struct handoffcontext ctx;
+    struct handoffthreadarg args[TEST_THREADCOUNT];
+    struct thread *threads[TEST_THREADCOUNT];
+    mutex_init(&ctx.mtx);
+    ctx.finishedcount = 0;
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        threads[i] = nullptr;
+    }
+    MUTEX_LOCK(&ctx.mtx);
+    /* Start threads one by one, so that we know the order they started waiting. */
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        args[i].ctx = &ctx;
+        args[i].index = i;
+        threads[i] = thread_create(THREAD_STACK_SIZE, handoffthread, &args[i]);
+        if (threads[i] == nullptr) {
+            co_printf("not enough memory to spawn threads\n");
+            mutex_unlock(&ctx.mtx);
+            goto out;
+        }
+        int ret = sched_queue(threads[i]);
+        if (ret < 0) {
+            co_printf("failed to queue thread (error %d)\n", ret);
+            thread_delete(threads[i]);
+            threads[i] = nullptr;
+            mutex_unlock(&ctx.mtx);
+            goto out;
+        }
+        while (threads[i]->waitingmutex != &ctx.mtx) {
+            sched_schedule();
+        }
+    }
+    mutex_unlock(&ctx.mtx);
+    while (1) {
+        MUTEX_LOCK(&ctx.mtx);
+        bool done = TEST_THREADCOUNT <= ctx.finishedcount;
+        mutex_unlock(&ctx.mtx);
+        if (done) {
+            break;
+        }
+        sched_schedule();
+    }
+    result = true;
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        if (ctx.order[i] != i) {
+            co_printf("thread %d got the mutex at %d-th place\n", ctx.order[i], i);
+            result = false;
+        }
+    }
+out:
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        if (threads[i] != nullptr) {
+            thread_join(threads[i]);
+        }
+    }
+    return result;
+}
+
+struct inheritcontext {
+    struct mutex lowmutex;    /* Held by the low priority thread */
+    struct mutex middlemutex; /* Held by the middle priority thread */
+    struct mutex *highmutex;  /* The one high priority thread waits for */
+    bool release;
+    int8_t low_priority_after_unlock;
+};
+
+#define TEST_LOW_PRIORITY 10
+#define TEST_MIDDLE_PRIORITY 5
+#define TEST_HIGH_PRIORITY 0
+
+static void lowthread(void *arg) {
+    arch_irq_enable();
+    struct inheritcontext *ctx = arg;
+    MUTEX_LOCK(&ctx->lowmutex);
+    while (!ctx->release) {
+        thread_sleep(1);
+    }
+    mutex_unlock(&ctx->lowmutex);
+    ctx->low_priority_after_unlock = sched_get_current_thread()->priority;
+}
+
+static void middlethread(void *arg) {
+    arch_irq_enable();
+    struct inheritcontext *ctx = arg;
+    MUTEX_LOCK(&ctx->middlemutex);
+    MUTEX_LOCK(&ctx->lowmutex);
+    mutex_unlock(&ctx->lowmutex);
+    mutex_unlock(&ctx->middlemutex);
+}
+
+static void highthread(void *arg) {
+    arch_irq_enable();
+    struct inheritcontext *ctx = arg;
+    MUTEX_LOCK(ctx->highmutex);
+    mutex_unlock(ctx->highmutex);
+}
+
+[[nodiscard]] static struct thread *start_thread_with_priority(void (*mainfunc)(void *), struct inheritcontext *ctx, int8_t priority) {
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, mainfunc, ctx);
+    if (thread == nullptr) {
+        co_printf("not enough memory to spawn threads\n");
+        return nullptr;
+    }
+    sched_set_priority(thread, priority);
+    int ret = sched_queue(thread);
+    if (ret < 0) {
+        co_printf("failed to queue thread (error %d)\n", ret);
+        thread_delete(thread);
+        return nullptr;
+    }
+    return thread;
+}
+
+/*
+ * Low priority thread holds a mutex and doesn't let it go until we say so. Once higher priority threads are waiting for
+ * it (directly, or through the middle thread when `chained` is set), it should be running at the highest priority.
+ */
+static bool run_inheritance_test(bool chained) {
+    bool result = false;
+    struct inheritcontext ctx;
+    struct thread *low = nullptr;
+    struct thread *middle = nullptr;
+    struct thread *high = nullptr;
+    mutex_init(&ctx.lowmutex);
+    mutex_init(&ctx.middlemutex);
+    ctx.highmutex = chained ? &ctx.middlemutex : &ctx.lowmutex;
+    ctx.release = false;
+    ctx.low_priority_after_unlock = 0;
+
+    low = start_thread_with_priority(lowthread, &ctx, TEST_LOW_PRIORITY);
+    if (low == nullptr) {
+        goto out;
+    }
+    while (ctx.lowmutex.owner != low) {
+        thread_sleep(1);
+    }
+    if (chained) {
+        middle = start_thread_with_priority(middlethread, &ctx, TEST_MIDDLE_PRIORITY);
+        if (middle == nullptr) {
+            goto out;
+        }
+        while (middle->waitingmutex != &ctx.lowmutex) {
+            thread_sleep(1);
+        }
+        if (low->priority != TEST_MIDDLE_PRIORITY) {
+            co_printf("low priority thread is running at %d, expected %d\n", low->priority, TEST_MIDDLE_PRIORITY);
+            goto out;
+        }
+    }
+    high = start_thread_with_priority(highthread, &ctx, TEST_HIGH_PRIORITY);
+    if (high == nullptr) {
+        goto out;
+    }
+    while (high->waitingmutex != ctx.highmutex) {
+        thread_sleep(1);
+    }
+    if (low->priority != TEST_HIGH_PRIORITY) {
+        co_printf("low priority thread is running at %d, expected %d\n", low->priority, TEST_HIGH_PRIORITY);
+        goto out;
+    }
+    if ((middle != nullptr) && (middle->priority != TEST_HIGH_PRIORITY)) {
+        co_printf("middle priority thread is running at %d, expected %d\n", middle->priority, TEST_HIGH_PRIORITY);
+        goto out;
+    }
+    result = true;
+out:
+    ctx.release = true;
+    if (low != nullptr) {
+        thread_join(low);
+        if (ctx.low_priority_after_unlock != TEST_LOW_PRIORITY) {
+            co_printf("low priority thread is running at %d after unlock, expected %d\n", ctx.low_priority_after_unlock, TEST_LOW_PRIORITY);
+            result = false;
+        }
+    }
+    if (middle != nullptr) {
+        thread_join(middle);
+    }
+    if (high != nullptr) {
+        thread_join(high);
+    }
+    return result;
+}
+
+static bool do_inheritance(void) {
+    return run_inheritance_test(false);
+}
+
+static bool do_chained_inheritance(void) {
+    return run_inheritance_test(true);
+}
+
 static struct test const TESTS[] = {
     {.name = "basic lock & unlock test", .fn = do_basic},
     {.name = "thread synchronization", .fn = do_threadsync},
+    {.name = "FIFO handoff on unlock", .fn = do_handoff},
+    {.name = "priority inheritance", .fn = do_inheritance},
+    {.name = "chained priority inheritance", .fn = do_chained_inheritance},
 };
 
 const struct test_group TESTGROUP_MUTEX = {
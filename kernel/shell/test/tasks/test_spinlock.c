@@ -0,0 +1,128 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/cpu.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/tasks/thread.h>
+
+#define CONTENTION_THREADS_PER_CPU 2
+#define CONTENTION_ITERATIONS 10000
+
+static bool do_nested(void) {
+    struct spinlock lock = {0};
+    bool prev_interrupts = arch_irq_enable();
+    TEST_EXPECT(!spinlock_is_held(&lock));
+    spinlock_lock(&lock);
+    TEST_EXPECT(spinlock_is_held(&lock));
+    TEST_EXPECT(!arch_irq_are_enabled());
+    spinlock_lock(&lock);
+    spinlock_unlock(&lock);
+    /* Still held by the outer lock */
+    TEST_EXPECT(spinlock_is_held(&lock));
+    TEST_EXPECT(!arch_irq_are_enabled());
+    spinlock_unlock(&lock);
+    TEST_EXPECT(!spinlock_is_held(&lock));
+    TEST_EXPECT(arch_irq_are_enabled());
+    if (!prev_interrupts) {
+        arch_irq_disable();
+    }
+    return true;
+}
+
+static bool do_irqstate(void) {
+    struct spinlock lock = {0};
+    bool prev_interrupts = arch_irq_disable();
+    spinlock_lock(&lock);
+    spinlock_unlock(&lock);
+    /* Interrupts were disabled before locking, so they should stay that way. */
+    TEST_EXPECT(!arch_irq_are_enabled());
+    arch_irq_restore(prev_interrupts);
+    return true;
+}
+
+static bool do_held_count(void) {
+    struct spinlock lock1 = {0};
+    struct spinlock lock2 = {0};
+    /* Otherwise we may move to other CPU between reading the count and locking. */
+    bool prev_interrupts = arch_irq_disable();
+    struct cpu *cpu = cpu_get_current();
+    size_t oldcount = cpu->spinlock_count;
+    spinlock_lock(&lock1);
+    spinlock_lock(&lock1);
+    spinlock_lock(&lock2);
+    bool result = (cpu->spinlock_count == (oldcount + 3)) && (lock1.owner_thread == sched_get_current_thread());
+    spinlock_unlock(&lock2);
+    spinlock_unlock(&lock1);
+    result = result && (cpu->spinlock_count == (oldcount + 1));
+    spinlock_unlock(&lock1);
+    result = result && (cpu->spinlock_count == oldcount);
+    arch_irq_restore(prev_interrupts);
+    TEST_EXPECT(result);
+    return true;
+}
+
+static bool do_current_cpu(void) {
+    struct cpu *cpu = cpu_get_current();
+    TEST_EXPECT(cpu != nullptr);
+    TEST_EXPECT(cpu->self == cpu);
+    TEST_EXPECT(cpu->online);
+    TEST_EXPECT(cpu_get(cpu->index) == cpu);
+    return true;
+}
+
+static struct spinlock s_contention_lock;
+/* Not atomic on purpose, as the lock is what keeps increments from getting lost. */
+static size_t s_contention_counter;
+
+static void contention_thread(void *arg) {
+    (void)arg;
+    arch_irq_enable();
+    for (size_t i = 0; i < CONTENTION_ITERATIONS; i++) {
+        spinlock_lock(&s_contention_lock);
+        s_contention_counter++;
+        spinlock_unlock(&s_contention_lock);
+    }
+}
+
+static bool do_contention(void) {
+    /* With other CPUs online, these run at the same time. */
+    struct thread *threads[CPU_MAX_COUNT * CONTENTION_THREADS_PER_CPU];
+    size_t thread_count = cpu_get_online_count() * CONTENTION_THREADS_PER_CPU;
+    s_contention_counter = 0;
+    size_t started_count = 0;
+    bool result = true;
+    for (; started_count < thread_count; started_count++) {
+        struct thread *thread = thread_create(THREAD_STACK_SIZE, contention_thread, nullptr);
+        if (thread == nullptr) {
+            co_printf("not enough memory to spawn threads\n");
+            result = false;
+            break;
+        }
+        if (sched_queue(thread) < 0) {
+            thread_delete(thread);
+            result = false;
+            break;
+        }
+        threads[started_count] = thread;
+    }
+    for (size_t i = 0; i < started_count; i++) {
+        thread_join(threads[i]);
+    }
+    TEST_EXPECT(result);
+    TEST_EXPECT(s_contention_counter == (thread_count * CONTENTION_ITERATIONS));
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "nested locking", .fn = do_nested},
+    {.name = "interrupt state", .fn = do_irqstate},
+    {.name = "held count", .fn = do_held_count},
+    {.name = "current CPU", .fn = do_current_cpu},
+    {.name = "contention between threads", .fn = do_contention},
+};
+
+const struct test_group TESTGROUP_SPINLOCK = {
+    .name = "spinlock",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
@@ -0,0 +1,106 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+
+#define TEST_EXIT_STATUS 42
+
+static void returningthread(void *arg) {
+    (void)arg;
+    arch_irq_enable();
+}
+
+static void exitingthread(void *arg) {
+    (void)arg;
+    arch_irq_enable();
+    thread_exit(TEST_EXIT_STATUS);
+}
+
+[[nodiscard]] static struct thread *start_thread(void (*mainfunc)(void *)) {
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, mainfunc, nullptr);
+    if (thread == nullptr) {
+        co_printf("not enough memory to spawn threads\n");
+        return nullptr;
+    }
+    int ret = sched_queue(thread);
+    if (ret < 0) {
+        co_printf("failed to queue thread (error %d)\n", ret);
+        thread_delete(thread);
+        return nullptr;
+    }
+    return thread;
+}
+
+static bool do_join(void) {
+    struct thread *thread = start_thread(returningthread);
+    TEST_EXPECT(thread != nullptr);
+    TEST_EXPECT(thread_join(thread) == 0);
+    thread = start_thread(exitingthread);
+    TEST_EXPECT(thread != nullptr);
+    TEST_EXPECT(thread_join(thread) == TEST_EXIT_STATUS);
+    return true;
+}
+
+static bool do_join_exited(void) {
+    struct thread *thread = start_thread(exitingthread);
+    TEST_EXPECT(thread != nullptr);
+    /* Let the thread exit before we start joining. */
+    while (!thread->exited) {
+        thread_sleep(1);
+    }
+    TEST_EXPECT(thread_join(thread) == TEST_EXIT_STATUS);
+    return true;
+}
+
+static bool do_detach(void) {
+    struct thread *thread = start_thread(returningthread);
+    TEST_EXPECT(thread != nullptr);
+    thread_detach(thread);
+    /* Nothing to check here, but the thread should be gone without leaking memory. */
+    thread_sleep(10);
+    return true;
+}
+
+/*
+ * Returns false if the current thread wasn't found.
+ */
+[[nodiscard]] static bool get_current_stats(struct thread_stats *out) {
+    struct thread_stats stats[32];
+    size_t count = thread_get_all_stats(stats, sizeof(stats) / sizeof(*stats));
+    size_t id = sched_get_current_thread()->id;
+    for (size_t i = 0; (i < count) && (i < (sizeof(stats) / sizeof(*stats))); i++) {
+        if (stats[i].id == id) {
+            *out = stats[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool do_accounting(void) {
+    struct thread_stats before, after;
+    TEST_EXPECT(get_current_stats(&before));
+    TICKTIME starttime = g_ticktime;
+    while (g_ticktime < (starttime + 2)) {
+    }
+    thread_sleep(1);
+    TEST_EXPECT(get_current_stats(&after));
+    TEST_EXPECT(before.run_cycles < after.run_cycles);
+    TEST_EXPECT(before.voluntary_switches < after.voluntary_switches);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "join returns exit status", .fn = do_join},
+    {.name = "join already exited thread", .fn = do_join_exited},
+    {.name = "detached thread", .fn = do_detach},
+    {.name = "cpu accounting", .fn = do_accounting},
+};
+
+const struct test_group TESTGROUP_THREAD = {
+    .name = "thread",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
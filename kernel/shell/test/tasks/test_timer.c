@@ -0,0 +1,77 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
+
+static bool do_sleep(void) {
+    TICKTIME deadline = g_ticktime + 10;
+    thread_sleep_until(deadline);
+    TICKTIME waketime = g_ticktime;
+    co_printf("deadline %llu, woke up at %llu\n", deadline, waketime);
+    TEST_EXPECT(deadline <= waketime);
+    return true;
+}
+
+struct timerrecord {
+    TICKTIME deadline;
+    TICKTIME firedtime;
+    bool fired;
+};
+
+static void recordcallback(void *data) {
+    struct timerrecord *record = data;
+    record->firedtime = g_ticktime;
+    record->fired = true;
+}
+
+/* Deadlines that land in level 0, right at the level 0 boundary, and in level 1. */
+static TICKTIME const TEST_DISTANCES[] = {1, 5, 63, 64, 100, 200};
+#define TEST_TIMERCOUNT (sizeof(TEST_DISTANCES) / sizeof(*TEST_DISTANCES))
+
+static bool do_wheel(void) {
+    bool result = true;
+    struct timer timers[TEST_TIMERCOUNT] = {0};
+    struct timerrecord records[TEST_TIMERCOUNT] = {0};
+    struct timer canceledtimer = {0};
+    struct timerrecord canceledrecord = {0};
+    TICKTIME now = g_ticktime;
+    TICKTIME lastdeadline = now;
+    for (size_t i = 0; i < TEST_TIMERCOUNT; i++) {
+        records[i].deadline = now + TEST_DISTANCES[i];
+        timer_start(&timers[i], records[i].deadline, recordcallback, &records[i]);
+        if (lastdeadline < records[i].deadline) {
+            lastdeadline = records[i].deadline;
+        }
+    }
+    timer_start(&canceledtimer, now + 50, recordcallback, &canceledrecord);
+    TEST_EXPECT(timer_cancel(&canceledtimer));
+    TEST_EXPECT(!timer_cancel(&canceledtimer));
+    thread_sleep_until(lastdeadline + 1);
+    for (size_t i = 0; i < TEST_TIMERCOUNT; i++) {
+        if (!records[i].fired) {
+            co_printf("timer %zu didn't fire\n", i);
+            timer_cancel(&timers[i]);
+            result = false;
+            continue;
+        }
+        if (records[i].firedtime != records[i].deadline) {
+            co_printf("timer %zu: deadline %llu, fired at %llu\n", i, records[i].deadline, records[i].firedtime);
+            result = false;
+        }
+    }
+    TEST_EXPECT(!canceledrecord.fired);
+    return result;
+}
+
+static struct test const TESTS[] = {
+    {.name = "sleep until deadline", .fn = do_sleep},
+    {.name = "timer wheel deadlines", .fn = do_wheel},
+};
+
+const struct test_group TESTGROUP_TIMER = {
+    .name = "timer",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
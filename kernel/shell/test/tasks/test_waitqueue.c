@@ -0,0 +1,142 @@
+#include "../test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
+#include <kernel/tasks/condvar.h>
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/semaphore.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/ticktime.h>
+
+#define TEST_TIMEOUT 1000
+#define TEST_THREADCOUNT 5
+
+static bool do_semaphore_timeout(void) {
+    struct semaphore sem;
+    semaphore_init(&sem, 0);
+    TICKTIME deadline = g_ticktime + 5;
+    TEST_EXPECT(!semaphore_wait_until(&sem, deadline));
+    TEST_EXPECT(deadline <= g_ticktime);
+    semaphore_post(&sem);
+    TEST_EXPECT(semaphore_try_wait(&sem));
+    TEST_EXPECT(!semaphore_try_wait(&sem));
+    return true;
+}
+
+struct pingpongcontext {
+    struct semaphore ping;
+    struct semaphore pong;
+};
+
+static void pingpongthread(void *arg) {
+    arch_irq_enable();
+    struct pingpongcontext *ctx = arg;
+    semaphore_wait(&ctx->ping);
+    semaphore_post(&ctx->pong);
+}
+
+static bool do_semaphore_wakeup(void) {
+    struct pingpongcontext ctx;
+    semaphore_init(&ctx.ping, 0);
+    semaphore_init(&ctx.pong, 0);
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, pingpongthread, &ctx);
+    if (thread == nullptr) {
+        co_printf("not enough memory to spawn threads\n");
+        return false;
+    }
+    int ret = sched_queue(thread);
+    if (ret < 0) {
+        co_printf("failed to queue thread (error %d)\n", ret);
+        thread_delete(thread);
+        return false;
+    }
+    /* Let the thread start waiting first. */
+    thread_sleep(10);
+    semaphore_post(&ctx.ping);
+    bool result = semaphore_wait_until(&ctx.pong, g_ticktime + TEST_TIMEOUT);
+    thread_join(thread);
+    TEST_EXPECT(result);
+    return true;
+}
+
+struct broadcastcontext {
+    struct mutex mtx;
+    struct condvar cond;
+    bool ready;
+    int wokencount;
+};
+
+static void broadcastthread(void *arg) {
+    arch_irq_enable();
+    struct broadcastcontext *ctx = arg;
+    MUTEX_LOCK(&ctx->mtx);
+    while (!ctx->ready) {
+        condvar_wait(&ctx->cond, &ctx->mtx);
+    }
+    ctx->wokencount++;
+    mutex_unlock(&ctx->mtx);
+}
+
+static bool do_condvar_broadcast(void) {
+    bool result = false;
+    struct broadcastcontext ctx;
+    struct thread *threads[TEST_THREADCOUNT];
+    mutex_init(&ctx.mtx);
+    condvar_init(&ctx.cond);
+    ctx.ready = false;
+    ctx.wokencount = 0;
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        threads[i] = nullptr;
+    }
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        threads[i] = thread_create(THREAD_STACK_SIZE, broadcastthread, &ctx);
+        if (threads[i] == nullptr) {
+            co_printf("not enough memory to spawn threads\n");
+            goto out;
+        }
+        int ret = sched_queue(threads[i]);
+        if (ret < 0) {
+            co_printf("failed to queue thread (error %d)\n", ret);
+            thread_delete(threads[i]);
+            threads[i] = nullptr;
+            goto out;
+        }
+    }
+    thread_sleep(10);
+    MUTEX_LOCK(&ctx.mtx);
+    ctx.ready = true;
+    condvar_broadcast(&ctx.cond);
+    TICKTIME deadline = g_ticktime + TEST_TIMEOUT;
+    while ((ctx.wokencount < TEST_THREADCOUNT) && (g_ticktime < deadline)) {
+        condvar_wait_until(&ctx.cond, &ctx.mtx, g_ticktime + 1);
+    }
+    result = ctx.wokencount == TEST_THREADCOUNT;
+    if (!result) {
+        co_printf("only %d threads were woken up\n", ctx.wokencount);
+    }
+    mutex_unlock(&ctx.mtx);
+out:
+    /* If we failed to spawn some of threads, others are still waiting. */
+    MUTEX_LOCK(&ctx.mtx);
+    ctx.ready = true;
+    condvar_broadcast(&ctx.cond);
+    mutex_unlock(&ctx.mtx);
+    for (int i = 0; i < TEST_THREADCOUNT; i++) {
+        if (threads[i] != nullptr) {
+            thread_join(threads[i]);
+        }
+    }
+    return result;
+}
+
+static struct test const TESTS[] = {
+    {.name = "semaphore timeout", .fn = do_semaphore_timeout},
+    {.name = "semaphore wakes waiting thread", .fn = do_semaphore_wakeup},
+    {.name = "condvar broadcast", .fn = do_condvar_broadcast},
+};
+
+const struct test_group TESTGROUP_WAITQUEUE = {
+    .name = "waitqueue",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
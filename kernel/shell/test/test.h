@@ -22,6 +22,8 @@ bool __test_expect(bool b, char const *expr, char const *func, char const *file,
 
 /* clang-format off */
 #define ENUMERATE_TESTGROUPS(_x)    \
+    /* io */                        \
+    _x(TESTGROUP_BCACHE)            \
     /* lib */                       \
     _x(TESTGROUP_BITMAP)            \
     _x(TESTGROUP_BST)               \
@@ -33,8 +35,20 @@ bool __test_expect(bool b, char const *expr, char const *func, char const *file,
     /* mem */                       \
     _x(TESTGROUP_PMM)               \
     _x(TESTGROUP_HEAP)              \
+    _x(TESTGROUP_MMU)               \
+    _x(TESTGROUP_SWAP)              \
     /* tasks */                     \
-    _x(TESTGROUP_MUTEX)
+    _x(TESTGROUP_CLOCK)             \
+    _x(TESTGROUP_DEADLINE)          \
+    _x(TESTGROUP_FPU)               \
+    _x(TESTGROUP_IRQWORK)           \
+    _x(TESTGROUP_MUTEX)             \
+    _x(TESTGROUP_SPINLOCK)          \
+    _x(TESTGROUP_THREAD)            \
+    _x(TESTGROUP_TIMER)             \
+    _x(TESTGROUP_WAITQUEUE)         \
+    /* (Top level) */               \
+    _x(TESTGROUP_TRAPMANAGER)
 
 /* clang-format on */
 
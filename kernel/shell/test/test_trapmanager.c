@@ -0,0 +1,161 @@
+#include "test.h"
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/io/co.h>
+#include <kernel/lib/list.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/trapmanager.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISPATCH_COUNT 1000
+#define MAX_HANDLER_COUNT 2
+
+static void countcallback(int trapnum, void *trapframe, void *data) {
+    (void)trapnum;
+    (void)trapframe;
+    int *count = data;
+    (*count)++;
+}
+
+static int find_free_trap(void) {
+    for (int i = YJKERNEL_ARCH_TRAP_COUNT - 1; 0 <= i; i--) {
+        if (trapmanager_get_handler_count(i) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * How trapmanager_trap() used to dispatch traps, before the dispatch table: It walked the handler list, and verified
+ * checksum of each handler before calling it. This is only here to compare against.
+ */
+static uint32_t legacy_checksum(struct trap_handler const *handler) {
+    struct trap_handler temp;
+    vmemcpy(&temp, handler, sizeof(temp));
+    temp.checksum = 0;
+    uint32_t *val = (void *)&temp;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < (sizeof(*handler) / sizeof(uint32_t)); i++) {
+        sum += val[i];
+    }
+    return ((uint32_t)~0) - sum;
+}
+
+static void legacy_trap(struct list *handlers, int trapnum, void *trapframe) {
+    LIST_FOREACH(handlers, handlernode) {
+        struct trap_handler *handler = handlernode->data;
+        uint32_t expected_checksum = legacy_checksum(handler);
+        uint32_t got_checksum = handler->checksum;
+        if (expected_checksum != got_checksum) {
+            co_printf("bad trap handler checksum in trap %d: expected %#x, got %#x\n", trapnum, expected_checksum, got_checksum);
+        } else {
+            handler->callback(trapnum, trapframe, handler->data);
+        }
+    }
+}
+
+/*
+ * Returns average TSC cycles taken to reach the handler(s) and come back. If `legacy_handlers` isn't nullptr, it goes
+ * through legacy_trap() with those instead.
+ */
+static uint64_t dispatch_many(int trapnum, struct list *legacy_handlers) {
+    bool prev_interrupts = arch_irq_disable();
+    uint64_t start = arch_read_tsc();
+    for (int i = 0; i < DISPATCH_COUNT; i++) {
+        if (legacy_handlers != nullptr) {
+            legacy_trap(legacy_handlers, trapnum, nullptr);
+        } else {
+            trapmanager_trap(trapnum, nullptr);
+        }
+    }
+    uint64_t cycles = arch_read_tsc() - start;
+    arch_irq_restore(prev_interrupts);
+    return cycles / DISPATCH_COUNT;
+}
+
+/*
+ * Dispatches to `handler_count` handlers, both through trapmanager and the old way, and prints how long it took.
+ */
+static bool dispatch_test(size_t handler_count) {
+    struct trap_handler handlers[MAX_HANDLER_COUNT];
+    struct trap_handler legacy_handlers[MAX_HANDLER_COUNT];
+    struct list legacy_list;
+    int callcounts[MAX_HANDLER_COUNT] = {0};
+    int legacy_callcounts[MAX_HANDLER_COUNT] = {0};
+
+    int trapnum = find_free_trap();
+    TEST_EXPECT(0 <= trapnum);
+    list_init(&legacy_list);
+    for (size_t i = 0; i < handler_count; i++) {
+        trapmanager_register_trap(&handlers[i], trapnum, countcallback, &callcounts[i]);
+        legacy_handlers[i].callback = countcallback;
+        legacy_handlers[i].data = &legacy_callcounts[i];
+        list_insert_back(&legacy_list, &legacy_handlers[i].node, &legacy_handlers[i]);
+    }
+    /* List nodes have to be in place before calculating checksums */
+    for (size_t i = 0; i < handler_count; i++) {
+        legacy_handlers[i].checksum = legacy_checksum(&legacy_handlers[i]);
+    }
+    uint64_t cycles = dispatch_many(trapnum, nullptr);
+    uint64_t legacy_cycles = dispatch_many(trapnum, &legacy_list);
+    for (size_t i = 0; i < handler_count; i++) {
+        trapmanager_unregister_trap(&handlers[i], trapnum);
+    }
+    co_printf("trap %d: %llu cycles per dispatch (list walk with checksums: %llu cycles)\n", trapnum, cycles, legacy_cycles);
+    for (size_t i = 0; i < handler_count; i++) {
+        TEST_EXPECT(callcounts[i] == DISPATCH_COUNT);
+        TEST_EXPECT(legacy_callcounts[i] == DISPATCH_COUNT);
+    }
+    TEST_EXPECT(trapmanager_get_handler_count(trapnum) == 0);
+    return true;
+}
+
+static bool do_single(void) {
+    return dispatch_test(1);
+}
+
+static bool do_chain(void) {
+    return dispatch_test(2);
+}
+
+static bool do_audit(void) {
+    struct trap_handler handlers[2];
+    int callcounts[2];
+    int trapnum = find_free_trap();
+    TEST_EXPECT(0 <= trapnum);
+    for (size_t i = 0; i < 2; i++) {
+        trapmanager_register_trap(&handlers[i], trapnum, countcallback, &callcounts[i]);
+    }
+    size_t goodcount = trapmanager_audit();
+    /* Corrupt a handler, and see if the audit catches it. */
+    bool prev_interrupts = arch_irq_disable();
+    void *olddata = handlers[1].data;
+    handlers[1].data = nullptr;
+    size_t badcount = trapmanager_audit();
+    handlers[1].data = olddata;
+    arch_irq_restore(prev_interrupts);
+    size_t fixedcount = trapmanager_audit();
+    for (size_t i = 0; i < 2; i++) {
+        trapmanager_unregister_trap(&handlers[i], trapnum);
+    }
+    TEST_EXPECT(goodcount == 0);
+    TEST_EXPECT(badcount == 1);
+    TEST_EXPECT(fixedcount == 0);
+    TEST_EXPECT(trapmanager_get_handler_count(trapnum) == 0);
+    TEST_EXPECT(trapmanager_audit() == 0);
+    return true;
+}
+
+static struct test const TESTS[] = {
+    {.name = "dispatch to single handler", .fn = do_single},
+    {.name = "dispatch to multiple handlers", .fn = do_chain},
+    {.name = "audit trap handlers", .fn = do_audit},
+};
+
+const struct test_group TESTGROUP_TRAPMANAGER = {
+    .name = "trapmanager",
+    .tests = TESTS,
+    .testslen = sizeof(TESTS) / sizeof(*TESTS),
+};
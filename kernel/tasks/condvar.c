@@ -0,0 +1,42 @@
+#include <kernel/tasks/condvar.h>
+#include <kernel/tasks/mutex.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
+
+void condvar_init(struct condvar *out) {
+    waitqueue_init(&out->waitqueue);
+}
+
+static bool do_wait(struct condvar *self, struct mutex *mutex, bool has_deadline, TICKTIME deadline) {
+    bool result = true;
+    /*
+     * Scheduler lock is held from unlocking to blocking, so nobody can signal in between.
+     */
+    sched_lock();
+    mutex_unlock(mutex);
+    if (has_deadline) {
+        result = waitqueue_wait_until(&self->waitqueue, deadline);
+    } else {
+        waitqueue_wait(&self->waitqueue);
+    }
+    sched_unlock();
+    MUTEX_LOCK(mutex);
+    return result;
+}
+
+void condvar_wait(struct condvar *self, struct mutex *mutex) {
+    do_wait(self, mutex, false, 0);
+}
+
+bool condvar_wait_until(struct condvar *self, struct mutex *mutex, TICKTIME deadline) {
+    return do_wait(self, mutex, true, deadline);
+}
+
+void condvar_signal(struct condvar *self) {
+    waitqueue_wake_one(&self->waitqueue);
+}
+
+void condvar_broadcast(struct condvar *self) {
+    waitqueue_wake_all(&self->waitqueue);
+}
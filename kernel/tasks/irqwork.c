@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/panic.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/tasks/waitqueue.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Interrupt handlers are waiting for us, so we run above everything else. */
+#define WORKER_THREAD_PRIORITY INT8_MIN
+
+static struct list s_pending_works;
+static struct waitqueue s_waitqueue;
+static struct thread *s_worker_thread;
+
+void irqwork_init(struct irqwork *out, void (*callback)(void *data), void *data) {
+    vmemset(out, 0, sizeof(*out));
+    out->callback = callback;
+    out->data = data;
+}
+
+void irqwork_schedule(struct irqwork *work) {
+    sched_lock();
+    if (s_worker_thread == nullptr) {
+        work->callback(work->data);
+        goto out;
+    }
+    if (work->pending) {
+        goto out;
+    }
+    work->pending = true;
+    list_insert_back(&s_pending_works, &work->node, work);
+    waitqueue_wake_one(&s_waitqueue);
+out:
+    sched_unlock();
+}
+
+bool irqwork_is_worker_thread(void) {
+    return (s_worker_thread != nullptr) && (sched_get_current_thread() == s_worker_thread);
+}
+
+static void worker_main(void *arg) {
+    (void)arg;
+    sched_lock();
+    while (1) {
+        struct list_node *node = list_remove_front(&s_pending_works);
+        if (node == nullptr) {
+            waitqueue_wait(&s_waitqueue);
+            continue;
+        }
+        struct irqwork *work = node->data;
+        /* Clear it before running, so that interrupts that arrive while we are running schedule it again. */
+        work->pending = false;
+        sched_unlock();
+        work->callback(work->data);
+        sched_lock();
+    }
+}
+
+void irqwork_start(void) {
+    assert(s_worker_thread == nullptr);
+    struct thread *thread = thread_create(THREAD_STACK_SIZE, worker_main, nullptr);
+    if (thread == nullptr) {
+        panic("irqwork: not enough memory to create the worker thread");
+    }
+    sched_set_priority(thread, WORKER_THREAD_PRIORITY);
+    sched_lock();
+    int ret = sched_queue(thread);
+    MUST_SUCCEED(ret);
+    s_worker_thread = thread;
+    /* Works that were scheduled before this point already ran, so nothing is pending yet. */
+    sched_unlock();
+}
@@ -1,36 +1,84 @@
-#include <kernel/arch/interrupts.h>
+#include <kernel/io/co.h>
 #include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
 #include <kernel/tasks/mutex.h>
 #include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
 #include <stdatomic.h>
 
 void mutex_init(struct mutex *out) {
     vmemset(out, 0, sizeof(*out));
 }
 
+static void set_owner(struct mutex *self, struct thread *owner) {
+    self->owner = owner;
+    if (owner != nullptr) {
+        list_insert_back(&owner->held_mutexes, &self->owner_node, self);
+    }
+}
+
 [[nodiscard]] bool __mutex_try_lock(struct mutex *self, struct source_location loc) {
     bool expected = false;
-    if (!atomic_compare_exchange_strong_explicit(&self->locked, &expected, true, memory_order_acquire, memory_order_relaxed)) {
-        return false;
+    sched_lock();
+    bool result = atomic_compare_exchange_strong_explicit(&self->locked, &expected, true, memory_order_acquire, memory_order_relaxed);
+    if (result) {
+        vmemcpy(&self->locksource, &loc, sizeof(self->locksource));
+        set_owner(self, sched_get_current_thread());
     }
-    vmemcpy(&self->locksource, &loc, sizeof(self->locksource));
-    return true;
+    sched_unlock();
+    return result;
 }
 
 void __mutex_lock(struct mutex *self, struct source_location loc) {
     assert(self);
-    bool prev_interrupts = arch_irq_disable();
+    sched_lock();
     if (!__mutex_try_lock(self, loc)) {
         sched_wait_mutex(self, &loc);
         assert(self->locked);
     }
-    arch_irq_restore(prev_interrupts);
+    sched_unlock();
 }
 
 void mutex_unlock(struct mutex *self) {
+    sched_lock();
+    assert(self->locked);
+    struct thread *oldowner = self->owner;
+    if (oldowner != nullptr) {
+        list_remove_node(&oldowner->held_mutexes, &self->owner_node);
+    }
+    while (1) {
+        struct list_node *node = list_remove_front(&self->waiters);
+        if (node == nullptr) {
+            break;
+        }
+        struct thread *thread = node->data;
+        assert(thread->waitingmutex == self);
+        thread->waitingmutex = nullptr;
+        if (thread->shutdown) {
+            /* Scheduler will delete the thread once it sees it, so don't give the mutex to it. */
+            co_printf("mutex: thread is about to shutdown - skipping it\n");
+            int ret = sched_queue(thread);
+            MUST_SUCCEED(ret);
+            continue;
+        }
+        /* Hand over the mutex. It stays locked, so nobody else can take it in the meantime. */
+        vmemcpy(&self->locksource, &thread->desired_locksource, sizeof(self->locksource));
+        set_owner(self, thread);
+        /* Remaining waiters are now waiting for the new owner. */
+        sched_update_inherited_priority(thread);
+        int ret = sched_queue(thread);
+        MUST_SUCCEED(ret);
+        goto out;
+    }
     self->locksource.filename = nullptr;
     self->locksource.function = nullptr;
     self->locksource.line = 0;
+    self->owner = nullptr;
     atomic_store_explicit(&self->locked, false, memory_order_release);
+out:
+    if (oldowner != nullptr) {
+        sched_update_inherited_priority(oldowner);
+    }
+    sched_unlock();
 }
@@ -1,252 +1,599 @@
 #include <assert.h>
 #include <errno.h>
 #include <kernel/arch/interrupts.h>
+#include <kernel/arch/smp.h>
+#include <kernel/arch/tick.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/cpu.h>
 #include <kernel/io/co.h>
+#include <kernel/lib/bitmap.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
-#include <kernel/mem/heap.h>
+#include <kernel/panic.h>
 #include <kernel/tasks/mutex.h>
 #include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
 #include <kernel/tasks/thread.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #define BOOT_THREAD_PRIORITY 20
 
 /*
- * Each queue has associated priority, and when selecting the next thread we
- * start from lowest priority, but every time a queue is selected, remaining
- * opportunities is decreased.
+ * Stop periodic timer interrupts while the idle thread is waiting for the next timer. Only the boot CPU's timer drives
+ * g_ticktime and timers, so this is only done while it's the only CPU online.
+ */
+static bool const CONFIG_TICKLESS_IDLE = true;
+
+/* Time slice of each priority class, in ticks */
+static TICKTIME const CONFIG_TIME_SLICE_HIGH = 2;   /* priority < 0 */
+static TICKTIME const CONFIG_TIME_SLICE_NORMAL = 5; /* 0 <= priority < BOOT_THREAD_PRIORITY */
+static TICKTIME const CONFIG_TIME_SLICE_LOW = 10;   /* BOOT_THREAD_PRIORITY <= priority */
+
+/* Deadline threads can't reserve more than this much CPU time in total, in 0.1% units */
+static uint32_t const CONFIG_DEADLINE_MAX_UTILIZATION = 800;
+
+/*
+ * Each priority level has its own queue, and when selecting the next thread we
+ * go through non-empty queues in round-robin fashion, but every time a queue
+ * is selected, remaining opportunities is decreased.
  * (Initial opportunities count is 1 for lowest priority, 2 for next lowest,
- * and so on...)
+ * and so on, counting only non-empty queues)
+ *
+ * When opportunities become zero, that queue is no longer selected until every
+ * other queue also runs out of opportunities, thus lower priority queues are
+ * selected less than higher priority ones.
  *
- * When opportunities become zero, that queue is no longer selected, thus lower
- * priority queues are selected less than higher priority ones.
+ * Queues that are non-empty and still have opportunities left are tracked in a
+ * bitmap, so that selecting the next queue doesn't depend on how many queues
+ * there are. Opportunities are given when a queue is first selected in a
+ * round, so starting a new round is just a matter of copying the bitmap.
+ *
+ * Each CPU has its own set of queues. Woken threads go to the CPU with the fewest threads to run, and CPUs that run
+ * out of threads take one from the CPU with the most threads waiting.
+ */
+#define PRIORITY_LEVEL_COUNT (INT8_MAX - INT8_MIN + 1)
+#define LEVEL_WORD_COUNT ((PRIORITY_LEVEL_COUNT + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+struct sched_cpu {
+    struct sched_queue queues[PRIORITY_LEVEL_COUNT];
+    UINT nonempty_levels_words[LEVEL_WORD_COUNT];
+    UINT runnable_levels_words[LEVEL_WORD_COUNT];
+    struct bitmap nonempty_levels;
+    /* Non-empty levels that still have opportunities left in current round */
+    struct bitmap runnable_levels;
+    size_t current_round; /* 0 if this wasn't initialized yet */
+    long current_level;
+    size_t queued_count; /* Threads in the queues */
+    struct thread *runningthread;
+    /* Runs when there's nothing else to run. It's never in the queue. */
+    struct thread *idlethread;
+};
+
+/*
+ * Protects everything here, as well as waitqueues, timers and everything built on top of those. See sched_lock().
  */
-static struct list s_queues;
-static struct sched_queue *s_current_queue_node;
-static struct thread *s_runningthread;
-static struct list s_mutexwaitthreads;
+static struct spinlock s_lock;
+static struct sched_cpu s_cpus[CPU_MAX_COUNT];
+static struct sched_stats s_stats;
+/* Exited threads that are deleted once they are no longer running */
+static struct list s_zombies;
 
 /*
- * If insert_after is nullptr, queue will be inserted at front.
+ * Deadline threads that are ready to run, sorted by deadline. These run before anything in the priority queues, and
+ * those that used up their budget are taken out until the next period.
  */
-[[nodiscard]] static struct sched_queue *alloc_queue(struct sched_queue *insert_after, int8_t priority) {
-    struct sched_queue *resultqueue = heap_alloc(sizeof(*resultqueue), HEAP_FLAG_ZEROMEMORY);
-    if (resultqueue == nullptr) {
-        return nullptr;
-    }
-    resultqueue->priority = priority;
-    if (insert_after == nullptr) {
-        list_insert_front(&s_queues, &resultqueue->node, resultqueue);
-    } else {
-        list_insert_after(&s_queues, &insert_after->node, &resultqueue->node, resultqueue);
+static struct list s_deadline_queue;
+/* Sum of budget/period of every deadline thread, in 0.1% units */
+static uint32_t s_deadline_utilization;
+
+void sched_lock(void) {
+    spinlock_lock(&s_lock);
+}
+
+void sched_unlock(void) {
+    spinlock_unlock(&s_lock);
+}
+
+bool sched_lock_is_held(void) {
+    return spinlock_is_held(&s_lock);
+}
+
+static struct sched_cpu *sched_cpu_of(struct cpu const *cpu) {
+    struct sched_cpu *rq = &s_cpus[cpu->index];
+    if (rq->current_round == 0) {
+        rq->nonempty_levels.words = rq->nonempty_levels_words;
+        rq->nonempty_levels.word_count = LEVEL_WORD_COUNT;
+        rq->runnable_levels.words = rq->runnable_levels_words;
+        rq->runnable_levels.word_count = LEVEL_WORD_COUNT;
+        rq->current_round = 1;
+        rq->current_level = -1;
     }
-    return resultqueue;
+    return rq;
 }
 
-[[nodiscard]] static struct sched_queue *get_queue(int8_t priority) {
-    struct list_node *insert_after = nullptr;
-    struct sched_queue *result_queue = nullptr;
-    bool should_insert_front = false;
-    struct sched_queue *queue = list_get_data_or_null(s_queues.front);
-    if (queue != nullptr) {
-        if (priority < queue->priority) {
-            should_insert_front = true;
-        }
+/*
+ * The caller must hold the lock, so that we can't move to other CPU in the meantime.
+ */
+static struct sched_cpu *this_cpu(void) {
+    return sched_cpu_of(cpu_get_current());
+}
+
+static long level_of(int8_t priority) {
+    return (long)priority - INT8_MIN;
+}
+
+[[nodiscard]] static struct sched_queue *get_queue(struct sched_cpu *rq, int8_t priority) {
+    struct sched_queue *queue = &rq->queues[level_of(priority)];
+    queue->priority = priority;
+    return queue;
+}
+
+/* Returns 1 for lowest non-empty level, 2 for next lowest, and so on. */
+static size_t rank_of_level(struct sched_cpu const *rq, long level) {
+    size_t rank = 0;
+    size_t last_word_idx = level / BITS_PER_WORD;
+    for (size_t i = 0; i < last_word_idx; i++) {
+        rank += __builtin_popcount(rq->nonempty_levels_words[i]);
     }
-    if (!should_insert_front) {
-        LIST_FOREACH(&s_queues, queue_node) {
-            struct sched_queue *queue = queue_node->data;
-            assert(queue);
-            struct sched_queue *next_queue = list_get_data_or_null(queue_node->next);
-            /* Found the queue */
-            if (queue->priority == priority) {
-                result_queue = queue;
-                break;
-            }
-            /* No more queue */
-            if (next_queue == nullptr) {
-                insert_after = queue_node;
-                break;
-            }
-            /* Given priority is between current and next queue's priority. */
-            if ((queue->priority < priority) &&
-                (priority < next_queue->priority)) {
-                insert_after = queue_node;
-                break;
-            }
+    UINT mask = make_bitmask(0, (level % BITS_PER_WORD) + 1);
+    rank += __builtin_popcount(rq->nonempty_levels_words[last_word_idx] & mask);
+    return rank;
+}
+
+static bool is_deadline_thread(struct thread const *thread) {
+    return thread->dl_period != 0;
+}
+
+static void queue_deadline_thread(struct thread *thread) {
+    /* Threads with the same deadline run in the order they were queued. */
+    LIST_FOREACH(&s_deadline_queue, node) {
+        struct thread *other = node->data;
+        if (thread->dl_deadline < other->dl_deadline) {
+            list_insert_before(&s_deadline_queue, node, &thread->sched_listnode, thread);
+            return;
         }
     }
-    if (result_queue != nullptr) {
-        return result_queue;
-    }
-    return alloc_queue(list_get_data_or_null(insert_after), priority);
+    list_insert_back(&s_deadline_queue, &thread->sched_listnode, thread);
 }
 
-static void reset_queues(void) {
+static void reset_queues(struct sched_cpu *rq) {
     /*
      * We have to reset the scheduler either because we are scheduling for
      * the first time, or every queue ran out of opportunities.
      */
-
-    /* Reset opportunities. */
-    size_t opportunities = 1;
-    LIST_FOREACH(&s_queues, queuenode) {
-        struct sched_queue *queue = queuenode->data;
-        assert(queue);
-        queue->opportunities = opportunities;
-        opportunities++;
-    }
+    rq->current_round++;
+    vmemcpy(rq->runnable_levels_words, rq->nonempty_levels_words, sizeof(rq->runnable_levels_words));
 }
 
-static struct sched_queue *pick_next_queue(void) {
-    struct list_node *node = nullptr;
-    if (s_current_queue_node != nullptr) {
-        node = &s_current_queue_node->node;
-    }
-    for (size_t i = 0; i < 2; i++) {
-        for (; node != nullptr; node = node->next) {
-            if ((s_current_queue_node != nullptr) &&
-                (&s_current_queue_node->node == node)) {
-                continue;
-            }
-            struct sched_queue *queue = node->data;
-            assert(queue);
-            if ((queue->opportunities != 0) && (queue->threads.front != nullptr)) {
-                break;
-            }
+static struct sched_queue *pick_next_queue(struct sched_cpu *rq) {
+    long level = -1;
+    for (size_t i = 0; (i < 2) && (level < 0); i++) {
+        /* Look for the next queue after current one, wrapping around at the end. */
+        level = bitmap_find_first_set_bit(&rq->runnable_levels, rq->current_level + 1);
+        if (level < 0) {
+            level = bitmap_find_first_set_bit(&rq->runnable_levels, 0);
         }
-        /* If we couldn't find any queues, reset to beginning and try again. */
-        if ((node == nullptr) && (i == 0)) {
-            node = s_queues.front;
+        /* If we couldn't find any queues, start a new round and try again. */
+        if ((level < 0) && (i == 0)) {
+            reset_queues(rq);
         }
     }
-
-    if (node == nullptr) {
-        node = s_queues.front;
-        if (node == nullptr) {
-            return nullptr;
-        }
-        reset_queues();
+    if (level < 0) {
+        return nullptr;
+    }
+    struct sched_queue *queue = &rq->queues[level];
+    if (queue->round != rq->current_round) {
+        queue->round = rq->current_round;
+        queue->opportunities = rank_of_level(rq, level);
     }
-    struct sched_queue *queue = node->data;
-    assert(queue);
+    assert(queue->opportunities != 0);
     queue->opportunities--;
-    s_current_queue_node = queue;
+    if (queue->opportunities == 0) {
+        bitmap_clear_bit(&rq->runnable_levels, level);
+    }
+    rq->current_level = level;
     return queue;
 }
 
-static struct thread *pick_next_task_from_mutex_waitlist(void) {
-    struct thread *result = nullptr;
+static void remove_from_run_queue(struct thread *thread) {
+    assert(thread->in_run_queue);
+    if (is_deadline_thread(thread)) {
+        list_remove_node(&s_deadline_queue, &thread->sched_listnode);
+    } else {
+        struct sched_cpu *rq = sched_cpu_of(thread->cpu);
+        struct sched_queue *queue = get_queue(rq, thread->priority);
+        list_remove_node(&queue->threads, &thread->sched_listnode);
+        if (queue->threads.front == nullptr) {
+            bitmap_clear_bit(&rq->nonempty_levels, level_of(queue->priority));
+            bitmap_clear_bit(&rq->runnable_levels, level_of(queue->priority));
+        }
+        assert(rq->queued_count != 0);
+        rq->queued_count--;
+    }
+    thread->in_run_queue = false;
+}
 
-    LIST_FOREACH(&s_mutexwaitthreads, threadnode) {
-        struct thread *thread = threadnode->data;
-        assert(thread->waitingmutex != nullptr);
-        if (__mutex_try_lock(thread->waitingmutex, thread->desired_locksource)) {
-            list_remove_node(&s_mutexwaitthreads, &thread->sched_listnode);
-            result = thread;
-            if (result->shutdown) {
-                co_printf("sched: thread is about to shutdown - unlocking mutex\n");
-                mutex_unlock(thread->waitingmutex);
-            }
-            thread->waitingmutex = nullptr;
-            /*
-             * Since the list was mutated inside loop, we must get out of
-             * here
-             */
-            break;
+/*
+ * Takes a thread from the CPU with the most threads waiting, so that we don't sit idle while others have work queued.
+ * Returns nullptr if there's nothing to take.
+ */
+static struct thread *steal_thread(struct sched_cpu *rq) {
+    struct sched_cpu *busiest = nullptr;
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        struct cpu *cpu = cpu_get(i);
+        if (!cpu->online) {
+            continue;
+        }
+        struct sched_cpu *other = sched_cpu_of(cpu);
+        if ((other != rq) && (other->queued_count != 0) && ((busiest == nullptr) || (busiest->queued_count < other->queued_count))) {
+            busiest = other;
         }
     }
-    return result;
+    if (busiest == nullptr) {
+        return nullptr;
+    }
+    /* Take the highest priority thread that has been waiting the longest. */
+    long level = bitmap_find_first_set_bit(&busiest->nonempty_levels, 0);
+    assert(0 <= level);
+    struct thread *thread = busiest->queues[level].threads.back->data;
+    remove_from_run_queue(thread);
+    s_stats.migrations++;
+    return thread;
 }
 
-static struct thread *pick_next_task(void) {
-    bool prev_interrupts = arch_irq_disable();
+static struct thread *pick_next_task(struct sched_cpu *rq) {
+    assert(sched_lock_is_held());
     struct thread *result = nullptr;
 
     while (1) {
-        result = pick_next_task_from_mutex_waitlist();
-        if (result == nullptr) {
-            do {
-                struct sched_queue *queue = pick_next_queue();
-                if (queue == nullptr) {
-                    break;
+        struct list_node *node = list_remove_front(&s_deadline_queue);
+        if (node != nullptr) {
+            result = node->data;
+        } else {
+            struct sched_queue *queue = pick_next_queue(rq);
+            if (queue != nullptr) {
+                node = list_remove_back(&queue->threads);
+                assert(node != nullptr);
+                if (queue->threads.front == nullptr) {
+                    bitmap_clear_bit(&rq->nonempty_levels, level_of(queue->priority));
+                    bitmap_clear_bit(&rq->runnable_levels, level_of(queue->priority));
                 }
-                struct list_node *node = list_remove_back(&queue->threads);
-                if (node == nullptr) {
+                assert(rq->queued_count != 0);
+                rq->queued_count--;
+                result = node->data;
+            } else {
+                result = steal_thread(rq);
+                if (result == nullptr) {
                     break;
                 }
-                result = node->data;
-            } while (0);
+            }
         }
-        if ((result == nullptr) || (!result->shutdown)) {
+        result->in_run_queue = false;
+        if (!result->shutdown) {
             break;
         }
         co_printf("sched: shutting down thread %p\n", result);
-        thread_delete(result);
+        thread_set_exited(result, THREAD_EXIT_STATUS_SHUTDOWN);
         result = nullptr;
     }
-    arch_irq_restore(prev_interrupts);
     return result;
 }
 
 void sched_print_queues(void) {
+    sched_lock();
     co_printf("----- QUEUE LIST -----\n");
-    LIST_FOREACH(&s_queues, queuenode) {
-        struct sched_queue *queue = queuenode->data;
-        co_printf("queue %p - Pri %d [threads exist: %d]\n", queue, queue->priority, queue->threads.front != nullptr);
-        LIST_FOREACH(&queue->threads, threadnode) {
-            co_printf(" - thread %p\n", threadnode);
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        struct cpu *cpu = cpu_get(i);
+        if (!cpu->online) {
+            continue;
+        }
+        struct sched_cpu *rq = sched_cpu_of(cpu);
+        co_printf("CPU %zu - running thread %p\n", cpu->index, rq->runningthread);
+        for (long level = bitmap_find_first_set_bit(&rq->nonempty_levels, 0); 0 <= level; level = bitmap_find_first_set_bit(&rq->nonempty_levels, level + 1)) {
+            struct sched_queue *queue = &rq->queues[level];
+            co_printf("queue %p - Pri %d [opportunities: %zu]\n", queue, queue->priority, (queue->round == rq->current_round) ? queue->opportunities : rank_of_level(rq, level));
+            LIST_FOREACH(&queue->threads, threadnode) {
+                co_printf(" - thread %p\n", threadnode);
+            }
+        }
+    }
+    if (s_deadline_queue.front != nullptr) {
+        co_printf("deadline queue\n");
+        LIST_FOREACH(&s_deadline_queue, threadnode) {
+            struct thread *thread = threadnode->data;
+            co_printf(" - thread %p [deadline: %llu]\n", threadnode, thread->dl_deadline);
         }
     }
+    sched_unlock();
 }
 
-void sched_wait_mutex(struct mutex *mutex, struct source_location const *locksource) {
-    assert(mutex->locked);
-    bool prev_interrupts = arch_irq_disable();
-    vmemcpy(&s_runningthread->desired_locksource, locksource, sizeof(*locksource));
-    struct thread *nextthread = pick_next_task();
-    if (nextthread == nullptr) {
-        co_printf("sched: WARNING: there is no thread to wait for mutex\n");
-        co_printf("mutex is currently locked by %s:%d (%s)\n", mutex->locksource.filename, mutex->locksource.line, mutex->locksource.function);
-        co_printf("lock requested by %s:%d (%s)\n", locksource->filename, locksource->line, locksource->function);
-        sched_print_queues();
-        while (1) {
+TICKTIME sched_get_time_slice(int8_t priority) {
+    if (priority < 0) {
+        return CONFIG_TIME_SLICE_HIGH;
+    }
+    if (priority < BOOT_THREAD_PRIORITY) {
+        return CONFIG_TIME_SLICE_NORMAL;
+    }
+    return CONFIG_TIME_SLICE_LOW;
+}
+
+void sched_get_stats(struct sched_stats *out) {
+    sched_lock();
+    vmemcpy(out, &s_stats, sizeof(*out));
+    out->deadline_utilization = s_deadline_utilization;
+    sched_unlock();
+}
+
+static void reap_zombies(void) {
+    struct list_node *node = s_zombies.front;
+    while (node != nullptr) {
+        struct list_node *next = node->next;
+        struct thread *thread = node->data;
+        if (!thread->running) {
+            list_remove_node(&s_zombies, node);
+            thread_delete(thread);
         }
-        goto out;
+        node = next;
     }
-    assert(s_runningthread != nullptr);
-    assert(s_runningthread->waitingmutex == nullptr);
-    s_runningthread->waitingmutex = mutex;
-    list_insert_front(&s_mutexwaitthreads, &s_runningthread->sched_listnode, s_runningthread);
-    struct thread *oldthread = s_runningthread;
+}
+
+void sched_add_zombie(struct thread *thread) {
+    sched_lock();
+    list_insert_back(&s_zombies, &thread->sched_listnode, thread);
+    sched_unlock();
+}
+
+/*
+ * `preempted` is true if the current thread didn't give up the CPU by itself.
+ *
+ * The lock is passed to the next thread, and it's only released once we are off the old thread's stack. That's what
+ * keeps other CPUs from picking up the old thread before it's completely switched out.
+ */
+static void switch_to(struct sched_cpu *rq, struct thread *nextthread, bool preempted) {
+    reap_zombies();
+    struct thread *oldthread = rq->runningthread;
+    assert(oldthread != nullptr);
     assert(nextthread != oldthread);
-    s_runningthread = nextthread;
+    uint64_t now = arch_read_tsc();
+    oldthread->run_cycles += now - oldthread->last_run_tsc;
+    if (preempted) {
+        oldthread->involuntary_switches++;
+    } else {
+        oldthread->voluntary_switches++;
+    }
+    if (nextthread != rq->idlethread) {
+        nextthread->wait_cycles += now - nextthread->last_queue_tsc;
+    }
+    nextthread->last_run_tsc = now;
+    nextthread->time_slice_left = sched_get_time_slice(nextthread->priority);
+    nextthread->switch_count++;
+    s_stats.context_switches++;
+    /* This has to come before changing the running thread, as it checks that the old thread is the holder. */
+    spinlock_pass_to(&s_lock, &oldthread->sched_lock_hold, nextthread, &nextthread->sched_lock_hold);
+    rq->runningthread = nextthread;
+    oldthread->running = false;
+    nextthread->running = true;
+    nextthread->cpu = cpu_get_current();
     thread_switch(oldthread, nextthread);
-out:
-    arch_irq_restore(prev_interrupts);
+}
+
+struct thread *sched_get_current_thread(void) {
+    /* Interrupts are disabled, so that we can't move to other CPU in the middle. */
+    ARCH_IRQSTATE prev_irqstate = arch_irq_disable();
+    struct thread *result = s_cpus[cpu_get_current()->index].runningthread;
+    arch_irq_restore(prev_irqstate);
+    return result;
+}
+
+bool sched_is_idle_thread(struct thread const *thread) {
+    if (thread == nullptr) {
+        return false;
+    }
+    for (size_t i = 0; i < CPU_MAX_COUNT; i++) {
+        if (s_cpus[i].idlethread == thread) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Spinlock holders must never switch away, as nobody else on the same CPU could take the lock until they come back.
+ * Our own lock is the exception, as it's passed to the next thread.
+ */
+static void assert_no_other_spinlocks_held(void) {
+    assert(sched_lock_is_held());
+    assert(cpu_get_current()->spinlock_count == s_lock.depth);
+}
+
+static void block(bool preempted) {
+    sched_lock();
+    assert_no_other_spinlocks_held();
+    struct sched_cpu *rq = this_cpu();
+    assert(rq->runningthread != nullptr);
+    assert(rq->runningthread != rq->idlethread);
+    struct thread *nextthread = pick_next_task(rq);
+    if (nextthread == nullptr) {
+        nextthread = rq->idlethread;
+    }
+    if (nextthread != rq->runningthread) {
+        switch_to(rq, nextthread, preempted);
+    }
+    sched_unlock();
+}
+
+void sched_block(void) {
+    block(false);
+}
+
+static void queue_on(struct thread *thread, struct cpu *cpu) {
+    struct sched_cpu *rq = sched_cpu_of(cpu);
+    struct sched_queue *queue = get_queue(rq, thread->priority);
+    long level = level_of(thread->priority);
+    list_insert_front(&queue->threads, &thread->sched_listnode, thread);
+    thread->in_run_queue = true;
+    thread->last_queue_tsc = arch_read_tsc();
+    thread->cpu = cpu;
+    rq->queued_count++;
+    bitmap_set_bit(&rq->nonempty_levels, level);
+    if ((queue->round != rq->current_round) || (queue->opportunities != 0)) {
+        bitmap_set_bit(&rq->runnable_levels, level);
+    }
+}
+
+/*
+ * Moves the thread to the queue of new priority, if it's in the run queue.
+ */
+static void set_effective_priority(struct thread *thread, int8_t priority) {
+    if (thread->priority == priority) {
+        return;
+    }
+    if (!thread->in_run_queue || is_deadline_thread(thread)) {
+        /* Deadline queue doesn't care about priority */
+        thread->priority = priority;
+        return;
+    }
+    remove_from_run_queue(thread);
+    thread->priority = priority;
+    queue_on(thread, thread->cpu);
+}
+
+/*
+ * Raises priority of the mutex owner to `priority`. If the owner is waiting for another mutex, that mutex's owner is
+ * raised as well, and so on.
+ */
+static void inherit_priority(struct mutex *mutex, int8_t priority) {
+    while (mutex != nullptr) {
+        struct thread *owner = mutex->owner;
+        /* Also stops at deadlocks, as we come back to a thread that already has the priority. */
+        if ((owner == nullptr) || (owner->priority <= priority)) {
+            break;
+        }
+        set_effective_priority(owner, priority);
+        mutex = owner->waitingmutex;
+    }
+}
+
+void sched_update_inherited_priority(struct thread *thread) {
+    sched_lock();
+    int8_t priority = thread->base_priority;
+    LIST_FOREACH(&thread->held_mutexes, mutexnode) {
+        struct mutex *mutex = mutexnode->data;
+        LIST_FOREACH(&mutex->waiters, waiternode) {
+            struct thread *waiter = waiternode->data;
+            if (waiter->priority < priority) {
+                priority = waiter->priority;
+            }
+        }
+    }
+    set_effective_priority(thread, priority);
+    sched_unlock();
+}
+
+void sched_set_priority(struct thread *thread, int8_t priority) {
+    sched_lock();
+    thread->base_priority = priority;
+    sched_update_inherited_priority(thread);
+    if (thread->waitingmutex != nullptr) {
+        inherit_priority(thread->waitingmutex, thread->priority);
+    }
+    sched_unlock();
+}
+
+void sched_wait_mutex(struct mutex *mutex, struct source_location const *locksource) {
+    sched_lock();
+    assert(mutex->locked);
+    struct thread *thread = this_cpu()->runningthread;
+    assert(thread != nullptr);
+    assert(thread->waitingmutex == nullptr);
+    /*
+     * We don't come back here until mutex_unlock() hands over the mutex to us and puts us back to the queue.
+     */
+    vmemcpy(&thread->desired_locksource, locksource, sizeof(*locksource));
+    thread->waitingmutex = mutex;
+    list_insert_back(&mutex->waiters, &thread->sched_listnode, thread);
+    inherit_priority(mutex, thread->priority);
+    sched_block();
+    sched_unlock();
+}
+
+/* Threads that are running or waiting to run on the CPU */
+static size_t load_of(struct cpu const *cpu) {
+    struct sched_cpu *rq = sched_cpu_of(cpu);
+    bool is_busy = (rq->runningthread != nullptr) && (rq->runningthread != rq->idlethread);
+    return rq->queued_count + (is_busy ? 1 : 0);
+}
+
+/*
+ * Picks the least loaded CPU for the thread. The CPU it ran on last time wins ties, as its caches may still have what
+ * the thread was using.
+ */
+static struct cpu *pick_cpu_for(struct thread const *thread) {
+    struct cpu *result = (thread->cpu != nullptr) ? thread->cpu : cpu_get_current();
+    size_t result_load = load_of(result);
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        struct cpu *cpu = cpu_get(i);
+        if (!cpu->online) {
+            continue;
+        }
+        size_t load = load_of(cpu);
+        if (load < result_load) {
+            result = cpu;
+            result_load = load;
+        }
+    }
+    return result;
+}
+
+/*
+ * Wakes up the CPU if it's idle, so that it picks up what was just queued. Busy CPUs see it on their next tick.
+ * Returns false if the CPU wasn't idle.
+ */
+static bool kick_if_idle(struct cpu *cpu) {
+    struct sched_cpu *rq = sched_cpu_of(cpu);
+    if ((rq->idlethread == nullptr) || (rq->runningthread != rq->idlethread)) {
+        return false;
+    }
+    if (cpu != cpu_get_current()) {
+        arch_smp_send_reschedule(cpu);
+    }
+    return true;
 }
 
 [[nodiscard]] int sched_queue(struct thread *thread) {
-    int ret = 0;
-    bool prev_interrupts = arch_irq_disable();
-    struct sched_queue *queue = get_queue(thread->priority);
-    if (queue == nullptr) {
-        ret = -ENOMEM;
+    sched_lock();
+    assert(!sched_is_idle_thread(thread));
+    assert(!thread->dl_throttled);
+    if (is_deadline_thread(thread)) {
+        queue_deadline_thread(thread);
+        thread->in_run_queue = true;
+        thread->last_queue_tsc = arch_read_tsc();
+        /* Any CPU can run it, so wake up one that has nothing to do. */
+        for (size_t i = 0; i < cpu_get_count(); i++) {
+            struct cpu *cpu = cpu_get(i);
+            if (cpu->online && kick_if_idle(cpu)) {
+                break;
+            }
+        }
         goto out;
     }
-    list_insert_front(&queue->threads, &thread->sched_listnode, thread);
-    goto out;
+    struct cpu *cpu = pick_cpu_for(thread);
+    queue_on(thread, cpu);
+    kick_if_idle(cpu);
 out:
-    arch_irq_restore(prev_interrupts);
-    return ret;
+    sched_unlock();
+    return 0;
 }
 
-void sched_schedule(void) {
-    bool prev_interrupts = arch_irq_disable();
-    struct thread *nextthread = pick_next_task();
+static void reschedule(bool preempted) {
+    sched_lock();
+    assert_no_other_spinlocks_held();
+    struct sched_cpu *rq = this_cpu();
+    struct thread *nextthread = pick_next_task(rq);
     if (nextthread == nullptr) {
         goto out;
     }
@@ -257,27 +604,284 @@ void sched_schedule(void) {
      * If there are no other threads to switch, we will never reach here,
      * so it doesn't trip below assertion.
      */
-    assert(s_runningthread != nullptr);
-    int ret = sched_queue(s_runningthread);
-    if (ret < 0) {
-        co_printf("sched: failed to queue current thread(error %d)\n", ret);
+    struct thread *thread = rq->runningthread;
+    assert(thread != nullptr);
+    if (thread != rq->idlethread) {
+        /* It keeps running here, so it stays on this CPU. */
+        if (is_deadline_thread(thread)) {
+            queue_deadline_thread(thread);
+            thread->in_run_queue = true;
+            thread->last_queue_tsc = arch_read_tsc();
+        } else {
+            queue_on(thread, cpu_get_current());
+        }
     }
-    struct thread *oldthread = s_runningthread;
-    assert(oldthread != nullptr);
-    assert(nextthread != oldthread);
-    s_runningthread = nextthread;
-    thread_switch(oldthread, nextthread);
+    switch_to(rq, nextthread, preempted);
 out:
-    arch_irq_restore(prev_interrupts);
+    sched_unlock();
+}
+
+void sched_schedule(void) {
+    reschedule(false);
+}
+
+/*
+ * Returns true if there's something the CPU could run, including threads it could take from other CPUs.
+ */
+static bool has_work_for(struct sched_cpu const *rq) {
+    if ((s_deadline_queue.front != nullptr) || (rq->queued_count != 0)) {
+        return true;
+    }
+    for (size_t i = 0; i < cpu_get_count(); i++) {
+        struct cpu *cpu = cpu_get(i);
+        if (cpu->online && (sched_cpu_of(cpu)->queued_count != 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void record_deadline_miss(struct thread *thread) {
+    thread->dl_missed_deadlines++;
+    s_stats.deadline_misses++;
+}
+
+static void start_next_period(struct thread *thread, TICKTIME now) {
+    thread->dl_deadline += thread->dl_period;
+    if (thread->dl_deadline <= now) {
+        /* More than a whole period behind. Don't try to catch up with periods that are already gone. */
+        thread->dl_deadline = now + thread->dl_period;
+    }
+    thread->dl_budget_left = thread->dl_budget;
+}
+
+static void replenish_budget(void *data) {
+    struct thread *thread = data;
+    assert(thread->dl_throttled);
+    /* It ran out of budget before saying it's done, so the work didn't get done in time. */
+    record_deadline_miss(thread);
+    start_next_period(thread, g_ticktime);
+    thread->dl_throttled = false;
+    int ret = sched_queue(thread);
+    MUST_SUCCEED(ret);
+}
+
+static void deadline_tick(struct thread *thread) {
+    TICKTIME now = g_ticktime;
+    if (thread->dl_deadline <= now) {
+        record_deadline_miss(thread);
+        start_next_period(thread, now);
+    }
+    if (thread->dl_budget_left != 0) {
+        thread->dl_budget_left--;
+    }
+    if (thread->dl_budget_left == 0) {
+        thread->dl_throttled = true;
+        s_stats.deadline_throttles++;
+        timer_start(&thread->dl_replenish_timer, thread->dl_deadline, replenish_budget, thread);
+        block(true);
+        return;
+    }
+    struct list_node *front = s_deadline_queue.front;
+    if ((front != nullptr) && (((struct thread *)front->data)->dl_deadline < thread->dl_deadline)) {
+        s_stats.priority_preemptions++;
+        reschedule(true);
+    }
+}
+
+void sched_tick(void) {
+    ASSERT_IRQ_DISABLED();
+    sched_lock();
+    struct sched_cpu *rq = this_cpu();
+    struct thread *thread = rq->runningthread;
+    if (thread == nullptr) {
+        goto out;
+    }
+    if (thread == rq->idlethread) {
+        if (has_work_for(rq)) {
+            sched_schedule();
+        }
+        goto out;
+    }
+    if (is_deadline_thread(thread)) {
+        deadline_tick(thread);
+        goto out;
+    }
+    if (s_deadline_queue.front != nullptr) {
+        /* Deadline threads always go first */
+        s_stats.priority_preemptions++;
+        reschedule(true);
+        goto out;
+    }
+    if (thread->time_slice_left != 0) {
+        thread->time_slice_left--;
+    }
+    if (thread->time_slice_left == 0) {
+        /* If there's nothing else to run, the thread just keeps running with new time slice. */
+        thread->time_slice_left = sched_get_time_slice(thread->priority);
+        s_stats.slice_expirations++;
+        reschedule(true);
+        goto out;
+    }
+    long highest_level = bitmap_find_first_set_bit(&rq->runnable_levels, 0);
+    if ((0 <= highest_level) && (highest_level < level_of(thread->priority))) {
+        /*
+         * Higher priority thread is waiting, and its queue still has opportunities left. Start looking from the top,
+         * so that it is the one we pick.
+         */
+        rq->current_level = -1;
+        s_stats.priority_preemptions++;
+        reschedule(true);
+    }
+out:
+    sched_unlock();
+}
+
+/*
+ * Returns CPU time reserved by given period and budget, in 0.1% units. Rounded up, so that rounding errors can't let
+ * deadline threads overcommit.
+ */
+static uint32_t utilization_of(TICKTIME period, TICKTIME budget) {
+    if (period == 0) {
+        return 0;
+    }
+    return ((budget * 1000) + period - 1) / period;
+}
+
+[[nodiscard]] int sched_set_deadline(struct thread *thread, TICKTIME period, TICKTIME budget) {
+    int ret = 0;
+    if ((period != 0) && ((budget == 0) || (period < budget))) {
+        return -EINVAL;
+    }
+    sched_lock();
+    assert(!sched_is_idle_thread(thread));
+    uint32_t new_utilization = s_deadline_utilization - utilization_of(thread->dl_period, thread->dl_budget) + utilization_of(period, budget);
+    if (CONFIG_DEADLINE_MAX_UTILIZATION < new_utilization) {
+        ret = -EBUSY;
+        goto out;
+    }
+    s_deadline_utilization = new_utilization;
+    bool was_runnable = thread->in_run_queue;
+    if (thread->in_run_queue) {
+        remove_from_run_queue(thread);
+    }
+    if (thread->dl_throttled) {
+        bool was_pending = timer_cancel(&thread->dl_replenish_timer);
+        assert(was_pending);
+        (void)was_pending;
+        thread->dl_throttled = false;
+        was_runnable = true;
+    }
+    thread->dl_period = period;
+    thread->dl_budget = budget;
+    thread->dl_budget_left = budget;
+    thread->dl_deadline = g_ticktime + period;
+    if (was_runnable) {
+        ret = sched_queue(thread);
+        MUST_SUCCEED(ret);
+    }
+out:
+    sched_unlock();
+    return ret;
+}
+
+void sched_wait_next_period(void) {
+    assert(arch_irq_are_enabled());
+    sched_lock();
+    struct thread *thread = this_cpu()->runningthread;
+    assert(thread != nullptr);
+    assert(is_deadline_thread(thread));
+    TICKTIME now = g_ticktime;
+    TICKTIME next_period_start = thread->dl_deadline;
+    if (next_period_start <= now) {
+        /* The timer didn't get to see the deadline passing yet */
+        record_deadline_miss(thread);
+    }
+    /* The next period's budget is given now, but we don't run until the period starts. */
+    start_next_period(thread, now);
+    sched_unlock();
+    if (now < next_period_start) {
+        thread_sleep_until(next_period_start);
+    }
+}
+
+[[noreturn]] static void idle_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        /*
+         * Interrupts stay disabled after unlocking, so that nothing can be queued for us between checking and halting
+         * without its interrupt waking us up.
+         */
+        arch_irq_disable();
+        sched_lock();
+        bool has_work = has_work_for(this_cpu());
+        bool stop_tick = !has_work && CONFIG_TICKLESS_IDLE && (cpu_get_online_count() == 1);
+        if (stop_tick) {
+            TICKTIME now = g_ticktime;
+            TICKTIME next_event = timer_get_next_event(now + arch_tick_get_max_stop_ticks());
+            arch_tick_stop(next_event - now);
+        }
+        sched_unlock();
+        if (!has_work) {
+            /*
+             * If the timer interrupt wakes up a thread, it switches to it directly. Other interrupts may also queue
+             * threads, and we pick them up below.
+             */
+            arch_irq_wait();
+            arch_irq_disable();
+            if (stop_tick) {
+                arch_tick_resume();
+            }
+        }
+        sched_schedule();
+    }
+}
+
+/*
+ * Makes `thread` the running thread of current CPU. What was running so far becomes that thread, and as it took the
+ * lock before there was a thread to hold it, the lock is handed over to the thread as well.
+ */
+static void become_thread(struct sched_cpu *rq, struct thread *thread) {
+    assert(rq->runningthread == nullptr);
+    struct spinlock_hold before_thread;
+    thread->sched_lock_hold.depth = s_lock.depth;
+    thread->sched_lock_hold.prev_irqstate = s_lock.prev_irqstate;
+    spinlock_pass_to(&s_lock, &before_thread, thread, &thread->sched_lock_hold);
+    rq->runningthread = thread;
+    thread->running = true;
+    thread->cpu = cpu_get_current();
+    thread->last_run_tsc = arch_read_tsc();
 }
 
 void sched_init_boot_thread(void) {
-    assert(s_runningthread == nullptr);
     /*
      * Init values for thread is not used, as those are only used for fresh new
      * threads, and boot thread is what we are running now.
      */
-    s_runningthread = thread_create(0, nullptr, nullptr);
-    assert(s_runningthread != nullptr);
-    s_runningthread->priority = BOOT_THREAD_PRIORITY;
+    struct thread *bootthread = thread_create(0, nullptr, nullptr);
+    assert(bootthread != nullptr);
+    struct thread *idlethread = thread_create(THREAD_STACK_SIZE, idle_thread_main, nullptr);
+    assert(idlethread != nullptr);
+    sched_lock();
+    struct sched_cpu *rq = this_cpu();
+    become_thread(rq, bootthread);
+    rq->idlethread = idlethread;
+    idlethread->cpu = cpu_get_current();
+    sched_unlock();
+    sched_set_priority(bootthread, BOOT_THREAD_PRIORITY);
+}
+
+[[noreturn]] void sched_start_cpu(void) {
+    ASSERT_IRQ_DISABLED();
+    /* Like the boot thread, init values are not used. What we are running now becomes the idle thread. */
+    struct thread *thread = thread_create(0, nullptr, nullptr);
+    if (thread == nullptr) {
+        panic("sched: not enough memory to start the CPU");
+    }
+    sched_lock();
+    struct sched_cpu *rq = this_cpu();
+    become_thread(rq, thread);
+    rq->idlethread = thread;
+    sched_unlock();
+    idle_thread_main(nullptr);
 }
@@ -0,0 +1,54 @@
+#include <kernel/lib/strutil.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/semaphore.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+
+void semaphore_init(struct semaphore *out, size_t count) {
+    vmemset(out, 0, sizeof(*out));
+    out->count = count;
+    waitqueue_init(&out->waitqueue);
+}
+
+void semaphore_wait(struct semaphore *self) {
+    sched_lock();
+    while (self->count == 0) {
+        waitqueue_wait(&self->waitqueue);
+    }
+    self->count--;
+    sched_unlock();
+}
+
+[[nodiscard]] bool semaphore_wait_until(struct semaphore *self, TICKTIME deadline) {
+    sched_lock();
+    bool result = true;
+    while (self->count == 0) {
+        if (!waitqueue_wait_until(&self->waitqueue, deadline) && (self->count == 0)) {
+            result = false;
+            goto out;
+        }
+    }
+    self->count--;
+out:
+    sched_unlock();
+    return result;
+}
+
+[[nodiscard]] bool semaphore_try_wait(struct semaphore *self) {
+    sched_lock();
+    bool result = false;
+    if (self->count != 0) {
+        self->count--;
+        result = true;
+    }
+    sched_unlock();
+    return result;
+}
+
+void semaphore_post(struct semaphore *self) {
+    sched_lock();
+    self->count++;
+    waitqueue_wake_one(&self->waitqueue);
+    sched_unlock();
+}
@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/smp.h>
+#include <kernel/cpu.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/spinlock.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+void spinlock_lock(struct spinlock *self) {
+    ARCH_IRQSTATE prev_irqstate = arch_irq_disable();
+    struct cpu *cpu = cpu_get_current();
+    struct thread *thread = sched_get_current_thread();
+    if (atomic_load_explicit(&self->owner, memory_order_relaxed) == cpu) {
+        /*
+         * Holders can't sleep or be preempted, so another thread can only see this if the holder broke that rule.
+         * Spinning here would never end, as the holder can't run again until we stop.
+         */
+        assert(self->owner_thread == thread);
+        self->depth++;
+        cpu->spinlock_count++;
+        return;
+    }
+    struct cpu *expected = nullptr;
+    while (!atomic_compare_exchange_weak_explicit(&self->owner, &expected, cpu, memory_order_acquire, memory_order_relaxed)) {
+        expected = nullptr;
+        arch_smp_spin_pause();
+    }
+    self->owner_thread = thread;
+    self->depth = 1;
+    self->prev_irqstate = prev_irqstate;
+    cpu->spinlock_count++;
+}
+
+void spinlock_unlock(struct spinlock *self) {
+    assert(spinlock_is_held(self));
+    assert(self->depth != 0);
+    struct cpu *cpu = cpu_get_current();
+    assert(cpu->spinlock_count != 0);
+    cpu->spinlock_count--;
+    self->depth--;
+    if (self->depth != 0) {
+        return;
+    }
+    ARCH_IRQSTATE prev_irqstate = self->prev_irqstate;
+    self->owner_thread = nullptr;
+    atomic_store_explicit(&self->owner, nullptr, memory_order_release);
+    arch_irq_restore(prev_irqstate);
+}
+
+bool spinlock_is_held(struct spinlock *self) {
+    return (atomic_load_explicit(&self->owner, memory_order_relaxed) == cpu_get_current()) && (self->owner_thread == sched_get_current_thread());
+}
+
+void spinlock_pass_to(struct spinlock *self, struct spinlock_hold *save_to, struct thread *thread, struct spinlock_hold const *restore_from) {
+    assert(spinlock_is_held(self));
+    assert(restore_from->depth != 0);
+    struct spinlock_hold next_hold = *restore_from;
+    struct cpu *cpu = cpu_get_current();
+    assert(self->depth <= cpu->spinlock_count);
+    save_to->depth = self->depth;
+    save_to->prev_irqstate = self->prev_irqstate;
+    /* The lock stays on this CPU, so only the count and the holding thread change. */
+    cpu->spinlock_count = cpu->spinlock_count - self->depth + next_hold.depth;
+    self->owner_thread = thread;
+    self->depth = next_hold.depth;
+    self->prev_irqstate = next_hold.prev_irqstate;
+}
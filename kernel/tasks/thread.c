@@ -1,18 +1,53 @@
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
 #include <kernel/arch/thread.h>
+#include <kernel/arch/tsc.h>
+#include <kernel/clock.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
 #include <kernel/mem/heap.h>
+#include <kernel/panic.h>
+#include <kernel/tasks/sched.h>
 #include <kernel/tasks/thread.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/* Every thread that wasn't deleted yet */
+static struct list s_threads;
+static size_t s_next_thread_id;
+
+/*
+ * New threads start here. The thread that switched to us was holding the scheduler lock, and it was passed to us.
+ */
+static void thread_entry(void *arg) {
+    struct thread *thread = arg;
+    sched_unlock();
+    thread->init_mainfunc(thread->init_data);
+    thread_exit(0);
+}
 
 struct thread *thread_create(size_t stacksize, void (*init_mainfunc)(void *), void *init_data) {
     struct thread *thread = heap_alloc(sizeof(*thread), HEAP_FLAG_ZEROMEMORY);
     if (thread == nullptr) {
         return nullptr;
     }
-    thread->arch_thread = arch_thread_create(stacksize, init_mainfunc, init_data);
+    thread->init_mainfunc = init_mainfunc;
+    thread->init_data = init_data;
+    /* thread_entry() releases it, and that also enables interrupts. */
+    thread->sched_lock_hold.depth = 1;
+    thread->sched_lock_hold.prev_irqstate = IRQSTATE_ENABLED;
+    thread->arch_thread = arch_thread_create(stacksize, thread_entry, thread);
     if (thread->arch_thread == nullptr) {
         goto fail_arch_thread;
     }
+    sched_lock();
+    thread->id = s_next_thread_id++;
+    list_insert_back(&s_threads, &thread->all_threads_node, thread);
+    sched_unlock();
     goto out;
 fail_arch_thread:
     if (thread != nullptr) {
@@ -28,6 +63,9 @@ void thread_delete(struct thread *thread) {
     if (thread == nullptr) {
         return;
     }
+    sched_lock();
+    list_remove_node(&s_threads, &thread->all_threads_node);
+    sched_unlock();
     arch_thread_destroy(thread->arch_thread);
     heap_free(thread);
 }
@@ -35,3 +73,128 @@ void thread_delete(struct thread *thread) {
 void thread_switch(struct thread *from, struct thread *to) {
     arch_thread_switch(from->arch_thread, to->arch_thread);
 }
+
+void thread_set_exited(struct thread *thread, int status) {
+    sched_lock();
+    assert(!thread->exited);
+    thread->exit_status = status;
+    thread->exited = true;
+    /* Give back CPU time it reserved */
+    int ret = sched_set_deadline(thread, 0, 0);
+    MUST_SUCCEED(ret);
+    if (thread->detached) {
+        sched_add_zombie(thread);
+    } else {
+        waitqueue_wake_all(&thread->join_waitqueue);
+    }
+    sched_unlock();
+}
+
+int thread_enable_fpu(void) {
+    struct thread *thread = sched_get_current_thread();
+    assert(thread != nullptr);
+    return arch_thread_enable_fpu(thread->arch_thread);
+}
+
+size_t thread_get_all_stats(struct thread_stats *out, size_t max_count) {
+    sched_lock();
+    uint64_t now = arch_read_tsc();
+    size_t count = 0;
+    LIST_FOREACH(&s_threads, node) {
+        struct thread *thread = node->data;
+        if (count < max_count) {
+            struct thread_stats *stats = &out[count];
+            stats->id = thread->id;
+            stats->priority = thread->priority;
+            stats->is_idle = sched_is_idle_thread(thread);
+            stats->exited = thread->exited;
+            stats->run_cycles = thread->run_cycles;
+            stats->wait_cycles = thread->wait_cycles;
+            stats->voluntary_switches = thread->voluntary_switches;
+            stats->involuntary_switches = thread->involuntary_switches;
+            stats->missed_deadlines = thread->dl_missed_deadlines;
+            stats->is_deadline = (thread->dl_period != 0);
+            if (thread->running) {
+                /* TSCs of CPUs may be slightly off from each other, so this is only an estimate for other CPUs. */
+                stats->run_cycles += now - thread->last_run_tsc;
+            }
+        }
+        count++;
+    }
+    sched_unlock();
+    return count;
+}
+
+[[noreturn]] void thread_exit(int status) {
+    sched_lock();
+    struct thread *thread = sched_get_current_thread();
+    assert(thread != nullptr);
+    thread_set_exited(thread, status);
+    sched_block();
+    panic("thread: exited thread is running again");
+}
+
+int thread_join(struct thread *thread) {
+    assert(!thread->detached);
+    assert(thread != sched_get_current_thread());
+    sched_lock();
+    while (!thread->exited) {
+        waitqueue_wait(&thread->join_waitqueue);
+    }
+    /* It kept the scheduler lock from setting `exited` to switching away for the last time, so it's safe to delete now. */
+    assert(!thread->running);
+    sched_unlock();
+    int status = thread->exit_status;
+    thread_delete(thread);
+    return status;
+}
+
+void thread_detach(struct thread *thread) {
+    sched_lock();
+    assert(!thread->detached);
+    thread->detached = true;
+    if (thread->exited) {
+        sched_add_zombie(thread);
+    }
+    sched_unlock();
+}
+
+static void wakeup_sleeping_thread(void *data) {
+    struct thread *thread = data;
+    int ret = sched_queue(thread);
+    MUST_SUCCEED(ret);
+}
+
+void thread_sleep_until(TICKTIME deadline) {
+    assert(arch_irq_are_enabled());
+    struct thread *thread = sched_get_current_thread();
+    if (thread == nullptr) {
+        while (g_ticktime < deadline) {
+        }
+        return;
+    }
+    sched_lock();
+    if (g_ticktime < deadline) {
+        /* The timer is the only one that can queue us again, so it's not pending anymore when we come back. */
+        struct timer timer = {0};
+        timer_start(&timer, deadline, wakeup_sleeping_thread, thread);
+        sched_block();
+        assert(!timer_is_pending(&timer));
+    }
+    sched_unlock();
+}
+
+void thread_sleep(TICKTIME ticks) {
+    if (ticks == 0) {
+        sched_schedule();
+        return;
+    }
+    thread_sleep_until(g_ticktime + ticks);
+}
+
+void thread_poll_backoff(uint64_t start_ns) {
+    if (((clock_get_ns() - start_ns) < CLOCK_NS_PER_TICK) || !arch_irq_are_enabled()) {
+        return;
+    }
+    thread_sleep(1);
+}
@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Timers are kept in a hierarchical timer wheel: Level 0 has a slot for each of the next 64 ticks, level 1 has a slot
+ * for each of the next 64 * 64 ticks, and so on. Starting a timer is just a matter of putting it into the right slot,
+ * and each tick only has to look at a single slot of level 0. Whenever level 0 wraps around, timers in the next slot
+ * of level 1 are moved down to the level 0 (and the same goes for upper levels).
+ *
+ * Deadlines that are too far away for the wheel are placed at the farthest slot, and they are placed again when that
+ * slot is moved down.
+ */
+#define LEVEL_BITS 6
+#define SLOTS_PER_LEVEL (1U << LEVEL_BITS)
+#define SLOT_MASK (SLOTS_PER_LEVEL - 1)
+#define LEVEL_COUNT 4
+#define MAX_TIMER_DISTANCE ((1ULL << (LEVEL_BITS * LEVEL_COUNT)) - 1)
+
+static struct list s_wheel[LEVEL_COUNT][SLOTS_PER_LEVEL];
+/* Next tick that hasn't been processed yet */
+static TICKTIME s_wheel_time;
+
+static size_t slot_index(TICKTIME time, size_t level) {
+    return (time >> (LEVEL_BITS * level)) & SLOT_MASK;
+}
+
+static void add_timer(struct timer *timer) {
+    TICKTIME deadline = timer->deadline;
+    struct list *slot;
+    if (deadline < s_wheel_time) {
+        /* Already expired - Run it with the next tick. */
+        slot = &s_wheel[0][slot_index(s_wheel_time, 0)];
+    } else {
+        TICKTIME distance = deadline - s_wheel_time;
+        if (MAX_TIMER_DISTANCE < distance) {
+            deadline = s_wheel_time + MAX_TIMER_DISTANCE;
+            distance = MAX_TIMER_DISTANCE;
+        }
+        size_t level = 0;
+        while ((1ULL << (LEVEL_BITS * (level + 1))) <= distance) {
+            level++;
+        }
+        assert(level < LEVEL_COUNT);
+        slot = &s_wheel[level][slot_index(deadline, level)];
+    }
+    timer->slot = slot;
+    list_insert_back(slot, &timer->node, timer);
+}
+
+/*
+ * Moves timers in current slot of given level to lower levels. Returns the slot index that was used.
+ */
+static size_t cascade(size_t level) {
+    size_t index = slot_index(s_wheel_time, level);
+    struct list *slot = &s_wheel[level][index];
+    while (1) {
+        struct list_node *node = list_remove_front(slot);
+        if (node == nullptr) {
+            break;
+        }
+        add_timer(node->data);
+    }
+    return index;
+}
+
+void timer_start(struct timer *timer, TICKTIME deadline, void (*callback)(void *data), void *data) {
+    sched_lock();
+    assert(timer->slot == nullptr);
+    timer->deadline = deadline;
+    timer->callback = callback;
+    timer->data = data;
+    add_timer(timer);
+    sched_unlock();
+}
+
+bool timer_cancel(struct timer *timer) {
+    sched_lock();
+    bool result = false;
+    if (timer->slot != nullptr) {
+        list_remove_node(timer->slot, &timer->node);
+        timer->slot = nullptr;
+        result = true;
+    }
+    sched_unlock();
+    return result;
+}
+
+bool timer_is_pending(struct timer const *timer) {
+    return timer->slot != nullptr;
+}
+
+TICKTIME timer_get_next_event(TICKTIME limit) {
+    assert(sched_lock_is_held());
+    for (TICKTIME time = s_wheel_time; time < limit; time++) {
+        size_t index = slot_index(time, 0);
+        /* Upper levels may have something to move down when level 0 wraps around. */
+        if ((index == 0) || (s_wheel[0][index].front != nullptr)) {
+            return time;
+        }
+    }
+    return limit;
+}
+
+void timer_tick(TICKTIME now) {
+    assert(sched_lock_is_held());
+    while (s_wheel_time <= now) {
+        size_t index = slot_index(s_wheel_time, 0);
+        if (index == 0) {
+            for (size_t level = 1; (level < LEVEL_COUNT) && (cascade(level) == 0); level++) {
+            }
+        }
+        struct list expired = s_wheel[0][index];
+        list_init(&s_wheel[0][index]);
+        LIST_FOREACH(&expired, node) {
+            struct timer *timer = node->data;
+            timer->slot = &expired; /* So that callbacks can still cancel timers we haven't run yet */
+        }
+        /*
+         * Move on to the next tick before running callbacks, so that timers started by them don't end up in the slot
+         * we are taking apart.
+         */
+        s_wheel_time++;
+        while (1) {
+            struct list_node *node = list_remove_front(&expired);
+            if (node == nullptr) {
+                break;
+            }
+            struct timer *timer = node->data;
+            timer->slot = nullptr;
+            timer->callback(timer->data);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/lib/diagnostics.h>
+#include <kernel/lib/list.h>
+#include <kernel/lib/strutil.h>
+#include <kernel/tasks/sched.h>
+#include <kernel/tasks/thread.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/tasks/waitqueue.h>
+#include <kernel/ticktime.h>
+#include <stddef.h>
+
+/* Lives in the waiting thread's stack while it's waiting. */
+struct waiter {
+    struct list_node node;
+    struct waitqueue *queue;
+    struct thread *thread;
+    struct timer timeout_timer;
+    bool woken;
+};
+
+void waitqueue_init(struct waitqueue *out) {
+    vmemset(out, 0, sizeof(*out));
+}
+
+static void timeout_callback(void *data) {
+    struct waiter *waiter = data;
+    list_remove_node(&waiter->queue->waiters, &waiter->node);
+    int ret = sched_queue(waiter->thread);
+    MUST_SUCCEED(ret);
+}
+
+static bool do_wait(struct waitqueue *self, bool has_deadline, TICKTIME deadline) {
+    assert(sched_lock_is_held());
+    if (has_deadline && (deadline <= g_ticktime)) {
+        return false;
+    }
+    struct thread *thread = sched_get_current_thread();
+    if (thread == nullptr) {
+        /*
+         * Only the boot CPU is running at this point, and interrupt handlers may take the lock again, as nobody is
+         * the current thread yet.
+         */
+        arch_irq_wait();
+        arch_irq_disable();
+        return !has_deadline || (g_ticktime < deadline);
+    }
+    struct waiter waiter = {
+        .queue = self,
+        .thread = thread,
+    };
+    list_insert_back(&self->waiters, &waiter.node, &waiter);
+    if (has_deadline) {
+        timer_start(&waiter.timeout_timer, deadline, timeout_callback, &waiter);
+    }
+    /* We don't come back here until either the timer or the waker puts us back to the queue. */
+    sched_block();
+    assert(!timer_is_pending(&waiter.timeout_timer));
+    return waiter.woken;
+}
+
+void waitqueue_wait(struct waitqueue *self) {
+    do_wait(self, false, 0);
+}
+
+bool waitqueue_wait_until(struct waitqueue *self, TICKTIME deadline) {
+    return do_wait(self, true, deadline);
+}
+
+static void wake_waiter(struct waiter *waiter) {
+    timer_cancel(&waiter->timeout_timer);
+    waiter->woken = true;
+    int ret = sched_queue(waiter->thread);
+    MUST_SUCCEED(ret);
+}
+
+bool waitqueue_wake_one(struct waitqueue *self) {
+    sched_lock();
+    struct list_node *node = list_remove_front(&self->waiters);
+    if (node != nullptr) {
+        wake_waiter(node->data);
+    }
+    sched_unlock();
+    return node != nullptr;
+}
+
+size_t waitqueue_wake_all(struct waitqueue *self) {
+    sched_lock();
+    size_t count = 0;
+    while (1) {
+        struct list_node *node = list_remove_front(&self->waiters);
+        if (node == nullptr) {
+            break;
+        }
+        wake_waiter(node->data);
+        count++;
+    }
+    sched_unlock();
+    return count;
+}
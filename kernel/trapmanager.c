@@ -1,14 +1,48 @@
+#include <assert.h>
 #include <kernel/arch/interrupts.h>
 #include <kernel/io/co.h>
 #include <kernel/lib/diagnostics.h>
 #include <kernel/lib/list.h>
 #include <kernel/lib/strutil.h>
+#include <kernel/panic.h>
+#include <kernel/tasks/irqwork.h>
+#include <kernel/tasks/spinlock.h>
+#include <kernel/tasks/timer.h>
+#include <kernel/ticktime.h>
 #include <kernel/trapmanager.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/******************************** Configuration *******************************/
+
+/*
+ * How often trap handlers are audited, in ticks.
+ */
+static TICKTIME const CONFIG_AUDIT_INTERVAL = 5000;
+
+/******************************************************************************/
+
+/*
+ * What trapmanager_trap() calls for each trap. If there's only one handler, this is the handler itself. Otherwise it
+ * is run_handler_chain() with the list of handlers.
+ */
+struct trap_dispatch {
+    void (*callback)(int trapnum, void *trapframe, void *data);
+    void *data;
+};
+
+enum {
+    TRAP_COUNT = YJKERNEL_ARCH_TRAP_COUNT,
+};
+
+static struct trap_dispatch s_dispatch[TRAP_COUNT];
 /* Each trap entry is a list of trap handlers. */
-static struct list s_traps[YJKERNEL_ARCH_TRAP_COUNT];
+static struct list s_traps[TRAP_COUNT];
+/*
+ * Protects both of above. Handlers are called without holding this, so a handler must not be unregistered while its
+ * trap can still happen.
+ */
+static struct spinlock s_lock;
 
 static uint32_t calculate_checksum(struct trap_handler const *handler) {
     struct trap_handler temp;
@@ -23,44 +57,157 @@ static uint32_t calculate_checksum(struct trap_handler const *handler) {
     return ((uint32_t)~0) - sum;
 }
 
+static void run_handler_chain(int trapnum, void *trapframe, void *data) {
+    struct list *handlers = data;
+    LIST_FOREACH(handlers, handlernode) {
+        struct trap_handler *handler = handlernode->data;
+        handler->callback(trapnum, trapframe, handler->data);
+    }
+}
+
+static void get_expected_dispatch(struct trap_dispatch *out, int trapnum) {
+    struct list *handlers = &s_traps[trapnum];
+    if (handlers->front == nullptr) {
+        out->callback = nullptr;
+        out->data = nullptr;
+    } else if (handlers->front == handlers->back) {
+        struct trap_handler *handler = handlers->front->data;
+        out->callback = handler->callback;
+        out->data = handler->data;
+    } else {
+        out->callback = run_handler_chain;
+        out->data = handlers;
+    }
+}
+
+/*
+ * Returns number of bad entries.
+ */
+static size_t audit_trap(int trapnum) {
+    assert(spinlock_is_held(&s_lock));
+    size_t badcount = 0;
+    LIST_FOREACH(&s_traps[trapnum], handlernode) {
+        struct trap_handler *handler = handlernode->data;
+        uint32_t expected_checksum = calculate_checksum(handler);
+        uint32_t got_checksum = handler->checksum;
+        if (expected_checksum != got_checksum) {
+            co_printf("bad trap handler checksum in trap %d: expected %#x, got %#x\n", trapnum, expected_checksum, got_checksum);
+            badcount++;
+        }
+    }
+    struct trap_dispatch expected;
+    get_expected_dispatch(&expected, trapnum);
+    if ((expected.callback != s_dispatch[trapnum].callback) || (expected.data != s_dispatch[trapnum].data)) {
+        co_printf("bad dispatch entry in trap %d\n", trapnum);
+        badcount++;
+    }
+    return badcount;
+}
+
+static void update_checksum(struct list_node *node) {
+    if (node == nullptr) {
+        return;
+    }
+    struct trap_handler *handler = node->data;
+    handler->checksum = calculate_checksum(handler);
+}
+
+/*
+ * Don't build on top of something that is already broken: Handlers around it will get new checksums, which would hide
+ * the corruption from later audits.
+ */
+static void audit_before_update(int trapnum) {
+    if (audit_trap(trapnum) != 0) {
+        panic("trapmanager: trap handlers were corrupted");
+    }
+}
+
 void trapmanager_register_trap(struct trap_handler *out, int trapnum, void (*callback)(int trapnum, void *trapframe, void *data), void *data) {
-    bool prev_interrupts = arch_irq_disable();
+    assert((0 <= trapnum) && (trapnum < TRAP_COUNT));
+    spinlock_lock(&s_lock);
+    audit_before_update(trapnum);
     out->callback = callback;
     out->data = data;
     list_insert_back(&s_traps[trapnum], &out->node, out);
-    out->checksum = calculate_checksum(out);
-    if (out->node.prev != nullptr) {
-        struct trap_handler *handler = out->node.prev->data;
-        handler->checksum = calculate_checksum(handler);
-    }
-    if (out->node.next != nullptr) {
-        struct trap_handler *handler = out->node.next->data;
-        handler->checksum = calculate_checksum(handler);
-    }
-    arch_irq_restore(prev_interrupts);
+    /* Handlers next to it also change, as their list nodes point to it. */
+    update_checksum(&out->node);
+    update_checksum(out->node.prev);
+    update_checksum(out->node.next);
+    get_expected_dispatch(&s_dispatch[trapnum], trapnum);
+    spinlock_unlock(&s_lock);
+}
+
+void trapmanager_unregister_trap(struct trap_handler *handler, int trapnum) {
+    assert((0 <= trapnum) && (trapnum < TRAP_COUNT));
+    spinlock_lock(&s_lock);
+    audit_before_update(trapnum);
+    struct list_node *prev = handler->node.prev;
+    struct list_node *next = handler->node.next;
+    list_remove_node(&s_traps[trapnum], &handler->node);
+    update_checksum(prev);
+    update_checksum(next);
+    get_expected_dispatch(&s_dispatch[trapnum], trapnum);
+    spinlock_unlock(&s_lock);
 }
 
 void trapmanager_trap(int trapnum, void *trapframe) {
     ASSERT_IRQ_DISABLED();
-    enum {
-        HANDLERS_COUNT = sizeof(s_traps) / sizeof(*s_traps),
-    };
-    if (HANDLERS_COUNT <= trapnum) {
-        co_printf("trap %d is outside of valid trap range(0~%d)\n", trapnum, HANDLERS_COUNT - 1);
+    if (TRAP_COUNT <= (unsigned)trapnum) {
+        co_printf("trap %d is outside of valid trap range(0~%d)\n", trapnum, TRAP_COUNT - 1);
         return;
     }
-    if (!s_traps[trapnum].front) {
+    spinlock_lock(&s_lock);
+    struct trap_dispatch dispatch = s_dispatch[trapnum];
+    spinlock_unlock(&s_lock);
+    if (dispatch.callback == nullptr) {
         co_printf("no trap handler registered for trap %d\n", trapnum);
         return;
     }
+    dispatch.callback(trapnum, trapframe, dispatch.data);
+}
+
+size_t trapmanager_get_handler_count(int trapnum) {
+    assert((0 <= trapnum) && (trapnum < TRAP_COUNT));
+    size_t count = 0;
+    spinlock_lock(&s_lock);
     LIST_FOREACH(&s_traps[trapnum], handlernode) {
-        struct trap_handler *handler = handlernode->data;
-        uint32_t expected_checksum = calculate_checksum(handler);
-        uint32_t got_checksum = handler->checksum;
-        if (expected_checksum != got_checksum) {
-            co_printf("bad trap handler checksum in trap %d: expected %#x, got %#x\n", trapnum, expected_checksum, got_checksum);
-        } else {
-            handler->callback(trapnum, trapframe, handler->data);
-        }
+        count++;
+    }
+    spinlock_unlock(&s_lock);
+    return count;
+}
+
+size_t trapmanager_audit(void) {
+    size_t badcount = 0;
+    for (int i = 0; i < TRAP_COUNT; i++) {
+        /* Let other interrupts in between traps, instead of blocking them for the whole table */
+        spinlock_lock(&s_lock);
+        badcount += audit_trap(i);
+        spinlock_unlock(&s_lock);
+    }
+    return badcount;
+}
+
+static struct timer s_audit_timer;
+static struct irqwork s_audit_work;
+
+static void audit_work_callback(void *data) {
+    (void)data;
+    size_t badcount = trapmanager_audit();
+    if (badcount != 0) {
+        co_printf("trapmanager: %zu bad trap entries found\n", badcount);
     }
 }
+
+static void audit_timer_callback(void *data) {
+    (void)data;
+    irqwork_schedule(&s_audit_work);
+    timer_start(&s_audit_timer, g_ticktime + CONFIG_AUDIT_INTERVAL, audit_timer_callback, nullptr);
+}
+
+void trapmanager_start_periodic_audit(void) {
+    irqwork_init(&s_audit_work, audit_work_callback, nullptr);
+    bool prev_interrupts = arch_irq_disable();
+    timer_start(&s_audit_timer, g_ticktime + CONFIG_AUDIT_INTERVAL, audit_timer_callback, nullptr);
+    arch_irq_restore(prev_interrupts);
+}
@@ -271,6 +271,7 @@ void windowd_start(void) {
         goto die;
     }
     thread_started = true;
+    thread_detach(thread);
     return;
 die:
     if (thread_started) {
@@ -34,6 +34,7 @@ no_kvm        = os.getenv('YJK_NO_KVM')       == '1' # No KVM?
 tfault_debug  = os.getenv('YJK_TFAULT_DEBUG') == '1' # Triple-fault debug?
 penguin_qemu  = os.getenv('YJK_PENGUINQEMU')  == '1' # Use Linux QEMU under WSL2?
 qemu_add_args = os.getenv('YJK_QEMUFLAGS')           # Additional QEMU flags
+smp_cpu_count = os.getenv('YJK_SMP')                 # Number of CPUs
 
 cdrompath = "out/i586/YJKOS_i586.iso"
 hddpath   = "harddisk.img"
@@ -47,6 +48,10 @@ qemu_args = [
     "-net", "none",
 ]
 
+if smp_cpu_count != None:
+    qemu_args.append("-smp")
+    qemu_args.append(smp_cpu_count)
+
 if qemu_add_args != None:
     for arg in qemu_add_args.split(' '):
         qemu_args.append(arg)